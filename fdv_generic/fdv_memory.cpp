@@ -88,4 +88,12 @@ namespace fdv
 
   uint8_t* EEPROMAllocator::s_pos = 0;
 
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // Arena static storage
+
+  Arena* Arena::s_first   = NULL;
+  Arena* Arena::s_current = NULL;
+
 }
@@ -26,6 +26,7 @@
 #define FDV_MEMORY_H
 
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include "fdv_algorithm.h"
@@ -94,19 +95,308 @@ inline void operator delete[](void* ptr)
 
 
 
+namespace fdv
+{
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  // Arena
+  // Bump allocator over a single heap block, allocated once by the constructor and freed by
+  // the destructor. While an Arena is active (see Arena::Scope) allocItems() and reallocItems()
+  // (so string, vector<> and Buffer<>) allocate from it. Freeing a block doesn't give memory
+  // back, unless it is the last allocated one: all memory is released in one step by reset()
+  // or by the destructor, so the heap isn't fragmented by many small short lived objects.
+  // Allocations which don't fit go to the heap (see overflows()).
+  // Objects allocated from an Arena must be destroyed before it (or before reset()), so objects
+  // which outlive it must not allocate while it is active (use Arena::Scope(NULL)).
+
+  class Arena
+  {
+
+    // blocks are prefixed by their capacity
+    static uint8_t const HEADERSIZE = sizeof(void*) > sizeof(uint16_t)? sizeof(void*) : sizeof(uint16_t);
+
+    Arena(Arena const& c);            // copy not allowed
+    Arena& operator=(Arena const& c); // assignment not allowed
+
+  public:
+
+    // size = 0 creates an empty arena (everything goes to the heap)
+    explicit Arena(uint16_t size)
+      : m_begin(size? static_cast<uint8_t*>(malloc(size)) : NULL),
+        m_end(m_begin? m_begin + size : NULL),
+        m_top(m_begin),
+        m_last(NULL),
+        m_highWater(0),
+        m_overflows(0),
+        m_next(s_first)
+    {
+      s_first = this;
+    }
+
+    ~Arena()
+    {
+      Arena** a = &s_first;
+      while (*a != this)
+        a = &(*a)->m_next;
+      *a = m_next;
+      if (s_current == this)
+        s_current = NULL;
+      free(m_begin);
+    }
+
+    // discards all allocations
+    void reset()
+    {
+      m_top  = m_begin;
+      m_last = NULL;
+    }
+
+    uint16_t size() const
+    {
+      return m_end - m_begin;
+    }
+
+    uint16_t used() const
+    {
+      return m_top - m_begin;
+    }
+
+    // max bytes used since construction (including block headers)
+    uint16_t highWater() const
+    {
+      return m_highWater;
+    }
+
+    // number of allocations which didn't fit (done on the heap)
+    uint16_t overflows() const
+    {
+      return m_overflows;
+    }
+
+    bool owns(void const* ptr) const
+    {
+      return ptr >= m_begin && ptr < m_end;
+    }
+
+    // returns NULL when there isn't enough space
+    void* allocate(uint16_t size)
+    {
+      size = align(size);
+      if (m_end - m_top < HEADERSIZE + size)
+      {
+        ++m_overflows;
+        return NULL;
+      }
+      header(m_top + HEADERSIZE) = size;
+      m_last = m_top + HEADERSIZE;
+      grow(m_last + size);
+      return m_last;
+    }
+
+    // "ptr" must be owned by this arena. Returns NULL when there isn't enough space (ptr is
+    // still valid).
+    void* reallocate(void* ptr, uint16_t size)
+    {
+      uint8_t* p = static_cast<uint8_t*>(ptr);
+      if (size <= capacity(p))
+        return ptr;
+      if (p == m_last)
+      {
+        // last block: grow in place
+        size = align(size);
+        if (m_end - p < size)
+        {
+          ++m_overflows;
+          return NULL;
+        }
+        header(p) = size;
+        grow(p + size);
+        return ptr;
+      }
+      void* newPtr = allocate(size);
+      if (newPtr)
+        memcpy(newPtr, ptr, capacity(p));
+      return newPtr;
+    }
+
+    // "ptr" must be owned by this arena. Only the last block is actually freed.
+    void deallocate(void* ptr)
+    {
+      if (ptr == m_last)
+      {
+        m_top  = m_last - HEADERSIZE;
+        m_last = NULL;
+      }
+    }
+
+    // usable size of a block owned by an arena
+    static uint16_t capacity(void const* ptr)
+    {
+      return header(const_cast<uint8_t*>(static_cast<uint8_t const*>(ptr)));
+    }
+
+    // the arena which will serve allocItems() and reallocItems(), NULL = heap
+    static Arena* current()
+    {
+      return s_current;
+    }
+
+    // returns the arena which allocated "ptr", NULL if it is on the heap
+    static Arena* owner(void const* ptr)
+    {
+      for (Arena* a = s_first; a; a = a->m_next)
+        if (a->owns(ptr))
+          return a;
+      return NULL;
+    }
+
+
+    // activates an arena (NULL = heap) until the end of scope
+    class Scope
+    {
+    public:
+      explicit Scope(Arena* arena)
+        : m_prev(s_current)
+      {
+        s_current = arena;
+      }
+
+      ~Scope()
+      {
+        s_current = m_prev;
+      }
+
+    private:
+      Arena* m_prev;
+    };
+
+
+  private:
+
+    static uint16_t align(uint16_t size)
+    {
+      return (size + HEADERSIZE - 1) & ~(HEADERSIZE - 1);
+    }
+
+    // capacity of the block
+    static uint16_t& header(uint8_t* ptr)
+    {
+      return *reinterpret_cast<uint16_t*>(ptr - HEADERSIZE);
+    }
+
+    void grow(uint8_t* newTop)
+    {
+      m_top = newTop;
+      m_highWater = max(m_highWater, used());
+    }
+
+
+  private:
+
+    uint8_t* m_begin;
+    uint8_t* m_end;
+    uint8_t* m_top;
+    uint8_t* m_last;       // last allocated block (can be resized in place)
+    uint16_t m_highWater;
+    uint16_t m_overflows;
+    Arena*   m_next;       // next alive arena
+
+    static Arena* s_first;    // alive arenas
+    static Arena* s_current;
+  };
+
+
+
+#ifdef FDV_MEMORY_STATS
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  // MemoryStats
+  // Define FDV_MEMORY_STATS to count calls of allocItems(), reallocItems() and freeItems(),
+  // ie to compare allocations made by two versions of the same code.
+
+  struct MemoryStats
+  {
+    struct Data
+    {
+      uint32_t allocs;
+      uint32_t reallocs;
+      uint32_t frees;
+    };
+
+    static Data& data()
+    {
+      static Data s_data;
+      return s_data;
+    }
+
+    static void reset()
+    {
+      memset(&data(), 0, sizeof(Data));
+    }
+  };
+
+#endif
+
+}
+
+
+
+// allocates from the active Arena, if any
 template <typename T>
 inline T* allocItems(size_t size)
 {  
+#ifdef FDV_MEMORY_STATS
+  ++fdv::MemoryStats::data().allocs;
+#endif
+  fdv::Arena* arena = fdv::Arena::current();
+  if (arena)
+  {
+    void* ptr = arena->allocate(size * sizeof(T));
+    if (ptr)
+      return static_cast<T*>(ptr);
+  }
   T* ret = static_cast<T*>(malloc(size * sizeof(T)));
   return ret;
 }
 
+// blocks owned by an Arena are reallocated by it (or moved to the heap if they don't fit), heap
+// blocks stay on the heap
 template <typename T>
 inline T* reallocItems(T* ptr, size_t newSize)
 {
+  if (ptr == NULL)
+    return allocItems<T>(newSize);
+#ifdef FDV_MEMORY_STATS
+  ++fdv::MemoryStats::data().reallocs;
+#endif
+  fdv::Arena* arena = fdv::Arena::owner(ptr);
+  if (arena)
+  {
+    void* newPtr = arena->reallocate(ptr, newSize*sizeof(T));
+    if (newPtr == NULL && (newPtr = malloc(newSize*sizeof(T))) != NULL)
+    {
+      memcpy(newPtr, ptr, fdv::min<size_t>(newSize*sizeof(T), fdv::Arena::capacity(ptr)));
+      arena->deallocate(ptr);
+    }
+    return static_cast<T*>(newPtr);
+  }
   return static_cast<T*>(realloc(ptr, newSize*sizeof(T)));
 }
 
+// frees memory obtained by allocItems() or reallocItems()
+inline void freeItems(void* ptr)
+{
+#ifdef FDV_MEMORY_STATS
+  if (ptr)
+    ++fdv::MemoryStats::data().frees;
+#endif
+  fdv::Arena* arena = ptr? fdv::Arena::owner(ptr) : NULL;
+  if (arena)
+    arena->deallocate(ptr);
+  else
+    free(ptr);
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -204,7 +494,7 @@ namespace fdv
 
     ~Buffer()
     {
-      free(m_data);
+      freeItems(m_data);
     }
 
     void reset(uint16_t size)
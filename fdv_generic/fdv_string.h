@@ -53,9 +53,9 @@ namespace fdv
     //// construct/copy/destroy
 
     string()
-      : m_data(allocChars(1))
+      : m_data(NULL)
     {
-      m_data[0] = 0;
+      data()[0] = 0;
     }
 
 
@@ -107,8 +107,8 @@ namespace fdv
     {
       len = (len == 0xFFFF? strlen(str) : len);
       m_data = reallocChars(m_data, len+1);
-      memcpy(m_data, str, len);
-      m_data[len] = 0;
+      memcpy(data(), str, len);
+      data()[len] = 0;
       return *this;
     }
 
@@ -128,8 +128,8 @@ namespace fdv
     string& assign(uint16_t n, char c)
     {
       m_data = reallocChars(m_data, n+1);
-      memset(m_data, c, n);
-      m_data[n] = 0;
+      memset(data(), c, n);
+      data()[n] = 0;
       return *this;
     }
 
@@ -155,6 +155,8 @@ namespace fdv
     void swap(string& s)
     {
       fdv::swap(m_data, s.m_data);
+      for (uint8_t i = 0; i != PREALLOCSIZE; ++i)
+        fdv::swap(m_buffer[i], s.m_buffer[i]);
     }
 
 
@@ -164,30 +166,30 @@ namespace fdv
     // warning: linear cost
     uint16_t size() const
     {
-      return strlen(m_data);
+      return strlen(data());
     }
 
 
     void clear()
     {
       m_data = reallocChars(m_data, 1);
-      m_data[0] = 0;
+      data()[0] = 0;
     }
 
 
     bool empty() const
     {
-      return m_data[0] == 0;
+      return data()[0] == 0;
     }
 
 
     void resize(uint16_t n, char c = 0)
     {
-      uint16_t oldlen = strlen(m_data);
+      uint16_t oldlen = strlen(data());
       m_data = reallocChars(m_data, n+1);
       if (n > oldlen)
-        memset(&m_data[oldlen], c, n-oldlen);
-      m_data[n] = 0;
+        memset(&data()[oldlen], c, n-oldlen);
+      data()[n] = 0;
     }    
 
 
@@ -195,48 +197,48 @@ namespace fdv
 
     char* begin()
     {
-      return m_data;
+      return data();
     }
 
     char const* begin() const
     {
-      return m_data;
+      return data();
     }
 
     // warning, linear cost!
     char* end()
     {
-      return &m_data[size()];
+      return &data()[size()];
     }
 
     // warning, linear cost!
     char const* end() const
     {
-      return &m_data[size()];
+      return &data()[size()];
     }
 
 
     char const& operator[] (uint16_t pos) const
     {
-      return m_data[pos];
+      return data()[pos];
     }
 
 
     char& operator[] (uint16_t pos)
     {
-      return m_data[pos];
+      return data()[pos];
     }    
 
 
     char const* c_str() const
     {
-      return m_data;
+      return data();
     }
 
 
     char* c_str()
     {
-      return m_data;
+      return data();
     }
 
 
@@ -266,8 +268,8 @@ namespace fdv
 
     string& append(char const* str)
     {
-      m_data = reallocChars(m_data, strlen(m_data)+strlen(str)+1);
-      strcat(m_data, str);
+      m_data = reallocChars(m_data, strlen(data())+strlen(str)+1);
+      strcat(data(), str);
       return *this;
     }
 
@@ -281,10 +283,10 @@ namespace fdv
 
     void push_back(char c)
     {
-      uint16_t oldlen = strlen(m_data);
+      uint16_t oldlen = strlen(data());
       m_data = reallocChars(m_data, oldlen+2);
-      m_data[oldlen]   = c;
-      m_data[oldlen+1] = 0;
+      data()[oldlen]   = c;
+      data()[oldlen+1] = 0;
     }    
 
 
@@ -296,7 +298,7 @@ namespace fdv
 
     int compare(char const* s) const
     {
-      return strcmp(m_data, s);
+      return strcmp(data(), s);
     }
 
 
@@ -304,8 +306,8 @@ namespace fdv
     {
       if (count > 0)
       {
-        uint16_t oldlen = strlen(m_data)+1; // +1 = final zero
-        memmove(first, first+count, oldlen-(first-m_data)-count);
+        uint16_t oldlen = strlen(data())+1; // +1 = final zero
+        memmove(first, first+count, oldlen-(first-data())-count);
         m_data = reallocChars(m_data, oldlen-count);
       }
     }
@@ -313,8 +315,8 @@ namespace fdv
     // returns 0xFFFF if not found
     uint16_t find(char c, uint16_t pos = 0) const
     {
-      char* p = strchr(m_data+pos, c);
-      return p? (p-m_data) : 0xFFFF;
+      char* p = strchr(data()+pos, c);
+      return p? (p-data()) : 0xFFFF;
     }
 
   private:
@@ -322,35 +324,35 @@ namespace fdv
 
     char m_buffer[PREALLOCSIZE];
 
-    char* allocChars(uint16_t size)
+    // note: m_data is NULL when m_buffer is used, so the object doesn't point to itself and
+    // can be moved in memory (vector<> relocates items using realloc() and memmove())
+    char* data() const
     {
-      if (size <= PREALLOCSIZE)
-        return &m_buffer[0];
-      else
-        return (char*)malloc(size);
+      return m_data? m_data : const_cast<char*>(&m_buffer[0]);
     }
 
+    // returns NULL when m_buffer is used
     char* reallocChars(char* ptr, uint16_t size)
     {
-      char* newbuf = NULL;
       if (size <= PREALLOCSIZE)
-        newbuf = &m_buffer[0];        
-      else
       {
-        if (ptr == &m_buffer[0])
-          newbuf = (char*)malloc(size);  
-        else
-          newbuf = (char*)realloc(ptr, size);  
-      }        
-      if (ptr == &m_buffer[0]) 
-        memcpy(newbuf, ptr, min(size, PREALLOCSIZE));
+        if (ptr)
+        {
+          memcpy(m_buffer, ptr, size);
+          freeItems(ptr);
+        }
+        return NULL;
+      }
+      if (ptr)
+        return reallocItems<char>(ptr, size);
+      char* newbuf = allocItems<char>(size);
+      memcpy(newbuf, m_buffer, PREALLOCSIZE);
       return newbuf;
     }
 
     void freeChars(char* ptr)
     {
-      if (ptr != &m_buffer[0])
-        free(ptr);
+      freeItems(ptr);
     }
 
 
@@ -428,6 +430,15 @@ namespace fdv
     return string(&str[0]);
   }
 
+  inline string const toString(int32_t v)
+  {
+    // -2147483648
+    // 12345678901
+    char str[11+1];
+    ltoa(v, &str[0], 10);
+    return string(&str[0]);
+  }
+
   inline string const toString(uint16_t v)
   {
     char str[9];
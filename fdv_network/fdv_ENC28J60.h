@@ -305,6 +305,24 @@ namespace fdv
     // EPKTCNT: Ethernet Packet Count
     static uint8_t const EPKTCNT = BANK1 | 0x19;
 
+    // EDMASTL: DMA Start Low Byte (EDMAST<7:0>)
+    static uint8_t const EDMASTL = BANK0 | 0x10;
+
+    // EDMASTH: DMA Start High Byte (EDMAST<12:8>)
+    static uint8_t const EDMASTH = BANK0 | 0x11;
+
+    // EDMANDL: DMA End Low Byte (EDMAND<7:0>)
+    static uint8_t const EDMANDL = BANK0 | 0x12;
+
+    // EDMANDH: DMA End High Byte (EDMAND<12:8>)
+    static uint8_t const EDMANDH = BANK0 | 0x13;
+
+    // EDMACSL: DMA Checksum Low Byte (EDMACS<7:0>)
+    static uint8_t const EDMACSL = BANK0 | 0x16;
+
+    // EDMACSH: DMA Checksum High Byte (EDMACS<15:8>)
+    static uint8_t const EDMACSH = BANK0 | 0x17;
+
     // MIREGADR: MII Register Address (MIREGADR<4:0>)
     static uint8_t const MIREGADR = BANK2 | 0x14;
 
@@ -448,6 +466,9 @@ namespace fdv
 
     static uint8_t const MAXLISTENERS = 5;
 
+    // max polls of ECON1.DMAST while the DMA checksum engine runs (each poll is an SPI register read)
+    static uint16_t const DMATIMEOUT = 1000;
+
     enum Mode
     {
       HalfDuplex,
@@ -471,6 +492,11 @@ namespace fdv
         m_currIndex = 0;
       }
 
+      void readSeek(uint16_t position)
+      {
+        m_currIndex = position;
+      }
+
       uint8_t readByte(uint16_t index)
       {
         uint8_t r;
@@ -562,6 +588,7 @@ namespace fdv
 
         // status
         m_available       = false;
+        m_checksumOffload = false;
         m_frameReceived   = 0;
         m_frameSent       = false;
         m_nextRXPacketPtr = RXBUFFERSTART;
@@ -696,6 +723,21 @@ namespace fdv
     }
 
 
+    // checksums are calculated by the DMA checksum engine
+    // Opt-in (default disabled): call setChecksumOffload(true) only after the DMA path has been
+    // checked on the actual board (see storeDMAChecksum()).
+    bool checksumOffload() const
+    {
+      return m_checksumOffload;
+    }
+
+
+    void setChecksumOffload(bool value)
+    {
+      m_checksumOffload = value;
+    }
+
+
   private:
 
     void extInterrupt()
@@ -746,6 +788,42 @@ namespace fdv
     }
 
 
+    // calculates checksum using the DMA checksum engine and stores it into the frame
+    // dataStart: position in buffer memory of first frame data byte
+    // returns false if the DMA engine doesn't complete in DMATIMEOUT polls
+    // Silicon errata (ENC28J60 rev. B, DMA module): a checksum calculated while a packet is being
+    // received, with reception enabled (ECON1.RXEN), may be wrong. This is why checksum offload is opt-in.
+    bool storeDMAChecksum(uint16_t dataStart, LinkLayerChecksum const* checksum)
+    {
+      uint16_t start = dataStart + checksum->start;
+      uint16_t end   = start + checksum->length - 1;
+      setReg(EDMASTL, start & 0xFF);
+      setReg(EDMASTH, (start >> 8) & 0xFF);
+      setReg(EDMANDL, end & 0xFF);
+      setReg(EDMANDH, (end >> 8) & 0xFF);
+
+      // start and wait (bounded: we are inside an ATOMIC_BLOCK)
+      bitFieldSet(ECON1, BIT_CSUMEN | BIT_DMAST);
+      uint16_t polls = DMATIMEOUT;
+      while ((getReg(ECON1) & BIT_DMAST) && --polls);
+      if (polls == 0)
+      {
+        bitFieldClear(ECON1, BIT_CSUMEN | BIT_DMAST);
+        return false;
+      }
+      bitFieldClear(ECON1, BIT_CSUMEN);
+
+      // EDMACSH is the first byte in network order
+      uint8_t hi = getReg(EDMACSH);
+      uint8_t lo = getReg(EDMACSL);
+      beginWriteMemory(dataStart + checksum->position);
+      writeByte(hi);
+      writeByte(lo);
+      endWriteMemory();
+      return true;
+    }
+
+
   public:
 
     ILinkLayer::SendResult sendFrame(LinkLayerSendFrame const* frame)
@@ -779,6 +857,11 @@ namespace fdv
 
         endWriteMemory();
 
+        // calculate checksums in buffer memory
+        for (LinkLayerChecksum const* checksum = frame->checksums; checksum != NULL; checksum = checksum->next)
+          if (!storeDMAChecksum(TXBUFFERSTART + 1 + 6 + 6 + 2, checksum))
+            return SendFail;
+
         // set Start position in buffer memory
         setReg(ETXSTL, TXBUFFERSTART & 0xFF);
         setReg(ETXSTH, (TXBUFFERSTART >> 8) & 0xFF);
@@ -1134,6 +1217,7 @@ namespace fdv
     HardwareSPIMaster* m_spi;
     Pin const*         m_interruptPin;
     bool               m_available;
+    bool               m_checksumOffload;
     LinkAddress        m_address;    // the MAC address
     Mode               m_mode;
     Array<ILinkLayerListener*, MAXLISTENERS> m_listeners; // upper layer listeners
@@ -545,6 +545,7 @@ namespace fdv
       RcvFrame(LinkAddress const& srcAddress_, LinkAddress const& destAddress_, uint16_t type_length_, uint8_t* payload_, uint16_t dataLength_)
         : LinkLayerReceiveFrame(srcAddress_, destAddress_, type_length_, dataLength_), payload(payload_)
       {
+        checksumVerified = true;  // payload already verified by hardware CRC and message checksum
       }
 
       void readReset()
@@ -552,6 +553,11 @@ namespace fdv
         m_readPos = 0;
       }
 
+      void readSeek(uint16_t position)
+      {
+        m_readPos = position;
+      }
+
       uint8_t readByte()
       {
         return payload[m_readPos++];
@@ -46,6 +46,67 @@ namespace fdv
 {
 
 
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Internet checksum (RFC 1071) helpers
+  // Sums are 32 bit ones complement accumulators, folded to 16 bit only at the end.
+
+  struct InternetChecksum
+  {
+
+    // big endian word
+    static uint16_t word(uint8_t const* p)
+    {
+      return (uint16_t)p[0] << 8 | p[1];
+    }
+
+    // adds "length" bytes to "sum". An odd trailing byte is added as high byte of a zero padded word.
+    static uint32_t add(void const* data, uint16_t length, uint32_t sum = 0)
+    {
+      uint8_t const* p = (uint8_t const*)data;
+      for (; length >= 8; length -= 8, p += 8)
+      {
+        sum += word(p);
+        sum += word(p + 2);
+        sum += word(p + 4);
+        sum += word(p + 6);
+      }
+      for (; length >= 2; length -= 2, p += 2)
+        sum += word(p);
+      if (length == 1)
+        sum += (uint16_t)p[0] << 8;
+      return sum;
+    }
+
+    static uint16_t fold(uint32_t sum)
+    {
+      sum = (sum >> 16) + (sum & 0xFFFF);
+      sum += (sum >> 16);
+      return (uint16_t)sum;
+    }
+
+    // RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')
+    // returns the new checksum after a 16 bit word of the checksummed data changes from oldValue to newValue
+    static uint16_t update(uint16_t checksum, uint16_t oldValue, uint16_t newValue)
+    {
+      return ~fold((uint32_t)(uint16_t)~checksum + (uint16_t)~oldValue + newValue);
+    }
+
+    // as update() for a 32 bit field (ie an IP address)
+    static uint16_t update(uint16_t checksum, uint8_t const* oldValue, uint8_t const* newValue)
+    {
+      uint32_t sum = (uint32_t)(uint16_t)~checksum;
+      sum += (uint16_t)~word(oldValue);
+      sum += (uint16_t)~word(oldValue + 2);
+      sum += word(newValue);
+      sum += word(newValue + 2);
+      return ~fold(sum);
+    }
+
+  };
+
+
+
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   // a list of linked buffers
@@ -98,26 +159,30 @@ namespace fdv
       }
     };
 
-    uint16_t calcInternetChecksum()
+    // ones complement sum of all buffers (not folded)
+    uint32_t calcSum(uint32_t sum = 0) const
     {
-      Enumerator enu(*this);
-      uint16_t nbytes = calcLength();
-      uint32_t sum = 0;
-      while (nbytes > 1)
-      {
-        uint8_t lo = *enu.data; enu.moveNext();
-        uint8_t hi = *enu.data; enu.moveNext();
-        sum += (uint16_t)lo << 8 | hi;
-        nbytes -= 2;
-      }
-      if (nbytes == 1)
+      bool odd = false; // previous buffer left the high byte of a word
+      for (DataList const* curr = this; curr != NULL; curr = curr->next)
       {
-        uint8_t lo = *enu.data; enu.moveNext();
-        sum += (uint16_t)lo << 8;
+        uint8_t const* p = (uint8_t const*)curr->data;
+        uint16_t length  = curr->length;
+        if (length == 0)
+          continue;
+        if (odd)
+        {
+          sum += *p++;  // low byte of the pending word
+          --length;
+        }
+        sum = InternetChecksum::add(p, length, sum);
+        odd = (length & 1);
       }
-      sum = (sum >> 16) + (sum & 0xffff);
-      sum += (sum >> 16);
-      return (uint16_t)~sum;      
+      return sum;
+    }
+
+    uint16_t calcInternetChecksum() const
+    {
+      return ~InternetChecksum::fold(calcSum());
     }
 
   };
@@ -212,19 +277,39 @@ namespace fdv
   };
 
 
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  // an Internet checksum calculated by the link layer (see ILinkLayer::checksumOffload)
+  // offsets are relative to the first frame data byte
+
+  struct LinkLayerChecksum
+  {
+    LinkLayerChecksum const* next;  // NULL = no next
+    uint16_t                 start;
+    uint16_t                 length;
+    uint16_t                 position;  // where the checksum is stored. Its content is included in the sum (i.e. pseudo header sum)
+
+    LinkLayerChecksum(LinkLayerChecksum const* next_, uint16_t start_, uint16_t length_, uint16_t position_)
+      : next(next_), start(start_), length(length_), position(position_)
+    {
+    }
+  };
+
+
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   // frame used to send packet to link layer
 
   struct LinkLayerSendFrame
   {
-    LinkAddress     srcAddress;
-    LinkAddress     destAddress;
-    uint16_t        type_length;
-    DataList const* dataList;
+    LinkAddress              srcAddress;
+    LinkAddress              destAddress;
+    uint16_t                 type_length;
+    DataList const*          dataList;
+    LinkLayerChecksum const* checksums;   // checksums to calculate (only when ILinkLayer::checksumOffload() is true)
 
-    explicit LinkLayerSendFrame(LinkAddress const& srcAddress_, LinkAddress const& destAddress_, uint16_t type_length_, DataList const* dataList_)
-      : srcAddress(srcAddress_), destAddress(destAddress_), type_length(type_length_), dataList(dataList_)
+    explicit LinkLayerSendFrame(LinkAddress const& srcAddress_, LinkAddress const& destAddress_, uint16_t type_length_, DataList const* dataList_, LinkLayerChecksum const* checksums_ = NULL)
+      : srcAddress(srcAddress_), destAddress(destAddress_), type_length(type_length_), dataList(dataList_), checksums(checksums_)
     {
     }
 
@@ -241,6 +326,7 @@ namespace fdv
     LinkAddress srcAddress;
     uint16_t    type_length;
     uint16_t    dataLength;  // may include additional padding
+    bool        checksumVerified;  // true when the link layer has already validated the data (IP checksums are not verified)
 
     virtual void readReset() = 0;
     virtual uint8_t readByte() = 0;
@@ -248,11 +334,12 @@ namespace fdv
     virtual void readBlock(void* dstBuffer, uint16_t length) = 0;
 
     LinkLayerReceiveFrame()
+      : checksumVerified(false)
     {      
     }
 
     LinkLayerReceiveFrame(LinkAddress const& srcAddress_, LinkAddress const& destAddress_, uint16_t type_length_, uint16_t dataLength_)
-      : destAddress(destAddress_), srcAddress(srcAddress_), type_length(type_length_), dataLength(dataLength_)
+      : destAddress(destAddress_), srcAddress(srcAddress_), type_length(type_length_), dataLength(dataLength_), checksumVerified(false)
     {      
     }
 
@@ -261,6 +348,13 @@ namespace fdv
       while (bytesToBypass--)
         readByte();
     }
+
+    // moves read position to the specified data offset (link layers should override it with a direct access)
+    virtual void readSeek(uint16_t position)
+    {
+      readReset();
+      bypass(position);
+    }
   };
 
 
@@ -291,6 +385,12 @@ namespace fdv
     virtual void addListener(ILinkLayerListener* listener) = 0;
     virtual void recvFrame() = 0;
     virtual SendResult sendFrame(LinkLayerSendFrame const* frame) = 0;
+
+    // true if sendFrame calculates LinkLayerSendFrame::checksums, so upper layers can skip the software pass
+    virtual bool checksumOffload() const
+    {
+      return false;
+    }
   };
 
 
@@ -712,7 +812,7 @@ namespace fdv
   // Protocol_IP (IP - Internet Protocol)
   // Does Not support datagrams fragmentation (for both RX and TX)
   // Does Not support multicast and broadcast for TX
-  // Does Not check checksum on received packets
+  // Checksums of received packets (IP header, ICMP, UDP and TCP) are verified unless disabled or already verified by the link layer
 
   class Protocol_IP : public ILinkLayerListener
   {
@@ -746,13 +846,136 @@ namespace fdv
 
   public:
 
+    // datagrams dropped because of wrong checksum
+    struct ChecksumErrors
+    {
+      uint16_t IP;
+      uint16_t ICMP;
+      uint16_t UDP;
+      uint16_t TCP;
+    };
+
+
+    // the datagram payload is not copied, it is read directly from the link layer frame
+    // The payload checksum is summed while the payload is read sequentially (see checksumValid()).
     struct Datagram
     {
       uint8_t   protocol;
       IPAddress sourceAddress;
       IPAddress destAddress;
-      void*     data;
       uint16_t  dataLength;
+
+      // checksumErrors: counter incremented on wrong checksum. NULL = don't verify
+      Datagram(LinkLayerReceiveFrame* frame, uint16_t dataOffset, uint16_t* checksumErrors)
+        : m_frame(frame), m_dataOffset(dataOffset), m_readPos(0), m_checksumErrors(checksumErrors), m_checksumValid(true), m_sumPos(0), m_sum(0)
+      {
+      }
+
+      uint8_t readByte()
+      {
+        uint8_t b = m_frame->readByte();
+        sum(&b, 1);
+        ++m_readPos;
+        return b;
+      }
+
+      // assume big-endian (that is the network byte order)
+      uint16_t readWord()
+      {
+        uint16_t w = m_frame->readWord();
+        uint8_t b[2] = { w >> 8, w & 0xFF };
+        sum(&b[0], 2);
+        m_readPos += 2;
+        return w;
+      }
+
+      void readBlock(void* dstBuffer, uint16_t length)
+      {
+        m_frame->readBlock(dstBuffer, length);
+        sum((uint8_t const*)dstBuffer, length);
+        m_readPos += length;
+      }
+
+      void bypass(uint16_t bytesToBypass)
+      {
+        readSeek(m_readPos + bytesToBypass);
+      }
+
+      // position is relative to the first payload byte
+      void readSeek(uint16_t position)
+      {
+        m_readPos = position;
+        m_frame->readSeek(m_dataOffset + position);
+      }
+
+      uint16_t readPosition() const
+      {
+        return m_readPos;
+      }
+
+      // true when checksumValid() has to verify the checksum
+      bool verifyChecksum() const
+      {
+        return m_checksumErrors != NULL;
+      }
+
+      // verifies the checksum of the first "length" payload bytes, plus initialSum (ie the pseudo header sum).
+      // Only bytes not already read (sequentially from payload start) are read here, read position is preserved.
+      // Always true when checksum doesn't need to be verified.
+      bool checksumValid(uint32_t initialSum, uint16_t length)
+      {
+        if (m_checksumErrors != NULL)
+        {
+          if (m_sumPos > length)
+          {
+            // read beyond checksummed bytes, restart
+            m_sumPos = 0;
+            m_sum    = 0;
+          }
+          if (m_sumPos < length)
+          {
+            uint16_t readPos = m_readPos;
+            readSeek(m_sumPos);
+            uint8_t buffer[16];
+            while (m_sumPos < length)
+            {
+              uint16_t chunk = length - m_sumPos;
+              readBlock(&buffer[0], chunk < sizeof(buffer)? chunk : sizeof(buffer));
+            }
+            readSeek(readPos);
+          }
+          m_checksumValid = (InternetChecksum::fold(initialSum + m_sum) == 0xFFFF);
+          if (!m_checksumValid)
+            ++*m_checksumErrors;
+          m_checksumErrors = NULL;  // verified once
+        }
+        return m_checksumValid;
+      }
+
+    private:
+
+      // sums bytes read at the end of the already summed ones
+      void sum(uint8_t const* data, uint16_t length)
+      {
+        if (m_checksumErrors != NULL && m_readPos == m_sumPos && length > 0)
+        {
+          m_sumPos += length;
+          if (m_readPos & 1)
+          {
+            m_sum += *data++;  // low byte of a word
+            --length;
+          }
+          m_sum = InternetChecksum::add(data, length, m_sum);
+        }
+      }
+
+      LinkLayerReceiveFrame* m_frame;
+      uint16_t               m_dataOffset;  // IP header length
+      uint16_t               m_readPos;
+      uint16_t*              m_checksumErrors;
+      bool                   m_checksumValid;
+      uint16_t               m_sumPos;      // bytes summed (from payload start)
+      uint32_t               m_sum;
     };
 
 
@@ -766,8 +989,9 @@ namespace fdv
   public:
 
     explicit Protocol_IP(bool routingEnabled)
-      : m_ARP(NULL), m_datagramIdent(0), m_routingEnabled(routingEnabled)
+      : m_ARP(NULL), m_datagramIdent(0), m_routingEnabled(routingEnabled), m_checksumVerification(true)
     {            
+      memset(&m_checksumErrors, 0, sizeof(ChecksumErrors));
     }
 
 
@@ -839,54 +1063,31 @@ namespace fdv
     }
 
 
+    // true if the interface used to reach destAddress calculates checksums (see ILinkLayer::checksumOffload)
+    bool checksumOffload(IPAddress const& destAddress)
+    {
+      uint8_t interfaceIndex = findInterfaceForAddress(destAddress, NULL);
+      return interfaceIndex != 0xFF && m_ARP->interfaces()[interfaceIndex].interface->checksumOffload();
+    }
+
+
     // if srcAddress=0.0.0.0 then it is automatically selected from used interface
-    bool send(IPAddress const& srcAddress, IPAddress const& destAddress, uint8_t protocol, DataList const& data, bool isRouting)
+    // checksumPosition: position (inside data) of upper layer checksum, calculated by the link layer when checksumOffload()
+    // is true (it must contain the pseudo header sum). 0xFFFF = already calculated
+    bool send(IPAddress const& srcAddress, IPAddress const& destAddress, uint8_t protocol, DataList const& data, bool isRouting, uint16_t checksumPosition = 0xFFFF)
     {
 #ifdef TCPVERBOSE
       serial.write_P(PSTR("IP:send: src: ")); serial.writeIPv4(srcAddress.data()); cout << endl;
       serial.write_P(PSTR("IP:send: dst: ")); serial.writeIPv4(destAddress.data()); cout << endl;
 #endif
 
-      IPAddress effectiveDestAddress; // this IP address is used only in order to get effective hardware address, not as effective destination IP address
-      uint8_t   interfaceIndex = findInterfaceForAddress(destAddress, &effectiveDestAddress);
+      LinkAddress const* destHardwareAddress;
+      uint8_t interfaceIndex = prepareSend(srcAddress, destAddress, isRouting, &destHardwareAddress);
       if (interfaceIndex == 0xFF)
-        return false; // no route, fail
-
-      // find destination hardware address
-      LinkAddress const* destHardwareAddress = m_ARP->getHardwareAddress(interfaceIndex, effectiveDestAddress);
-      if (destHardwareAddress == NULL)  // still not available? Try until ARPTRYTIMEOUT timeouts
-      {
-#ifdef TCPVERBOSE
-        serial.write_P(PSTR("IP:send: no hardware addr")); cout << endl;
-#endif
-        return false;
-        // todo: test
-        /*
-        TimeOut timeOut(ARPTRYTIMEOUT);
-        while ((destHardwareAddress = m_ARP->getHardwareAddressFromCache(effectiveDestAddress)) == NULL && !timeOut)
-        receive();
-        */
-      }
-
-      // avoid routing to the same interface
-      if (isRouting && findInterfaceForAddress(srcAddress, NULL) == interfaceIndex)
-      {
-#ifdef TCPVERBOSE
-        serial.write_P(PSTR("IP:send: routing failed, same interface!")); cout << endl;
-#endif
         return false;
-      }
 
       IPAddress sourceAddress = srcAddress.isAllZero()? m_ARP->interfaces()[interfaceIndex].address : srcAddress;  // is the source IP auto calculated?
 
-      if (destHardwareAddress == NULL)
-      {
-#ifdef TCPVERBOSE
-        serial.write_P(PSTR("IPsend: fail!")); cout << endl;
-#endif        
-        return false; // failed to get destination hardware address
-      }        
-
       // IP header
       uint8_t IPHeader[20];
       //   VER (4) | HLEN (5 = 20 bytes)
@@ -921,17 +1122,8 @@ namespace fdv
       IPHeader[17] = destAddress[1];
       IPHeader[18] = destAddress[2];
       IPHeader[19] = destAddress[3];
-      // calculate checksum
-      uint16_t checksum = DataList(NULL, &IPHeader[0], 20).calcInternetChecksum();
-      IPHeader[10] = checksum >> 8;
-      IPHeader[11] = checksum & 0xFF;
-
-      // link layer
-      DataList dataList(&data, &IPHeader[0], 20);
-      ILinkLayer* interface = m_ARP->interfaces()[interfaceIndex].interface;
-      LinkLayerSendFrame frame(interface->getAddress(), *destHardwareAddress, 0x0800, &dataList);
 
-      return interface->sendFrame(&frame) == ILinkLayer::SendOK;
+      return transmit(interfaceIndex, *destHardwareAddress, &IPHeader[0], data, true, checksumPosition);
     }
 
 
@@ -943,13 +1135,16 @@ namespace fdv
       if (frame->type_length == 0x0800)
       {
 
-        Datagram datagram;
+        // fixed part of the header, read at once
+        uint8_t header[20];
+        if (frame->dataLength < 20)
+          return false;
+        frame->readBlock(&header[0], 20);
 
         // VER | HLEN
-        uint8_t b = frame->readByte();
-        if ( ((b >> 4) & 0x0F) != 4)
+        if ( ((header[0] >> 4) & 0x0F) != 4)
           return false; // unsupported IP version
-        uint16_t headerLength = static_cast<uint16_t>(b & 0x0F) * 4;  // header length in bytes
+        uint16_t headerLength = static_cast<uint16_t>(header[0] & 0x0F) * 4;  // header length in bytes
         if (headerLength < 20 || headerLength > frame->dataLength)
         {
 #ifdef TCPVERBOSE
@@ -958,9 +1153,8 @@ namespace fdv
           return false; // invalid headerLength                   
         }
         // TOS (bypass)
-        frame->readByte();
         // Total Length
-        uint16_t totalLength = frame->readWord();
+        uint16_t totalLength = (uint16_t)header[2] << 8 | header[3];
         if (totalLength < headerLength || totalLength > frame->dataLength)
         {
 #ifdef TCPVERBOSE
@@ -968,25 +1162,47 @@ namespace fdv
 #endif
           return false; // invalid totalLength
         }          
+        // Checksum
+        bool verify = m_checksumVerification && !frame->checksumVerified;
+        if (verify)
+        {
+          uint32_t sum = InternetChecksum::add(&header[0], 20);
+          if (headerLength > 20)
+          {
+            uint8_t options[40];
+            frame->readBlock(&options[0], headerLength - 20);
+            sum = InternetChecksum::add(&options[0], headerLength - 20, sum);
+          }
+          if (InternetChecksum::fold(sum) != 0xFFFF)
+          {
+#ifdef TCPVERBOSE
+            serial.write_P(PSTR("IP::processLinkLayerFrame: wrong checksum")); cout << endl;
+#endif
+            ++m_checksumErrors.IP;
+            return false;
+          }
+        }
+        uint16_t* checksumErrors = NULL;
+        if (verify)
+        {
+          switch (header[9])
+          {
+            case 0x01: checksumErrors = &m_checksumErrors.ICMP; break;
+            case 0x06: checksumErrors = &m_checksumErrors.TCP;  break;
+            case 0x11: checksumErrors = &m_checksumErrors.UDP;  break;
+          }
+        }
+        Datagram datagram(frame, headerLength, checksumErrors);
         // Identification (bypass)
-        frame->readWord();
         // Flags (bypass) | Fragment offset (bypass)
-        frame->readWord();
-        // TTL - time To Live (bypass)
-        frame->readByte();
+        // TTL - time To Live (used by routing)
         // Protocol
-        datagram.protocol = frame->readByte();
-        // Checksum (bypass)
-        frame->readWord();
+        datagram.protocol = header[9];
         // Source IP address
-        for (uint8_t i = 0; i != 4; ++i)
-          datagram.sourceAddress[i] = frame->readByte();
+        memcpy(datagram.sourceAddress.data(), &header[12], 4);
         // Destination IP address
-        for (uint8_t i = 0; i != 4; ++i)
-          datagram.destAddress[i] = frame->readByte();
-        // bypass other header fields
-        for (uint8_t i = 20; i != headerLength; ++i)
-          frame->readByte();
+        memcpy(datagram.destAddress.data(), &header[16], 4);
+        // other header fields are bypassed by Datagram
 
 #ifdef TCPVERBOSE
         serial.write_P(PSTR("IP::processLinkLayerFrame: src: "));
@@ -996,20 +1212,8 @@ namespace fdv
         cout << endl;
 #endif
 
-        // data
+        // data (read by listeners)
         datagram.dataLength = totalLength - headerLength;
-        if (getFreeMem() - 200 < datagram.dataLength)
-        {
-#ifdef TCPVERBOSE
-          serial.write_P(PSTR("IP:processLinkLayerFrame: cannot allocate")); cout << endl;
-#endif
-          return false; // cannot allocate
-        }
-        SimpleBuffer<uint8_t> dataBuffer(datagram.dataLength);
-        if (dataBuffer.get() == NULL)
-          return false; // cannot allocate
-        datagram.data = dataBuffer.get();
-        frame->readBlock(datagram.data, datagram.dataLength);
 
         // is this for me?
         bool rightDest = false;
@@ -1031,8 +1235,11 @@ namespace fdv
 
             // send to listeners
             for (uint8_t i = 0; i != m_listeners.size(); ++i)
+            {
+              datagram.readSeek(0);  // a listener may have read part of the payload before rejecting it
               if (m_listeners[i]->processIPDatagram(&datagram))
                 break; // message processed   
+            }
           }
           else if (m_routingEnabled)
           {
@@ -1040,7 +1247,7 @@ namespace fdv
 #ifdef TCPVERBOSE
             serial.write_P(PSTR("IP::processLinkLayerFrame: route")); cout << endl;
 #endif
-            send(datagram.sourceAddress, datagram.destAddress, datagram.protocol, DataList(NULL, datagram.data, datagram.dataLength), true);
+            route(&datagram, &header[0], headerLength);
           }
 
           return true;
@@ -1062,6 +1269,113 @@ namespace fdv
     }      
 
 
+  private:
+
+    // only routed datagrams need to be copied
+    // header: the received header (fixed part)
+    bool route(Datagram* datagram, uint8_t* header, uint16_t headerLength)
+    {
+      if (getFreeMem() - 200 < datagram->dataLength)
+      {
+#ifdef TCPVERBOSE
+        serial.write_P(PSTR("IP:route: cannot allocate")); cout << endl;
+#endif
+        return false; // cannot allocate
+      }
+      SimpleBuffer<uint8_t> dataBuffer(datagram->dataLength);
+      if (dataBuffer.get() == NULL)
+        return false; // cannot allocate
+      datagram->readSeek(0);  // the frame position may still be inside the header options
+      datagram->readBlock(dataBuffer.get(), datagram->dataLength);
+      DataList data(NULL, dataBuffer.get(), datagram->dataLength);
+
+      if (headerLength != 20)
+        return send(datagram->sourceAddress, datagram->destAddress, datagram->protocol, data, true);  // options are not forwarded, build a new header
+
+      // forward the received header, decrementing TTL
+      if (header[8] <= 1)
+        return false; // TTL expired
+      LinkAddress const* destHardwareAddress;
+      uint8_t interfaceIndex = prepareSend(datagram->sourceAddress, datagram->destAddress, true, &destHardwareAddress);
+      if (interfaceIndex == 0xFF)
+        return false;
+      uint16_t checksum = (uint16_t)header[10] << 8 | header[11];
+      uint16_t oldWord  = (uint16_t)header[8] << 8 | header[9];
+      --header[8];
+      checksum = InternetChecksum::update(checksum, oldWord, (uint16_t)header[8] << 8 | header[9]);
+      header[10] = checksum >> 8;
+      header[11] = checksum & 0xFF;
+      return transmit(interfaceIndex, *destHardwareAddress, header, data, false, 0xFFFF);
+    }
+
+
+    // find interface and destination hardware address. Return 0xFF on fail
+    uint8_t prepareSend(IPAddress const& srcAddress, IPAddress const& destAddress, bool isRouting, LinkAddress const** destHardwareAddress)
+    {
+      IPAddress effectiveDestAddress; // this IP address is used only in order to get effective hardware address, not as effective destination IP address
+      uint8_t   interfaceIndex = findInterfaceForAddress(destAddress, &effectiveDestAddress);
+      if (interfaceIndex == 0xFF)
+        return 0xFF; // no route, fail
+
+      // find destination hardware address
+      *destHardwareAddress = m_ARP->getHardwareAddress(interfaceIndex, effectiveDestAddress);
+      if (*destHardwareAddress == NULL)  // still not available? Try until ARPTRYTIMEOUT timeouts
+      {
+#ifdef TCPVERBOSE
+        serial.write_P(PSTR("IP:send: no hardware addr")); cout << endl;
+#endif
+        return 0xFF;
+        // todo: test
+        /*
+        TimeOut timeOut(ARPTRYTIMEOUT);
+        while ((destHardwareAddress = m_ARP->getHardwareAddressFromCache(effectiveDestAddress)) == NULL && !timeOut)
+        receive();
+        */
+      }
+
+      // avoid routing to the same interface
+      if (isRouting && findInterfaceForAddress(srcAddress, NULL) == interfaceIndex)
+      {
+#ifdef TCPVERBOSE
+        serial.write_P(PSTR("IP:send: routing failed, same interface!")); cout << endl;
+#endif
+        return 0xFF;
+      }
+
+      return interfaceIndex;
+    }
+
+
+    // calcHeaderChecksum: false = IPHeader already contains a valid checksum
+    bool transmit(uint8_t interfaceIndex, LinkAddress const& destHardwareAddress, uint8_t* IPHeader, DataList const& data, bool calcHeaderChecksum, uint16_t checksumPosition)
+    {
+      ILinkLayer* interface = m_ARP->interfaces()[interfaceIndex].interface;
+      // calculate checksum (or let the link layer do it)
+      bool offload = interface->checksumOffload();
+      if (calcHeaderChecksum && !offload)
+      {
+        uint16_t checksum = DataList(NULL, IPHeader, 20).calcInternetChecksum();
+        IPHeader[10] = checksum >> 8;
+        IPHeader[11] = checksum & 0xFF;
+      }
+      uint16_t totalLength = (uint16_t)IPHeader[2] << 8 | IPHeader[3];
+      LinkLayerChecksum upperChecksum(NULL, 20, totalLength - 20, 20 + checksumPosition);
+      LinkLayerChecksum headerChecksum(checksumPosition != 0xFFFF? &upperChecksum : NULL, 0, 20, 10);
+      LinkLayerChecksum const* checksums = NULL;
+      if (offload)
+        checksums = calcHeaderChecksum? &headerChecksum : headerChecksum.next;
+
+      // link layer
+      DataList dataList(&data, IPHeader, 20);
+      LinkLayerSendFrame frame(interface->getAddress(), destHardwareAddress, 0x0800, &dataList, checksums);
+
+      return interface->sendFrame(&frame) == ILinkLayer::SendOK;
+    }
+
+
+  public:
+
+
     Array<Protocol_ARP::InterfaceEntry, Protocol_ARP::MAXINTERFACES> const& interfaces() const
     {
       return m_ARP->interfaces();
@@ -1080,6 +1394,25 @@ namespace fdv
     }
 
 
+    // enables/disables checksum verification of received datagrams (enabled by default)
+    void checksumVerification(bool value)
+    {
+      m_checksumVerification = value;
+    }
+
+
+    bool checksumVerification() const
+    {
+      return m_checksumVerification;
+    }
+
+
+    ChecksumErrors const& checksumErrors() const
+    {
+      return m_checksumErrors;
+    }
+
+
   private:
 
     Protocol_ARP*                      m_ARP;            // ARP protocol
@@ -1087,6 +1420,8 @@ namespace fdv
     Array<IListener*, MAXLISTENERS>    m_listeners;      // upper layer listeners
     Array<RouteEntry, MAXROUTEENTRIES> m_routingTable;   // routing table    
     bool                               m_routingEnabled; // routing enabled
+    bool                               m_checksumVerification;
+    ChecksumErrors                     m_checksumErrors;
   };
 
 
@@ -1094,7 +1429,6 @@ namespace fdv
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   // Protocol_ICMP (ICMP - Internet Control Message Protocol)
   // Supports only pings
-  // Doesn't check checksum on received packets
 
   class Protocol_ICMP : public Protocol_IP::IListener
   {
@@ -1117,32 +1451,47 @@ namespace fdv
 #endif
       if (datagram->protocol == 0x01 && datagram->dataLength >= 8)
       {
-        uint8_t* databuf = static_cast<uint8_t*>(datagram->data);
-        if (databuf[0] == 8 && databuf[1] == 0)       // received Echo request
+        uint8_t header[8];
+        datagram->readBlock(&header[0], 8);
+        if (header[0] == 8 && header[1] == 0)       // received Echo request
         {
 #ifdef TCPVERBOSE
           serial.write_P(PSTR("ICMP::processIPDatagram: ECHO req")); cout << endl;
 #endif
+          // echo data must be sent back, so it is the only ICMP payload copied from the link layer
+          uint16_t echoLength = datagram->dataLength - 8;
+          if (getFreeMem() - 200 < echoLength)
+            return true; // cannot allocate
+          SimpleBuffer<uint8_t> echoData(echoLength);
+          if (echoData.get() == NULL && echoLength > 0)
+            return true; // cannot allocate
+          datagram->readBlock(echoData.get(), echoLength);
+          if (!datagram->checksumValid(0, datagram->dataLength))
+            return true;  // discard
           // set ICMP type = 0 (echo reply), code = 0
-          databuf[0] = 0;
-          databuf[1] = 0;
-          // clear checksum
-          databuf[2] = 0;
-          databuf[3] = 0;
-          // calculate and set new checksum
-          uint16_t checksum = DataList(NULL, datagram->data, datagram->dataLength).calcInternetChecksum();
-          databuf[2] = checksum >> 8;
-          databuf[3] = checksum & 0xFF;
+          header[0] = 0;
+          header[1] = 0;
+          // only type changed: update checksum (RFC 1624) instead of summing echo data again (or let the link layer calculate it)
+          DataList echoDataList(NULL, echoData.get(), echoLength);
+          DataList reply(&echoDataList, &header[0], 8);
+          bool offload = m_IP->checksumOffload(datagram->sourceAddress);
+          uint16_t checksum = 0;
+          if (!offload)
+            checksum = InternetChecksum::update(InternetChecksum::word(&header[2]), 0x0800, 0x0000);
+          header[2] = checksum >> 8;
+          header[3] = checksum & 0xFF;
           // send back datagram
-          m_IP->send(datagram->destAddress, datagram->sourceAddress, 0x01, DataList(NULL, datagram->data, datagram->dataLength), false);
+          m_IP->send(datagram->destAddress, datagram->sourceAddress, 0x01, reply, false, offload? 2 : 0xFFFF);
           return true;
         }
-        else if (databuf[0] == 0 && databuf[1] == 0)  // received Echo reply
+        else if (header[0] == 0 && header[1] == 0)  // received Echo reply
         {
 #ifdef TCPVERBOSE
           serial.write_P(PSTR("ICMP::processIPDatagram: ECHO reply")); cout << endl;
 #endif
-          m_receivedID = ((uint16_t)databuf[4] << 8) | databuf[5];
+          if (!datagram->checksumValid(0, datagram->dataLength))
+            return true;  // discard
+          m_receivedID = ((uint16_t)header[4] << 8) | header[5];
           return true;
         }
       }
@@ -1216,15 +1565,47 @@ namespace fdv
       uint16_t  length;        
     };
 
+    // the datagram data is read directly from the link layer frame
     struct Datagram
     {
       uint16_t  sourcePort;
       uint16_t  destPort;
       uint16_t  dataLength;
-      uint8_t*  data;
+
+      // pseudoHeaderSum: ignored when hasChecksum is false (checksum field is zero)
+      Datagram(Protocol_IP::Datagram* IPDatagram, bool hasChecksum, uint32_t pseudoHeaderSum)
+        : m_IPDatagram(IPDatagram), m_hasChecksum(hasChecksum), m_pseudoHeaderSum(pseudoHeaderSum)
+      {
+      }
+
+      // copies data (up to dataLength bytes) to dstBuffer, starting from the first data byte
+      void readBlock(void* dstBuffer, uint16_t length)
+      {
+        readReset();
+        m_IPDatagram->readBlock(dstBuffer, length);
+      }
+
+      // moves read position to the first data byte
+      void readReset()
+      {
+        m_IPDatagram->readSeek(8);
+      }
+
+      // data must be used only when checksum is valid. Call after readBlock(), so only data not copied yet is read again
+      bool checksumValid()
+      {
+        return !m_hasChecksum || m_IPDatagram->checksumValid(m_pseudoHeaderSum, 8 + dataLength);
+      }
+
+    private:
+
+      Protocol_IP::Datagram* m_IPDatagram;
+      bool                   m_hasChecksum;
+      uint32_t               m_pseudoHeaderSum;
     };        
 
     // interface used by classes that need to receive packets
+    // Listeners have to check Datagram::checksumValid() before using the data
     struct IListener
     {
       virtual bool processUDPDatagram(IPAddress const& sourceAddress, Datagram* datagram) = 0;
@@ -1240,6 +1621,19 @@ namespace fdv
     }
 
 
+    // not folded sum of the pseudo header (used also by TCP)
+    static uint32_t calcPseudoHeaderSum(IPAddress const& sourceAddress, IPAddress const& destAddress, uint8_t protocol, uint16_t length)
+    {
+      PseudoHeader pseudoHeader;
+      pseudoHeader.sourceAddress = sourceAddress;
+      pseudoHeader.destAddress   = destAddress;
+      pseudoHeader.zeros         = 0x00;
+      pseudoHeader.protocol      = protocol;
+      pseudoHeader.length        = Utility::htons(length);
+      return InternetChecksum::add(&pseudoHeader, sizeof(PseudoHeader));
+    }
+
+
     void addListener(IListener* listener)
     {
       m_listeners.push_back(listener);
@@ -1261,13 +1655,17 @@ namespace fdv
 #endif
       if (datagram->protocol == 0x11 && datagram->dataLength >= 8)
       {
-        uint8_t* databuf = static_cast<uint8_t*>(datagram->data);
+        uint8_t header[8];
+        datagram->readBlock(&header[0], 8);
+
+        uint16_t length = (uint16_t)header[4] << 8 | header[5];
+        bool hasChecksum = datagram->verifyChecksum() && (header[6] | header[7]) != 0;  // zero = no checksum
+        uint32_t pseudoHeaderSum = hasChecksum? calcPseudoHeaderSum(datagram->sourceAddress, datagram->destAddress, 0x11, length) : 0;
 
-        Datagram UDPDatagram;
-        UDPDatagram.sourcePort = (uint16_t)databuf[0] << 8 | databuf[1];
-        UDPDatagram.destPort   = (uint16_t)databuf[2] << 8 | databuf[3];
-        UDPDatagram.dataLength = ((uint16_t)databuf[4] << 8 | databuf[5]) - 8;
-        UDPDatagram.data       = &databuf[8];              
+        Datagram UDPDatagram(datagram, hasChecksum, pseudoHeaderSum);
+        UDPDatagram.sourcePort = (uint16_t)header[0] << 8 | header[1];
+        UDPDatagram.destPort   = (uint16_t)header[2] << 8 | header[3];
+        UDPDatagram.dataLength = min<uint16_t>(length - 8, datagram->dataLength - 8);
 
         for (uint8_t i = 0; i != m_listeners.size(); ++i)
           if (m_listeners[i]->processUDPDatagram(datagram->sourceAddress, &UDPDatagram))
@@ -1293,17 +1691,11 @@ namespace fdv
       serial.write_P(PSTR("UDP::Send: dst: ")); serial.writeIPv4(destAddress.data()); cout << endl;
 #endif
 
-      PseudoHeader pseudoHeader;
+      uint16_t dataLength = data.calcLength();
 
       uint8_t interfaceIndex = m_IP->findInterfaceForAddress(destAddress, NULL); 
 
-      pseudoHeader.sourceAddress = m_IP->interfaces()[interfaceIndex].address;
-      pseudoHeader.destAddress   = destAddress;
-      pseudoHeader.zeros         = 0x00;
-      pseudoHeader.protocol      = 0x11;
-      pseudoHeader.length        = Utility::htons(8 + data.calcLength());
-
-      uint16_t dataLength = data.calcLength();
+      uint32_t pseudoHeaderSum = calcPseudoHeaderSum(m_IP->interfaces()[interfaceIndex].address, destAddress, 0x11, 8 + dataLength);
 
       uint8_t udphead[8] =
       {
@@ -1319,8 +1711,17 @@ namespace fdv
 
       DataList datagram(&data, &udphead[0], 8);
 
+      if (m_IP->checksumOffload(destAddress))
+      {
+        // the link layer calculates checksum, just store the pseudo header sum
+        uint16_t sum = InternetChecksum::fold(pseudoHeaderSum);
+        udphead[6] = sum >> 8;
+        udphead[7] = sum & 0xFF;
+        return m_IP->send(IPAddress(0, 0, 0, 0), destAddress, 0x11, datagram, false, 6);
+      }
+
       // calc checksum      
-      uint16_t checksum = DataList(&datagram, &pseudoHeader, sizeof(PseudoHeader)).calcInternetChecksum();
+      uint16_t checksum = ~InternetChecksum::fold(datagram.calcSum(pseudoHeaderSum));
       udphead[6] = checksum >> 8;
       udphead[7] = checksum & 0xFF;
 
@@ -1347,19 +1748,738 @@ namespace fdv
 
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-  // StackTCPIP (aggregates Protocol_ARP, Protocol_IP, Protocol_ICMP, Protocol_UDP)
-
-  class StackTCPIP
+  // Protocol_TCP (TCP - Transmission Control Protocol)
+  // Minimal implementation:
+  //   - fixed connection table, send and receive buffers are allocated when a connection is opened
+  //   - the send window is limited by SENDBUFFERSIZE (unacknowledged + unsent bytes)
+  //   - go-back-N retransmission with exponential backoff
+  //   - out of order segments are dropped (and acknowledged), no urgent data, no options
+
+  class Protocol_TCP : public Protocol_IP::IListener
   {
 
   public:
 
-    StackTCPIP(IPAddress const& IP, IPAddress const& subnet, IPAddress const& gateway, ILinkLayer* interface, bool routingEnabled)
-      : m_IP(routingEnabled),
-      m_ICMP(&m_IP),
-      m_UDP(&m_IP)
-    {      
-      m_ARP.addInterface(interface, IP);
+    static uint8_t const  MAXCONNECTIONS    = 3;
+    static uint8_t const  MAXLISTENPORTS    = 2;
+    static uint16_t const SENDBUFFERSIZE    = 256;   // max unacknowledged + unsent bytes
+    static uint16_t const RECVBUFFERSIZE    = 256;   // max advertised window
+    static uint16_t const MAXSEGMENTSIZE    = 256;
+    static uint32_t const RETRANSMITTIMEOUT = 500;   // initial retransmit timeout (ms), doubled at each retry
+    static uint8_t const  MAXRETRANSMITS    = 6;
+    static uint32_t const TIMEWAITTIMEOUT   = 2000;  // shortened 2*MSL, to release table slots soon
+    static uint32_t const FINWAIT2TIMEOUT   = 30000; // max time waiting for remote FIN after application close
+    static uint8_t const  DUPACKTHRESHOLD   = 3;     // duplicate ACKs which trigger a fast retransmit
+
+    static uint8_t const  INVALID = 0xFF;            // invalid connection index
+
+    enum State
+    {
+      CLOSED,
+      SYN_SENT,
+      SYN_RECEIVED,
+      ESTABLISHED,
+      FIN_WAIT_1,
+      FIN_WAIT_2,
+      CLOSE_WAIT,
+      CLOSING,
+      LAST_ACK,
+      TIME_WAIT
+    };
+
+
+  private:
+
+    // header flags
+    static uint8_t const FIN = 0x01;
+    static uint8_t const SYN = 0x02;
+    static uint8_t const RST = 0x04;
+    static uint8_t const PSH = 0x08;
+    static uint8_t const ACK = 0x10;
+
+    struct Connection
+    {
+      uint8_t   state;
+      bool      owned;        // used by the application (accepted or connected) until close()
+      bool      finQueued;    // application has closed, FIN follows buffered data
+      uint8_t   retransmits;
+      uint8_t   dupAcks;      // duplicate ACKs counter (fast retransmit)
+      IPAddress remoteAddress;
+      uint16_t  remotePort;
+      uint16_t  localPort;
+      uint32_t  iss;          // initial send sequence number
+      uint32_t  sndUna;       // oldest unacknowledged sequence number (first byte of sendBuffer)
+      uint32_t  sndNxt;       // next sequence number to send
+      uint32_t  sndMax;       // highest sequence number sent
+      uint32_t  rcvNxt;       // next sequence number expected
+      uint16_t  sndWnd;       // remote receive window
+      uint16_t  sendLength;   // bytes in send buffer
+      uint16_t  recvLength;   // bytes in receive buffer
+      uint32_t  timer;        // retransmit (or TIME_WAIT) timer start
+      uint8_t*  buffer;       // send buffer (SENDBUFFERSIZE) + receive buffer (RECVBUFFERSIZE). NULL = free slot
+
+      uint8_t* recvBuffer()
+      {
+        return buffer + SENDBUFFERSIZE;
+      }
+
+      uint16_t window() const
+      {
+        return RECVBUFFERSIZE - recvLength;
+      }
+    };
+
+    struct Segment
+    {
+      uint16_t               sourcePort;
+      uint16_t               destPort;
+      uint32_t               seq;
+      uint32_t               ack;
+      uint8_t                flags;
+      uint16_t               window;
+      Protocol_IP::Datagram* data;        // read position is at the first data byte
+      uint16_t               dataLength;
+    };
+
+
+  public:
+
+    explicit Protocol_TCP(Protocol_IP* ip)
+      : m_IP(ip), m_lastSrcUsedPort(49151)
+    {
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+      {
+        m_connections[i].state  = CLOSED;
+        m_connections[i].owned  = false;
+        m_connections[i].buffer = NULL;
+      }
+      m_IP->addListener(this);
+    }
+
+
+    ~Protocol_TCP()
+    {
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+        freeItems(m_connections[i].buffer);
+    }
+
+
+    // accepts incoming connections on the specified local port (use accept() to get them)
+    bool listen(uint16_t port)
+    {
+      if (isListening(port))
+        return true;
+      if (m_listenPorts.size() == m_listenPorts.maxSize())
+        return false;
+      m_listenPorts.push_back(port);
+      return true;
+    }
+
+
+    void unlisten(uint16_t port)
+    {
+      m_listenPorts.remove(port);
+    }
+
+
+    // return the index of an established connection on the specified local port, INVALID if none
+    // The connection must be released using close()
+    uint8_t accept(uint16_t port)
+    {
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+      {
+        Connection& c = m_connections[i];
+        if (!c.owned && c.localPort == port && (c.state == ESTABLISHED || c.state == CLOSE_WAIT))
+        {
+          c.owned = true;
+          return i;
+        }
+      }
+      return INVALID;
+    }
+
+
+    // sends SYN and returns the connection index (INVALID on fail). Connection is established when state() is ESTABLISHED
+    // The connection must be released using close()
+    uint8_t connect(IPAddress const& destAddress, uint16_t destPort)
+    {
+      m_lastSrcUsedPort = (m_lastSrcUsedPort == 65535? 49152 : m_lastSrcUsedPort + 1);
+      uint8_t index = openConnection(destAddress, destPort, m_lastSrcUsedPort);
+      if (index != INVALID)
+      {
+        Connection& c = m_connections[index];
+        c.owned = true;
+        c.state = SYN_SENT;
+        c.timer = millis();
+        sendSegment(c, c.iss, SYN, NULL, 0);
+      }
+      return index;
+    }
+
+
+    // queues data to send, return the number of bytes queued (less than length when send buffer is full)
+    uint16_t send(uint8_t index, void const* data, uint16_t length)
+    {
+      Connection& c = m_connections[index];
+      if ((c.state != ESTABLISHED && c.state != CLOSE_WAIT) || c.finQueued)
+        return 0;
+      length = min<uint16_t>(length, SENDBUFFERSIZE - c.sendLength);
+      memcpy(c.buffer + c.sendLength, data, length);
+      c.sendLength += length;
+      output(c, false);
+      return length;
+    }
+
+
+    // return the number of bytes copied to buffer (0 = no data available)
+    uint16_t recv(uint8_t index, void* buffer, uint16_t bufferSize)
+    {
+      Connection& c = m_connections[index];
+      uint16_t length = min(bufferSize, c.recvLength);
+      if (length > 0)
+      {
+        bool wasSmall = c.window() < RECVBUFFERSIZE / 2;
+        memcpy(buffer, c.recvBuffer(), length);
+        c.recvLength -= length;
+        memmove(c.recvBuffer(), c.recvBuffer() + length, c.recvLength);
+        // window update, when the remote side could be waiting for it
+        if (wasSmall && c.window() >= RECVBUFFERSIZE / 2 && c.state != CLOSED)
+          sendSegment(c, c.sndNxt, ACK, NULL, 0);
+      }
+      return length;
+    }
+
+
+    // number of received bytes ready to be read by recv()
+    uint16_t available(uint8_t index) const
+    {
+      return m_connections[index].recvLength;
+    }
+
+
+    State state(uint8_t index) const
+    {
+      return static_cast<State>(m_connections[index].state);
+    }
+
+
+    // sends FIN after buffered data and releases the connection (index becomes invalid)
+    void close(uint8_t index)
+    {
+      Connection& c = m_connections[index];
+      c.owned = false;
+      switch (c.state)
+      {
+        case SYN_SENT:
+          setClosed(c);
+          break;
+        case ESTABLISHED:
+          c.state     = FIN_WAIT_1;
+          c.finQueued = true;
+          output(c, false);
+          break;
+        case CLOSE_WAIT:
+          c.state     = LAST_ACK;
+          c.finQueued = true;
+          output(c, false);
+          break;
+        case CLOSED:
+          setClosed(c);
+          break;
+        default:
+          break;
+      }
+    }
+
+
+    // handles retransmissions and TIME_WAIT timeouts, call periodically
+    void tick()
+    {
+      uint32_t now = millis();
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+      {
+        Connection& c = m_connections[i];
+        if (c.state == CLOSED)
+          continue;
+        if (c.state == TIME_WAIT || c.state == FIN_WAIT_2)
+        {
+          uint32_t elapsed = millisDiff(c.timer, now);
+          if ((c.state == TIME_WAIT && elapsed > TIMEWAITTIMEOUT) || elapsed > FINWAIT2TIMEOUT)
+            setClosed(c);
+          continue;
+        }
+        bool probe   = c.sndWnd == 0 && c.sendLength > c.sndNxt - c.sndUna;  // zero window probe
+        bool pending = c.sndNxt != c.sndUna || probe;
+        if (pending && millisDiff(c.timer, now) > (RETRANSMITTIMEOUT << c.retransmits))
+        {
+          if (++c.retransmits > MAXRETRANSMITS)
+          {
+#ifdef TCPVERBOSE
+            serial.write_P(PSTR("TCP::tick: too many retransmits, abort")); cout << endl;
+#endif
+            sendSegment(c, c.sndNxt, RST, NULL, 0);
+            setClosed(c);
+            continue;
+          }
+          c.timer = now;
+          if (c.state == SYN_SENT)
+            sendSegment(c, c.iss, SYN, NULL, 0);
+          else if (c.state == SYN_RECEIVED)
+            sendSegment(c, c.iss, SYN | ACK, NULL, 0);
+          else
+          {
+            c.sndNxt = c.sndUna;  // go-back-N
+            output(c, probe);
+          }
+        }
+      }
+    }
+
+
+    bool processIPDatagram(Protocol_IP::Datagram* datagram)
+    {
+#ifdef TCPVERBOSE
+      serial.write_P(PSTR("TCP::processIPDatagram: src: ")); serial.writeIPv4(datagram->sourceAddress.data()); cout << endl;
+#endif
+      if (datagram->protocol != 0x06 || datagram->dataLength < 20)
+        return false;
+
+      uint8_t databuf[20];
+      datagram->readBlock(&databuf[0], 20);
+      uint8_t headerLength = (databuf[12] >> 4) * 4;
+      if (headerLength < 20 || headerLength > datagram->dataLength)
+        return true;  // invalid header length, discard
+      if (datagram->verifyChecksum() &&
+          !datagram->checksumValid(Protocol_UDP::calcPseudoHeaderSum(datagram->sourceAddress, datagram->destAddress, 0x06, datagram->dataLength), datagram->dataLength))
+        return true;  // wrong checksum, discard
+      datagram->bypass(headerLength - 20);  // options
+
+      Segment segment;
+      segment.sourcePort = (uint16_t)databuf[0] << 8 | databuf[1];
+      segment.destPort   = (uint16_t)databuf[2] << 8 | databuf[3];
+      segment.seq        = getDWord(&databuf[4]);
+      segment.ack        = getDWord(&databuf[8]);
+      segment.flags      = databuf[13];
+      segment.window     = (uint16_t)databuf[14] << 8 | databuf[15];
+      segment.data       = datagram;
+      segment.dataLength = datagram->dataLength - headerLength;
+
+      uint8_t index = findConnection(datagram->sourceAddress, segment.sourcePort, segment.destPort);
+      if (index != INVALID)
+        processSegment(m_connections[index], segment);
+      else if ((segment.flags & (SYN | ACK | RST)) == SYN && isListening(segment.destPort))
+      {
+        index = openConnection(datagram->sourceAddress, segment.sourcePort, segment.destPort);
+        if (index != INVALID)
+        {
+#ifdef TCPVERBOSE
+          serial.write_P(PSTR("TCP::processIPDatagram: SYN received")); cout << endl;
+#endif
+          Connection& c = m_connections[index];
+          c.state  = SYN_RECEIVED;
+          c.rcvNxt = segment.seq + 1;
+          c.sndWnd = segment.window;
+          c.timer  = millis();
+          sendSegment(c, c.iss, SYN | ACK, NULL, 0);
+        }
+        else
+          sendReset(datagram->sourceAddress, segment);  // connection table full
+      }
+      else if (!(segment.flags & RST))
+        sendReset(datagram->sourceAddress, segment);    // no connection, no listener
+
+      return true;
+    }
+
+
+  private:
+
+    static uint32_t getDWord(uint8_t const* buf)
+    {
+      return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+    }
+
+
+    static void putDWord(uint8_t* buf, uint32_t value)
+    {
+      buf[0] = value >> 24;
+      buf[1] = value >> 16;
+      buf[2] = value >> 8;
+      buf[3] = value;
+    }
+
+
+    // sequence numbers comparison (modulo 2^32)
+    static bool seqLT(uint32_t a, uint32_t b)
+    {
+      return static_cast<int32_t>(a - b) < 0;
+    }
+
+
+    bool isListening(uint16_t port) const
+    {
+      for (uint8_t i = 0; i != m_listenPorts.size(); ++i)
+        if (m_listenPorts[i] == port)
+          return true;
+      return false;
+    }
+
+
+    uint8_t findConnection(IPAddress const& remoteAddress, uint16_t remotePort, uint16_t localPort) const
+    {
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+      {
+        Connection const& c = m_connections[i];
+        if (c.buffer != NULL && c.localPort == localPort && c.remotePort == remotePort && c.remoteAddress == remoteAddress)
+          return i;
+      }
+      return INVALID;
+    }
+
+
+    // allocates a free slot, return INVALID on fail
+    uint8_t openConnection(IPAddress const& remoteAddress, uint16_t remotePort, uint16_t localPort)
+    {
+      for (uint8_t i = 0; i != MAXCONNECTIONS; ++i)
+      {
+        Connection& c = m_connections[i];
+        if (c.buffer == NULL)
+        {
+          Arena::Scope heap(NULL);  // connections outlive the running script arena (if any)
+          c.buffer = allocItems<uint8_t>(SENDBUFFERSIZE + RECVBUFFERSIZE);
+          if (c.buffer == NULL)
+            return INVALID;
+          c.state         = CLOSED;
+          c.owned         = false;
+          c.finQueued     = false;
+          c.retransmits   = 0;
+          c.dupAcks       = 0;
+          c.remoteAddress = remoteAddress;
+          c.remotePort    = remotePort;
+          c.localPort     = localPort;
+          c.iss           = Random::nextUInt32();
+          c.sndUna        = c.iss;
+          c.sndNxt        = c.iss + 1;  // SYN
+          c.sndMax        = c.sndNxt;
+          c.rcvNxt        = 0;
+          c.sndWnd        = 0;
+          c.sendLength    = 0;
+          c.recvLength    = 0;
+          return i;
+        }
+      }
+      return INVALID;
+    }
+
+
+    // the slot is released when the application doesn't own it anymore
+    void setClosed(Connection& c)
+    {
+      c.state = CLOSED;
+      if (!c.owned)
+      {
+        freeItems(c.buffer);
+        c.buffer = NULL;
+      }
+    }
+
+
+    void processSegment(Connection& c, Segment& segment)
+    {
+      if (c.state == CLOSED)
+      {
+        if (!(segment.flags & RST))
+          sendReset(c.remoteAddress, segment);
+        return;
+      }
+
+      if (c.state == SYN_SENT)
+      {
+        if ((segment.flags & ACK) && segment.ack != c.iss + 1)
+        {
+          if (!(segment.flags & RST))
+            sendReset(c.remoteAddress, segment);
+        }
+        else if (segment.flags & RST)
+        {
+          if (segment.flags & ACK)
+            setClosed(c);  // connection refused
+        }
+        else if ((segment.flags & (SYN | ACK)) == (SYN | ACK))
+        {
+          c.state       = ESTABLISHED;
+          c.rcvNxt      = segment.seq + 1;
+          c.sndUna      = c.iss + 1;
+          c.sndWnd      = segment.window;
+          c.retransmits = 0;
+          sendSegment(c, c.sndNxt, ACK, NULL, 0);
+        }
+        return;  // simultaneous open not supported
+      }
+
+      // retransmitted SYN (our SYN+ACK has been lost)
+      if ((segment.flags & SYN) && segment.seq + 1 == c.rcvNxt)
+      {
+        if (c.state == SYN_RECEIVED)
+          sendSegment(c, c.iss, SYN | ACK, NULL, 0);
+        else
+          sendSegment(c, c.sndNxt, ACK, NULL, 0);  // our ACK has been lost
+        return;
+      }
+
+      // trim already received data, drop out of order segments
+      if (seqLT(segment.seq, c.rcvNxt))
+      {
+        uint32_t duplicated = c.rcvNxt - segment.seq;
+        if (duplicated > segment.dataLength || (duplicated == segment.dataLength && (segment.flags & FIN) == 0 && segment.dataLength > 0))
+        {
+          if (!(segment.flags & RST))
+            sendSegment(c, c.sndNxt, ACK, NULL, 0);
+          return;
+        }
+        segment.data->bypass(duplicated);
+        segment.dataLength -= duplicated;
+        segment.seq         = c.rcvNxt;
+      }
+      else if (segment.seq != c.rcvNxt)
+      {
+        if (!(segment.flags & RST))
+          sendSegment(c, c.sndNxt, ACK, NULL, 0);
+        return;
+      }
+
+      if (segment.flags & (RST | SYN))
+      {
+#ifdef TCPVERBOSE
+        serial.write_P(PSTR("TCP::processSegment: reset")); cout << endl;
+#endif
+        if (segment.flags & SYN)
+          sendSegment(c, c.sndNxt, RST, NULL, 0);
+        setClosed(c);
+        return;
+      }
+
+      if (!(segment.flags & ACK))
+        return;
+
+      if (c.state == SYN_RECEIVED)
+      {
+        if (segment.ack != c.iss + 1)
+        {
+          sendReset(c.remoteAddress, segment);
+          return;
+        }
+        c.state       = ESTABLISHED;
+        c.sndUna      = c.iss + 1;
+        c.retransmits = 0;
+      }
+
+      // acknowledged data (and FIN)
+      if (seqLT(c.sndUna, segment.ack) && !seqLT(c.sndMax, segment.ack))
+      {
+        bool     finAcked = c.finQueued && segment.ack == c.sndUna + c.sendLength + 1;
+        uint16_t acked    = finAcked? c.sendLength : segment.ack - c.sndUna;
+        c.sendLength -= acked;
+        memmove(c.buffer, c.buffer + acked, c.sendLength);
+        c.sndUna = segment.ack;
+        if (seqLT(c.sndNxt, c.sndUna))
+          c.sndNxt = c.sndUna;
+        c.retransmits = 0;
+        c.dupAcks     = 0;
+        c.timer       = millis();
+        if (finAcked)
+        {
+          switch (c.state)
+          {
+            case FIN_WAIT_1:
+              c.state = FIN_WAIT_2;
+              break;
+            case CLOSING:
+              c.state = TIME_WAIT;
+              break;
+            case LAST_ACK:
+              setClosed(c);
+              return;
+          }
+        }
+      }
+      else if (seqLT(c.sndMax, segment.ack))
+      {
+        sendSegment(c, c.sndNxt, ACK, NULL, 0);  // acknowledges something not yet sent
+        return;
+      }
+      else if (segment.window == 0)
+        c.retransmits = 0;  // zero window probe answered, remote side is alive
+      else if (segment.ack == c.sndUna && c.sndMax != c.sndUna && segment.dataLength == 0 && segment.window == c.sndWnd &&
+               ++c.dupAcks == DUPACKTHRESHOLD)
+        c.sndNxt = c.sndUna;  // fast retransmit: remote side is receiving segments after a lost one (go-back-N)
+      c.sndWnd = segment.window;
+
+      // received data
+      bool mustAck = false;
+      if (segment.dataLength > 0 && (c.state == ESTABLISHED || c.state == FIN_WAIT_1 || c.state == FIN_WAIT_2))
+      {
+        uint16_t length = min(segment.dataLength, c.window());
+        segment.data->readBlock(c.recvBuffer() + c.recvLength, length);
+        c.recvLength += length;
+        c.rcvNxt     += length;
+        mustAck       = true;  // even when nothing has been accepted (zero window probe)
+        if (length < segment.dataLength)
+          segment.flags &= ~FIN;  // FIN follows discarded data
+      }
+
+      // FIN
+      if (segment.flags & FIN)
+      {
+        c.rcvNxt += 1;
+        mustAck   = true;
+        switch (c.state)
+        {
+          case ESTABLISHED:
+            c.state = CLOSE_WAIT;
+            break;
+          case FIN_WAIT_1:
+            c.state = CLOSING;  // our FIN not acknowledged yet
+            break;
+          case FIN_WAIT_2:
+            c.state = TIME_WAIT;
+            break;
+        }
+        if (c.state == TIME_WAIT)
+          c.timer = millis();
+      }
+
+      if (!output(c, false) && mustAck)
+        sendSegment(c, c.sndNxt, ACK, NULL, 0);
+    }
+
+
+    // sends unsent data (and FIN) allowed by the remote window. Return true if at least a segment has been sent
+    // probe = send at least one byte even if remote window is zero
+    bool output(Connection& c, bool probe)
+    {
+      if (c.state != ESTABLISHED && c.state != CLOSE_WAIT && c.state != FIN_WAIT_1 && c.state != CLOSING && c.state != LAST_ACK)
+        return false;
+      bool sent = false;
+      while (true)
+      {
+        uint16_t offset = c.sndNxt - c.sndUna;
+        if (offset > c.sendLength)
+          return sent;  // FIN already sent
+        uint16_t window = c.sndWnd > offset? c.sndWnd - offset : (probe && offset == 0? 1 : 0);
+        uint16_t length = min<uint16_t>(c.sendLength - offset, window);
+        if (length > MAXSEGMENTSIZE)
+          length = MAXSEGMENTSIZE;
+        bool     fin    = c.finQueued && offset + length == c.sendLength;
+        if (length == 0 && !fin)
+          return sent;
+        if (c.sndNxt == c.sndUna)
+          c.timer = millis();  // start retransmit timer
+        sendSegment(c, c.sndNxt, ACK | (length > 0? PSH : 0) | (fin? FIN : 0), c.buffer + offset, length);
+        c.sndNxt += length + (fin? 1 : 0);
+        if (seqLT(c.sndMax, c.sndNxt))
+          c.sndMax = c.sndNxt;
+        sent  = true;
+        probe = false;
+      }
+    }
+
+
+    bool sendSegment(Connection const& c, uint32_t seq, uint8_t flags, void const* data, uint16_t length)
+    {
+      return sendSegment(c.remoteAddress, c.localPort, c.remotePort, seq, c.rcvNxt, flags, c.window(), data, length);
+    }
+
+
+    // RFC 793: reset for segments which don't belong to any connection
+    bool sendReset(IPAddress const& destAddress, Segment const& segment)
+    {
+#ifdef TCPVERBOSE
+      serial.write_P(PSTR("TCP::sendReset")); cout << endl;
+#endif
+      if (segment.flags & ACK)
+        return sendSegment(destAddress, segment.destPort, segment.sourcePort, segment.ack, 0, RST, 0, NULL, 0);
+      uint32_t ack = segment.seq + segment.dataLength + ((segment.flags & SYN)? 1 : 0) + ((segment.flags & FIN)? 1 : 0);
+      return sendSegment(destAddress, segment.destPort, segment.sourcePort, 0, ack, RST | ACK, 0, NULL, 0);
+    }
+
+
+    bool sendSegment(IPAddress const& destAddress, uint16_t srcPort, uint16_t destPort, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t window, void const* data, uint16_t length)
+    {
+      uint8_t interfaceIndex = m_IP->findInterfaceForAddress(destAddress, NULL);
+      if (interfaceIndex == 0xFF)
+        return false;  // no route
+
+      uint32_t pseudoHeaderSum = Protocol_UDP::calcPseudoHeaderSum(m_IP->interfaces()[interfaceIndex].address, destAddress, 0x06, 20 + length);  // same pseudo header of UDP
+
+      uint8_t tcphead[20] =
+      {
+        srcPort >> 8,
+        srcPort & 0xFF,
+        destPort >> 8,
+        destPort & 0xFF,
+        0, 0, 0, 0,       // sequence number
+        0, 0, 0, 0,       // acknowledgment number
+        5 << 4,           // data offset (20 bytes)
+        flags,
+        window >> 8,
+        window & 0xFF,
+        0,                // checksum
+        0,
+        0,                // urgent pointer
+        0
+      };
+      putDWord(&tcphead[4], seq);
+      putDWord(&tcphead[8], (flags & ACK)? ack : 0);
+
+      DataList payload(NULL, data, length);
+      DataList segment(length > 0? &payload : NULL, &tcphead[0], 20);
+
+      if (m_IP->checksumOffload(destAddress))
+      {
+        // the link layer calculates checksum, just store the pseudo header sum
+        uint16_t sum = InternetChecksum::fold(pseudoHeaderSum);
+        tcphead[16] = sum >> 8;
+        tcphead[17] = sum & 0xFF;
+        return m_IP->send(IPAddress(0, 0, 0, 0), destAddress, 0x06, segment, false, 16);
+      }
+
+      // calc checksum
+      uint16_t checksum = ~InternetChecksum::fold(segment.calcSum(pseudoHeaderSum));
+      tcphead[16] = checksum >> 8;
+      tcphead[17] = checksum & 0xFF;
+
+      return m_IP->send(IPAddress(0, 0, 0, 0), destAddress, 0x06, segment, false);
+    }
+
+
+  private:
+
+    Protocol_IP*                        m_IP;                          // IP layer
+    Connection                          m_connections[MAXCONNECTIONS]; // connection table
+    Array<uint16_t, MAXLISTENPORTS>     m_listenPorts;                 // listening local ports
+    uint16_t                            m_lastSrcUsedPort;             // last port used to connect
+
+  };
+
+
+
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  // StackTCPIP (aggregates Protocol_ARP, Protocol_IP, Protocol_ICMP, Protocol_UDP, Protocol_TCP)
+
+  class StackTCPIP
+  {
+
+  public:
+
+    StackTCPIP(IPAddress const& IP, IPAddress const& subnet, IPAddress const& gateway, ILinkLayer* interface, bool routingEnabled)
+      : m_IP(routingEnabled),
+      m_ICMP(&m_IP),
+      m_UDP(&m_IP),
+      m_TCP(&m_IP)
+    {      
+      m_ARP.addInterface(interface, IP);
       m_IP.setARP(&m_ARP);
       m_IP.addRoute(IP & subnet, subnet, IP, 0);  // myself
       m_IP.addRoute(IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), gateway, 0);   // default gateway
@@ -1368,13 +2488,20 @@ namespace fdv
     explicit StackTCPIP(bool routingEnabled)
       : m_IP(routingEnabled),
       m_ICMP(&m_IP),
-      m_UDP(&m_IP)
+      m_UDP(&m_IP),
+      m_TCP(&m_IP)
     {      
     }
 
     void yield()
     {
       m_UDP.receive();
+      m_TCP.tick();
+    }
+
+    Protocol_TCP& TCP()
+    {
+      return m_TCP;
     }
 
     Protocol_UDP& UDP()
@@ -1403,6 +2530,7 @@ namespace fdv
     Protocol_IP   m_IP;
     Protocol_ICMP m_ICMP;
     Protocol_UDP  m_UDP;
+    Protocol_TCP  m_TCP;
   };
 
 
@@ -1416,16 +2544,18 @@ namespace fdv
 
   public:
 
-    enum Protocol { UDP };
+    enum Protocol { UDP, TCP };
 
     Socket(StackTCPIP* stack, Protocol protocol)
-      : m_stack(stack), m_protocol(protocol), m_bindHost(IPAddress(0, 0, 0, 0)), m_bindPort(0)
+      : m_stack(stack), m_protocol(protocol), m_bindHost(IPAddress(0, 0, 0, 0)), m_bindPort(0), m_connection(Protocol_TCP::INVALID), m_listenPort(0)
     {
       switch (m_protocol)
       {
       case UDP:
         m_stack->UDP().addListener(this);
         break;
+      case TCP:
+        break;
       }
     }
 
@@ -1436,6 +2566,9 @@ namespace fdv
       case UDP:
         m_stack->UDP().delListener(this);
         break;
+      case TCP:
+        close();
+        break;
       }
     }
 
@@ -1454,13 +2587,25 @@ namespace fdv
         //cout << (uint16_t)datagram->destPort << endl;
         return false;
       }
-      m_currentReceivedData = min(datagram->dataLength, m_currentBufferSize);
-      memcpy(m_currentBuffer, datagram->data, m_currentReceivedData);
+      uint16_t length = min(datagram->dataLength, m_currentBufferSize);
+      datagram->readBlock(m_currentBuffer, length);
+      if (datagram->checksumValid())
+        m_currentReceivedData = length;
       return true;
     }
 
+    // TCP: receives up to bufferSize bytes. Returns 0 on timeout or when the connection has been closed
     uint16_t recv(uint32_t timeout_ms, void* buffer, uint16_t bufferSize)
     {
+      if (m_protocol == TCP)
+      {
+        if (m_connection == Protocol_TCP::INVALID)
+          return 0;
+        TimeOut timeout(timeout_ms);
+        while (!timeout && m_stack->TCP().available(m_connection) == 0 && canReceive())
+          m_stack->yield();
+        return m_stack->TCP().recv(m_connection, buffer, bufferSize);
+      }
       m_currentBuffer       = buffer;
       m_currentBufferSize   = bufferSize;
       m_currentReceivedData = 0;
@@ -1485,8 +2630,98 @@ namespace fdv
       }
     }
 
+    // TCP: waits until all data has been queued (the send window is small). Returns false if the connection has been lost
+    bool send(void const* buffer, uint16_t bufferSize)
+    {
+      if (m_protocol != TCP || m_connection == Protocol_TCP::INVALID)
+        return false;
+      uint8_t const* data = static_cast<uint8_t const*>(buffer);
+      while (true)
+      {
+        uint16_t queued = m_stack->TCP().send(m_connection, data, bufferSize);
+        data       += queued;
+        bufferSize -= queued;
+        if (bufferSize == 0)
+          return true;
+        Protocol_TCP::State state = m_stack->TCP().state(m_connection);
+        if (state != Protocol_TCP::ESTABLISHED && state != Protocol_TCP::CLOSE_WAIT)
+          return false;
+        m_stack->yield();
+      }
+    }
+
+    // TCP: accepts incoming connections on the specified port
+    bool listen(uint16_t port)
+    {
+      if (m_protocol != TCP || !m_stack->TCP().listen(port))
+        return false;
+      m_listenPort = port;
+      return true;
+    }
+
+    // TCP: waits for an incoming connection on the listening port and assigns it to "socket"
+    bool accept(Socket* socket, uint32_t timeout_ms)
+    {
+      if (m_listenPort == 0)
+        return false;
+      TimeOut timeout(timeout_ms);
+      uint8_t connection;
+      while ((connection = m_stack->TCP().accept(m_listenPort)) == Protocol_TCP::INVALID && !timeout)
+        m_stack->yield();
+      if (connection == Protocol_TCP::INVALID)
+        return false;
+      socket->close();
+      socket->m_connection = connection;
+      return true;
+    }
+
+    // TCP: connects to the specified host and waits for the connection to be established
+    bool connect(IPAddress const& destAddress, uint16_t port, uint32_t timeout_ms)
+    {
+      if (m_protocol != TCP)
+        return false;
+      close();
+      m_connection = m_stack->TCP().connect(destAddress, port);
+      if (m_connection == Protocol_TCP::INVALID)
+        return false;
+      TimeOut timeout(timeout_ms);
+      while (m_stack->TCP().state(m_connection) == Protocol_TCP::SYN_SENT && !timeout)
+        m_stack->yield();
+      if (m_stack->TCP().state(m_connection) == Protocol_TCP::ESTABLISHED)
+        return true;
+      close();
+      return false;
+    }
+
+    // TCP: closes the connection (after buffered data has been sent) and stops listening
+    void close()
+    {
+      if (m_connection != Protocol_TCP::INVALID)
+      {
+        m_stack->TCP().close(m_connection);
+        m_connection = Protocol_TCP::INVALID;
+      }
+      if (m_listenPort != 0)
+      {
+        m_stack->TCP().unlisten(m_listenPort);
+        m_listenPort = 0;
+      }
+    }
+
+    bool isConnected() const
+    {
+      return m_connection != Protocol_TCP::INVALID && m_stack->TCP().state(m_connection) == Protocol_TCP::ESTABLISHED;
+    }
+
   private:
 
+    // TCP: more data may arrive
+    bool canReceive() const
+    {
+      Protocol_TCP::State state = m_stack->TCP().state(m_connection);
+      return state == Protocol_TCP::ESTABLISHED || state == Protocol_TCP::FIN_WAIT_1 || state == Protocol_TCP::FIN_WAIT_2;
+    }
+
     StackTCPIP* m_stack;
     Protocol    m_protocol;
     IPAddress   m_bindHost;
@@ -1494,6 +2729,8 @@ namespace fdv
     void*       m_currentBuffer;
     uint16_t    m_currentBufferSize;
     uint16_t    m_currentReceivedData;
+    uint8_t     m_connection;  // TCP connection index
+    uint16_t    m_listenPort;  // TCP listening port (0 = not listening)
   };
 
 
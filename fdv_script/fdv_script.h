@@ -72,6 +72,8 @@ primary_expression = variable
 | unparsed_string_literal
 | '(' expression ')'
 | '{' [expression] {',' expression} '}'
+| '{' ':' '}'
+| '{' expression ':' expression {',' expression ':' expression} '}'
 
 
 postfix_expression = variable ("--" | "++")
@@ -145,9 +147,16 @@ iteration_statement = "while" '(' expression ')' statement
 
 jump_statement = "continue" ';'
 | "break" ';'
+| "return" [expression] ';'
 
 
-output_statement = ':' expression {':' expression} ';'
+function_definition = "func" identifier '(' [identifier {',' identifier}] ')' compound_statement
+
+
+output_statement = ':' output_item {':' output_item} ';'
+
+
+output_item = string_literal | expression
 
 
 statement = "<?"
@@ -155,6 +164,7 @@ statement = "<?"
 | "//" all_chars EOL
 | output_statement
 | compound_statement
+| function_definition
 | expression_statement
 | selection_statement
 | iteration_statement
@@ -183,6 +193,11 @@ void write(char const* str)
 {
 cout << str;
 }
+// optional, used to write literal text (otherwise write(char) is called for each char)
+void write(char const* str, size_t len)
+{
+cout.write(str, len);
+}
 };
 
 int main()
@@ -201,6 +216,51 @@ cout << "ok!" << endl;
 
 *******************************************************************************
 
+COMPILE ONCE, RUN MANY TIMES:
+
+parseScript() compiles the script to bytecode (ScriptCode) and runs it with ScriptVM.
+To run the same script many times keep the compiled code (and its input):
+
+ScriptCode code;
+if (compileScript< RunTime<Output> >(&textInput, &code))
+for (uint8_t i = 0; i != 10; ++i)
+runScript(&globalRunTime, &textInput, &code);
+
+*******************************************************************************
+
+PROFILER:
+
+Define FDV_SCRIPT_PROFILER before including fdv_script.h to record execution count and time of
+each statement (by script file and source offset) and library function (see ScriptProfiler).
+The report is written by ScriptProfiler::dump() or, from a script, by "profile_dump()" (ScriptLibrary).
+
+
+ARENA:
+
+Strings, arrays and variables of a script can be allocated from an Arena (see fdv_memory.h),
+released in one step, instead of fragmenting the heap. The arena must outlive the RunTime:
+
+  Arena arena(1024);
+  {
+    Arena::Scope arenaScope(&arena);
+    RunTimeT runTime(output, library, NULL);
+    parseScript(&runTime, &input);
+  }
+  // arena.highWater() and arena.overflows() tell how to size it
+
+ScriptScheduler does it for each running script (see FDV_SCRIPT_ARENA).
+
+
+OPTIMIZATIONS:
+
+When a script is compiled, operators and interpolated strings whose operands are all constants
+are evaluated once ("x = 60*60*24" stores 86400, "$(1+1)px" is the constant "2px"), "if" and
+"while" with a constant condition don't emit the test, and statements which can never run
+("if (0) {...}", the "else" of "if (1)", "while (0) ...") are not emitted. Direct execution
+behaves the same. Define FDV_SCRIPT_OPTIMIZE as 0 to compile scripts as they are written.
+
+*******************************************************************************
+
 
 SCRIPT SAMPLES:
 ************************
@@ -287,6 +347,25 @@ iniwritestring("CONF.INI", "myarray", str(arr));
 ...
 ar1 = eval(inireadstring("CONF.INI", "myarray", "{}"));
 ?>
+************************
+Sample #10, functions (parameters and variables are local, globals are not visible):
+<?
+func fact(n)
+{
+  if (n < 2)
+    return 1;
+  return n * fact(n - 1);
+}
+: fact(5);
+?>
+************************
+Sample #11, maps (keys are strings, see also mapkeys(), maphas() and mapdel()):
+<?
+m = {"name" : "boiler", "temp" : 21};
+m["on"] = 1;
+:m["name"] : " " : sizeof(m);   // print "boiler 3"
+e = {:};                        // create empty map
+?>
 
 
 */
@@ -299,8 +378,25 @@ ar1 = eval(inireadstring("CONF.INI", "myarray", "{}"));
 #include <stdlib.h>
 #include <ctype.h>
 
+#include "../fdv_generic/fdv_timesched.h"
 #include "../fdv_sdlib/fdv_sdcard.h"
 #include "fdv_variant.h"
+#include "fdv_scriptProfiler.h"
+
+
+// compile time optimizations (see OPTIMIZATIONS), define as 0 to disable them
+#ifndef FDV_SCRIPT_OPTIMIZE
+#define FDV_SCRIPT_OPTIMIZE 1
+#endif
+
+// windows of BufferedFileInput (see CachedFileInput). The default is a single 16 bytes window,
+// like the old buffer (42 bytes of RAM); 3 windows of 32 bytes avoid most re-reads of loops (134 bytes)
+#ifndef FDV_SCRIPT_INPUTWINDOWS
+#define FDV_SCRIPT_INPUTWINDOWS 1
+#endif
+#ifndef FDV_SCRIPT_INPUTWINDOWLEN
+#define FDV_SCRIPT_INPUTWINDOWLEN 16
+#endif
 
 
 
@@ -320,8 +416,94 @@ namespace fdv
     virtual bool isEOF() = 0;
     virtual string const extract(size_t from) = 0;
     virtual void extract(size_t from, char* result) = 0;
+
+    // Returns the chars already in memory starting at current position (without moving it),
+    // "len" receives their count (at least one when not EOF).
+    // Returns NULL (len=0) when the input has no memory buffer: use get() and next().
+    virtual char const* span(size_t* len)
+    {
+      *len = 0;
+      return NULL;
+    }
+  };
+
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // writeOutput
+  // Writes "len" chars to OutputT, as a whole when OutputT implements
+  // "void write(char const* str, size_t len)", otherwise calling write(char) for each char.
+
+  template <typename OutputT>
+  struct OutputHasSpanWrite
+  {
+    template <typename T, void (T::*)(char const*, size_t)> struct Check { };
+    template <typename T> static uint8_t  test(Check<T, &T::write>*);
+    template <typename T> static uint16_t test(...);
+    static bool const value = sizeof(test<OutputT>(0)) == sizeof(uint8_t);
+  };
+
+  template <bool SPANWRITE>
+  struct OutputSpanWriter
+  {
+    template <typename OutputT>
+    static void write(OutputT* output, char const* str, size_t len)
+    {
+      output->write(str, len);
+    }
+  };
+
+  template <>
+  struct OutputSpanWriter<false>
+  {
+    template <typename OutputT>
+    static void write(OutputT* output, char const* str, size_t len)
+    {
+      for (; len > 0; --len)
+        output->write(*str++);
+    }
   };
 
+  template <typename OutputT>
+  inline void writeOutput(OutputT* output, char const* str, size_t len)
+  {
+    OutputSpanWriter< OutputHasSpanWrite<OutputT>::value >::write(output, str, len);
+  }
+
+
+  // writes "len" chars of "input" (from current position) to "output"
+  template <typename OutputT>
+  inline void writeOutput(OutputT* output, InputBase* input, size_t len)
+  {
+    while (len > 0)
+    {
+      size_t count;
+      char const* str = input->span(&count);
+      if (str == NULL)
+      {
+        // input without buffer
+        output->write( input->get() );
+        input->next();
+        --len;
+        continue;
+      }
+      count = min(count, len);
+      writeOutput(output, str, count);
+      input->pos(input->pos() + count);
+      len -= count;
+    }
+  }
+
+
+  // writes "value" to "output" (a string is written without copying it)
+  template <typename OutputT>
+  inline void writeOutput(OutputT* output, Variant const& value)
+  {
+    if (value.type() == Variant::STRING)
+      output->write( value.constStringVal().c_str() );
+    else
+      output->write( value.toString().c_str() );
+  }
+
 
   ///////////////////////////////////////////////////////////////////////////////////////////////
   // TextInput
@@ -333,7 +515,7 @@ namespace fdv
   public:
 
     TextInput(char const* text) :
-        m_text(text), m_pos(0)
+        m_text(text), m_pos(0), m_len(strlen(text))
         {
         }
 
@@ -375,6 +557,12 @@ namespace fdv
           memcpy(result, &m_text[from], m_pos-from);
         }
 
+        char const* span(size_t* len)
+        {
+          *len = m_len - m_pos;
+          return &m_text[m_pos];
+        }
+
   private:
 
     char const* m_text;
@@ -384,85 +572,183 @@ namespace fdv
 
 
   ///////////////////////////////////////////////////////////////////////////////////////////////
-  // FileInput
-  // Input from File
-
-  struct BufferedFileInput : public InputBase
-  {
-    BufferedFileInput(File* file) :
-  m_file(file), m_bufPos(0), m_fileSize(m_file->size()), m_filePos(0xFFFFFFFF)
+  // CachedFileInput
+  // Input from File, cached in WINDOWS windows of WINDOWLEN (power of 2) bytes.
+  // RAM used (AVR): 20 + WINDOWS * (WINDOWLEN + 6) bytes, ie 42 bytes for 1x16 (the former
+  // BufferedFileInput, with a single 16 bytes buffer, used 29), 134 bytes for 3x32.
+  // Windows are aligned to WINDOWLEN and the least recently used one is replaced, so jumping back
+  // (loops, backtracking) doesn't read the file again while the jump target is still cached.
+  // With more than two windows, moving forward to the next window also reads the following one
+  // (read-ahead), when the file is already positioned there (no seek).
+
+  template <uint8_t WINDOWS, uint8_t WINDOWLEN>
+  struct CachedFileInput : public InputBase
   {
-    pos(0);
-  }
+    CachedFileInput(File* file) :
+      m_file(file), m_fileSize(m_file->size()), m_filePos(NOWINDOW), m_clock(0), m_hits(0), m_misses(0), m_cur(0), m_bufPos(0)
+    {
+      for (uint8_t i = 0; i != WINDOWS; ++i)
+      {
+        m_windows[i].filePos = NOWINDOW;
+        m_windows[i].lastUse = 0;
+      }
+      pos(0);
+    }
 
-  char get()
-  {
-    return m_buffer[m_bufPos];
-  }
+    char get()
+    {
+      return m_windows[m_cur].data[m_bufPos];
+    }
 
-  void next()
-  {
-    ++m_bufPos;
-    if (m_bufPos==BUFLEN)
-      pos(m_filePos + m_bufPos);
-  }
+    void next()
+    {
+      if (++m_bufPos == WINDOWLEN)
+      {
+        uint32_t start = m_windows[m_cur].filePos + WINDOWLEN;
+        select(start);
+        m_bufPos = 0;
+        if (WINDOWS > 2 && start + WINDOWLEN < m_fileSize && find(start + WINDOWLEN) == NOTCACHED
+          && m_filePos == start + WINDOWLEN)
+          load(lru(), start + WINDOWLEN);  // read-ahead
+      }
+    }
 
-  size_t pos()
-  {
-    return m_filePos + m_bufPos;
-  }
+    size_t pos()
+    {
+      return m_windows[m_cur].filePos + m_bufPos;
+    }
 
-  void pos(size_t value)
-  {
-    if (value < m_filePos || value >= (m_filePos+BUFLEN))
+    void pos(size_t value)
     {
-      m_filePos = value;
-      m_bufPos = 0;
-      m_file->position(m_filePos);
-      m_file->read(&m_buffer[0], BUFLEN);
+      uint32_t start = value & ~uint32_t(WINDOWLEN - 1);
+      if (start != m_windows[m_cur].filePos)
+        select(start);
+      m_bufPos = value - start;
     }
-    else
-      m_bufPos = value - m_filePos;
-  }
 
-  bool isEOF()
-  {
-    return m_filePos + m_bufPos >= m_fileSize;
-  }
+    bool isEOF()
+    {
+      return pos() >= m_fileSize;
+    }
 
-  string const extract(size_t from)
-  {
-    string ret(pos()-from, ' ');
-    extract(from, ret.c_str());
-    return ret;
-  }
+    string const extract(size_t from)
+    {
+      string ret(pos()-from, ' ');
+      extract(from, ret.c_str());
+      return ret;
+    }
 
-  void extract(size_t from, char* result)
-  {
-    if (from > m_filePos)
+    void extract(size_t from, char* result)
     {
-      memcpy(result, &m_buffer[from-m_filePos], pos()-from);
+      uint32_t end = pos();
+      while (from < end)
+      {
+        uint32_t start = from & ~uint32_t(WINDOWLEN - 1);
+        uint8_t  len   = min<uint32_t>(start + WINDOWLEN, end) - from;
+        uint8_t  w     = find(start);
+        if (w != NOTCACHED)
+          memcpy(result, &m_windows[w].data[from - start], len);
+        else
+          read(from, result, len);
+        from   += len;
+        result += len;
+      }
     }
-    else
+
+    char const* span(size_t* len)
     {
-      m_file->position(from);
-      m_file->read(result, pos()-from);
+      *len = min<uint32_t>(WINDOWLEN - m_bufPos, m_fileSize - pos());
+      return &m_windows[m_cur].data[m_bufPos];
+    }
+
+    // number of window changes satisfied by the cache
+    uint16_t hits() const
+    {
+      return m_hits;
+    }
+
+    // number of window changes that required a file read
+    uint16_t misses() const
+    {
+      return m_misses;
     }
-    // no need to restore position
-  }
 
   private:
 
-    static uint8_t const BUFLEN = 16;
+    static uint32_t const NOWINDOW  = 0xFFFFFFFF;
+    static uint8_t  const NOTCACHED = 0xFF;
+
+    struct Window
+    {
+      uint32_t filePos;   // NOWINDOW = empty
+      uint16_t lastUse;
+      char     data[WINDOWLEN];
+    };
+
+    // makes the window starting at "start" the current one
+    void select(uint32_t start)
+    {
+      m_cur = find(start);
+      if (m_cur != NOTCACHED)
+        ++m_hits;
+      else
+      {
+        ++m_misses;
+        m_cur = lru();
+        load(m_cur, start);
+      }
+      m_windows[m_cur].lastUse = ++m_clock;
+    }
+
+    uint8_t find(uint32_t start)
+    {
+      for (uint8_t i = 0; i != WINDOWS; ++i)
+        if (m_windows[i].filePos == start)
+          return i;
+      return NOTCACHED;
+    }
+
+    // least recently used window, never the current one
+    uint8_t lru()
+    {
+      uint8_t r = NOTCACHED;
+      for (uint8_t i = 0; i != WINDOWS; ++i)
+        if ((i != m_cur || WINDOWS == 1) && (r == NOTCACHED || uint16_t(m_clock - m_windows[i].lastUse) > uint16_t(m_clock - m_windows[r].lastUse)))
+          r = i;
+      return r;
+    }
+
+    void load(uint8_t window, uint32_t start)
+    {
+      m_windows[window].filePos = start;
+      m_windows[window].lastUse = m_clock;
+      read(start, m_windows[window].data, WINDOWLEN);
+    }
+
+    // seeks only when the file is not already positioned at "from"
+    void read(uint32_t from, char* buffer, uint8_t len)
+    {
+      if (m_filePos != from)
+        m_file->position(from);
+      uint16_t count = m_file->read(buffer, len);
+      m_filePos = count <= len? from + count : NOWINDOW;  // NOWINDOW = read error
+    }
 
     File*    m_file;
-    char     m_buffer[BUFLEN];
-    uint8_t  m_bufPos;
     uint32_t m_fileSize;
-    uint32_t m_filePos;
+    uint32_t m_filePos;   // current position of m_file (NOWINDOW = unknown)
+    uint16_t m_clock;
+    uint16_t m_hits;
+    uint16_t m_misses;
+    uint8_t  m_cur;       // current window
+    uint8_t  m_bufPos;    // position inside current window
+    Window   m_windows[WINDOWS];
   };
 
 
+  typedef CachedFileInput<FDV_SCRIPT_INPUTWINDOWS, FDV_SCRIPT_INPUTWINDOWLEN> BufferedFileInput;
+
+
   struct UnBufferedFileInput : public InputBase
   {
     UnBufferedFileInput(File* file)
@@ -527,12 +813,22 @@ namespace fdv
   struct Variable
   {
     Variable(char const* name_, Variant const& value_) :
-  name(name_), value(value_)
+  name(name_), value(value_), hash(nameHash(name_))
+  {
+  }
+
+  // one byte digest of a name, used to discard most non matching variables without comparing strings
+  static uint8_t nameHash(char const* name)
   {
+    uint8_t h = 0;
+    for (; *name; ++name)
+      h = ((h << 1) | (h >> 7)) ^ *name;
+    return h;
   }
 
   string  name;
   Variant value;
+  uint8_t hash;   // nameHash(name)
   };
 
 
@@ -560,75 +856,103 @@ namespace fdv
       vars.push_back(var);
     }
 
-    void setVariableArrayValue(size_t vindex, size_t arrayIndex, Variant const& value)
-    {
-      vector<Variant>& arr = vars[vindex].value.arrayVal();
-      if (arrayIndex >= arr.size())
-        arr.resize(arrayIndex+1);
-      arr[arrayIndex] = value;
-    }
-
-    void setVariable(char const* name, size_t arrayIndex, Variant const& value)
+    // "index" is an array position or, when it is a STRING or the variable is a MAP, a map key.
+    // Use an INVALID index to set the whole variable.
+    // note: returns false if a map is full
+    bool setVariable(char const* name, Variant const& index, Variant const& value)
     {
       size_t i = findVariable(name);
       if (i==NOTFOUND)
       {
         // new variable
-        if (arrayIndex==0xFFFF)
-        {
-          // simple variable
-          addVariable(Variable(name, value));
-        }
-        else
-        {
-          // array
-          addVariable(Variable(name, Variant(vector<Variant>())));  // add empty array
-          setVariableArrayValue(vars.size()-1, arrayIndex, value);
-        }
-      }
-      else
-      {
-        // update variable
-        if (arrayIndex==0xFFFF)
-        {
-          // simple variable
-          vars[i] = Variable(name, value);
-        }
-        else
-        {
-          // array
-          setVariableArrayValue(i, arrayIndex, value);
-        }
+        addVariable(Variable(name, Variant()));
+        i = vars.size()-1;
       }
+      return setVariableAt(i, index, value);
     }
 
-    // note: returns NULL if not found
-    // note: arrayIndex=0xFFFF if this is "not" an array index
-    Variant* getVariableValue(char const* name, size_t arrayIndex = 0xFFFF)
+    // updates an existing variable by index (see findVariable())
+    bool setVariableAt(size_t vindex, Variant const& index, Variant const& value)
+    {
+      Variant* v = item(vars[vindex].value, index, true);
+      if (v)
+        *v = value;
+      return v != NULL;
+    }
+
+    // note: returns NULL if not found (variable, array item or map key)
+    Variant* getVariableValue(char const* name, Variant const& index = Variant())
     {
       size_t i = findVariable(name);
       // not found
       if (i==NOTFOUND)
         return NULL;
-      // simple variable (or array without index)
-      if (arrayIndex==0xFFFF)
-        return &vars[i].value;
-      // array item
-      return &(vars[i].value.arrayVal()[arrayIndex]);
+      return getVariableValueAt(i, index);
+    }
+
+    // gets value of an existing variable by index (see findVariable())
+    Variant* getVariableValueAt(size_t vindex, Variant const& index = Variant())
+    {
+      return item(vars[vindex].value, index, false);
+    }
+
+    // returns "var" itself, its array item or map value (NULL if it doesn't exist and !create)
+    static Variant* item(Variant& var, Variant const& index, bool create)
+    {
+      if (index.type()==Variant::INVALID)
+        return &var;
+      if (var.type()==Variant::MAP || index.type()==Variant::STRING)
+      {
+        if (!create && var.type()!=Variant::MAP)
+          return NULL;
+        string numericKey;
+        char const* key = index.type()==Variant::STRING? index.constStringVal().c_str() : (numericKey = index.toString()).c_str();
+        return create? var.mapVal().insert(key) : var.mapVal().find(key);
+      }
+      if (!create && var.type()!=Variant::ARRAY)
+        return NULL;
+      size_t arrayIndex = index.toUInt32();
+      if (arrayIndex >= var.constArrayVal().size())
+      {
+        if (!create)
+          return NULL;
+        var.arrayVal().resize(arrayIndex+1);
+      }
+      return &var.arrayVal()[arrayIndex];
     }
 
     // note: returns NOTFOUND if not found
     size_t findVariable(char const* name)
     {
+      uint8_t hash = Variable::nameHash(name);
       for (size_t i=0; i!=vars.size(); ++i)
-        if (vars[i].name == name)
+        if (vars[i].hash == hash && vars[i].name == name)
           return i;
       return NOTFOUND;
     }
 
+    // returns NOTFOUND if not found
+    uint16_t findFunc(char const* funcName)
+    {
+      return library->findFunc(funcName);
+    }
+
+    // funcID obtained by findFunc()
+    bool execFunc(uint16_t funcID, Variant* result)
+    {
+#ifdef FDV_SCRIPT_PROFILER
+      uint32_t start = micros();
+      bool ret = library->execFunc(funcID, *this, result);
+      ScriptProfiler::function(funcID, micros() - start);
+      return ret;
+#else
+      return library->execFunc(funcID, *this, result);
+#endif
+    }
+
     bool execFunc(char const* funcName, Variant* result)
     {
-      return library->execFunc(funcName, *this, result);
+      return execFunc(findFunc(funcName), result);
     }
 
     vector<Variable> vars;
@@ -639,20 +963,253 @@ namespace fdv
 
 
 
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptCode
+  // Compiled form of a script. Built by Script in compile mode, executed by ScriptVM.
+  // Literal text (outside "<?"..."?>") is not copied: OP_TEXT refers to the source input,
+  // so the input must be available when the code runs.
+  // Variables are referenced by slot (index inside "symbols"), jumps are relative to the
+  // end of the jump instruction (so code blocks can be moved).
+
+  struct ScriptCode
+  {
+    enum OpCode
+    {
+      OP_HALT,       //                       stop execution
+      OP_POP,        //                       discard top
+      OP_PUSHU8,     // u8 value              push UINT8 constant
+      OP_PUSHU16,    // u16 value             push UINT16 constant
+      OP_PUSHCONST,  // u16 const             push constants[const]
+      OP_LOAD,       // u8 slot               push variable value
+      OP_LOADSOFT,   // u8 slot, u16 const    like OP_LOAD, push constants[const] if variable doesn't exist
+      OP_STORE,      // u8 slot               assign top to variable (top is not removed)
+      OP_PREINC,     // u8 slot               ++var, push value
+      OP_PREDEC,     // u8 slot               --var, push value
+      OP_POSTINC,    // u8 slot               push value, var++
+      OP_POSTDEC,    // u8 slot               push value, var--
+      OP_SIZEOF,     // u8 slot               push sizeof(var)
+      OP_REF,        // u8 slot               push &var
+      OP_DEREF,      // u8 slot               push *var
+      OP_NEG,        //                       unary operators on top
+      OP_NOT,
+      OP_BNOT,
+      OP_MUL,        //                       binary operators (pop rhs, replace lhs with the result)
+      OP_DIV,
+      OP_MOD,
+      OP_ADD,
+      OP_SUB,
+      OP_SHL,
+      OP_SHR,
+      OP_LT,
+      OP_GT,
+      OP_LE,
+      OP_GE,
+      OP_EQ,
+      OP_NE,
+      OP_AND,
+      OP_XOR,
+      OP_OR,
+      OP_LAND,
+      OP_LOR,
+      OP_MKARRAY,    //                       push empty array
+      OP_APPEND,     //                       pop item and append it to the array on top
+      OP_CONCAT,     // u8 count              pop "count" items and push them concatenated as string
+      OP_CALL,       // u8 argc, u8 func      call function named functions[func] with "argc" parameters (user function if defined)
+      OP_OUTPUT,     //                       pop and write to output
+      OP_TEXT,       // u16 pos, u16 len      write "len" chars of the source input starting at "pos"
+      OP_JUMP,       // i16 offset
+      OP_JUMPF,      // i16 offset            pop, jump if false
+      OP_JUMPT,      // i16 offset            pop, jump if true
+      OP_BREAK,      // i16 offset            unresolved "break" (resolved to OP_JUMP at the end of loop)
+      OP_CONTINUE,   // i16 offset            unresolved "continue" (resolved to OP_JUMP at the end of loop)
+      OP_STMT,       // u16 pos               a statement at source offset "pos" begins (emitted only by FDV_SCRIPT_PROFILER)
+      OP_FUNCDEF,    // u8 func, i16 offset   define user function functions[func] (its code follows), then jump over it
+      OP_FUNC,       // u8 params             user function entry: checks parameters count
+      OP_RETURN,     //                       return top from user function (stop if outside functions)
+      OP_MKMAP,      //                       push empty map
+      OP_MAPSET,     //                       pop value and key, set it into the map on top
+    };
+
+    // added to variable opcodes (OP_LOAD...OP_DEREF): array index has been pushed before
+    // note: for OP_STORE the index is below the value
+    static uint8_t const OPF_INDEXED = 0x80;
+
+    static uint8_t const MAXSYMBOLS = 255;
+
+    // max nested user function calls
+    static uint8_t const MAXCALLDEPTH = 8;
+
+    // number of operand bytes of an instruction
+    static uint8_t operandsSize(uint8_t op)
+    {
+      switch (op & ~OPF_INDEXED)
+      {
+      case OP_PUSHU8:
+      case OP_LOAD:
+      case OP_STORE:
+      case OP_PREINC:
+      case OP_PREDEC:
+      case OP_POSTINC:
+      case OP_POSTDEC:
+      case OP_SIZEOF:
+      case OP_REF:
+      case OP_DEREF:
+      case OP_CONCAT:
+      case OP_FUNC:
+        return 1;
+      case OP_CALL:
+      case OP_PUSHU16:
+      case OP_PUSHCONST:
+      case OP_JUMP:
+      case OP_JUMPF:
+      case OP_JUMPT:
+      case OP_BREAK:
+      case OP_CONTINUE:
+      case OP_STMT:
+        return 2;
+      case OP_LOADSOFT:
+      case OP_FUNCDEF:
+        return 3;
+      case OP_TEXT:
+        return 4;
+      default:
+        return 0;
+      }
+    }
+
+    static uint16_t read16(uint8_t const* p)
+    {
+      return p[0] | (p[1] << 8);
+    }
+
+    // v = op v (OP_NEG, OP_NOT, OP_BNOT)
+    static void unaryOperator(uint8_t op, Variant& v)
+    {
+      switch (op)
+      {
+      case OP_NEG:  v = -v; break;
+      case OP_NOT:  v = !v; break;
+      case OP_BNOT: v = ~v; break;
+      }
+    }
+
+    // lhs = lhs op rhs (OP_MUL...OP_LOR)
+    static void binaryOperator(uint8_t op, Variant& lhs, Variant const& rhs)
+    {
+      switch (op)
+      {
+      case OP_MUL:  lhs = lhs * rhs;  break;
+      case OP_DIV:  lhs = lhs / rhs;  break;
+      case OP_MOD:  lhs = lhs % rhs;  break;
+      case OP_ADD:  lhs = lhs + rhs;  break;
+      case OP_SUB:  lhs = lhs - rhs;  break;
+      case OP_SHL:  lhs = lhs << rhs; break;
+      case OP_SHR:  lhs = lhs >> rhs; break;
+      case OP_LT:   lhs = lhs < rhs;  break;
+      case OP_GT:   lhs = lhs > rhs;  break;
+      case OP_LE:   lhs = lhs <= rhs; break;
+      case OP_GE:   lhs = lhs >= rhs; break;
+      case OP_EQ:   lhs = lhs == rhs; break;
+      case OP_NE:   lhs = lhs != rhs; break;
+      case OP_AND:  lhs = lhs & rhs;  break;
+      case OP_XOR:  lhs = lhs ^ rhs;  break;
+      case OP_OR:   lhs = lhs | rhs;  break;
+      case OP_LAND: lhs.uint8Val() = lhs.toBool() && rhs.toBool(); break;
+      case OP_LOR:  lhs.uint8Val() = lhs.toBool() || rhs.toBool(); break;
+      }
+    }
+
+    // "count" values concatenated as string (OP_CONCAT)
+    // note: values are converted to strings in place, then the result is allocated once
+    static Variant concat(Variant* values, uint8_t count)
+    {
+      uint16_t length = 0;
+      for (uint8_t i = 0; i != count; ++i)
+      {
+        if (values[i].type() != Variant::STRING)
+          values[i] = Variant(values[i].toString());
+        length += values[i].constStringVal().size();
+      }
+      Variant r;
+      string& s = r.stringVal();
+      s.resize(length);
+      char* dst = s.begin();
+      for (uint8_t i = 0; i != count; ++i)
+        for (char const* src = values[i].constStringVal().c_str(); *src; ++src)
+          *dst++ = *src;
+      return r;
+    }
+
+    void write16(size_t pos, uint16_t value)
+    {
+      code[pos]     = value & 0xFF;
+      code[pos + 1] = value >> 8;
+    }
+
+    void clear()
+    {
+      code.clear();
+      constants.clear();
+      symbols.clear();
+      functions.clear();
+    }
+
+    // true if the code writes literal text (so it needs the source input)
+    bool hasText() const
+    {
+      for (size_t i = 0; i < code.size(); i += 1 + operandsSize(code[i]))
+        if (code[i] == OP_TEXT && read16(&code[i + 3]) > 0)
+          return true;
+      return false;
+    }
+
+    vector<uint8_t> code;
+    vector<Variant> constants;
+    vector<string>  symbols;    // variable names (by slot)
+    vector<string>  functions;  // called function names (resolved by ScriptVM on first call)
+  };
+
+
   ///////////////////////////////////////////////////////////////////////////////////////////////
   // Script
+  // Directly executes a script while parsing it or, when a ScriptCode is specified, compiles it
+  // (see ScriptVM).
 
   template <typename RunTimeT>
   class Script
   {
 
+    // user function (see parse_function_definition())
+    struct Function
+    {
+      string         name;
+      vector<string> params;
+      size_t         pos;    // position of body ('{'), code address in compile mode
+    };
+
+    // end of an already parsed statement (see parse_statement())
+    struct StatementSpan
+    {
+      size_t start;
+      size_t end;
+      bool   startInCode;  // m_incode before the statement
+      bool   endInCode;    // m_incode after the statement
+    };
+
   public:
 
-    Script(RunTimeT* globalRunTime, InputBase* input) :
+    Script(RunTimeT* globalRunTime, InputBase* input, ScriptCode* code = NULL) :
         m_runTime(globalRunTime),
           m_input(input),
           m_progStatus(ST_RUN),
-          m_incode(false)
+          m_incode(false),
+          m_code(code),
+          m_codeError(false),
+          m_callDepth(0),
+          m_skipping(false),
+          m_constCount(0),
+          m_constEnd(0),
+          m_lastTarget(0)
         {
         }
 
@@ -663,8 +1220,10 @@ namespace fdv
     class PosSaver
     {
     public:
-      PosSaver(InputBase* input) :
-          m_input(input), m_pos(input->pos())
+      PosSaver(InputBase* input, ScriptCode* code) :
+          m_input(input), m_pos(input->pos()), m_code(code),
+          m_codeSize(code? code->code.size() : 0),
+          m_constantsSize(code? code->constants.size() : 0)
           {
           }
 
@@ -679,10 +1238,18 @@ namespace fdv
             return true;
           }
 
+          // restores input position and drops code compiled after the saved position
           void restore()
           {
             if (m_input)
+            {
               m_input->pos( m_pos );
+              if (m_code)
+              {
+                m_code->code.resize(m_codeSize);
+                m_code->constants.resize(m_constantsSize);
+              }
+            }
           }
 
           size_t savedPos()
@@ -693,22 +1260,338 @@ namespace fdv
           void reset()
           {
             m_pos = m_input->pos();
+            if (m_code)
+            {
+              m_codeSize      = m_code->code.size();
+              m_constantsSize = m_code->constants.size();
+            }
           }
 
     private:
-      InputBase* m_input;
-      size_t     m_pos;
+      InputBase*  m_input;
+      size_t      m_pos;
+      ScriptCode* m_code;
+      size_t      m_codeSize;
+      size_t      m_constantsSize;
     };
 
 
-    void bypassSpaces()
+    //// compile mode helpers
+
+
+    void emit(uint8_t value)
     {
-      while ( !m_input->isEOF() && isspace(m_input->get()) )
-        m_input->next();
+      m_constCount = 0;  // see emitConstant()
+      vector<uint8_t>& code = m_code->code;
+      if (code.size() == code.capacity())
+        code.reserve(code.size() + 32);  // grow by chunks
+      size_t sz = code.size();
+      code.push_back(value);
+      if (code.size() == sz)
+        m_codeError = true;  // out of memory
     }
 
 
-    // Parsers all single chars ('+', '-', ';', etc...), bypassing leading spaces
+    void emit16(uint16_t value)
+    {
+      emit(value & 0xFF);
+      emit(value >> 8);
+    }
+
+
+    // note: positions of the last consecutive constants are recorded for constant folding
+    void emitConstant(Variant const& value)
+    {
+      size_t  pos   = m_code->code.size();
+      uint8_t count = pos == m_constEnd? m_constCount : 0;  // 0 if something else has been emitted or removed
+      switch (value.type())
+      {
+      case Variant::UINT8:
+        emit(ScriptCode::OP_PUSHU8);
+        emit(value.toUInt32());
+        break;
+      case Variant::UINT16:
+        emit(ScriptCode::OP_PUSHU16);
+        emit16(value.toUInt32());
+        break;
+      default:
+        emit(ScriptCode::OP_PUSHCONST);
+        emit16(addConstant(value));
+        break;
+      }
+      if (count == MAXFOLD)
+      {
+        memmove(&m_constPos[0], &m_constPos[1], sizeof(size_t) * (MAXFOLD - 1));
+        --count;
+      }
+      m_constPos[count] = pos;
+      m_constCount      = count + 1;
+      m_constEnd        = m_code->code.size();
+    }
+
+
+    // number of constants pushed by the last instructions which can be folded (no jump lands
+    // between them)
+    uint8_t foldableConstants()
+    {
+      if (m_code->code.size() != m_constEnd || m_codeError)
+        return 0;
+      uint8_t count = 0;
+      while (count != m_constCount && m_constPos[m_constCount - count - 1] >= m_lastTarget)
+        ++count;
+      return count;
+    }
+
+
+    // value pushed by the constant instruction at "pos"
+    Variant constantAt(size_t pos)
+    {
+      uint8_t const* p = &m_code->code[pos];
+      Variant r;
+      switch (*p)
+      {
+      case ScriptCode::OP_PUSHU8:
+        r.uint8Val() = p[1];
+        break;
+      case ScriptCode::OP_PUSHU16:
+        r.uint16Val() = ScriptCode::read16(p + 1);
+        break;
+      default:
+        r = m_code->constants[ScriptCode::read16(p + 1)];
+        break;
+      }
+      return r;
+    }
+
+
+    // removes from the code the last "count" foldable constants, storing their values if "values" is not NULL
+    void removeConstants(uint8_t count, Variant* values = NULL)
+    {
+      size_t pos = m_constPos[m_constCount - count];
+      for (uint8_t i = 0; values && i != count; ++i)
+        values[i] = constantAt(m_constPos[m_constCount - count + i]);
+      // drop also their entries of the constants table, when they are the last ones
+      for (uint8_t i = count; i-- > 0; )
+      {
+        uint8_t const* p = &m_code->code[m_constPos[m_constCount - count + i]];
+        if (*p == ScriptCode::OP_PUSHCONST && ScriptCode::read16(p + 1) + 1u == m_code->constants.size())
+          m_code->constants.resize(m_code->constants.size() - 1);
+      }
+      m_code->code.resize(pos);
+      m_constCount -= count;
+      m_constEnd    = pos;
+    }
+
+
+    // only constants of these types are folded (they can be stored by ScriptCache)
+    static bool isFoldable(Variant const& value)
+    {
+      return (value.type() & (Variant::STRING | Variant::FLOAT | Variant::UINT8 | Variant::UINT16 | Variant::UINT32 | Variant::INT32)) != 0;
+    }
+
+
+    // emits an unary or binary operator, evaluated now if its operands are constants
+    void emitOperator(uint8_t op)
+    {
+#if FDV_SCRIPT_OPTIMIZE
+      bool    unary = op == ScriptCode::OP_NEG || op == ScriptCode::OP_NOT || op == ScriptCode::OP_BNOT;
+      uint8_t count = unary? 1 : 2;
+      if (foldableConstants() >= count)
+      {
+        Variant v[2];
+        v[0] = constantAt(m_constPos[m_constCount - count]);
+        v[1] = constantAt(m_constPos[m_constCount - 1]);
+        bool divByZero = (op == ScriptCode::OP_DIV || op == ScriptCode::OP_MOD) && !v[1].toBool();  // left to run time
+        if (unary)
+          ScriptCode::unaryOperator(op, v[0]);
+        else if (!divByZero)
+          ScriptCode::binaryOperator(op, v[0], v[1]);
+        if (!divByZero && isFoldable(v[0]))
+        {
+          removeConstants(count);
+          emitConstant(v[0]);
+          return;
+        }
+      }
+#endif
+      emit(op);
+    }
+
+
+    // emits OP_CONCAT, evaluated now if all segments are constants
+    void emitConcat(uint8_t count)
+    {
+#if FDV_SCRIPT_OPTIMIZE
+      if (count <= MAXFOLD && foldableConstants() >= count)
+      {
+        Variant values[MAXFOLD];
+        removeConstants(count, values);
+        emitConstant(ScriptCode::concat(values, count));
+        return;
+      }
+#endif
+      emit(ScriptCode::OP_CONCAT);
+      emit(count);
+    }
+
+
+    // if the condition just compiled is a constant, removes it and returns true
+    bool constantCondition(bool* value)
+    {
+#if FDV_SCRIPT_OPTIMIZE
+      if (foldableConstants() >= 1)
+      {
+        Variant v;
+        removeConstants(1, &v);
+        *value = v.toBool();
+        return true;
+      }
+#endif
+      return false;
+    }
+
+
+    uint16_t addConstant(Variant const& value)
+    {
+      size_t sz = m_code->constants.size();
+      m_code->constants.push_back(value);
+      if (m_code->constants.size() == sz || sz > 0xFFFF)
+        m_codeError = true;
+      return sz;
+    }
+
+
+    // returns index of "name" inside "names" (added if not present)
+    uint8_t nameIndex(vector<string>& names, string const& name)
+    {
+      for (size_t i = 0; i != names.size(); ++i)
+        if (names[i] == name)
+          return i;
+      if (names.size() == ScriptCode::MAXSYMBOLS)
+      {
+        m_codeError = true;
+        return 0;
+      }
+      names.push_back(name);
+      return names.size() - 1;
+    }
+
+
+    // returns variable slot
+    uint8_t symbol(string const& name)
+    {
+      return nameIndex(m_code->symbols, name);
+    }
+
+
+    // emits a variable instruction. aindex is not INVALID when an index has been emitted
+    void emitVariable(uint8_t op, string const& name, Variant const& aindex)
+    {
+      emit(aindex.type() == Variant::INVALID? op : (op | ScriptCode::OPF_INDEXED));
+      emit(symbol(name));
+    }
+
+
+    // returns position of the offset to patch with patchJump()
+    size_t emitJump(uint8_t op)
+    {
+      emit(op);
+      emit16(0);
+      return m_code->code.size() - 2;
+    }
+
+
+    // backward jump
+    void emitJumpTo(uint8_t op, size_t target)
+    {
+      emit(op);
+      emit16(target - (m_code->code.size() + 2));
+      m_lastTarget = max(m_lastTarget, target);
+    }
+
+
+    // jump to the current position
+    void patchJump(size_t offsetPos)
+    {
+      patchJump(offsetPos, m_code->code.size());
+    }
+
+
+    void patchJump(size_t offsetPos, size_t target)
+    {
+      if (!m_codeError)
+        m_code->write16(offsetPos, target - (offsetPos + 2));
+      m_lastTarget = max(m_lastTarget, target);
+    }
+
+
+    // converts OP_BREAK and OP_CONTINUE of [start, end) code into jumps
+    // note: inner loops have already resolved their own ones
+    void resolveLoopJumps(size_t start, size_t end, size_t breakTarget, size_t continueTarget)
+    {
+      if (m_codeError)
+        return;
+      vector<uint8_t>& code = m_code->code;
+      while (start < end)
+      {
+        uint8_t op = code[start];
+        if (op == ScriptCode::OP_BREAK || op == ScriptCode::OP_CONTINUE)
+        {
+          code[start] = ScriptCode::OP_JUMP;
+          patchJump(start + 1, op == ScriptCode::OP_BREAK? breakTarget : continueTarget);
+        }
+        start += 1 + ScriptCode::operandsSize(op);
+      }
+    }
+
+
+    // in compile mode keywords cannot be used as variable or function names
+    // (direct execution rejects them because they don't exist at run time)
+    bool isKeyword(string const& name)
+    {
+      char const* n = name.c_str();
+      return strcmp_P(n, PSTR("if"))==0
+          || strcmp_P(n, PSTR("else"))==0
+          || strcmp_P(n, PSTR("while"))==0
+          || strcmp_P(n, PSTR("do"))==0
+          || strcmp_P(n, PSTR("for"))==0
+          || strcmp_P(n, PSTR("break"))==0
+          || strcmp_P(n, PSTR("continue"))==0
+          || strcmp_P(n, PSTR("return"))==0
+          || strcmp_P(n, PSTR("func"))==0
+          || strcmp_P(n, PSTR("sizeof"))==0;
+    }
+
+
+    // parses a whole identifier (unlike parse_nchar(), "returned" doesn't match "return")
+    bool parse_keyword(char const* keyword)
+    {
+      PosSaver psaver(m_input, m_code);
+      string name;
+      if (parse_identifier(name) && name == keyword)
+        return psaver.release();
+      return false;
+    }
+
+
+    // returns index of user function "name" or NOTFOUND
+    size_t findFunction(string const& name)
+    {
+      for (size_t i = 0; i != m_funcs.size(); ++i)
+        if (m_funcs[i].name == name)
+          return i;
+      return RunTimeT::NOTFOUND;
+    }
+
+
+    void bypassSpaces()
+    {
+      while ( !m_input->isEOF() && isspace(m_input->get()) )
+        m_input->next();
+    }
+
+
+    // Parsers all single chars ('+', '-', ';', etc...), bypassing leading spaces
     bool parse_1char(char c, char* result)
     {
       if (parse_1char(c))
@@ -778,7 +1661,7 @@ namespace fdv
     // Parsers N chars ("if", "while", "&&", etc...), bypass leading spaces
     bool parse_nchar(char const* s)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
       bypassSpaces();
       while (*s != 0)
       {
@@ -866,7 +1749,7 @@ namespace fdv
     bool parse_identifier(string& result)
     {
       bypassSpaces();
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
       // ALPHA
       if (parse_ALPHA())
       {
@@ -885,7 +1768,7 @@ namespace fdv
     bool parse_constant(Variant* result)
     {
       bypassSpaces();
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // "0x" HEXDIGIT {HEXDIGIT}
       if (parse_nchar("0x"))
@@ -934,7 +1817,7 @@ namespace fdv
     // escape = '\' ascii_char
     bool parse_escape(char* c)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // '\' ascii_char
       if (m_input->get() == '\\')
@@ -973,22 +1856,29 @@ namespace fdv
 
 
     // evar = '$' variable
-    bool parse_evar(string& result, bool exec)
+    // interpreter: a missing variable is not an evar (it is output as it is)
+    bool parse_evar(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (m_input->get() == '$')
       {
         m_input->next();
         string vname;
-        size_t aindex;
+        Variant aindex;
         if (parse_variable(vname, &aindex, exec))
         {
-          if (exec)
+          if (m_code)
+          {
+            // a missing variable is output as it is (like direct execution does)
+            emitVariable(ScriptCode::OP_LOADSOFT, vname, aindex);
+            emit16(addConstant(Variant(m_input->extract(psaver.savedPos()))));
+          }
+          else if (exec)
           {
             Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
             if (v!=NULL)
-              result = v->toString();
+              *result = *v;
             else
               return false;
           }
@@ -1001,9 +1891,9 @@ namespace fdv
 
 
     // eexp = "$(" expression ')'
-    bool parse_eexp(string& result, bool exec)
+    bool parse_eexp(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (m_input->get() == '$')
       {
@@ -1011,13 +1901,8 @@ namespace fdv
         if (m_input->get() == '(')
         {
           m_input->next();
-          Variant r;
-          if (parse_expression(&r, exec) && parse_1char(')'))
-          {
-            if (exec)
-              result = r.toString();
+          if (parse_expression(result, exec) && parse_1char(')'))
             return psaver.release();
-          }
           else
             return false;
         }
@@ -1028,27 +1913,39 @@ namespace fdv
 
 
     // string_literal = '"' {( escape | ascii_char | eexp | evar )} '"'
+    // The literal is split in segments: literal parts and eexp/evar values. In compile mode each
+    // segment is pushed and then concatenated by OP_CONCAT.
+    // "result" NULL means output_statement: segments are written to the output (emitting OP_OUTPUT
+    // in compile mode) without building the whole string.
     bool parse_string_literal(string* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       bypassSpaces();
       if (m_input->get() == '\"')  // check for Double Quote
       {
         m_input->next();
-        result->clear();
+        bool     collect  = exec || m_code;  // literal parts are not stored while skipping
+        string   text;                       // pending literal part (compile mode or output)
+        string*  dest     = (m_code || !result)? &text : result;
+        uint16_t segments = 0;               // compile mode: number of values pushed
+        if (result)
+          result->clear();
         for (;;)
         {
           if (m_input->isEOF())
             return false;
           char c = m_input->get();
-          string sr;
+          Variant value;
+          if (c == '$' && !text.empty())
+            putLiteralSegment(text, result, segments);  // literal part before an evar/eexp
           if (parse_escape(&c))
-            result->push_back(c);
-          else if (parse_eexp(sr, exec))
-            result->append(sr);
-          else if (parse_evar(sr, exec))
-            result->append(sr);
+          {
+            if (collect)
+              dest->push_back(c);
+          }
+          else if (parse_eexp(&value, exec) || parse_evar(&value, exec))
+            putValueSegment(value, result, segments, exec);
           else if(c == '\"')  // check for ending Double Quote
           {
             m_input->next();
@@ -1056,10 +1953,24 @@ namespace fdv
           }
           else
           {
-            result->push_back( m_input->get() );
+            if (collect)
+              dest->push_back(c);
             m_input->next();
           }
         }
+        if (m_code && result && segments == 0)
+          emitConstant(Variant(text));  // just a string constant
+        else
+        {
+          if (!text.empty())
+            putLiteralSegment(text, result, segments);
+          if (m_code && result)
+          {
+            if (segments > 0xFF)
+              m_codeError = true;
+            emitConcat(segments);
+          }
+        }
         return psaver.release();
       }
 
@@ -1067,10 +1978,47 @@ namespace fdv
     }
 
 
+    // parse_string_literal() helper: literal part "text" becomes a segment (and is cleared)
+    void putLiteralSegment(string& text, string* result, uint16_t& segments)
+    {
+      if (m_code)
+      {
+        emitConstant(Variant(text));
+        if (result)
+          ++segments;
+        else
+          emit(ScriptCode::OP_OUTPUT);
+      }
+      else if (m_runTime->output)
+        m_runTime->output->write(text.c_str());
+      text.clear();
+    }
+
+
+    // parse_string_literal() helper: the value of an eexp/evar becomes a segment
+    void putValueSegment(Variant const& value, string* result, uint16_t& segments, bool exec)
+    {
+      if (m_code)
+      {
+        if (result)
+          ++segments;
+        else
+          emit(ScriptCode::OP_OUTPUT);
+      }
+      else if (exec)
+      {
+        if (result)
+          result->append(value.type() == Variant::STRING? value.constStringVal() : value.toString());
+        else if (m_runTime->output)
+          writeOutput(m_runTime->output, value);
+      }
+    }
+
+
     // unparsed_string_literal = ''' {ascii_char} '''
     bool parse_unparsed_string_literal(string* result)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       bypassSpaces();
       if (m_input->get() == '\'') // check for Single Quote
@@ -1095,24 +2043,26 @@ namespace fdv
 
 
     // variable = identifier [ '[' expression ']' ]
-    // note: *arrayIndex=0xFFFF if it is "not" an array index
-    bool parse_variable(string& result, size_t* arrayIndex, bool exec)
+    // note: *index is INVALID if there isn't an index (array position or map key)
+    bool parse_variable(string& result, Variant* index, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_identifier(result))
       {
+        if (m_code && isKeyword(result))
+          return false;
         psaver.reset(); // to avoid spaces loss in case parse_1char() fails
         if (parse_1char('['))
         {
-          Variant f;
-          if (!parse_expression(&f, exec) || !parse_1char(']'))
+          if (!parse_expression(index, exec) || !parse_1char(']'))
             return false;
-          *arrayIndex = f.toUInt32();
+          if (index->type() == Variant::INVALID)
+            *index = Variant((uint8_t)0);  // not evaluated (or no value): anyway indexed
         }
         else
         {
-          *arrayIndex = 0xFFFF;
+          index->clear();
           psaver.restore(); // to avoid spaces loss in this case
         }
         return psaver.release();
@@ -1122,22 +2072,45 @@ namespace fdv
     }
 
 
+    // parses the value of "key" and adds it to "map"
+    bool parse_map_value(Variant* map, Variant const& key, bool exec)
+    {
+      Variant value;
+      if (!parse_expression(&value, exec))
+        return false;
+      if (m_code)
+        emit(ScriptCode::OP_MAPSET);
+      else if (exec)
+      {
+        Variant* v = key.type()==Variant::INVALID? NULL : RunTimeT::item(*map, key, true);
+        if (v == NULL)
+          return false;
+        *v = value;
+      }
+      return true;
+    }
+
+
     // primary_expression = variable
     //                    | constant
     //                    | string_literal
     //                    | parse_unparsed_string_literal
     //                    | '(' expression ')'
     //                    | '{' [expression] {',' expression} '}'
+    //                    | '{' ':' '}'
+    //                    | '{' expression ':' expression {',' expression ':' expression} '}'
     bool parse_primary_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // variable
       string vname;
-      size_t aindex;
+      Variant aindex;
       if (parse_variable(vname, &aindex, exec))
       {
-        if (exec)
+        if (m_code)
+          emitVariable(ScriptCode::OP_LOAD, vname, aindex);
+        else if (exec)
         {
           Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
           if (v!=NULL)
@@ -1150,7 +2123,11 @@ namespace fdv
 
       // constant
       if (parse_constant(result))
+      {
+        if (m_code)
+          emitConstant(*result);
         return psaver.release();
+      }
 
       // string_literal
       string sresult;
@@ -1164,7 +2141,9 @@ namespace fdv
       // unparsed_string_literal
       if (parse_unparsed_string_literal(&sresult))
       {
-        if (exec)
+        if (m_code)
+          emitConstant(Variant(sresult));
+        else if (exec)
           *result = Variant(sresult);
         return psaver.release();
       }
@@ -1180,18 +2159,53 @@ namespace fdv
 
       // '{' [expression] {',' expression} '}'
       // note: array creation and initialization
+      // '{' ':' '}'
+      // '{' expression ':' expression {',' expression ':' expression} '}'
+      // note: map creation and initialization (keys are converted to strings)
       if (parse_1char('{'))
       {
         result->clear();
         result->type(Variant::ARRAY); // start with empty array
-        Variant item;
-        if (parse_expression(&item, exec))
+        size_t mkpos = m_code? m_code->code.size() : 0;
+        if (m_code)
+          emit(ScriptCode::OP_MKARRAY);
+        if (parse_1char(':'))
         {
-          if (exec)
-            result->arrayVal().push_back(item);
-          while (parse_1char(',') && parse_expression(&item, exec))
-            if (exec)
-              result->arrayVal().push_back(item);
+          // empty map
+          result->type(Variant::MAP);
+          if (m_code && !m_codeError)
+            m_code->code[mkpos] = ScriptCode::OP_MKMAP;
+        }
+        else
+        {
+          Variant item;
+          if (parse_expression(&item, exec))
+          {
+            if (parse_1char(':'))
+            {
+              // map: the first item was a key
+              result->type(Variant::MAP);
+              if (m_code && !m_codeError)
+                m_code->code[mkpos] = ScriptCode::OP_MKMAP;
+              if (!parse_map_value(result, item, exec))
+                return false;
+              while (parse_1char(','))
+                if (!parse_expression(&item, exec) || !parse_1char(':') || !parse_map_value(result, item, exec))
+                  return false;
+            }
+            else
+            {
+              if (m_code)
+                emit(ScriptCode::OP_APPEND);
+              else if (exec)
+                result->arrayVal().push_back(item);
+              while (parse_1char(',') && parse_expression(&item, exec))
+                if (m_code)
+                  emit(ScriptCode::OP_APPEND);
+                else if (exec)
+                  result->arrayVal().push_back(item);
+            }
+          }
         }
         if (!parse_1char('}'))
           return false;
@@ -1203,21 +2217,71 @@ namespace fdv
     }
 
 
+    // compile mode: '(' already parsed
+    bool compile_call(string const& funcName)
+    {
+      uint16_t argc = 0;
+      Variant r;
+      if (parse_assignment_expression(&r, false))
+        ++argc;
+      while (parse_1char(',') && parse_assignment_expression(&r, false))
+        ++argc;
+      if (!parse_1char(')') || argc > 0xFF)
+        return false;
+      emit(ScriptCode::OP_CALL);
+      emit(argc);
+      emit(nameIndex(m_code->functions, funcName));
+      return true;
+    }
+
+
+    // executes user function "f", parameters are inside "frame" (which becomes the function RunTime)
+    bool callFunction(Function const& f, RunTimeT& frame, Variant* result)
+    {
+      if (frame.vars.size() != f.params.size() || m_callDepth == ScriptCode::MAXCALLDEPTH)
+        return false;
+      for (size_t i = 0; i != f.params.size(); ++i)
+        frame.vars[i] = Variable(f.params[i].c_str(), frame.vars[i].value);
+
+      RunTimeT*  runTime    = m_runTime;
+      size_t     pos        = m_input->pos();
+      ProgStatus progStatus = m_progStatus;
+      bool       incode     = m_incode;
+      m_runTime    = &frame;
+      m_progStatus = ST_RUN;
+      m_returnValue = Variant((uint8_t)0);
+      m_input->pos(f.pos);
+      ++m_callDepth;
+
+      bool ret = parse_compound_statement(true);
+      *result = m_returnValue;
+
+      --m_callDepth;
+      m_input->pos(pos);
+      m_incode     = incode;
+      m_progStatus = progStatus;
+      m_runTime    = runTime;
+      return ret;
+    }
+
+
     // postfix_expression = variable ("--" | "++")
     //                    | identifier '(' [assignment_expression] {',' assignment_expression} ')'
     //                    | primary_expression
     bool parse_postfix_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // variable ("--" | "++")
       string sresult;
-      size_t aindex;
+      Variant aindex;
       char nc[2];
       if (parse_variable(sresult, &aindex, exec)
         && (parse_nchar("--", nc) || parse_nchar("++", nc)))
       {
-        if (exec)
+        if (m_code)
+          emitVariable(nc[0]=='-'? ScriptCode::OP_POSTDEC : ScriptCode::OP_POSTINC, sresult, aindex);
+        else if (exec)
         {
           Variant* v = m_runTime->getVariableValue(sresult.c_str(), aindex);
           if (v != NULL)
@@ -1240,6 +2304,8 @@ namespace fdv
       // note: perform function call
       if (parse_identifier(sresult) && parse_1char('('))
       {
+        if (m_code)
+          return !isKeyword(sresult) && compile_call(sresult) && psaver.release();
         RunTimeT localRunTime(m_runTime->output, m_runTime->library, m_runTime);
         Variant r;
         if (parse_assignment_expression(&r, exec))
@@ -1252,8 +2318,14 @@ namespace fdv
           return false;
         if (exec)
         {
-          // executes function
-          if (!localRunTime.execFunc(sresult.c_str(), result))
+          // executes function (user functions first)
+          size_t f = findFunction(sresult);
+          if (f != RunTimeT::NOTFOUND)
+          {
+            if (!callFunction(m_funcs[f], localRunTime, result))
+              return false;
+          }
+          else if (!localRunTime.execFunc(sresult.c_str(), result))
             return false;
         }
         return psaver.release();
@@ -1277,7 +2349,7 @@ namespace fdv
     //                  | '*' variable       (note: get value of pointer)
     bool parse_unary_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // postfix_expression
       if (parse_postfix_expression(result, exec))
@@ -1286,11 +2358,13 @@ namespace fdv
       // ("--" | "++") variable
       char nc[2];
       string vname;
-      size_t aindex;
+      Variant aindex;
       if ((parse_nchar("--", nc) || parse_nchar("++", nc))
         && parse_variable(vname, &aindex, exec))
       {
-        if (exec)
+        if (m_code)
+          emitVariable(nc[0]=='-'? ScriptCode::OP_PREDEC : ScriptCode::OP_PREINC, vname, aindex);
+        else if (exec)
         {
           Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
           if (v != NULL)
@@ -1318,7 +2392,12 @@ namespace fdv
       {
         if (parse_unary_expression(result, exec))
         {
-          if (exec)
+          if (m_code)
+          {
+            if (op != '+')
+              emitOperator(op=='-'? ScriptCode::OP_NEG : (op=='!'? ScriptCode::OP_NOT : ScriptCode::OP_BNOT));
+          }
+          else if (exec)
           {
             switch (op)
             {
@@ -1347,7 +2426,9 @@ namespace fdv
       {
         if (parse_1char('(') && parse_variable(vname, &aindex, exec) && parse_1char(')'))
         {
-          if (exec)
+          if (m_code)
+            emitVariable(ScriptCode::OP_SIZEOF, vname, aindex);
+          else if (exec)
           {
             Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
             if (v != NULL)
@@ -1366,7 +2447,9 @@ namespace fdv
       {
         if (parse_variable(vname, &aindex, exec))
         {
-          if (exec)
+          if (m_code)
+            emitVariable(ScriptCode::OP_REF, vname, aindex);
+          else if (exec)
           {
             Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
             if (v != NULL)
@@ -1386,7 +2469,9 @@ namespace fdv
       {
         if (parse_variable(vname, &aindex, exec))
         {
-          if (exec)
+          if (m_code)
+            emitVariable(ScriptCode::OP_DEREF, vname, aindex);
+          else if (exec)
           {
             Variant* v = m_runTime->getVariableValue(vname.c_str(), aindex);
             if (v != NULL)
@@ -1408,7 +2493,7 @@ namespace fdv
     // multiplicative_expression = unary_expression {('*' | '/' | '%') unary_expression}
     bool parse_multiplicative_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // unary_expression
       if (parse_unary_expression(result, exec))
@@ -1422,7 +2507,9 @@ namespace fdv
           Variant f;
           if (parse_unary_expression(&f, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(op=='*'? ScriptCode::OP_MUL : (op=='/'? ScriptCode::OP_DIV : ScriptCode::OP_MOD));
+            else if (exec)
             {
               switch (op)
               {
@@ -1451,7 +2538,7 @@ namespace fdv
     // additive_expression = multiplicative_expression {('+' | '-') multiplicative_expression}
     bool parse_additive_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // multiplicative_expression
       if (parse_multiplicative_expression(result, exec))
@@ -1463,7 +2550,9 @@ namespace fdv
           Variant t;
           if (parse_multiplicative_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(op=='+'? ScriptCode::OP_ADD : ScriptCode::OP_SUB);
+            else if (exec)
             {
               *result = (op=='+'? *result + t : *result - t);
             }
@@ -1481,7 +2570,7 @@ namespace fdv
     // shift_expression = additive_expression {("<<" | ">>") additive_expression}
     bool parse_shift_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_additive_expression(result, exec))
       {
@@ -1491,7 +2580,9 @@ namespace fdv
           Variant f;
           if (parse_additive_expression(&f, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(op[0]=='<'? ScriptCode::OP_SHL : ScriptCode::OP_SHR);
+            else if (exec)
             {
               if (strncmp("<<", op, 2)==0)
                 *result = (*result << f);
@@ -1512,7 +2603,7 @@ namespace fdv
     // relational_expression = shift_expression {('<' | '>' | '<=' | '>=') shift_expression}
     bool parse_relational_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_shift_expression(result, exec))
       {
@@ -1526,7 +2617,16 @@ namespace fdv
           Variant f;
           if (parse_shift_expression(&f, exec))
           {
-            if (exec)
+            if (m_code)
+            {
+              if (strncmp("<=", op, 2)==0)
+                emitOperator(ScriptCode::OP_LE);
+              else if (strncmp(">=", op, 2)==0)
+                emitOperator(ScriptCode::OP_GE);
+              else
+                emitOperator(op[0]=='<'? ScriptCode::OP_LT : ScriptCode::OP_GT);
+            }
+            else if (exec)
             {
               if (strncmp("<=", op, 2)==0)
                 *result = (*result <= f);
@@ -1551,7 +2651,7 @@ namespace fdv
     // equality_expression = relational_expression {('==' | '!=') relational_expression}
     bool parse_equality_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_relational_expression(result, exec))
       {
@@ -1561,7 +2661,9 @@ namespace fdv
           Variant f;
           if (parse_relational_expression(&f, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(op[0]=='='? ScriptCode::OP_EQ : ScriptCode::OP_NE);
+            else if (exec)
             {
               if (strncmp("==", op, 2)==0)
                 *result = (*result == f);
@@ -1582,7 +2684,7 @@ namespace fdv
     // and_expression = equality_expression {'&' equality_expression}
     bool parse_and_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // equality_expression
       if (parse_equality_expression(result, exec))
@@ -1593,7 +2695,9 @@ namespace fdv
           Variant t;
           if (parse_equality_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(ScriptCode::OP_AND);
+            else if (exec)
               *result = *result & t;
           }
           else
@@ -1609,7 +2713,7 @@ namespace fdv
     // exclusive_or_expression = and_expression {'^' and_expression}
     bool parse_exclusive_or_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // and_expression
       if (parse_and_expression(result, exec))
@@ -1620,7 +2724,9 @@ namespace fdv
           Variant t;
           if (parse_and_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(ScriptCode::OP_XOR);
+            else if (exec)
               *result = *result ^ t;
           }
           else
@@ -1636,7 +2742,7 @@ namespace fdv
     // inclusive_or_expression = exclusive_or_expression {'|' exclusive_or_expression}
     bool parse_inclusive_or_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // exclusive_or_expression
       if (parse_exclusive_or_expression(result, exec))
@@ -1647,7 +2753,9 @@ namespace fdv
           Variant t;
           if (parse_exclusive_or_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(ScriptCode::OP_OR);
+            else if (exec)
               *result = *result | t;
           }
           else
@@ -1663,7 +2771,7 @@ namespace fdv
     // logical_and_expression = inclusive_or_expression {"&&" inclusive_or_expression}
     bool parse_logical_and_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // inclusive_or_expression
       if (parse_inclusive_or_expression(result, exec))
@@ -1674,7 +2782,9 @@ namespace fdv
           Variant t;
           if (parse_inclusive_or_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(ScriptCode::OP_LAND);
+            else if (exec)
               result->uint8Val() = result->toBool() && t.toBool();
           }
           else
@@ -1690,7 +2800,7 @@ namespace fdv
     // logical_or_expression = logical_and_expression {"||" logical_and_expression}
     bool parse_logical_or_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // logical_and_expression
       if (parse_logical_and_expression(result, exec))
@@ -1701,7 +2811,9 @@ namespace fdv
           Variant t;
           if (parse_logical_and_expression(&t, exec))
           {
-            if (exec)
+            if (m_code)
+              emitOperator(ScriptCode::OP_LOR);
+            else if (exec)
               result->uint8Val() = result->toBool() || t.toBool();
           }
           else
@@ -1717,12 +2829,25 @@ namespace fdv
     // conditional_expression = logical_or_expression ['?' expression ':' expression]
     bool parse_conditional_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_logical_or_expression(result, exec))
       {
         if (parse_1char('?'))
         {
+          if (m_code)
+          {
+            size_t jfalse = emitJump(ScriptCode::OP_JUMPF);
+            Variant f;
+            if (!parse_expression(&f, false))
+              return false;
+            size_t jend = emitJump(ScriptCode::OP_JUMP);
+            patchJump(jfalse);
+            if (!parse_1char(':') || !parse_expression(&f, false))
+              return false;
+            patchJump(jend);
+            return psaver.release();
+          }
           Variant f1, f2;
           if (!parse_expression(&f1, exec && result->toBool()==true)
             || !parse_1char(':')
@@ -1738,9 +2863,9 @@ namespace fdv
 
 
     // identifier_assign = variable '='
-    bool parse_identifier_assign(string& vname, size_t* aindex, bool exec)
+    bool parse_identifier_assign(string& vname, Variant* aindex, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_variable(vname, aindex, exec) && parse_1charCheckNext('=', '='))
         return psaver.release();
@@ -1752,11 +2877,28 @@ namespace fdv
     // assignment_expression = {identifier_assign} conditional_expression
     bool parse_assignment_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
-      // just to bypass identifiers
       string vname;
-      size_t aindex;
+      Variant aindex;
+
+      if (m_code)
+      {
+        // targets (with their array indexes) are compiled first, then value and assignments
+        vector<uint16_t> targets; // slot | OPF_INDEXED << 8
+        while (parse_identifier_assign(vname, &aindex, exec))
+          targets.push_back(symbol(vname) | (aindex.type()==Variant::INVALID? 0 : ScriptCode::OPF_INDEXED << 8));
+        if (!parse_conditional_expression(result, exec))
+          return false;
+        for (size_t i = targets.size(); i > 0; --i)
+        {
+          emit(ScriptCode::OP_STORE | (targets[i - 1] >> 8));
+          emit(targets[i - 1] & 0xFF);
+        }
+        return psaver.release();
+      }
+
+      // just to bypass identifiers
       while (parse_identifier_assign(vname, &aindex, exec));
 
       if (parse_conditional_expression(result, exec))
@@ -1766,7 +2908,8 @@ namespace fdv
           // reparse identifiers to do actual work
           psaver.restore();
           while (parse_identifier_assign(vname, &aindex, exec))
-            m_runTime->setVariable( vname.c_str(), aindex, *result );
+            if (!m_runTime->setVariable( vname.c_str(), aindex, *result ))
+              return false;
           // bypass conditional expression
           Variant f;
           parse_conditional_expression(&f, false);
@@ -1783,7 +2926,7 @@ namespace fdv
     // expression = logical_or_expression
     bool parse_expression(Variant* result, bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       // logical_or_expression
       if (parse_assignment_expression(result, exec))
@@ -1799,14 +2942,18 @@ namespace fdv
     // expression_statement = [expression] ';'
     bool parse_expression_statement(bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       Variant f;
       if (!parse_expression(&f, exec))
         return false;
 
       if (parse_1char(';'))
+      {
+        if (m_code)
+          emit(ScriptCode::OP_POP);
         return psaver.release();
+      }
 
       return false;
     }
@@ -1815,7 +2962,7 @@ namespace fdv
     // compound_statement = '{' {statement} '}'
     bool parse_compound_statement(bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_1char('{'))
       {
@@ -1834,9 +2981,45 @@ namespace fdv
     // selection_statement = "if" '(' expression ')' statement ["else" statement]
     bool parse_selection_statement(bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       Variant f;
+
+      if (m_code)
+      {
+        if (parse_nchar("if")
+          && parse_1char('(')
+          && parse_expression(&f, exec)
+          && parse_1char(')'))
+        {
+          bool cond;
+          if (constantCondition(&cond))
+          {
+            // the branch which can't run is not emitted
+            if (!(cond? parse_statement(exec) : parse_dead_statement()))
+              return false;
+            if (parse_nchar("else") && !(cond? parse_dead_statement() : parse_statement(exec)))
+              return false;
+            return psaver.release();
+          }
+          size_t jfalse = emitJump(ScriptCode::OP_JUMPF);
+          if (!parse_statement(exec))
+            return false;
+          if (parse_nchar("else"))
+          {
+            size_t jend = emitJump(ScriptCode::OP_JUMP);
+            patchJump(jfalse);
+            if (!parse_statement(exec))
+              return false;
+            patchJump(jend);
+          }
+          else
+            patchJump(jfalse);
+          return psaver.release();
+        }
+        return false;
+      }
+
       if (parse_nchar("if")
         && parse_1char('(')
         && parse_expression(&f, exec)
@@ -1860,7 +3043,10 @@ namespace fdv
     //                     | "for" '(' expression ';' expression ';' [expression] ')' statement
     bool parse_iteration_statement(bool exec)
     {
-      PosSaver psaver(m_input);
+      if (m_code)
+        return compile_iteration_statement();
+
+      PosSaver psaver(m_input, m_code);
 
       // "while" '(' expression ')' statement
       if (parse_nchar("while") && parse_1char('('))
@@ -1868,17 +3054,18 @@ namespace fdv
         size_t p1 = m_input->pos();
         while (true)
         {
-          m_progStatus = ST_RUN;
+          if (exec)
+            m_progStatus = ST_RUN;
           Variant f;
           if (!parse_expression(&f, exec) || !parse_1char(')'))
             return false;
           if (!parse_statement(exec && f.toBool()==true))
             return false;
-          if (!exec || f.toBool()==false || m_progStatus==ST_BREAK)
+          if (!exec || f.toBool()==false || m_progStatus==ST_BREAK || m_progStatus==ST_RETURN)
             break;
           m_input->pos(p1);
         }
-        m_progStatus = ST_RUN;
+        endLoop(exec);
         return psaver.release();
       }
       else
@@ -1891,7 +3078,8 @@ namespace fdv
         Variant f;
         do
         {
-          m_progStatus = ST_RUN;
+          if (exec)
+            m_progStatus = ST_RUN;
           m_input->pos(p1);
           if (!parse_statement(exec))
             return false;
@@ -1901,8 +3089,8 @@ namespace fdv
             || !parse_1char(')')
             || !parse_1char(';'))
             return false;
-        } while (f.toBool()==true && exec && m_progStatus!=ST_BREAK);
-        m_progStatus = ST_RUN;
+        } while (f.toBool()==true && exec && m_progStatus!=ST_BREAK && m_progStatus!=ST_RETURN);
+        endLoop(exec);
         return psaver.release();
       }
 
@@ -1914,7 +3102,8 @@ namespace fdv
         size_t p1 = m_input->pos();
         for (;;)
         {
-          m_progStatus = ST_RUN;
+          if (exec)
+            m_progStatus = ST_RUN;
           m_input->pos(p1);
           Variant f1;
           if (!parse_expression(&f1, exec))
@@ -1928,13 +3117,13 @@ namespace fdv
             return false;
           if (!parse_statement(exec && f1.toBool()==true))
             return false;
-          if (f1.toBool()==false || !exec || m_progStatus==ST_BREAK)
+          if (f1.toBool()==false || !exec || m_progStatus==ST_BREAK || m_progStatus==ST_RETURN)
             break;
           m_input->pos(p2);
           if (!parse_expression(&f2, exec))
             return false;
         }
-        m_progStatus = ST_RUN;
+        endLoop(exec);
         return psaver.release();
       }
       else
@@ -1944,24 +3133,157 @@ namespace fdv
     }
 
 
-    // jump_statement = "continue" ';'
-    //                | "break" ';'
-    bool parse_jump_statement(bool exec)
+    // "break" and "continue" end with the loop, "return" doesn't
+    void endLoop(bool exec)
     {
-      PosSaver psaver(m_input);
+      if (exec && m_progStatus != ST_RETURN)
+        m_progStatus = ST_RUN;
+    }
 
-      // "continue" ';'
-      if (parse_nchar("continue") && parse_1char(';'))
-      {
-        if (exec)
-          m_progStatus = ST_CONTINUE;
+
+    // compile mode: parses a statement which can never run. Its code is dropped (functions it
+    // defines are never defined, like in direct execution).
+    bool parse_dead_statement()
+    {
+      size_t codeSize      = m_code->code.size();
+      size_t constantsSize = m_code->constants.size();
+      if (!parse_statement(false))
+        return false;
+      m_code->code.resize(codeSize);
+      m_code->constants.resize(constantsSize);
+      m_lastTarget = min(m_lastTarget, codeSize);
+      return true;
+    }
+
+
+    // compile mode version of parse_iteration_statement()
+    bool compile_iteration_statement()
+    {
+      PosSaver psaver(m_input, m_code);
+      Variant f;
+
+      // "while" '(' expression ')' statement
+      if (parse_nchar("while") && parse_1char('('))
+      {
+        size_t condPos = m_code->code.size();
+        if (!parse_expression(&f, false) || !parse_1char(')'))
+          return false;
+        bool cond;
+        bool isConst = constantCondition(&cond);
+        if (isConst && !cond)
+          return parse_dead_statement() && psaver.release();
+        size_t jend = isConst? 0 : emitJump(ScriptCode::OP_JUMPF);
+        size_t bodyPos = m_code->code.size();
+        if (!parse_statement(false))
+          return false;
+        emitJumpTo(ScriptCode::OP_JUMP, condPos);
+        if (!isConst)
+          patchJump(jend);
+        resolveLoopJumps(bodyPos, m_code->code.size(), m_code->code.size(), condPos);
+        return psaver.release();
+      }
+      else
+        psaver.restore();
+
+      // "do" statement "while" '(' expression ')' ';'
+      if (parse_nchar("do"))
+      {
+        size_t bodyPos = m_code->code.size();
+        if (!parse_statement(false))
+          return false;
+        size_t condPos = m_code->code.size();
+        if (!parse_nchar("while")
+          || !parse_1char('(')
+          || !parse_expression(&f, false)
+          || !parse_1char(')')
+          || !parse_1char(';'))
+          return false;
+        emitJumpTo(ScriptCode::OP_JUMPT, bodyPos);
+        resolveLoopJumps(bodyPos, condPos, m_code->code.size(), condPos);
+        return psaver.release();
+      }
+
+      // "for" '(' expression_statement expression ';' [expression] ')' statement
+      if (parse_nchar("for")
+        && parse_1char('(')
+        && parse_expression_statement(false))
+      {
+        size_t condPos = m_code->code.size();
+        bool   hasCond = parse_expression(&f, false);  // missing test condition evaluates true
+        size_t jend    = hasCond? emitJump(ScriptCode::OP_JUMPF) : 0;
+        if (!parse_1char(';'))
+          return false;
+        // step expression is moved after the body
+        size_t stepPos = m_code->code.size();
+        if (parse_expression(&f, false))
+          emit(ScriptCode::OP_POP);
+        vector<uint8_t> step(m_code->code.begin() + stepPos, m_code->code.end());
+        m_code->code.resize(stepPos);
+        if (!parse_1char(')'))
+          return false;
+        size_t bodyPos = m_code->code.size();
+        if (!parse_statement(false))
+          return false;
+        size_t contPos = m_code->code.size();
+        for (size_t i = 0; i != step.size(); ++i)
+          emit(step[i]);
+        emitJumpTo(ScriptCode::OP_JUMP, condPos);
+        if (hasCond)
+          patchJump(jend);
+        resolveLoopJumps(bodyPos, contPos, m_code->code.size(), contPos);
+        return psaver.release();
+      }
+      else
+        psaver.restore();
+
+      return false;
+    }
+
+
+    // jump_statement = "continue" ';'
+    //                | "break" ';'
+    //                | "return" [expression] ';'
+    bool parse_jump_statement(bool exec)
+    {
+      PosSaver psaver(m_input, m_code);
+
+      // "return" [expression] ';'
+      if (parse_keyword("return"))
+      {
+        Variant r((uint8_t)0);
+        bool hasValue = !parse_1char(';');
+        if (hasValue && (!parse_expression(&r, exec) || !parse_1char(';')))
+          return false;
+        if (m_code)
+        {
+          if (!hasValue)
+            emitConstant(r);
+          emit(ScriptCode::OP_RETURN);
+        }
+        else if (exec)
+        {
+          m_returnValue = r;
+          m_progStatus = ST_RETURN;
+        }
+        return psaver.release();
+      }
+
+      // "continue" ';'
+      if (parse_nchar("continue") && parse_1char(';'))
+      {
+        if (m_code)
+          emitJump(ScriptCode::OP_CONTINUE);
+        else if (exec)
+          m_progStatus = ST_CONTINUE;
         return psaver.release();
       }
 
       // "break" ';'
       if (parse_nchar("break") && parse_1char(';'))
       {
-        if (exec)
+        if (m_code)
+          emitJump(ScriptCode::OP_BREAK);
+        else if (exec)
           m_progStatus = ST_BREAK;
         return psaver.release();
       }
@@ -1970,24 +3292,92 @@ namespace fdv
     }
 
 
-    // output_statement = ':' expression {':' expression} ';'
+    // function_definition = "func" identifier '(' [identifier {',' identifier}] ')' compound_statement
+    // The body is just located (compiled in compile mode), it is executed by callFunction() or
+    // OP_CALL. A function can be called once its definition has run (OP_FUNCDEF in compile mode).
+    bool parse_function_definition(bool exec)
+    {
+      PosSaver psaver(m_input, m_code);
+
+      Function f;
+      if (!parse_keyword("func") || !parse_identifier(f.name) || isKeyword(f.name) || !parse_1char('('))
+        return false;
+      string param;
+      if (parse_identifier(param))
+      {
+        f.params.push_back(param);
+        while (parse_1char(','))
+        {
+          if (!parse_identifier(param))
+            return false;
+          f.params.push_back(param);
+        }
+      }
+      if (!parse_1char(')') || f.params.size() > 0xFF)
+        return false;
+      bypassSpaces();
+
+      if (m_code)
+      {
+        // defines the function at run time, like direct execution, and jumps over the body
+        emit(ScriptCode::OP_FUNCDEF);
+        emit(nameIndex(m_code->functions, f.name));
+        emit16(0);
+        size_t jend = m_code->code.size() - 2;  // see patchJump()
+        if (m_code->code.size() > 0xFFFF)
+          m_codeError = true;
+        emit(ScriptCode::OP_FUNC);
+        emit(f.params.size());
+        // parameters have been pushed in order
+        for (size_t i = f.params.size(); i-- > 0; )
+        {
+          emitVariable(ScriptCode::OP_STORE, f.params[i], Variant());
+          emit(ScriptCode::OP_POP);
+        }
+        size_t bodyPos = m_code->code.size();
+        if (!parse_compound_statement(false))
+          return false;
+        // implicit "return 0;" ("break" and "continue" outside loops return too)
+        size_t retPos = m_code->code.size();
+        emitConstant(Variant((uint8_t)0));
+        emit(ScriptCode::OP_RETURN);
+        resolveLoopJumps(bodyPos, retPos, retPos, retPos);
+        patchJump(jend);
+        return psaver.release();
+      }
+
+      f.pos = m_input->pos();
+      if (!parse_compound_statement(false))
+        return false;
+      if (exec)
+        addFunction(f);
+      return psaver.release();
+    }
+
+
+    void addFunction(Function const& f)
+    {
+      size_t i = findFunction(f.name);
+      if (i == RunTimeT::NOTFOUND)
+        m_funcs.push_back(f);
+      else
+        m_funcs[i] = f;
+    }
+
+
+    // output_statement = ':' output_item {':' output_item} ';'
     bool parse_output_statement(bool exec)
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
 
       if (parse_1char(':'))
       {
-        Variant result;
-        if (!parse_expression(&result, exec))
+        if (!parse_output_item(exec))
           return false;
-        if (exec && m_runTime->output)
-          m_runTime->output->write( result.toString().c_str() );
         while (parse_1char(':'))
         {
-          if (!parse_expression(&result, exec))
+          if (!parse_output_item(exec))
             return false;
-          if (exec && m_runTime->output)
-            m_runTime->output->write( result.toString().c_str() );
         }
         if (!parse_1char(';'))
           return false;
@@ -1998,11 +3388,69 @@ namespace fdv
     }
 
 
+    // output_item = string_literal (followed by ':' or ';') | expression
+    // A string literal alone is written segment by segment, without building the whole string.
+    bool parse_output_item(bool exec)
+    {
+      PosSaver psaver(m_input, m_code);
+
+      if (m_code || !exec)
+      {
+        if (parse_string_literal(NULL, exec) && parse_output_item_end())
+          return psaver.release();
+      }
+      else if (parse_string_literal(NULL, false) && parse_output_item_end())
+      {
+        // interpreter: segments are written while parsing, so the literal has been checked first
+        m_input->pos(psaver.savedPos());
+        if (parse_string_literal(NULL, true) && parse_output_item_end())
+          return psaver.release();
+        return false;
+      }
+      psaver.restore();
+
+      Variant result;
+      if (!parse_expression(&result, exec))
+        return false;
+      if (m_code)
+        emit(ScriptCode::OP_OUTPUT);
+      else if (exec && m_runTime->output)
+        writeOutput(m_runTime->output, result);
+      return psaver.release();
+    }
+
+
+    // true if next char is ':' or ';' (not consumed)
+    bool parse_output_item_end()
+    {
+      bypassSpaces();
+      return !m_input->isEOF() && (m_input->get() == ':' || m_input->get() == ';');
+    }
+
+
     // output until "<?" or EOF
     void directOutput(bool exec)
     {
+      size_t start = m_input->pos();
+      size_t end   = start;  // compile mode: end of output text
+      bool   write = !m_code && exec && m_runTime->output;
       while (!m_input->isEOF())
       {
+        // whole span of text before "<?" (the last char is left to the code below: it could be
+        // the last one of the input or the '<' of "<?")
+        size_t len;
+        char const* text = m_input->span(&len);
+        size_t count = 0;
+        while (count + 1 < len && (text[count] != '<' || text[count + 1] != '?'))
+          ++count;
+        if (count > 0)
+        {
+          if (write)
+            writeOutput(m_runTime->output, text, count);
+          m_input->pos(m_input->pos() + count);
+          end = m_input->pos();
+        }
+
         char c = m_input->get();
         m_input->next();
         if (!m_input->isEOF())
@@ -2013,10 +3461,20 @@ namespace fdv
             m_incode = true;
             break;
           }
-          else if (exec && m_runTime->output)
+          else if (m_code)
+            end = m_input->pos();
+          else if (write)
             m_runTime->output->write( c );
         }
       }
+      if (m_code && end > start)
+      {
+        if (end > 0xFFFF)
+          m_codeError = true;
+        emit(ScriptCode::OP_TEXT);
+        emit16(start);
+        emit16(end - start);
+      }
     }
 
 
@@ -2031,10 +3489,85 @@ namespace fdv
     //           | jump_statement
     bool parse_statement(bool exec)
     {
-      PosSaver psaver(m_input);
-
       exec = exec && m_progStatus==ST_RUN;  // to handle "break" and "continue"
 
+      // interpreter: a statement already parsed once can be bypassed with a single jump
+      size_t start = m_input->pos();
+      bool   startInCode = m_incode;
+      size_t span = findSpan(start);  // m_spans is empty in compile mode
+      if (!exec && span != m_spans.size() && m_spans[span].start == start && m_spans[span].startInCode == m_incode)
+      {
+        m_input->pos(m_spans[span].end);
+        m_incode = m_spans[span].endInCode;
+        return true;
+      }
+
+      // statements nested inside a bypassed one are not recorded: the outer span covers them
+      bool outerSkip = m_skipping;
+      m_skipping = outerSkip || !exec;
+      bool ok = parse_statement_body(exec);
+      m_skipping = outerSkip;
+
+      if (ok && !m_code && !outerSkip)
+        addSpan(span, start, startInCode);
+      return ok;
+    }
+
+
+    // records the statement from "start" to the current position. "index" is findSpan(start).
+    // When the table is full the shortest span is replaced, if shorter than the new one.
+    void addSpan(size_t index, size_t start, bool startInCode)
+    {
+      size_t length = m_input->pos() - start;
+      if (length < MINSPANSIZE || (index != m_spans.size() && m_spans[index].start == start))
+        return;
+      if (m_spans.size() == MAXSPANS)
+      {
+        size_t shortest = 0;
+        for (size_t i = 1; i != m_spans.size(); ++i)
+          if (m_spans[i].end - m_spans[i].start < m_spans[shortest].end - m_spans[shortest].start)
+            shortest = i;
+        if (m_spans[shortest].end - m_spans[shortest].start >= length)
+          return;
+        m_spans.erase(m_spans.begin() + shortest);
+        if (shortest < index)
+          --index;
+      }
+      StatementSpan s = {start, m_input->pos(), startInCode, m_incode};
+      m_spans.insert(m_spans.begin() + index, s);
+    }
+
+
+    // returns index of the first span whose start is not less than "start" (m_spans is sorted by start)
+    size_t findSpan(size_t start)
+    {
+      size_t lo = 0, hi = m_spans.size();
+      while (lo < hi)
+      {
+        size_t mid = (lo + hi) / 2;
+        if (m_spans[mid].start < start)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+
+    bool parse_statement_body(bool exec)
+    {
+      PosSaver psaver(m_input, m_code);
+
+#ifdef FDV_SCRIPT_PROFILER
+      if (m_code)
+      {
+        emit(ScriptCode::OP_STMT);
+        emit16(m_input->pos());
+      }
+      else if (exec)
+        ScriptProfiler::statement(m_input->pos());
+#endif
+
       if (m_incode)
       {
 
@@ -2072,6 +3605,10 @@ namespace fdv
         if (parse_compound_statement(exec))
           return psaver.release();
 
+        // function_definition
+        if (parse_function_definition(exec))
+          return psaver.release();
+
         // expression_statement
         if (parse_expression_statement(exec))
           return psaver.release();
@@ -2103,13 +3640,23 @@ namespace fdv
   public:
 
     // script = {statement}
+    // note: in compile mode the script is not executed, just compiled
     bool parse_script()
     {
-      PosSaver psaver(m_input);
+      PosSaver psaver(m_input, m_code);
+#ifdef FDV_SCRIPT_PROFILER
+      ScriptProfiler::Scope profilerScope;
+#endif
 
       while (!m_input->isEOF())
       {
-        if (!parse_statement(true))
+        if (!parse_statement(m_code == NULL))
+          return false;
+      }
+      if (m_code)
+      {
+        emit(ScriptCode::OP_HALT);
+        if (m_codeError)
           return false;
       }
       return psaver.release();
@@ -2118,19 +3665,545 @@ namespace fdv
 
   private:
 
-    enum ProgStatus {ST_RUN, ST_BREAK, ST_CONTINUE};
+    enum ProgStatus {ST_RUN, ST_BREAK, ST_CONTINUE, ST_RETURN};
+
+    // max consecutive constants considered by constant folding (OP_CONCAT with more segments is not folded)
+    static uint8_t const MAXFOLD = 4;
+
+    // statements shorter than MINSPANSIZE characters are cheaper to parse than to record
+    static uint8_t const MINSPANSIZE = 16;
+    static uint8_t const MAXSPANS    = 32;
+
+    RunTimeT*        m_runTime;
+    InputBase*       m_input;
+    ProgStatus       m_progStatus;
+    bool             m_incode;       // true if inside "<?"..."?>" block
+    ScriptCode*      m_code;         // not NULL in compile mode
+    bool             m_codeError;    // compile mode: out of memory or limits exceeded
+    vector<Function> m_funcs;
+    Variant          m_returnValue;  // set by "return"
+    uint8_t          m_callDepth;
+    vector<StatementSpan> m_spans;   // interpreter: ends of statements already parsed, sorted by start
+    bool             m_skipping;     // parsing a statement with exec = false
+    size_t           m_constPos[MAXFOLD];  // compile mode: positions of the last consecutive constants (see emitConstant())
+    uint8_t          m_constCount;
+    size_t           m_constEnd;     // code size after the last of them
+    size_t           m_lastTarget;   // highest jump target (constants before it cannot be folded)
+
+  };
+
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptVM
+  // Executes code compiled by Script (see ScriptCode)
+
+  template <typename RunTimeT>
+  class ScriptVM
+  {
+
+  public:
+
+    // input is the source of "code", used to output literal text
+    ScriptVM(RunTimeT* runTime, InputBase* input, ScriptCode const* code) :
+        m_runTime(runTime),
+          m_input(input),
+          m_code(code),
+          m_ip(0),
+          m_top(this),
+          m_call(NULL),
+          m_depth(0)
+        {
+          m_slots.assign(m_code->symbols.size(), size_t(RunTimeT::NOTFOUND));
+          m_funcs.assign(m_code->functions.size(), uint16_t(RunTimeT::NOTFOUND));
+          m_userFuncs.assign(m_code->functions.size(), uint16_t(RunTimeT::NOTFOUND));
+        }
+
+
+    ~ScriptVM()
+    {
+      delete m_call;
+    }
+
+
+    enum Status
+    {
+      RUN_ERROR,
+      RUN_DONE,
+      RUN_SUSPENDED   // budget exhausted, call resume() to continue
+    };
 
-    RunTimeT*  m_runTime;
-    InputBase* m_input;
-    ProgStatus m_progStatus;
-    bool       m_incode;  // true if inside "<?"..."?>" block
 
+    // executes the whole script
+    bool run()
+    {
+      return resume(0, 0) == RUN_DONE;
+    }
+
+
+    // Executes (or continues) the script for at most "maxSteps" instructions and "maxMillis"
+    // milliseconds (0 = no limit), then suspends it. Execution state (instruction pointer and
+    // stack) is kept inside ScriptVM, so the runtime, input and code must remain valid until the
+    // script is done. Instructions of called user functions count in the same budget (a user
+    // function can be suspended too), library functions (ie call()) are never interrupted.
+    Status resume(uint16_t maxSteps, uint16_t maxMillis)
+    {
+#ifdef FDV_SCRIPT_PROFILER
+      ScriptProfiler::Scope profilerScope;
+#endif
+      Budget budget = { 0, maxSteps, maxMillis? millis() : 0, maxMillis };
+      return execute(budget);
+    }
+
+
+  private:
+
+    struct Budget
+    {
+      uint16_t steps;       // instructions executed so far
+      uint16_t maxSteps;
+      uint32_t startMillis;
+      uint16_t maxMillis;
+    };
+
+
+    // a user function being executed (see OP_CALL)
+    struct Call;
+
+
+    // VM of a user function called by "caller", which starts at "pos" (see OP_CALL)
+    ScriptVM(RunTimeT* frame, ScriptVM* caller, uint16_t pos) :
+        m_runTime(frame),
+          m_input(caller->m_input),
+          m_code(caller->m_code),
+          m_ip(pos),
+          m_top(caller->m_top),
+          m_call(NULL),
+          m_depth(caller->m_depth + 1)
+        {
+          m_slots.assign(m_code->symbols.size(), size_t(RunTimeT::NOTFOUND));
+        }
+
+
+    Status execute(Budget& budget)
+    {
+      if (m_call != NULL)
+      {
+        // continue the suspended user function first
+        Status status = runCall(budget);
+        if (status != RUN_DONE)
+          return status;
+      }
+      uint8_t const* code = &m_code->code[0];
+      uint8_t const* ip = code + m_ip;
+      uint16_t steps = budget.steps;  // stored back into budget when this VM stops or calls
+      for (; ; ++steps)
+      {
+        // time is checked every 32 instructions
+        if ((budget.maxSteps && steps >= budget.maxSteps)
+         || (budget.maxMillis && (steps & 0x1F) == 0x1F && millis() - budget.startMillis >= budget.maxMillis))
+        {
+          m_ip = ip - code;
+          return RUN_SUSPENDED;
+        }
+
+        uint8_t op = *ip++;
+        bool indexed = (op & ScriptCode::OPF_INDEXED) != 0;
+        switch (op & ~ScriptCode::OPF_INDEXED)
+        {
+
+        case ScriptCode::OP_HALT:
+        case ScriptCode::OP_BREAK:     // "break" or "continue" outside a loop: stop like direct execution
+        case ScriptCode::OP_CONTINUE:
+          budget.steps = steps;
+          return RUN_DONE;
+
+        case ScriptCode::OP_POP:
+          pop();
+          break;
+
+        case ScriptCode::OP_PUSHU8:
+          if (!push(Variant(*ip++)))
+            return RUN_ERROR;
+          break;
+
+        case ScriptCode::OP_PUSHU16:
+          if (!push(Variant(ScriptCode::read16(ip))))
+            return RUN_ERROR;
+          ip += 2;
+          break;
+
+        case ScriptCode::OP_PUSHCONST:
+          if (!push(m_code->constants[ScriptCode::read16(ip)]))
+            return RUN_ERROR;
+          ip += 2;
+          break;
+
+        case ScriptCode::OP_LOAD:
+        {
+          Variant* v = variable(*ip++, indexed);
+          if (v == NULL || !push(*v))
+            return RUN_ERROR;
+          break;
+        }
+
+        case ScriptCode::OP_LOADSOFT:
+        {
+          Variant* v = variable(*ip, indexed);
+          if (!push(v? *v : m_code->constants[ScriptCode::read16(ip + 1)]))
+            return RUN_ERROR;
+          ip += 3;
+          break;
+        }
+
+        case ScriptCode::OP_STORE:
+        {
+          Variant aindex;
+          if (indexed)
+            aindex = m_stack[m_stack.size() - 2];
+          if (!setVariable(*ip++, aindex, m_stack.back()))
+            return RUN_ERROR;
+          if (indexed)
+          {
+            m_stack[m_stack.size() - 2] = m_stack.back();
+            pop();
+          }
+          break;
+        }
+
+        case ScriptCode::OP_PREINC:
+        case ScriptCode::OP_PREDEC:
+        case ScriptCode::OP_POSTINC:
+        case ScriptCode::OP_POSTDEC:
+        {
+          uint8_t bop = op & ~ScriptCode::OPF_INDEXED;
+          Variant* v = variable(*ip++, indexed);
+          if (v == NULL)
+            return RUN_ERROR;
+          if (bop == ScriptCode::OP_POSTINC || bop == ScriptCode::OP_POSTDEC)
+          {
+            if (!push(*v))
+              return RUN_ERROR;
+          }
+          if (bop == ScriptCode::OP_PREINC || bop == ScriptCode::OP_POSTINC)
+            ++(*v);
+          else
+            --(*v);
+          if ((bop == ScriptCode::OP_PREINC || bop == ScriptCode::OP_PREDEC) && !push(*v))
+            return RUN_ERROR;
+          break;
+        }
+
+        case ScriptCode::OP_SIZEOF:
+        {
+          Variant* v = variable(*ip++, indexed);
+          if (v == NULL || !push(Variant()))
+            return RUN_ERROR;
+          m_stack.back().shrink( v->size() );
+          break;
+        }
+
+        case ScriptCode::OP_REF:
+        {
+          Variant* v = variable(*ip++, indexed);
+          if (v == NULL || !push(Variant(v)))
+            return RUN_ERROR;
+          break;
+        }
+
+        case ScriptCode::OP_DEREF:
+        {
+          Variant* v = variable(*ip++, indexed);
+          if (v == NULL || v->refVal() == NULL || !push(*(v->refVal())))
+            return RUN_ERROR;
+          break;
+        }
+
+        case ScriptCode::OP_NEG:
+        case ScriptCode::OP_NOT:
+        case ScriptCode::OP_BNOT:
+          ScriptCode::unaryOperator(op, m_stack.back());
+          break;
+
+        case ScriptCode::OP_MUL:
+        case ScriptCode::OP_DIV:
+        case ScriptCode::OP_MOD:
+        case ScriptCode::OP_ADD:
+        case ScriptCode::OP_SUB:
+        case ScriptCode::OP_SHL:
+        case ScriptCode::OP_SHR:
+        case ScriptCode::OP_LT:
+        case ScriptCode::OP_GT:
+        case ScriptCode::OP_LE:
+        case ScriptCode::OP_GE:
+        case ScriptCode::OP_EQ:
+        case ScriptCode::OP_NE:
+        case ScriptCode::OP_AND:
+        case ScriptCode::OP_XOR:
+        case ScriptCode::OP_OR:
+        case ScriptCode::OP_LAND:
+        case ScriptCode::OP_LOR:
+          ScriptCode::binaryOperator(op, m_stack[m_stack.size() - 2], m_stack.back());
+          pop();
+          break;
+
+        case ScriptCode::OP_MKARRAY:
+          if (!push(Variant()))
+            return RUN_ERROR;
+          m_stack.back().type(Variant::ARRAY);
+          break;
+
+        case ScriptCode::OP_MKMAP:
+          if (!push(Variant()))
+            return RUN_ERROR;
+          m_stack.back().type(Variant::MAP);
+          break;
+
+        case ScriptCode::OP_MAPSET:
+        {
+          Variant& key = m_stack[m_stack.size() - 2];
+          Variant* v = key.type()==Variant::INVALID? NULL : RunTimeT::item(m_stack[m_stack.size() - 3], key, true);
+          if (v == NULL)
+            return RUN_ERROR;
+          *v = m_stack.back();
+          pop();
+          pop();
+          break;
+        }
+
+        case ScriptCode::OP_APPEND:
+          m_stack[m_stack.size() - 2].arrayVal().push_back(m_stack.back());
+          pop();
+          break;
+
+        case ScriptCode::OP_CONCAT:
+        {
+          uint8_t count = *ip++;
+          size_t first = m_stack.size() - count;
+          Variant r = ScriptCode::concat(&m_stack[first], count);
+          m_stack.resize(first + 1);
+          m_stack.back() = r;
+          break;
+        }
+
+        case ScriptCode::OP_CALL:
+        {
+          uint8_t argc = *ip;
+          size_t first = m_stack.size() - argc;
+          uint16_t userFunc = m_top->m_userFuncs[ip[1]];
+          if (userFunc != RunTimeT::NOTFOUND)
+          {
+            // user functions first: it runs inside a new VM (own RunTime and stack), until its OP_RETURN
+            if (m_depth == ScriptCode::MAXCALLDEPTH || (m_call = new Call(this, userFunc)) == NULL)
+              return RUN_ERROR;
+            for (size_t i = first; i != m_stack.size(); ++i)
+              if (!m_call->vm.push(m_stack[i]))
+                return RUN_ERROR;
+            m_stack.resize(first);
+            ip += 2;
+            m_ip = ip - code;  // the result is pushed here, even after a suspension
+            budget.steps = steps;
+            Status status = runCall(budget);
+            if (status != RUN_DONE)
+              return status;
+            steps = budget.steps;
+            break;
+          }
+          RunTimeT localRunTime(m_runTime->output, m_runTime->library, m_runTime);
+          for (size_t i = first; i != m_stack.size(); ++i)
+            localRunTime.addVariable( Variable("", m_stack[i]) );
+          m_stack.resize(first);
+          uint16_t& funcID = m_top->m_funcs[ip[1]];
+          if (funcID == RunTimeT::NOTFOUND)
+            funcID = m_runTime->findFunc(m_code->functions[ip[1]].c_str());
+          Variant result;
+          if (!localRunTime.execFunc(funcID, &result) || !push(result))
+            return RUN_ERROR;
+          ip += 2;
+          break;
+        }
+
+        case ScriptCode::OP_FUNCDEF:
+          // (re)defines the function, visible to all the script (like direct execution)
+          m_top->m_userFuncs[ip[0]] = ip + 3 - code;
+          ip += 3 + int16_t(ScriptCode::read16(ip + 1));
+          break;
+
+        case ScriptCode::OP_FUNC:
+          if (m_stack.size() != *ip++)
+            return RUN_ERROR;  // wrong number of parameters
+          break;
+
+        case ScriptCode::OP_RETURN:
+          // result is on top (a top level "return" just stops the script)
+          budget.steps = steps;
+          return RUN_DONE;
+
+        case ScriptCode::OP_OUTPUT:
+          if (m_runTime->output)
+            writeOutput(m_runTime->output, m_stack.back());
+          pop();
+          break;
+
+        case ScriptCode::OP_TEXT:
+          if (m_runTime->output)
+          {
+            m_input->pos(ScriptCode::read16(ip));
+            writeOutput(m_runTime->output, m_input, ScriptCode::read16(ip + 2));
+          }
+          ip += 4;
+          break;
+
+        case ScriptCode::OP_STMT:
+#ifdef FDV_SCRIPT_PROFILER
+          ScriptProfiler::statement(ScriptCode::read16(ip));
+#endif
+          ip += 2;
+          break;
+
+        case ScriptCode::OP_JUMP:
+          ip += 2 + int16_t(ScriptCode::read16(ip));
+          break;
+
+        case ScriptCode::OP_JUMPF:
+        case ScriptCode::OP_JUMPT:
+        {
+          bool cond = m_stack.back().toBool();
+          pop();
+          if (cond == (op == ScriptCode::OP_JUMPT))
+            ip += int16_t(ScriptCode::read16(ip));
+          ip += 2;
+          break;
+        }
+
+        default:
+          return RUN_ERROR;
+
+        }
+      }
+    }
+
+
+    // executes the called user function (m_call) and pushes its result
+    Status runCall(Budget& budget)
+    {
+      Status status = m_call->vm.execute(budget);
+      if (status == RUN_DONE && (m_call->vm.m_stack.size() == 0 || !push(m_call->vm.m_stack.back())))
+        status = RUN_ERROR;
+      if (status != RUN_SUSPENDED)
+      {
+        delete m_call;
+        m_call = NULL;
+      }
+      return status;
+    }
+
+
+    bool push(Variant const& value)
+    {
+      size_t sz = m_stack.size();
+      m_stack.push_back(value);
+      return m_stack.size() != sz; // false = out of memory
+    }
+
+
+    void pop()
+    {
+      m_stack.pop_back();
+    }
+
+
+    // note: for OP_STORE the array index is handled by the caller
+    Variant* variable(uint8_t slot, bool indexed)
+    {
+      Variant aindex;
+      if (indexed)
+      {
+        aindex = m_stack.back();
+        pop();
+      }
+      size_t& vindex = m_slots[slot];
+      if (vindex == RunTimeT::NOTFOUND)
+      {
+        // not resolved yet (could have been created by a function, like eval())
+        vindex = m_runTime->findVariable(m_code->symbols[slot].c_str());
+        if (vindex == RunTimeT::NOTFOUND)
+          return NULL;
+      }
+      return m_runTime->getVariableValueAt(vindex, aindex);
+    }
+
+
+    // note: returns false if a map is full
+    bool setVariable(uint8_t slot, Variant const& aindex, Variant const& value)
+    {
+      size_t& vindex = m_slots[slot];
+      if (vindex == RunTimeT::NOTFOUND)
+        vindex = m_runTime->findVariable(m_code->symbols[slot].c_str());
+      if (vindex == RunTimeT::NOTFOUND)
+      {
+        vindex = m_runTime->vars.size();  // going to be added
+        return m_runTime->setVariable(m_code->symbols[slot].c_str(), aindex, value);
+      }
+      return m_runTime->setVariableAt(vindex, aindex, value);
+    }
+
+
+    RunTimeT*         m_runTime;
+    InputBase*        m_input;
+    ScriptCode const* m_code;
+    size_t            m_ip;     // offset of next instruction (see resume())
+    vector<Variant>   m_stack;
+    vector<size_t>    m_slots;  // symbol slot -> index of RunTime variable
+    vector<uint16_t>  m_funcs;      // function index -> library function ID
+    vector<uint16_t>  m_userFuncs;  // function index -> code position of the user function (see OP_FUNCDEF)
+    ScriptVM*         m_top;        // VM running the script, owner of m_funcs and m_userFuncs
+    Call*             m_call;       // called user function, kept while suspended
+    uint8_t           m_depth;      // user function calls nesting (see OP_CALL)
   };
 
 
+  template <typename RunTimeT>
+  struct ScriptVM<RunTimeT>::Call
+  {
+    RunTimeT frame;
+    ScriptVM vm;
+
+    Call(ScriptVM* caller, uint16_t pos) :
+        frame(caller->m_runTime->output, caller->m_runTime->library, caller->m_runTime),
+          vm(&frame, caller, pos)
+        {
+        }
+  };
+
+
+  // compiles "input" into "code"
+  template <typename RunTimeT>
+  inline bool compileScript(InputBase* input, ScriptCode* code)
+  {
+    code->clear();
+    return Script<RunTimeT>(NULL, input, code).parse_script();
+  }
+
+
+  // executes code compiled from "input" (see compileScript())
+  template <typename RunTimeT>
+  inline bool runScript(RunTimeT* runtime, InputBase* input, ScriptCode const* code)
+  {
+    return ScriptVM<RunTimeT>(runtime, input, code).run();
+  }
+
+
+  // compiles and executes the script
+  // note: when the script cannot be compiled (syntax errors, out of memory...) it is directly executed,
+  // so errors are reported exactly at the same point
   template <typename RunTimeT>
   inline bool parseScript(RunTimeT* runtime, InputBase* input)
   {
+    {
+      ScriptCode code;
+      if (compileScript<RunTimeT>(input, &code))
+        return runScript(runtime, input, &code);
+    }
     return Script<RunTimeT>(runtime, input).parse_script();
   }
 
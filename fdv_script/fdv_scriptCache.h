@@ -0,0 +1,512 @@
+/*
+# Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com)
+# Copyright (c) 2013 Fabrizio Di Vittorio.
+# All rights reserved.
+
+# GNU GPL LICENSE
+#
+# This module is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; latest version thereof,
+# available at: <http://www.gnu.org/licenses/gpl.txt>.
+#
+# This module is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this module; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA
+*/
+
+
+
+#ifndef FDV_SCRIPTCACHE_H_
+#define FDV_SCRIPTCACHE_H_
+
+
+#include <stddef.h>
+
+#include "../fdv_sdlib/fdv_sdcard.h"
+#include "../fdv_script/fdv_script.h"
+
+
+
+namespace fdv
+{
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptCache
+  // Stores compiled scripts (ScriptCode) next to the source file, replacing extension with its first
+  // letter followed by "SB" (ie "/www/index.htm" -> "/www/index.HSB", "/www/index.txt" -> "/www/index.TSB").
+  // Sources whose extension is "SBC", or which would map onto themselves ("x.HSB"), are never cached.
+  // An existing file with the cache name is overwritten only when it is a cache file (starts with
+  // the "SBC" magic), so user files are never replaced.
+  // A cached file is valid while size and last write date/time of the source directory entry
+  // don't change and it has been compiled from the same source (sources with extensions starting
+  // with the same letter share the same cache file).
+  // FAT write times have a 2 seconds resolution, so a source written in the current 2 seconds slot
+  // is not cached (a following edit of the same size could not be detected).
+  //
+  // SBC file layout:
+  //   char     magic[3]          "SBC"
+  //   uint8_t  version           (bit 7 set when compiled for the profiler)
+  //   uint32_t sourceSize        directory entry of the source
+  //   uint32_t sourceLastWrite   directory entry of the source
+  //   uint8_t  sourceNameLength
+  //   uint16_t codeSize
+  //   uint8_t  symbolsCount
+  //   uint8_t  functionsCount
+  //   uint16_t constantsCount
+  //   char     sourceName[sourceNameLength]  full source name, without leading '/'
+  //   uint8_t  code[codeSize]
+  //   symbols:   uint8_t length, char name[length]
+  //   functions: uint8_t length, char name[length]
+  //   constants: uint16_t type, value (STRING: uint16_t length, char str[length])
+
+  class ScriptCache
+  {
+
+    static uint8_t const VERSION = 7;
+    static uint8_t const PROFILER_VERSION = 0x80;  // set in version when compiled with FDV_SCRIPT_PROFILER
+
+    struct Header
+    {
+      char     magic[3];
+      uint8_t  version;
+      uint32_t sourceSize;
+      uint32_t sourceLastWrite;
+      uint8_t  sourceNameLength;
+      uint16_t codeSize;
+      uint8_t  symbolsCount;
+      uint8_t  functionsCount;
+      uint16_t constantsCount;
+    };
+
+  public:
+
+    // Gets compiled code of the script "filename" (already open as "file" and "input").
+    // Loads it from the SBC file if valid, otherwise compiles the script and saves the SBC file.
+    // Returns false if the script cannot be compiled.
+    template <typename RunTimeT>
+    static bool get(FileSystem& fileSystem, char const* filename, File& file, InputBase* input, ScriptCode* code)
+    {
+      if (*filename == '/')
+        ++filename;
+      Header header;
+      string cacheName;
+      bool hasStamp = cacheFilename(filename, &cacheName) && makeHeader(filename, file, &header);
+
+      if (hasStamp && load(fileSystem, cacheName.c_str(), header, filename, code))
+        return true;
+
+      if (!compileScript<RunTimeT>(input, code))
+        return false;
+
+      if (hasStamp && !writtenNow(header.sourceLastWrite))
+        save(fileSystem, cacheName.c_str(), &header, filename, *code);
+      return true;
+    }
+
+
+    // "/dir/name.ext" -> "/dir/name.ESB" ("/dir/name" -> "/dir/name.SB")
+    // returns false when the script must not be cached (its extension is "SBC" or it is its own cache name)
+    static bool cacheFilename(char const* filename, string* cacheName)
+    {
+      char const* sep = max(strrchr(filename, '/'), strrchr(filename, '\\'));
+      char const* dot = strrchr(sep? sep : filename, '.');
+      if (dot == NULL)
+        dot = filename + strlen(filename);  // no extension
+      else if (strcasecmp_P(dot + 1, PSTR("SBC")) == 0)
+        return false;
+      cacheName->assign(filename, dot);
+      cacheName->push_back('.');
+      if (*dot)
+        cacheName->push_back(toupper(dot[1]));
+      cacheName->append("SB");
+      return strcasecmp(cacheName->c_str(), filename) != 0;
+    }
+
+
+    // true when lastWrite (FAT date/time) is in the current 2 seconds slot: the file could be
+    // written again without changing its stamp
+    static bool writtenNow(uint32_t lastWrite)
+    {
+      DateTime now = DateTime::now();
+      return lastWrite == ((uint32_t(FAT_DATE(now.year, now.month, now.day)) << 16) | FAT_TIME(now.hours, now.minutes, now.seconds));
+    }
+
+
+  private:
+
+    static bool makeHeader(char const* filename, File& file, Header* header)
+    {
+      memset(header, 0, sizeof(Header));
+      memcpy_P(header->magic, PSTR("SBC"), 3);
+      header->version = VERSION;
+#ifdef FDV_SCRIPT_PROFILER
+      header->version |= PROFILER_VERSION;  // code contains OP_STMT
+#endif
+      size_t len = strlen(filename);
+      if (len > 255)
+        return false; // cannot be stored
+      header->sourceNameLength = len;
+      return file.dirEntry(&header->sourceSize, &header->sourceLastWrite);
+    }
+
+
+    static bool load(FileSystem& fileSystem, char const* cacheName, Header const& expected, char const* sourceName, ScriptCode* code)
+    {
+      File file(fileSystem, cacheName, File::MD_READ);
+      if (!file.isOpen())
+        return false;
+
+      Header header;
+      if (file.read(&header, sizeof(Header)) != sizeof(Header)
+        || memcmp(&header, &expected, offsetof(Header, codeSize)) != 0)
+        return false; // different or outdated
+
+      // compiled from the same source? (names are not case sensitive)
+      if (header.sourceNameLength != strlen(sourceName))
+        return false;
+      for (uint8_t pos = 0; pos != header.sourceNameLength; )
+      {
+        char name[16];
+        uint8_t len = min<uint8_t>(header.sourceNameLength - pos, sizeof(name));
+        if (file.read(&name[0], len) != len || strncasecmp(name, sourceName + pos, len) != 0)
+          return false; // another source with the same name and different extension
+        pos += len;
+      }
+
+      code->clear();
+
+      // code
+      code->code.resize(header.codeSize);
+      if (code->code.size() != header.codeSize
+        || file.read(&code->code[0], header.codeSize) != header.codeSize)
+        return false;
+
+      // symbols and functions
+      if (!readNames(file, header.symbolsCount, &code->symbols)
+        || !readNames(file, header.functionsCount, &code->functions))
+        return false;
+
+      // constants
+      for (uint16_t i = 0; i != header.constantsCount; ++i)
+      {
+        Variant value;
+        if (!readConstant(file, &value))
+          return false;
+        code->constants.push_back(value);
+      }
+
+      return code->constants.size() == header.constantsCount;
+    }
+
+
+    static bool readNames(File& file, uint8_t count, vector<string>* names)
+    {
+      for (uint8_t i = 0; i != count; ++i)
+      {
+        uint8_t len = 0;
+        file.read(&len, 1);
+        string name(len, ' ');
+        if (file.read(name.c_str(), len) != len)
+          return false;
+        names->push_back(name);
+      }
+      return names->size() == count;
+    }
+
+
+    static bool readConstant(File& file, Variant* value)
+    {
+      uint16_t type = 0;
+      file.read(&type, sizeof(type));
+      switch (type)
+      {
+      case Variant::STRING:
+      {
+        uint16_t len = 0;
+        file.read(&len, sizeof(len));
+        string& s = value->stringVal();
+        s.resize(len);
+        return file.read(s.c_str(), len) == len;
+      }
+      case Variant::FLOAT:
+        return file.read(&value->floatVal(), sizeof(float)) == sizeof(float);
+      case Variant::UINT8:
+        return file.read(&value->uint8Val(), sizeof(uint8_t)) == sizeof(uint8_t);
+      case Variant::UINT16:
+        return file.read(&value->uint16Val(), sizeof(uint16_t)) == sizeof(uint16_t);
+      case Variant::UINT32:
+        return file.read(&value->uint32Val(), sizeof(uint32_t)) == sizeof(uint32_t);
+      case Variant::INT32:
+        return file.read(&value->int32Val(), sizeof(int32_t)) == sizeof(int32_t);
+      default:
+        return false;
+      }
+    }
+
+
+    static void save(FileSystem& fileSystem, char const* cacheName, Header* header, char const* sourceName, ScriptCode const& code)
+    {
+      header->codeSize       = code.code.size();
+      header->symbolsCount   = code.symbols.size();
+      header->functionsCount = code.functions.size();
+      header->constantsCount = code.constants.size();
+
+      if (!isCacheFileOrMissing(fileSystem, cacheName))
+        return; // a user file: never overwritten
+
+      File file(fileSystem, cacheName, File::MD_WRITE | File::MD_CREATE | File::MD_TRUNC);
+      if (!file.isOpen())
+        return;
+      bool ok = file.write(header, sizeof(Header)) == sizeof(Header)
+             && file.write(sourceName, header->sourceNameLength) == header->sourceNameLength
+             && file.write(&code.code[0], header->codeSize) == header->codeSize;
+      ok = ok && writeNames(file, code.symbols) && writeNames(file, code.functions);
+      for (uint16_t i = 0; ok && i != header->constantsCount; ++i)
+        ok = writeConstant(file, code.constants[i]);
+      if (!ok)
+      {
+        // don't leave an invalid cache file
+        file.close();
+        fileSystem.removeFile(cacheName);
+      }
+    }
+
+
+    // true if "cacheName" doesn't exist or starts with the cache file magic
+    static bool isCacheFileOrMissing(FileSystem& fileSystem, char const* cacheName)
+    {
+      File file(fileSystem, cacheName, File::MD_READ);
+      if (!file.isOpen())
+        return true;
+      char magic[3];
+      return file.read(&magic[0], 3) == 3 && memcmp_P(magic, PSTR("SBC"), 3) == 0;
+    }
+
+
+    static bool writeNames(File& file, vector<string> const& names)
+    {
+      for (uint8_t i = 0; i != names.size(); ++i)
+      {
+        uint8_t len = names[i].size();
+        if (file.write(&len, 1) != 1 || file.write(names[i].c_str(), len) != len)
+          return false;
+      }
+      return true;
+    }
+
+
+    static bool writeConstant(File& file, Variant const& value)
+    {
+      uint16_t type = value.type();
+      Variant v(value);
+      if (file.write(&type, sizeof(type)) != sizeof(type))
+        return false;
+      switch (type)
+      {
+      case Variant::STRING:
+      {
+        uint16_t len = value.constStringVal().size();
+        return file.write(&len, sizeof(len)) == sizeof(len) && file.write(value.constStringVal().c_str(), len) == len;
+      }
+      case Variant::FLOAT:
+        return file.write(&v.floatVal(), sizeof(float)) == sizeof(float);
+      case Variant::UINT8:
+        return file.write(&v.uint8Val(), sizeof(uint8_t)) == sizeof(uint8_t);
+      case Variant::UINT16:
+        return file.write(&v.uint16Val(), sizeof(uint16_t)) == sizeof(uint16_t);
+      case Variant::UINT32:
+        return file.write(&v.uint32Val(), sizeof(uint32_t)) == sizeof(uint32_t);
+      case Variant::INT32:
+        return file.write(&v.int32Val(), sizeof(int32_t)) == sizeof(int32_t);
+      default:
+        return false; // cannot be cached
+      }
+    }
+
+  };
+
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptModuleCache
+  // Keeps in memory the compiled code of scripts executed by call(), discarding the least
+  // recently used. Scripts which write literal text keep also their source, up to MAXSOURCE
+  // chars (otherwise the text is read from the file).
+  // Library functions which modify files must call invalidate(). Files modified in other ways
+  // are detected by size and last write time (like ScriptCache does).
+
+  struct ScriptModuleCache
+  {
+
+    static uint8_t const  MAXMODULES = 3;
+    static uint16_t const MAXSOURCE  = 256;
+
+
+    struct Module
+    {
+      string     filename;   // empty = unused (or invalidated while in use)
+      ScriptCode code;
+      string     source;     // literal text source (see textInFile)
+      bool       textInFile; // literal text must be read from the file (source too large)
+      uint32_t   sourceSize; // size and last write of the file when loaded (see File::dirEntry())
+      uint32_t   sourceLastWrite;
+      uint16_t   lastUse;
+      uint8_t    users;      // running instances (cannot be discarded)
+    };
+
+
+    // Returns the module "filename", loading it if necessary, or NULL if it cannot be cached (or
+    // compiled). The module must be released with release().
+    template <typename RunTimeT>
+    static Module* acquire(FileSystem& fileSystem, char const* filename)
+    {
+      Data& d = data();
+      ++d.clock;
+      File file(fileSystem, filename, File::MD_READ);
+      uint32_t size, lastWrite;
+      bool hasStamp = file.isOpen() && file.dirEntry(&size, &lastWrite);
+      Module* module = find(filename);
+      if (module != NULL && (!hasStamp || module->sourceSize != size || module->sourceLastWrite != lastWrite))
+      {
+        invalidate(filename);  // modified (or removed) without invalidate()
+        module = NULL;
+      }
+      if (!hasStamp)
+        return NULL;
+      if (module == NULL)
+      {
+        // discard least recently used
+        for (uint8_t i = 0; i != MAXMODULES; ++i)
+          if (d.modules[i].users == 0 && (module == NULL || uint16_t(d.clock - d.modules[i].lastUse) > uint16_t(d.clock - module->lastUse)))
+            module = &d.modules[i];
+        if (module == NULL)
+          return NULL;
+        Arena::Scope heap(NULL);  // modules outlive the running script arena (if any)
+        if (!load<RunTimeT>(fileSystem, filename, file, module))
+        {
+          if (module->filename.size() == 0)
+            discard(module);
+          return NULL;
+        }
+        module->sourceSize      = size;
+        module->sourceLastWrite = lastWrite;
+        if (ScriptCache::writtenNow(lastWrite))
+          module->filename.clear();  // could change again with the same stamp: discarded by release()
+      }
+      module->lastUse = d.clock;
+      ++module->users;
+      return module;
+    }
+
+
+    static void release(Module* module)
+    {
+      if (--module->users == 0 && module->filename.size() == 0)
+        discard(module);
+    }
+
+
+    // to call when "filename" is modified, renamed or removed
+    static void invalidate(char const* filename)
+    {
+      Module* module = find(filename);
+      if (module)
+      {
+        module->filename.clear();
+        if (module->users == 0)
+          discard(module);
+      }
+    }
+
+
+  private:
+
+    struct Data
+    {
+      Module   modules[MAXMODULES];
+      uint16_t clock;
+    };
+
+
+    static Data& data()
+    {
+      static Data s_data;
+      return s_data;
+    }
+
+
+    // file names are not case sensitive, root directory can be omitted
+    static Module* find(char const* filename)
+    {
+      if (*filename == '/')
+        ++filename;
+      Data& d = data();
+      for (uint8_t i = 0; i != MAXMODULES; ++i)
+      {
+        char const* name = d.modules[i].filename.c_str();
+        if (d.modules[i].filename.size() > 0 && strcasecmp(*name == '/'? name + 1 : name, filename) == 0)
+          return &d.modules[i];
+      }
+      return NULL;
+    }
+
+
+    template <typename RunTimeT>
+    static bool load(FileSystem& fileSystem, char const* filename, File& file, Module* module)
+    {
+      discard(module);
+      BufferedFileInput input(&file);
+      if (!ScriptCache::get<RunTimeT>(fileSystem, filename, file, &input, &module->code))
+        return false;
+      uint32_t size = file.size();
+      module->textInFile = module->code.hasText() && size > MAXSOURCE;
+      if (module->code.hasText() && !module->textInFile)
+      {
+        module->source.resize(size, ' ');
+        file.position(0);
+        if (module->source.size() != size || file.read(module->source.c_str(), size) != size)
+          return false;
+      }
+      module->filename = filename;
+      return true;
+    }
+
+
+    static void discard(Module* module)
+    {
+      module->filename.clear();
+      module->code.clear();
+      module->source.clear();
+    }
+
+  };
+
+
+  // Compiles (or loads from ScriptCache) and executes the script "filename" (already open as "file").
+  // Like parseScript() the script is directly executed when it cannot be compiled.
+  template <typename RunTimeT>
+  inline bool parseScriptFile(RunTimeT* runtime, FileSystem& fileSystem, char const* filename, File& file)
+  {
+#ifdef FDV_SCRIPT_PROFILER
+    ScriptProfiler::Source profilerSource(filename);
+#endif
+    BufferedFileInput input(&file);
+    {
+      ScriptCode code;
+      if (ScriptCache::get<RunTimeT>(fileSystem, filename, file, &input, &code))
+        return runScript(runtime, &input, &code);
+    }
+    input.pos(0);
+    return Script<RunTimeT>(runtime, &input).parse_script();
+  }
+
+
+} // end of fdv namespace
+
+
+#endif /* FDV_SCRIPTCACHE_H_ */
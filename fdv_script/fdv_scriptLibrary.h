@@ -38,12 +38,14 @@
 #include "../fdv_sdlib/fdv_sdcard.h"
 #include "../fdv_sdlib/fdv_ini.h"
 #include "../fdv_script/fdv_scriptSchedule.h"
+#include "../fdv_script/fdv_scriptCache.h"
 
 
 #define FDV_SCRIPT_SUPPORT_FILES
 #define FDV_SCRIPT_SUPPORT_RFLINK
 #define FDV_SCRIPT_SUPPORT_PORTS
 #define FDV_SCRIPT_SUPPORT_ARRAY
+#define FDV_SCRIPT_SUPPORT_MAP
 #define FDV_SCRIPT_SUPPORT_STRINGS
 #define FDV_SCRIPT_SUPPORT_DATETIME
 #define FDV_SCRIPT_SUPPORT_FILESYSTEM
@@ -98,17 +100,281 @@ namespace fdv
 
 
     // checks also params count
+    // "type" can combine multiple types. Numbers and strings convert to each other, so they are
+    // always accepted; REFERENCE, ARRAY and MAP params must have one of the requested types.
     template <typename RunTimeT>
-    bool checkParamsType(RunTimeT& runtime, uint8_t index, uint8_t type)
+    bool checkParamsType(RunTimeT& runtime, uint8_t index, uint16_t type)
     {
-      return runtime.vars.size() > index && (runtime.vars[index].value.type() | type) != 0; // logic OR to accept multiple types
+      if (runtime.vars.size() <= index)
+        return false;
+      uint16_t const notConvertible = Variant::REFERENCE | Variant::ARRAY | Variant::MAP;
+      return (type & notConvertible) == 0 || (runtime.vars[index].value.type() & type) != 0;
     }
 
 
   public:
 
+    // Functions are identified by ID: findFunc() resolves a name once (ie when a compiled
+    // call site is executed the first time), then execFunc() dispatches by ID.
+    // Derived libraries (LibraryT) can add functions using IDs starting from FUNC_COUNT:
+    //
+    //   struct MyLibrary : ScriptLibrary
+    //   {
+    //     enum { FUNC_HELLO = ScriptLibrary::FUNC_COUNT };
+    //     MyLibrary(FileSystem* fileSystem) : ScriptLibrary(fileSystem) { }
+    //     uint16_t findFunc(char const* funcName)
+    //     {
+    //       if (strcmp_P(funcName, PSTR("hello"))==0)
+    //         return FUNC_HELLO;
+    //       return ScriptLibrary::findFunc(funcName);
+    //     }
+    //     template <typename RunTimeT>
+    //     bool execFunc(uint16_t funcID, RunTimeT& runtime, Variant* result)
+    //     {
+    //       if (funcID == FUNC_HELLO)
+    //       {
+    //         result->stringVal() = "hello!";
+    //         return true;
+    //       }
+    //       return ScriptLibrary::execFunc(funcID, runtime, result);
+    //     }
+    //   };
+
+    enum
+    {
+      FUNC_AVAILMEM,
+      FUNC_PINMODE_OUTPUT,
+      FUNC_PINMODE_INPUT,
+      FUNC_PINREAD,
+      FUNC_PINWRITE,
+      FUNC_ANALOGREAD,
+      FUNC_BEEP,
+      FUNC_DEBUG,
+      FUNC_LOG,
+      FUNC_TYPE,
+      FUNC_VARCOUNT,
+      FUNC_GETVAR,
+      FUNC_CALL,
+      FUNC_EVAL,
+      FUNC_TRUNC,
+      FUNC_ARRAYSIZE,
+      FUNC_ARRAYADD,
+      FUNC_ARRAYINS,
+      FUNC_ARRAYDEL,
+      FUNC_MAPKEYS,
+      FUNC_MAPHAS,
+      FUNC_MAPDEL,
+      FUNC_STR,
+      FUNC_CHR,
+      FUNC_STRTOINT,
+      FUNC_STRTOFLOAT,
+      FUNC_STRPOS,
+      FUNC_STRLEFT,
+      FUNC_WRITE,
+      FUNC_MILLIS,
+      FUNC_DELAY,
+      FUNC_TIME,
+      FUNC_SETTIME,
+      FUNC_SECONDS,
+      FUNC_MINUTES,
+      FUNC_HOURS,
+      FUNC_DAYOFWEEK,
+      FUNC_DAY,
+      FUNC_MONTH,
+      FUNC_YEAR,
+      FUNC_TIMECREATE,
+      FUNC_TIMESTR,
+      FUNC_MKDIR,
+      FUNC_RMDIR,
+      FUNC_UNLINK,
+      FUNC_COPY,
+      FUNC_RENAME,
+      FUNC_FILE_EXISTS,
+      FUNC_TEMPNAME,
+      FUNC_FOPEN,
+      FUNC_FCLOSE,
+      FUNC_FEOF,
+      FUNC_FGETC,
+      FUNC_FGETS,
+      FUNC_FTELL,
+      FUNC_FSEEK,
+      FUNC_FSIZE,
+      FUNC_FTRUNCATE,
+      FUNC_FREAD,
+      FUNC_FWRITE,
+      FUNC_INIREADSTRING,
+      FUNC_INIREADUINT,
+      FUNC_INIREADFLOAT,
+      FUNC_INIWRITESTRING,
+      FUNC_INIWRITEUINT,
+      FUNC_INIWRITEFLOAT,
+      FUNC_INIBYPASS,
+      FUNC_INIREMOVEKEY,
+      FUNC_INIFINDKEY,
+      FUNC_INIREADKEY,
+      FUNC_RELOADEVENTS,
+      FUNC_RF_GETLOCALID,
+      FUNC_RF_GETTEMP,
+      FUNC_RF_GETCO,
+      FUNC_RF_BOILERSET,
+      FUNC_RF_BOILERGET,
+      FUNC_RF_GETUPTIME,
+      FUNC_RF_BUZZERALARM,
+#ifdef FDV_SCRIPT_PROFILER
+      FUNC_PROFILE_DUMP,
+      FUNC_PROFILE_RESET,
+#endif
+      FUNC_COUNT,
+      FUNC_NOTFOUND = 0xFFFF
+    };
+
+
+    // returns FUNC_NOTFOUND if funcName is not a library function
+    uint16_t findFunc(char const* funcName)
+    {
+      uint8_t count;
+      FuncEntry const* funcs = funcTable(&count);
+
+      // binary search
+      uint8_t lo = 0;
+      uint8_t hi = count;
+      while (lo < hi)
+      {
+        uint8_t mid = (lo + hi) / 2;
+        int c = strcmp_P(funcName, funcs[mid].name);
+        if (c == 0)
+          return pgm_read_byte(&funcs[mid].id);
+        if (c < 0)
+          hi = mid;
+        else
+          lo = mid + 1;
+      }
+      return FUNC_NOTFOUND;
+    }
+
+
+    // copies name of funcID into "name" (at least 16 chars), returns false if not found
+    bool funcName(uint16_t funcID, char* name)
+    {
+      uint8_t count;
+      FuncEntry const* funcs = funcTable(&count);
+      for (uint8_t i = 0; i != count; ++i)
+        if (pgm_read_byte(&funcs[i].id) == funcID)
+        {
+          strncpy_P(name, funcs[i].name, sizeof(funcs[i].name));
+          name[sizeof(funcs[i].name)] = 0;
+          return true;
+        }
+      return false;
+    }
+
+
+  private:
+
+    struct FuncEntry
+    {
+      char    name[15];
+      uint8_t id;
+    };
+
+    static FuncEntry const* funcTable(uint8_t* count)
+    {
+      // must be sorted by name (strcmp order)
+      static FuncEntry const s_funcs[] PROGMEM =
+      {
+        { "analogread",      FUNC_ANALOGREAD },
+        { "arrayadd",        FUNC_ARRAYADD },
+        { "arraydel",        FUNC_ARRAYDEL },
+        { "arrayins",        FUNC_ARRAYINS },
+        { "arraysize",       FUNC_ARRAYSIZE },
+        { "availmem",        FUNC_AVAILMEM },
+        { "beep",            FUNC_BEEP },
+        { "call",            FUNC_CALL },
+        { "chr",             FUNC_CHR },
+        { "copy",            FUNC_COPY },
+        { "day",             FUNC_DAY },
+        { "dayofweek",       FUNC_DAYOFWEEK },
+        { "debug",           FUNC_DEBUG },
+        { "delay",           FUNC_DELAY },
+        { "eval",            FUNC_EVAL },
+        { "fclose",          FUNC_FCLOSE },
+        { "feof",            FUNC_FEOF },
+        { "fgetc",           FUNC_FGETC },
+        { "fgets",           FUNC_FGETS },
+        { "file_exists",     FUNC_FILE_EXISTS },
+        { "fopen",           FUNC_FOPEN },
+        { "fread",           FUNC_FREAD },
+        { "fseek",           FUNC_FSEEK },
+        { "fsize",           FUNC_FSIZE },
+        { "ftell",           FUNC_FTELL },
+        { "ftruncate",       FUNC_FTRUNCATE },
+        { "fwrite",          FUNC_FWRITE },
+        { "getvar",          FUNC_GETVAR },
+        { "hours",           FUNC_HOURS },
+        { "inibypass",       FUNC_INIBYPASS },
+        { "inifindkey",      FUNC_INIFINDKEY },
+        { "inireadfloat",    FUNC_INIREADFLOAT },
+        { "inireadkey",      FUNC_INIREADKEY },
+        { "inireadstring",   FUNC_INIREADSTRING },
+        { "inireaduint",     FUNC_INIREADUINT },
+        { "iniremovekey",    FUNC_INIREMOVEKEY },
+        { "iniwritefloat",   FUNC_INIWRITEFLOAT },
+        { "iniwritestring",  FUNC_INIWRITESTRING },
+        { "iniwriteuint",    FUNC_INIWRITEUINT },
+        { "log",             FUNC_LOG },
+        { "mapdel",          FUNC_MAPDEL },
+        { "maphas",          FUNC_MAPHAS },
+        { "mapkeys",         FUNC_MAPKEYS },
+        { "millis",          FUNC_MILLIS },
+        { "minutes",         FUNC_MINUTES },
+        { "mkdir",           FUNC_MKDIR },
+        { "month",           FUNC_MONTH },
+        { "pinmode_input",   FUNC_PINMODE_INPUT },
+        { "pinmode_output",  FUNC_PINMODE_OUTPUT },
+        { "pinread",         FUNC_PINREAD },
+        { "pinwrite",        FUNC_PINWRITE },
+#ifdef FDV_SCRIPT_PROFILER
+        { "profile_dump",    FUNC_PROFILE_DUMP },
+        { "profile_reset",   FUNC_PROFILE_RESET },
+#endif
+        { "reloadevents",    FUNC_RELOADEVENTS },
+        { "rename",          FUNC_RENAME },
+        { "rf_boilerget",    FUNC_RF_BOILERGET },
+        { "rf_boilerset",    FUNC_RF_BOILERSET },
+        { "rf_buzzeralarm",  FUNC_RF_BUZZERALARM },
+        { "rf_getco",        FUNC_RF_GETCO },
+        { "rf_getlocalid",   FUNC_RF_GETLOCALID },
+        { "rf_gettemp",      FUNC_RF_GETTEMP },
+        { "rf_getuptime",    FUNC_RF_GETUPTIME },
+        { "rmdir",           FUNC_RMDIR },
+        { "seconds",         FUNC_SECONDS },
+        { "settime",         FUNC_SETTIME },
+        { "str",             FUNC_STR },
+        { "strleft",         FUNC_STRLEFT },
+        { "strpos",          FUNC_STRPOS },
+        { "strtofloat",      FUNC_STRTOFLOAT },
+        { "strtoint",        FUNC_STRTOINT },
+        { "tempname",        FUNC_TEMPNAME },
+        { "time",            FUNC_TIME },
+        { "timecreate",      FUNC_TIMECREATE },
+        { "timestr",         FUNC_TIMESTR },
+        { "trunc",           FUNC_TRUNC },
+        { "type",            FUNC_TYPE },
+        { "unlink",          FUNC_UNLINK },
+        { "varcount",        FUNC_VARCOUNT },
+        { "write",           FUNC_WRITE },
+        { "year",            FUNC_YEAR },
+      };
+      *count = sizeof(s_funcs) / sizeof(FuncEntry);
+      return s_funcs;
+    }
+
+
+  public:
+
+
     template <typename RunTimeT>
-    bool execFunc(char const* funcName, RunTimeT& runtime, Variant* result)
+    bool execFunc(uint16_t funcID, RunTimeT& runtime, Variant* result)
     {
 
 
@@ -116,6 +382,9 @@ namespace fdv
       typedef typename RunTimeT::OutputType  OutputType;
 
 
+      switch (funcID)
+      {
+
 
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -123,7 +392,7 @@ namespace fdv
 
       // UINT32 = availmem()
       // Returns free heap
-      if (strcmp_P(funcName, PSTR("availmem"))==0)
+      case FUNC_AVAILMEM:
       {
         result->uint32Val() = getFreeMem();
         return true;
@@ -134,11 +403,11 @@ namespace fdv
       // pinmode_output(STRING pinname)
       // Sets specified pin as output
       // pinname : "B0", "A1", ...
-      if (strcmp_P(funcName, PSTR("pinmode_output"))==0)
+      case FUNC_PINMODE_OUTPUT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        string& pinname = runtime.vars[0].value.stringVal();
+        string const& pinname = runtime.vars[0].value.constStringVal();
         *portNameToDDR(pinname[0]) |= _BV(pinname[1]-48);
         return true;
       }
@@ -146,11 +415,11 @@ namespace fdv
       // pinmode_input(STRING pinname)
       // Sets specified pin as input
       // pinname : "B0", "A1", etc...
-      if (strcmp_P(funcName, PSTR("pinmode_input"))==0)
+      case FUNC_PINMODE_INPUT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        string& pinname = runtime.vars[0].value.stringVal();
+        string const& pinname = runtime.vars[0].value.constStringVal();
         *portNameToDDR(pinname[0]) &= ~_BV(pinname[1]-48);
         return true;
       }
@@ -158,11 +427,11 @@ namespace fdv
       // UINT8 = pinread(STRING pinname)
       // Reads specified digital pin. 0=low 1=high
       // pinname : "B0", "A1", etc...
-      if (strcmp_P(funcName, PSTR("pinread"))==0)
+      case FUNC_PINREAD:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        string& pinname = runtime.vars[0].value.stringVal();
+        string const& pinname = runtime.vars[0].value.constStringVal();
         result->uint8Val() = (*portNameToPIN(pinname[0]) & _BV(pinname[1]-48))? 1 : 0;
         return true;
       }
@@ -171,11 +440,11 @@ namespace fdv
       // Writes to specified digital pin.
       // pinname : "B0", "A1", etc...
       // value : 0 (low),  1 (high)
-      if (strcmp_P(funcName, PSTR("pinwrite"))==0)
+      case FUNC_PINWRITE:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT8))
           return false;
-        string& pinname = runtime.vars[0].value.stringVal();
+        string const& pinname = runtime.vars[0].value.constStringVal();
         uint8_t value = runtime.vars[1].value.uint8Val();
         if (value==0)
           *portNameToPORT(pinname[0]) &= ~_BV(pinname[1]-48);
@@ -192,7 +461,7 @@ namespace fdv
       //   5    = VCC   (DEFAULT)
       //   0    = external
       // Remember to call "Analog::init()"!
-      if (strcmp_P(funcName, PSTR("analogread"))==0)
+      case FUNC_ANALOGREAD:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8))
           return false;
@@ -218,12 +487,12 @@ namespace fdv
 
       // beep(STRING pin, UINT32 duration_ms, UINT32 frequency_hz)
       // Generates a beep
-      if (strcmp_P(funcName, PSTR("beep"))==0)
+      case FUNC_BEEP:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT32) || !checkParamsType(runtime, 2, Variant::UINT32))
           return false;
 
-        string& pin = runtime.vars[0].value.stringVal();
+        string const& pin = runtime.vars[0].value.constStringVal();
         uint32_t duration_ms = runtime.vars[1].value.toUInt32();
         uint32_t freq_hz = runtime.vars[2].value.toUInt32();
 
@@ -253,27 +522,27 @@ namespace fdv
 
       // debug(STRING msg)
       // Sends a debug message
-      if (strcmp_P(funcName, PSTR("debug"))==0)
+      case FUNC_DEBUG:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        debug << runtime.vars[0].value.stringVal() << ENDL;
+        debug << runtime.vars[0].value.constStringVal() << ENDL;
         return true;
       }
 
       // log(STRING msg)
       // Sends log message
-      if (strcmp_P(funcName, PSTR("log"))==0)
+      case FUNC_LOG:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        Log::add( runtime.vars[0].value.stringVal().c_str() );
+        Log::add( runtime.vars[0].value.constStringVal().c_str() );
         return true;
       }
 
       // STRING = type(ALLTYPES var)
-      // Returns variable type:  "S", "U8", "U16", "U32", "F", "A", "R"
-      if (strcmp_P(funcName, PSTR("type"))==0)
+      // Returns variable type:  "S", "U8", "U16", "U32", "I32", "F", "A", "R"
+      case FUNC_TYPE:
       {
         if (runtime.vars.size() < 1)
           return false;
@@ -294,9 +563,15 @@ namespace fdv
         case Variant::UINT32:
           result->stringVal() = "U32";
           break;
+        case Variant::INT32:
+          result->stringVal() = "I32";
+          break;
         case Variant::ARRAY:
           result->stringVal() = "A";
           break;
+        case Variant::MAP:
+          result->stringVal() = "M";
+          break;
         case Variant::REFERENCE:
           result->stringVal() = "R";
           break;
@@ -309,7 +584,7 @@ namespace fdv
 
       // UINT32 = varcount()
       // Returns number of existing variables
-      if (strcmp_P(funcName, PSTR("varcount"))==0)
+      case FUNC_VARCOUNT:
       {
         if (runtime.parent != NULL)
           result->uint32Val() = runtime.parent->vars.size();
@@ -323,7 +598,7 @@ namespace fdv
       //      <? result = getvar(0) + getvar(1); ?>
       //   - file "test.htm":
       //      <? r = call("sum.s", 5, 7); ?>
-      if (strcmp_P(funcName, PSTR("getvar"))==0)
+      case FUNC_GETVAR:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
@@ -339,26 +614,45 @@ namespace fdv
       //      <? result = getvar(0) + getvar(1); ?>
       //   - file "test.htm":
       //      <? r = call("sum.s", 5, 7); ?>
-      if (strcmp_P(funcName, PSTR("call"))==0)
+      case FUNC_CALL:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        File file(*m_fileSystem, runtime.vars[0].value.stringVal().c_str(), File::MD_READ);
-        if (file.isOpen())
+        char const* filename = runtime.vars[0].value.constStringVal().c_str();
+        RunTimeT localRunTime(runtime.output, static_cast<LibraryType*>(this), &runtime);
+        // add parameters
+        for (uint8_t i=1; i<runtime.vars.size(); ++i)
+          localRunTime.vars.push_back( runtime.vars[i] );
+        // execute script (cached compiled code if possible)
+#ifdef FDV_SCRIPT_PROFILER
+        ScriptProfiler::Source profilerSource(filename);
+#endif
+        bool ret = true;
+        ScriptModuleCache::Module* module = ScriptModuleCache::acquire<RunTimeT>(*m_fileSystem, filename);
+        if (module && module->textInFile)
         {
+          File file(*m_fileSystem, filename, File::MD_READ);
           BufferedFileInput input(&file);
-          RunTimeT localRunTime(runtime.output, static_cast<LibraryType*>(this), &runtime);
-          // add parameters
-          for (uint8_t i=1; i<runtime.vars.size(); ++i)
-            localRunTime.vars.push_back( runtime.vars[i] );
-          // execute script
-          bool ret = parseScript(&localRunTime, &input);
-          // retrieve a variable named "result" as result value
-          if (localRunTime.findVariable("result") != RunTimeT::NOTFOUND)
-            *result = *localRunTime.getVariableValue("result");
-          return ret;
+          ret = runScript(&localRunTime, &input, &module->code);
         }
-        return true;
+        else if (module)
+        {
+          TextInput input(module->source.c_str());
+          ret = runScript(&localRunTime, &input, &module->code);
+        }
+        else
+        {
+          File file(*m_fileSystem, filename, File::MD_READ);
+          if (!file.isOpen())
+            return true;
+          ret = parseScriptFile(&localRunTime, *m_fileSystem, filename, file);
+        }
+        if (module)
+          ScriptModuleCache::release(module);
+        // retrieve a variable named "result" as result value
+        if (localRunTime.findVariable("result") != RunTimeT::NOTFOUND)
+          *result = *localRunTime.getVariableValue("result");
+        return ret;
       }
 
 
@@ -367,11 +661,11 @@ namespace fdv
       // Example:
       //    r = eval("1+1");        // r = 2
       //    r = eval("{1, 2, 3}");  // r = {1, 2, 3}
-      if (strcmp_P(funcName, PSTR("eval"))==0)
+      case FUNC_EVAL:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        string& exp = runtime.vars[0].value.stringVal();
+        string const& exp = runtime.vars[0].value.constStringVal();
         if (exp.size() > 0)
         {
           //exp.append("   ");
@@ -383,18 +677,56 @@ namespace fdv
         return false;
       }
 
+#ifdef FDV_SCRIPT_PROFILER
+
+      // profile_dump([STRING filename])
+      // Writes the profiler report (statements and functions sorted by time) to the output or,
+      // when specified, to a file (overwritten).
+      // Example:
+      //    profile_dump("PROFILE.TXT");
+      case FUNC_PROFILE_DUMP:
+      {
+        if (runtime.vars.size() > 0)
+        {
+          if (!checkParamsType(runtime, 0, Variant::STRING))
+            return false;
+          File file(*m_fileSystem, runtime.vars[0].value.constStringVal().c_str(), File::MD_WRITE | File::MD_CREATE | File::MD_TRUNC);
+          if (!file.isOpen())
+            return false;
+          ScriptProfiler::dump(file, *static_cast<LibraryType*>(this));
+        }
+        else if (runtime.output)
+          ScriptProfiler::dump(*runtime.output, *static_cast<LibraryType*>(this));
+        return true;
+      }
+
+      // profile_reset()
+      // Clears profiler counters
+      case FUNC_PROFILE_RESET:
+      {
+        ScriptProfiler::reset();
+        return true;
+      }
+
+#endif // FDV_SCRIPT_PROFILER
+
 
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
       // MATH
 
-      // UINT32/16/8 = trunc(FLOAT value)
-      // Converts floating point value to integer
-      if (strcmp_P(funcName, PSTR("trunc"))==0)
+      // UINT32/16/8/INT32 = trunc(FLOAT value)
+      // Converts floating point value to integer (INT32 when negative)
+      // Example:
+      //    a = trunc(-5.7);   // a = -5 (INT32)
+      case FUNC_TRUNC:
       {
         if (!checkParamsType(runtime, 0, Variant::FLOAT))
           return false;
-        result->shrink( runtime.vars[0].value.toUInt32() );
+        if (runtime.vars[0].value.toFloat() < 0)
+          result->int32Val() = runtime.vars[0].value.toInt32();
+        else
+          result->shrink( runtime.vars[0].value.toUInt32() );
         return true;
       }
 
@@ -409,7 +741,7 @@ namespace fdv
       // Returns size of array. This is the same of "sizeof(array)", but must be called as "arraysize(&array)".
       // Example:
       //    sz = arraysize(&ar);
-      if (strcmp_P(funcName, PSTR("arraysize"))==0)
+      case FUNC_ARRAYSIZE:
       {
         if (!checkParamsType(runtime, 0, Variant::REFERENCE))
           return false;
@@ -424,11 +756,11 @@ namespace fdv
       // Before add elements to array you have to create one assigning an element or creating an empty array using "arr={};".
       // Example:
       //    ar = {};
-      //    arrayadd(ar, "hello");
-      //    arrayadd(ar, "world");
+      //    arrayadd(&ar, "hello");
+      //    arrayadd(&ar, "world");
       //    ar1[0] = "one";
-      //    arrayadd(ar1, "two");
-      if (strcmp_P(funcName, PSTR("arrayadd"))==0)
+      //    arrayadd(&ar1, "two");
+      case FUNC_ARRAYADD:
       {
         if (runtime.vars.size() < 2)
           return false;
@@ -442,7 +774,7 @@ namespace fdv
 
       // arrayins(ARRAY* array, UINT index, ALLTYPES value)
       // Insert a new type. Note that "array" must be a reference to array.
-      if (strcmp_P(funcName, PSTR("arrayins"))==0)
+      case FUNC_ARRAYINS:
       {
         if (runtime.vars.size() < 3)
           return false;
@@ -456,7 +788,7 @@ namespace fdv
 
       // arraydel(ARRAY* array, UINT index)
       // Removes item at index. Note that "array" must be a reference to array.
-      if (strcmp_P(funcName, PSTR("arraydel"))==0)
+      case FUNC_ARRAYDEL:
       {
         if (!checkParamsType(runtime, 0, Variant::REFERENCE) || !checkParamsType(runtime, 1, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
@@ -468,6 +800,57 @@ namespace fdv
 
 #endif // FDV_SCRIPT_SUPPORT_ARRAY
 
+      //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+      //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+      // MAP
+
+#ifdef FDV_SCRIPT_SUPPORT_MAP
+
+      // ARRAY = mapkeys(MAP map)
+      // Returns keys of the map (in insertion order).
+      // Example:
+      //    m = {"one" : 1, "two" : 2};
+      //    keys = mapkeys(m);               // keys = {"one", "two"}
+      //    for (i = 0; i < sizeof(keys); ++i)
+      //      : keys[i] : "=" : m[keys[i]];
+      case FUNC_MAPKEYS:
+      {
+        if (!checkParamsType(runtime, 0, Variant::MAP))
+          return false;
+        VariantMap const& map = runtime.vars[0].value.constMapVal();
+        vector<Variant>& keys = result->arrayVal();
+        for (uint16_t i = 0; i != map.size(); ++i)
+          keys.push_back( Variant(map.key(i)) );
+        return true;
+      }
+
+      // UINT8 = maphas(MAP map, STRING key)
+      // Returns 1 if the map contains "key" (reading a missing key is an error).
+      case FUNC_MAPHAS:
+      {
+        if (runtime.vars.size() < 2 || !checkParamsType(runtime, 0, Variant::MAP))
+          return false;
+        result->uint8Val() = runtime.vars[0].value.constMapVal().contains( runtime.vars[1].value.toString().c_str() );
+        return true;
+      }
+
+      // UINT8 = mapdel(MAP* map, STRING key)
+      // Removes "key" from the map, returns 1 if it existed. Note that "map" must be a reference to map.
+      // Example:
+      //    mapdel(&m, "one");
+      case FUNC_MAPDEL:
+      {
+        if (runtime.vars.size() < 2 || runtime.vars[0].value.type() != Variant::REFERENCE)
+          return false;
+        Variant* map = runtime.vars[0].value.refVal();
+        if (map == NULL || map->type() != Variant::MAP)
+          return false;
+        result->uint8Val() = map->mapVal().erase( runtime.vars[1].value.toString().c_str() );
+        return true;
+      }
+
+#endif // FDV_SCRIPT_SUPPORT_MAP
+
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
       //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
       // STRINGS
@@ -476,7 +859,7 @@ namespace fdv
 
       // STRING = str(ALLTYPES value [, UINT8 padlen [, STRING padchar="0"]])
       // Converts number to string with optional left pad
-      if (strcmp_P(funcName, PSTR("str"))==0)
+      case FUNC_STR:
       {
         if (runtime.vars.size() < 1)
           return false;
@@ -490,7 +873,7 @@ namespace fdv
         {
           if (!checkParamsType(runtime, 1, Variant::UINT8) || !checkParamsType(runtime, 2, Variant::STRING))
             return false;
-          result->stringVal() = padLeft( runtime.vars[0].value.toString(), runtime.vars[2].value.stringVal()[0], runtime.vars[1].value.uint8Val() );
+          result->stringVal() = padLeft( runtime.vars[0].value.toString(), runtime.vars[2].value.constStringVal()[0], runtime.vars[1].value.uint8Val() );
         }
         else
           result->stringVal() = runtime.vars[0].value.toString();
@@ -499,7 +882,7 @@ namespace fdv
 
       // STRING = chr(UINT8 value)
       // Converts ascii value to string (single character)
-      if (strcmp_P(funcName, PSTR("chr"))==0)
+      case FUNC_CHR:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8))
           return false;
@@ -509,32 +892,32 @@ namespace fdv
 
       // UINT8/UINT16/UINT32 = strtoint(STRING str)
       // Converts string to int
-      if (strcmp_P(funcName, PSTR("strtoint"))==0)
+      case FUNC_STRTOINT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        result->shrink( strtoul(&runtime.vars[0].value.stringVal()[0], NULL, 10) );
+        result->shrink( strtoul(&runtime.vars[0].value.constStringVal()[0], NULL, 10) );
         return true;
       }
 
       // FLOAT = strtofloat(STRING str)
       // Converts string to float
-      if (strcmp_P(funcName, PSTR("strtofloat"))==0)
+      case FUNC_STRTOFLOAT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        result->floatVal() = strtod(&runtime.vars[0].value.stringVal()[0], NULL);
+        result->floatVal() = strtod(&runtime.vars[0].value.constStringVal()[0], NULL);
         return true;
       }
 
       // UINT = strpos(STRING str, STRING substr)
       // Returns position of substring (0=first position) or 0xFFFF if not found
-      if (strcmp_P(funcName, PSTR("strpos"))==0)
+      case FUNC_STRPOS:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
-        char const* str = runtime.vars[0].value.stringVal().c_str();
-        char const* substr = runtime.vars[1].value.stringVal().c_str();
+        char const* str = runtime.vars[0].value.constStringVal().c_str();
+        char const* substr = runtime.vars[1].value.constStringVal().c_str();
         char const* pos = strstr(str, substr);
         result->shrink( pos? pos-str : 0xFFFF );
         return true;
@@ -542,11 +925,11 @@ namespace fdv
 
       // STRING = strleft(STRING str, UINT count)
       // Returns left count chars of str.
-      if (strcmp_P(funcName, PSTR("strleft"))==0)
+      case FUNC_STRLEFT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
-        result->stringVal().assign( runtime.vars[0].value.stringVal(), runtime.vars[1].value.toUInt32() );
+        result->stringVal().assign( runtime.vars[0].value.constStringVal(), runtime.vars[1].value.toUInt32() );
         return true;
       }
 
@@ -558,7 +941,7 @@ namespace fdv
 
       // write(ALLTYPES value)
       // Convert value to string and send to the output
-      if (strcmp_P(funcName, PSTR("write"))==0)
+      case FUNC_WRITE:
       {
         if (runtime.vars.size() < 1)
           return false;
@@ -576,7 +959,7 @@ namespace fdv
 
       // UINT32 = millis()
       // Returns milliseconds since startup or last timer overflow (about 50 days)
-      if (strcmp_P(funcName, PSTR("millis"))==0)
+      case FUNC_MILLIS:
       {
         result->uint32Val() = millis();
         return true;
@@ -584,7 +967,7 @@ namespace fdv
 
       // delay(UINT millis)
       // Delays for milliseconds
-      if (strcmp_P(funcName, PSTR("delay"))==0)
+      case FUNC_DELAY:
       {
         if (runtime.vars.size() < 1)
           return false;
@@ -595,7 +978,7 @@ namespace fdv
       // UINT32 = time()
       // Returns current Unix timestamp
       // must be updated before 50 days using settime()
-      if (strcmp_P(funcName, PSTR("time"))==0)
+      case FUNC_TIME:
       {
         result->uint32Val() = DateTime::now().getUnixDateTime();
         return true;
@@ -604,7 +987,7 @@ namespace fdv
       // settime(UINT32 timestamp)
       // Adjust current date time
       // must be updated before 50 days
-      if (strcmp_P(funcName, PSTR("settime"))==0)
+      case FUNC_SETTIME:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -614,7 +997,7 @@ namespace fdv
 
       // UINT8 = seconds(UINT32 timestamp)
       // Extracts seconds from timestamp
-      if (strcmp_P(funcName, PSTR("seconds"))==0)
+      case FUNC_SECONDS:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -624,7 +1007,7 @@ namespace fdv
 
       // UINT8 = minutes(UINT32 timestamp)
       // Extracts minutes from timestamp
-      if (strcmp_P(funcName, PSTR("minutes"))==0)
+      case FUNC_MINUTES:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -634,7 +1017,7 @@ namespace fdv
 
       // UINT8 = hours(UINT32 timestamp)
       // Extracts hours from timestamp
-      if (strcmp_P(funcName, PSTR("hours"))==0)
+      case FUNC_HOURS:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -644,7 +1027,7 @@ namespace fdv
 
       // UINT8 = dayofweek(UINT32 timestamp)
       // Extracts seconds from timestamp. 0=sunday...6=saturday
-      if (strcmp_P(funcName, PSTR("dayofweek"))==0)
+      case FUNC_DAYOFWEEK:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -654,7 +1037,7 @@ namespace fdv
 
       // UINT8 = day(UINT32 timestamp)
       // Extracts day of month from timestamp
-      if (strcmp_P(funcName, PSTR("day"))==0)
+      case FUNC_DAY:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -664,7 +1047,7 @@ namespace fdv
 
       // UINT8 = month(UINT32 timestamp)
       // Extracts month from timestamp
-      if (strcmp_P(funcName, PSTR("month"))==0)
+      case FUNC_MONTH:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -674,7 +1057,7 @@ namespace fdv
 
       // UINT16 = year(UINT32 timestamp)
       // Extracts year from timestamp
-      if (strcmp_P(funcName, PSTR("year"))==0)
+      case FUNC_YEAR:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT32))
           return false;
@@ -686,7 +1069,7 @@ namespace fdv
       // Create a timestamp from date time values
       // Example:
       //    timestamp = timecreate(5, 1, 1973, 10, 0, 0);
-      if (strcmp_P(funcName, PSTR("timecreate"))==0)
+      case FUNC_TIMECREATE:
       {
         for (uint8_t i=0; i<6; ++i)
           if (!checkParamsType(runtime, i, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
@@ -716,12 +1099,12 @@ namespace fdv
       //    's' : Seconds, with leading zeros (00..59)
       // Example:
       //   $"<p>$(timestr("d/m/Y H:i:s", time()))</p>";
-      if (strcmp_P(funcName, PSTR("timestr"))==0)
+      case FUNC_TIMESTR:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT32))
           return false;
         DateTime dt( runtime.vars[1].value.toUInt32() );
-        result->stringVal() = dt.format( runtime.vars[0].value.stringVal() );
+        result->stringVal() = dt.format( runtime.vars[0].value.constStringVal() );
         return true;
       }
 
@@ -735,67 +1118,75 @@ namespace fdv
 
       // mkdir(STRING fullpath)
       // Creates a new directory
-      if (strcmp_P(funcName, PSTR("mkdir"))==0)
+      case FUNC_MKDIR:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        m_fileSystem->makeDirectory( runtime.vars[0].value.stringVal().c_str() );
+        m_fileSystem->makeDirectory( runtime.vars[0].value.constStringVal().c_str() );
         return true;
       }
 
       // rmdir(STRING fullpath)
       // Removes a directory
-      if (strcmp_P(funcName, PSTR("rmdir"))==0)
+      case FUNC_RMDIR:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        m_fileSystem->removeDirectory( runtime.vars[0].value.stringVal().c_str() );
+        m_fileSystem->removeDirectory( runtime.vars[0].value.constStringVal().c_str() );
         return true;
       }
 
       // unlink(STRING fullpath)
       // Removes a file
-      if (strcmp_P(funcName, PSTR("unlink"))==0)
+      case FUNC_UNLINK:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        m_fileSystem->removeFile( runtime.vars[0].value.stringVal().c_str() );
+        ScriptModuleCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+        IniCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+        m_fileSystem->removeFile( runtime.vars[0].value.constStringVal().c_str() );
         return true;
       }
 
       // copy(STRING source, STRING dest)
       // Copies a file
-      if (strcmp_P(funcName, PSTR("copy"))==0)
+      case FUNC_COPY:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
-        fileCopy(*m_fileSystem, runtime.vars[0].value.stringVal().c_str(), runtime.vars[1].value.stringVal().c_str());
+        ScriptModuleCache::invalidate( runtime.vars[1].value.constStringVal().c_str() );
+        IniCache::invalidate( runtime.vars[1].value.constStringVal().c_str() );
+        fileCopy(*m_fileSystem, runtime.vars[0].value.constStringVal().c_str(), runtime.vars[1].value.constStringVal().c_str());
         return true;
       }
 
       // rename(STRING source, STRING dest)
       // Renames a file
-      if (strcmp_P(funcName, PSTR("rename"))==0)
+      case FUNC_RENAME:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
-        fileMove(*m_fileSystem, runtime.vars[0].value.stringVal().c_str(), runtime.vars[1].value.stringVal().c_str());
+        ScriptModuleCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+        IniCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+        ScriptModuleCache::invalidate( runtime.vars[1].value.constStringVal().c_str() );
+        IniCache::invalidate( runtime.vars[1].value.constStringVal().c_str() );
+        fileMove(*m_fileSystem, runtime.vars[0].value.constStringVal().c_str(), runtime.vars[1].value.constStringVal().c_str());
         return true;
       }
 
       // UINT8 = file_exists(STRING fullpath)
       // Returns 1 if the file/directory exists, 0 otherwise
-      if (strcmp_P(funcName, PSTR("file_exists"))==0)
+      case FUNC_FILE_EXISTS:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        result->uint8Val() = fileExists(*m_fileSystem, runtime.vars[0].value.stringVal().c_str());
+        result->uint8Val() = fileExists(*m_fileSystem, runtime.vars[0].value.constStringVal().c_str());
         return true;
       }
 
       // STRING = tempname()
       // Returns a temporary file name. The file is NOT created.
-      if (strcmp_P(funcName, PSTR("tempname"))==0)
+      case FUNC_TEMPNAME:
       {
         result->stringVal() = getTempFilename(*m_fileSystem);
         return true;
@@ -819,14 +1210,14 @@ namespace fdv
       //   'w+' Open for reading and writing; place the file pointer at the beginning of the file and truncate the file to zero length. If the file does not exist, attempt to create it.
       //   'a'  Open for writing only; place the file pointer at the end of the file. If the file does not exist, attempt to create it.
       //   'a+' Open for reading and writing; place the file pointer at the end of the file. If the file does not exist, attempt to create it.
-      if (strcmp_P(funcName, PSTR("fopen"))==0)
+      case FUNC_FOPEN:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
         result->uint16Val() = 0;
         uint8_t mode = 0xFF;
-        char m0 = runtime.vars[1].value.stringVal()[0];
-        char m1 = runtime.vars[1].value.stringVal().size() > 1? runtime.vars[1].value.stringVal()[1] : ' ';
+        char m0 = runtime.vars[1].value.constStringVal()[0];
+        char m1 = runtime.vars[1].value.constStringVal().size() > 1? runtime.vars[1].value.constStringVal()[1] : ' ';
         switch (m0)
         {
         case 'r':
@@ -841,7 +1232,12 @@ namespace fdv
         }
         if (mode!=0xFF)
         {
-          File* file = new File(*m_fileSystem, runtime.vars[0].value.stringVal().c_str(), mode);
+          if (mode & (File::MD_WRITE | File::MD_APPEND))  // fwrite() and ftruncate() may change the file
+          {
+            ScriptModuleCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+            IniCache::invalidate( runtime.vars[0].value.constStringVal().c_str() );
+          }
+          File* file = new File(*m_fileSystem, runtime.vars[0].value.constStringVal().c_str(), mode);
           if (file->isOpen())
             result->uint16Val() = uint16_t(file);
           else
@@ -852,7 +1248,7 @@ namespace fdv
 
       // fclose(UINT16 handle)
       // Closed a file
-      if (strcmp_P(funcName, PSTR("fclose"))==0)
+      case FUNC_FCLOSE:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -863,7 +1259,7 @@ namespace fdv
 
       // UINT8 = feof(UINT16 handle)
       // Tests for EOF
-      if (strcmp_P(funcName, PSTR("feof"))==0)
+      case FUNC_FEOF:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -874,7 +1270,7 @@ namespace fdv
 
       // UINT8 = fgetc(UINT16 handle)
       // Reads a character as ASCII number
-      if (strcmp_P(funcName, PSTR("fgetc"))==0)
+      case FUNC_FGETC:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -887,7 +1283,7 @@ namespace fdv
 
       // STRING = fgets(UINT16 handle)
       // Reads a line (until EOL or EOF)
-      if (strcmp_P(funcName, PSTR("fgets"))==0)
+      case FUNC_FGETS:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -898,7 +1294,7 @@ namespace fdv
 
       // UINT32 = ftell(UINT16 handle)
       // Returns the current position of the file read/write pointer
-      if (strcmp_P(funcName, PSTR("ftell"))==0)
+      case FUNC_FTELL:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -910,7 +1306,7 @@ namespace fdv
       // UINT32 = fseek(UINT16 handle, UINT32 position)
       // Sets current position (actually only SET is supported, so "whence" is not present)
       // Returns new position
-      if (strcmp_P(funcName, PSTR("fseek"))==0)
+      case FUNC_FSEEK:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16) || !checkParamsType(runtime, 1, Variant::UINT32))
           return false;
@@ -922,7 +1318,7 @@ namespace fdv
 
       // UINT32 = fsize(UINT16 handle)
       // Returns file size
-      if (strcmp_P(funcName, PSTR("fsize"))==0)
+      case FUNC_FSIZE:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16))
           return false;
@@ -933,7 +1329,7 @@ namespace fdv
 
       // ftruncate(UINT16 handle, UINT32 newsize)
       // Truncates file to the specified size
-      if (strcmp_P(funcName, PSTR("ftruncate"))==0)
+      case FUNC_FTRUNCATE:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16) || !checkParamsType(runtime, 1, Variant::UINT32))
           return false;
@@ -944,7 +1340,7 @@ namespace fdv
 
       // STRING = fread(UINT16 handle, UINT16 length)
       // Reads binary data
-      if (strcmp_P(funcName, PSTR("fread"))==0)
+      case FUNC_FREAD:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16) || !checkParamsType(runtime, 1, Variant::UINT16))
           return false;
@@ -957,12 +1353,12 @@ namespace fdv
 
       // fwrite(UINT16 handle, STRING buffer [, UINT16 length])
       // Writes binary data
-      if (strcmp_P(funcName, PSTR("fwrite"))==0)
+      case FUNC_FWRITE:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT16) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
         File* file = (File*)runtime.vars[0].value.uint16Val();
-        string& buffer = runtime.vars[1].value.stringVal();
+        string const& buffer = runtime.vars[1].value.constStringVal();
         uint16_t len = (runtime.vars.size() == 3 ? runtime.vars[2].value.toUInt32() : buffer.size());
         file->write(&buffer[0], len);
         return true;
@@ -977,19 +1373,19 @@ namespace fdv
       // STRING inireadstring(STRING filename, STRING key, STRING defaultValue)
       // STRING inireadstring(STRING filename, UINT32 position)
       // Reads value of key or position from specified ini file. To get position use findkey.
-      if (strcmp_P(funcName, PSTR("inireadstring"))==0)
+      case FUNC_INIREADSTRING:
       {
         if (runtime.vars.size() < 2)
           return false;
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
         // first overload
         if (runtime.vars[1].value.type() == Variant::STRING)
         {
           if (!checkParamsType(runtime, 2, Variant::STRING))
             return false;
-          result->stringVal() = ini.readString(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.stringVal().c_str());
+          result->stringVal() = ini.readString(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.constStringVal().c_str());
         }
         // second overload
         else if (runtime.vars[1].value.type() == Variant::UINT32)
@@ -1002,66 +1398,66 @@ namespace fdv
 
       // UINT8/16/32 inireaduint(STRING filename, STRING key, UINT defaultValue)
       // Reads value of key from specified ini file.
-      if (strcmp_P(funcName, PSTR("inireaduint"))==0)
+      case FUNC_INIREADUINT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        result->shrink( ini.readUInt32(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.toUInt32()) );
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        result->shrink( ini.readUInt32(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.toUInt32()) );
         return true;
       }
 
       // FLOAT inireadfloat(STRING filename, STRING key, FLOAT defaultValue)
       // Reads float value from specified ini file.
-      if (strcmp_P(funcName, PSTR("inireadfloat"))==0)
+      case FUNC_INIREADFLOAT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING) || !checkParamsType(runtime, 2, Variant::FLOAT))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        result->floatVal() = ini.readFloat(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.toFloat());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        result->floatVal() = ini.readFloat(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.toFloat());
         return true;
       }
 
       // iniwritestring(STRING filename, STRING key, STRING value)
       // Writes value of key to specified ini file
-      if (strcmp_P(funcName, PSTR("iniwritestring"))==0)
+      case FUNC_INIWRITESTRING:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING) || !checkParamsType(runtime, 2, Variant::STRING))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        ini.writeString(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        ini.writeString(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.constStringVal().c_str());
         return true;
       }
 
       // iniwriteuint(STRING filename, STRING key, UINT value)
       // Writes value of key to specified ini file
-      if (strcmp_P(funcName, PSTR("iniwriteuint"))==0)
+      case FUNC_INIWRITEUINT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING) || !checkParamsType(runtime, 2, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        ini.writeUInt32(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.toUInt32());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        ini.writeUInt32(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.toUInt32());
         return true;
       }
 
       // iniwritefloat(STRING filename, STRING key, FLOAT value)
       // Writes value of key to specified ini file
-      if (strcmp_P(funcName, PSTR("iniwritefloat"))==0)
+      case FUNC_INIWRITEFLOAT:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING) || !checkParamsType(runtime, 2, Variant::FLOAT))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        ini.writeFloat(runtime.vars[1].value.stringVal().c_str(), runtime.vars[2].value.toFloat());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        ini.writeFloat(runtime.vars[1].value.constStringVal().c_str(), runtime.vars[2].value.toFloat());
         return true;
       }
 
       // UINT32 inibypass(STRING filename, UINT position)
       // Bypasses key at specified position
-      if (strcmp_P(funcName, PSTR("inibypass"))==0)
+      case FUNC_INIBYPASS:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
         uint32_t pos = runtime.vars[1].value.toUInt32();
         ini.readString(&pos);
         result->uint32Val() = pos;
@@ -1070,12 +1466,12 @@ namespace fdv
 
       // iniremovekey(STRING filename, STRING key)
       // Removes all keys found
-      if (strcmp_P(funcName, PSTR("iniremovekey"))==0)
+      case FUNC_INIREMOVEKEY:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::STRING))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
-        ini.removeKey(runtime.vars[1].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
+        ini.removeKey(runtime.vars[1].value.constStringVal().c_str());
         return true;
       }
 
@@ -1093,35 +1489,35 @@ namespace fdv
       //     $"<p>KEY=$key VALUE=$value</p>";
       //     pos = inibypass(ini, pos);
       //   }
-      if (strcmp_P(funcName, PSTR("inifindkey"))==0)
+      case FUNC_INIFINDKEY:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT8 | Variant::UINT16 | Variant::UINT32) || !checkParamsType(runtime, 2, Variant::STRING) || !checkParamsType(runtime, 3, Variant::UINT8))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
         uint32_t pos = runtime.vars[1].value.toUInt32();
-        bool r = ini.findKey(&pos, runtime.vars[2].value.stringVal().c_str(), runtime.vars[3].value.toUInt32());
+        bool r = ini.findKey(&pos, runtime.vars[2].value.constStringVal().c_str(), runtime.vars[3].value.toUInt32());
         result->uint32Val() = r? pos : 0xFFFFFFFF;
         return true;
       }
 
       // STRING inireadkey(STRING filename, UINT position)
       // Reads key at position (use with inifindkey)
-      if (strcmp_P(funcName, PSTR("inireadkey"))==0)
+      case FUNC_INIREADKEY:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING) || !checkParamsType(runtime, 1, Variant::UINT8 | Variant::UINT16 | Variant::UINT32))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
         result->stringVal() = ini.readKey( runtime.vars[1].value.toUInt32() );
         return true;
       }
 
       // reloadevents(STRING filename)
       // Reloads events from specified ini file
-      if (strcmp_P(funcName, PSTR("reloadevents"))==0)
+      case FUNC_RELOADEVENTS:
       {
         if (!checkParamsType(runtime, 0, Variant::STRING))
           return false;
-        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.stringVal().c_str());
+        Ini ini(m_fileSystem->sdcard(), runtime.vars[0].value.constStringVal().c_str());
         ScriptScheduler<OutputType, LibraryType>::refresh(ini);
         return true;
       }
@@ -1136,7 +1532,7 @@ namespace fdv
 
       // UINT8 = rf_getlocalid()
       // Returns local device id
-      if (strcmp_P(funcName, PSTR("rf_getlocalid"))==0)
+      case FUNC_RF_GETLOCALID:
       {
         result->uint8Val() = WirelessRPC::localDeviceID();
         return true;
@@ -1146,7 +1542,7 @@ namespace fdv
       // Calls method METHOD_GET_TEMPERATURE.
       // Note: variation to METHOD_GET_TEMPERATURE, "temperature=numerator/denominator"
       // Returns 0 on failure, 1 on success.
-      if (strcmp_P(funcName, PSTR("rf_gettemp"))==0)
+      case FUNC_RF_GETTEMP:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::REFERENCE))
           return false;
@@ -1164,7 +1560,7 @@ namespace fdv
       // UINT8 = rf_getco(UINT8 deviceid, UINT16* co_low, UINT16* co_high)
       // Calls method METHOD_GET_CARBON_MONOXIDE.
       // Returns 0 on failure, 1 on success
-      if (strcmp_P(funcName, PSTR("rf_getco"))==0)
+      case FUNC_RF_GETCO:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::REFERENCE) || !checkParamsType(runtime, 2, Variant::REFERENCE))
           return false;
@@ -1183,7 +1579,7 @@ namespace fdv
       // UINT8 = rf_boilerset(UINT8 deviceid, UINT8 newstate)
       // Calls method METHOD_BOILER_ACTIVE.
       // Returns 0 on failure, 1 on success
-      if (strcmp_P(funcName, PSTR("rf_boilerset"))==0)
+      case FUNC_RF_BOILERSET:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::UINT8))
           return false;
@@ -1197,7 +1593,7 @@ namespace fdv
       // UINT8 = rf_boilerget(UINT8 deviceid, UINT8* currentstate)
       // Calls method METHOD_BOILER_QUERY.
       // Returns 0 on failure, 1 on success
-      if (strcmp_P(funcName, PSTR("rf_boilerget"))==0)
+      case FUNC_RF_BOILERGET:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::REFERENCE))
           return false;
@@ -1215,7 +1611,7 @@ namespace fdv
       // UINT8 = rf_getuptime(UINT8 deviceid, UINT32* uptime)
       // Calls method METHOD_SYSTEM_UPTIME.
       // Returns 0 on failure, 1 on success
-      if (strcmp_P(funcName, PSTR("rf_getuptime"))==0)
+      case FUNC_RF_GETUPTIME:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::REFERENCE))
           return false;
@@ -1235,7 +1631,7 @@ namespace fdv
       // frequency is in hz*10 (1=10hz, 10=100hz, 255=2550hz)
       // duration is in ms*10 (1=10ms, 10=100ms, 255=2550ms)
       // Returns 0 on failure, 1 on success
-      if (strcmp_P(funcName, PSTR("rf_buzzeralarm"))==0)
+      case FUNC_RF_BUZZERALARM:
       {
         if (!checkParamsType(runtime, 0, Variant::UINT8) || !checkParamsType(runtime, 1, Variant::UINT8) || !checkParamsType(runtime, 2, Variant::UINT8) || !checkParamsType(runtime, 3, Variant::UINT8))
           return false;
@@ -1251,6 +1647,7 @@ namespace fdv
 
 #endif // FDV_SCRIPT_SUPPORT_RFLINK
 
+      }
 
       return false;
     }
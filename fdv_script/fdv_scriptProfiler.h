@@ -0,0 +1,305 @@
+/*
+# Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com)
+# Copyright (c) 2013 Fabrizio Di Vittorio.
+# All rights reserved.
+
+# GNU GPL LICENSE
+#
+# This module is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; latest version thereof,
+# available at: <http://www.gnu.org/licenses/gpl.txt>.
+#
+# This module is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this module; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA
+*/
+
+
+
+
+#ifndef FDV_SCRIPTPROFILER_H_
+#define FDV_SCRIPTPROFILER_H_
+
+
+// Define FDV_SCRIPT_PROFILER (before including fdv_script.h) to enable the profiler.
+// When it is not defined this file is empty and no profiling code is generated.
+
+#ifdef FDV_SCRIPT_PROFILER
+
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "../fdv_generic/fdv_timesched.h"
+#include "../fdv_generic/fdv_string.h"
+
+
+
+namespace fdv
+{
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptProfiler
+  // Records, for each executed statement (identified by its script and its offset inside the
+  // script source), the execution count and the time (micros()) spent from its beginning to the
+  // beginning of the next statement. Statements of scripts executed by call() take their own time.
+  // Scripts are identified by file name (see Source), statements of scripts run without it (ie
+  // parseScript() of a TextInput) share the unnamed script.
+  // Records also calls count and time of each library function (time includes scripts executed
+  // by the function, ie call()).
+  // Tables have fixed size: statements and functions which don't fit are counted as "dropped".
+
+  struct ScriptProfiler
+  {
+
+    static uint8_t const MAXSTATEMENTS = 32;
+    static uint8_t const MAXFUNCS      = 16;
+    static uint8_t const MAXSCRIPTS    = 8;
+    static uint8_t const NAMESIZE      = 14;   // script names longer than 13 chars keep the last 13
+
+
+    struct Entry
+    {
+      uint16_t key;    // source offset or function ID
+      uint8_t  script; // script ID of a statement (0 = unnamed, 1... = Data::scripts[ID - 1])
+      uint16_t count;
+      uint32_t time;   // microseconds
+    };
+
+
+    // Statements executed while this object exists belong to the script "filename".
+    // Scripts which don't fit in the names table (MAXSCRIPTS) are counted as "dropped".
+    struct Source
+    {
+      explicit Source(char const* filename)
+        : m_saved(data().script)
+      {
+        data().script = scriptID(filename);
+      }
+      ~Source()
+      {
+        data().script = m_saved;
+      }
+    private:
+      uint8_t m_saved;
+    };
+
+
+    // Closes current statement while a script runs, then restores it: time of nested scripts
+    // is not added to the calling statement.
+    struct Scope
+    {
+      Scope()
+        : m_saved(enter())
+      {
+      }
+      ~Scope()
+      {
+        leave(m_saved);
+      }
+    private:
+      uint8_t m_saved;
+    };
+
+
+    // clears counters (script names and the running script are kept: scripts may be running)
+    static void reset()
+    {
+      Data& d = data();
+      d.statementsCount = 0;
+      d.funcsCount      = 0;
+      d.current         = NONE;
+      d.dropped         = 0;
+    }
+
+
+    // a statement at offset "pos" of the running script begins
+    static void statement(uint16_t pos)
+    {
+      Data& d = data();
+      close(d);
+      d.current = d.script == NONE? NONE : find(d.statements, &d.statementsCount, MAXSTATEMENTS, d.script, pos);
+      if (d.current == NONE)
+        ++d.dropped;
+      else
+        ++d.statements[d.current].count;
+    }
+
+
+    // a library function has been executed, taking "time" microseconds
+    static void function(uint16_t funcID, uint32_t time)
+    {
+      Data& d = data();
+      uint8_t i = find(d.funcs, &d.funcsCount, MAXFUNCS, 0, funcID);
+      if (i == NONE)
+      {
+        ++d.dropped;
+        return;
+      }
+      ++d.funcs[i].count;
+      d.funcs[i].time += time;
+    }
+
+
+    // Writes statements (script@offset, unnamed script is omitted) and functions sorted by
+    // time (descending), ie:
+    //   INDEX.HTM@120 10 5432
+    //   SUM.S@87 1 1200
+    //   @35 3 250
+    //   write 11 4000
+    // LibraryT must have "bool funcName(uint16_t funcID, char* name)" (name is 16 chars long).
+    template <typename OutputT, typename LibraryT>
+    static void dump(OutputT& output, LibraryT& library)
+    {
+      Data& d = data();
+      close(d);
+      output.write("script@offset count us\n");
+      dumpTable(output, library, d.statements, d.statementsCount, false);
+      output.write("function count us\n");
+      dumpTable(output, library, d.funcs, d.funcsCount, true);
+      output.write("dropped ");
+      output.write(toString(d.dropped).c_str());
+      output.write("\n");
+    }
+
+
+  private:
+
+    static uint8_t const NONE = 0xFF;
+
+
+    struct Data
+    {
+      Entry    statements[MAXSTATEMENTS];
+      Entry    funcs[MAXFUNCS];
+      char     scripts[MAXSCRIPTS][NAMESIZE];
+      uint8_t  statementsCount;
+      uint8_t  funcsCount;
+      uint8_t  scriptsCount;
+      uint8_t  current;      // index inside statements (valid if < statementsCount)
+      uint8_t  script;       // running script ID (NONE = not in the names table)
+      uint32_t start;        // micros() when current statement has begun
+      uint16_t dropped;
+    };
+
+
+    // zero initialized (current=0 is not valid until a statement is added, script=0 is unnamed)
+    static Data& data()
+    {
+      static Data s_data;
+      return s_data;
+    }
+
+
+    // adds elapsed time to current statement
+    static void close(Data& d)
+    {
+      uint32_t now = micros();
+      if (d.current < d.statementsCount)
+        d.statements[d.current].time += now - d.start;
+      d.start = now;
+    }
+
+
+    static uint8_t enter()
+    {
+      Data& d = data();
+      close(d);
+      uint8_t saved = d.current;
+      d.current = NONE;
+      return saved;
+    }
+
+
+    static void leave(uint8_t saved)
+    {
+      Data& d = data();
+      close(d);
+      d.current = saved;
+    }
+
+
+    // returns the ID of "filename", adding it to the names table if necessary (NONE if the table is full)
+    // note: file names are not case sensitive, root directory can be omitted
+    static uint8_t scriptID(char const* filename)
+    {
+      if (*filename == '/')
+        ++filename;
+      size_t len = strlen(filename);
+      if (len >= NAMESIZE)
+        filename += len - (NAMESIZE - 1);
+      Data& d = data();
+      for (uint8_t i = 0; i != d.scriptsCount; ++i)
+        if (strcasecmp(d.scripts[i], filename) == 0)
+          return i + 1;
+      if (d.scriptsCount == MAXSCRIPTS)
+        return NONE;
+      strcpy(d.scripts[d.scriptsCount], filename);
+      return ++d.scriptsCount;
+    }
+
+
+    // returns the entry with "script" and "key", adding it if necessary (returns NONE if table is full)
+    static uint8_t find(Entry* table, uint8_t* count, uint8_t maxCount, uint8_t script, uint16_t key)
+    {
+      for (uint8_t i = 0; i != *count; ++i)
+        if (table[i].key == key && table[i].script == script)
+          return i;
+      if (*count == maxCount)
+        return NONE;
+      table[*count].key    = key;
+      table[*count].script = script;
+      table[*count].count  = 0;
+      table[*count].time   = 0;
+      return (*count)++;
+    }
+
+
+    template <typename OutputT, typename LibraryT>
+    static void dumpTable(OutputT& output, LibraryT& library, Entry const* table, uint8_t count, bool funcs)
+    {
+      // sort indexes by time (insertion sort, tables are small)
+      uint8_t order[MAXSTATEMENTS > MAXFUNCS ? MAXSTATEMENTS : MAXFUNCS];
+      for (uint8_t i = 0; i != count; ++i)
+      {
+        uint8_t j = i;
+        for (; j > 0 && table[order[j - 1]].time < table[i].time; --j)
+          order[j] = order[j - 1];
+        order[j] = i;
+      }
+      for (uint8_t i = 0; i != count; ++i)
+      {
+        Entry const& e = table[order[i]];
+        char name[16];
+        if (funcs && library.funcName(e.key, name))
+          output.write(name);
+        else
+        {
+          if (!funcs && e.script != 0)
+            output.write(data().scripts[e.script - 1]);
+          output.write(funcs? "#" : "@");
+          output.write(toString(e.key).c_str());
+        }
+        output.write(" ");
+        output.write(toString(e.count).c_str());
+        output.write(" ");
+        output.write(toString(e.time).c_str());
+        output.write("\n");
+      }
+    }
+
+  };
+
+
+} // end of fdv namespace
+
+
+#endif // FDV_SCRIPT_PROFILER
+
+#endif /* FDV_SCRIPTPROFILER_H_ */
@@ -26,24 +26,189 @@
 #define FDV_SCRIPTSCHEDULE_H_
 
 
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "../fdv_generic/fdv_algorithm.h"
+#include "../fdv_generic/fdv_datetime.h"
 #include "../fdv_sdlib/fdv_sdcard.h"
 #include "../fdv_sdlib/fdv_ini.h"
 #include "../fdv_script/fdv_script.h"
+#include "../fdv_script/fdv_scriptCache.h"
 
 #include <util/atomic.h>
 
 
+// max number of scheduled scripts (53 bytes of RAM each)
+#ifndef FDV_SCRIPT_MAXTASKS
+#define FDV_SCRIPT_MAXTASKS 10
+#endif
+
+// bytes allocated by each running script for its variables and values (see Arena), so they
+// don't fragment the heap. 0 = use the heap. See ScriptScheduler::arenaHighWater to size it.
+#ifndef FDV_SCRIPT_ARENA
+#define FDV_SCRIPT_ARENA 0
+#endif
+
+
 
 namespace fdv
 {
 
-  // sizeof(ScriptTask) = 59
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptSchedule
+  // Parsed form of a schedule (see ScriptScheduler::refresh() for the syntax).
+  // Date/time schedules are stored as a range and a step for each field.
+  // sizeof(ScriptSchedule) = 24
+
+  struct ScriptSchedule
+  {
+
+    enum { SECOND, MINUTE, HOUR, DAY, MONTH, DAYOFWEEK, FIELDS };
+
+    static uint32_t const NEVER = 0xFFFFFFFF;
+
+    struct Field
+    {
+      uint8_t from;
+      uint8_t to;
+      uint8_t step;
+
+      bool match(uint8_t value) const
+      {
+        return value >= from && value <= to && (value - from) % step == 0;
+      }
+
+      // returns first matching value >= "value" or 0xFF
+      uint8_t nextMatch(uint8_t value) const
+      {
+        if (value < from)
+          return from;
+        uint8_t v = from + (value - from + step - 1) / step * step;
+        return v <= to? v : 0xFF;
+      }
+    };
+
+    uint32_t interval;         // seconds between executions (0 = date/time schedule)
+    uint16_t year;             // 0 = any
+    Field    fields[FIELDS];
+
+
+    // Parses a schedule:
+    //   seconds                   ie "2"
+    //   DD/MM/YYYY HH:MM:SS       ie "../../.... 14:00:00" (each field can be "..", "...." for year)
+    //   S M H D M W               ie "0 */5 8-18 * * 1-5" (cron style, each field can be "*", "n", "a-b" followed by "/step")
+    // returns false on syntax errors
+    bool parse(char const* str)
+    {
+      static uint8_t const LIMITS[FIELDS][2] PROGMEM = { {0, 59}, {0, 59}, {0, 23}, {1, 31}, {1, 12}, {0, 6} };
+      interval = 0;
+      year = 0;
+      for (uint8_t i = 0; i != FIELDS; ++i)
+      {
+        fields[i].from = pgm_read_byte(&LIMITS[i][0]);
+        fields[i].to   = pgm_read_byte(&LIMITS[i][1]);
+        fields[i].step = 1;
+      }
+
+      // DD/MM/YYYY HH:MM:SS
+      // 0123456789012345678
+      if (strlen(str)==19 && str[2]=='/' && str[5]=='/' && str[10]==' ' && str[13]==':' && str[16]==':')
+      {
+        static uint8_t const OFFSETS[] PROGMEM = { 17, 14, 11, 0, 3 };  // SECOND...MONTH
+        for (uint8_t i = 0; i != DAYOFWEEK; ++i)
+        {
+          char const* t = str + pgm_read_byte(&OFFSETS[i]);
+          if (*t != '.')
+            fields[i].from = fields[i].to = strtoul(t, NULL, 10);
+        }
+        if (str[6] != '.')
+          year = strtoul(str + 6, NULL, 10);
+        return true;
+      }
+
+      // seconds
+      if (strchr(str, ' ') == NULL)
+      {
+        interval = strtoul(str, NULL, 10);
+        return interval > 0;
+      }
+
+      // S M H D M W
+      for (uint8_t i = 0; i != FIELDS; ++i)
+      {
+        while (*str == ' ')
+          ++str;
+        Field& f = fields[i];
+        if (*str == '*')
+          ++str;
+        else if (isdigit(*str))
+        {
+          f.from = f.to = strtoul(str, (char**)&str, 10);
+          if (*str == '-')
+            f.to = strtoul(str + 1, (char**)&str, 10);
+        }
+        else
+          return false;
+        if (*str == '/')
+        {
+          if (f.from == f.to)
+            f.to = pgm_read_byte(&LIMITS[i][1]);  // "n/step" = from n to the end
+          f.step = strtoul(str + 1, (char**)&str, 10);
+        }
+        if (f.step == 0 || f.from > f.to || f.from < pgm_read_byte(&LIMITS[i][0]) || f.to > pgm_read_byte(&LIMITS[i][1])
+          || (*str != ' ' && *str != 0))
+          return false;
+      }
+      return true;
+    }
+
+
+    // returns the first date/time (unix timestamp) after "now" which matches the schedule (NEVER if none)
+    uint32_t next(uint32_t now) const
+    {
+      if (interval)
+        return now + interval;
+      uint32_t t = now + 1;
+      for (uint16_t i = 0; i != 1000; ++i)  // a matching day is found within few years
+      {
+        DateTime dt(t);
+        uint8_t v;
+        if (year && dt.year != year)
+        {
+          if (dt.year > year)
+            return NEVER;
+          t = DateTime(1, 1, year, 0, 0, 0).getUnixDateTime();
+        }
+        else if (!fields[MONTH].match(dt.month))
+          t = (dt.month == 12? DateTime(1, 1, dt.year + 1, 0, 0, 0) : DateTime(1, dt.month + 1, dt.year, 0, 0, 0)).getUnixDateTime();
+        else if (!fields[DAY].match(dt.day) || !fields[DAYOFWEEK].match(dt.dayOfWeek()))
+          t = t / 86400 * 86400 + 86400;  // next day
+        else if ((v = fields[HOUR].nextMatch(dt.hours)) != dt.hours)
+          t = t / 86400 * 86400 + (v == 0xFF? 86400 : v * 3600UL);
+        else if ((v = fields[MINUTE].nextMatch(dt.minutes)) != dt.minutes)
+          t = t / 3600 * 3600 + (v == 0xFF? 3600 : v * 60UL);
+        else if ((v = fields[SECOND].nextMatch(dt.seconds)) != dt.seconds)
+          t = t / 60 * 60 + (v == 0xFF? 60 : v);
+        else
+          return t;
+      }
+      return NEVER;
+    }
+
+  };
+
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // ScriptTask
+  // sizeof(ScriptTask) = 53
+
   struct ScriptTask
   {
-    char eventKey[18];       // the same of configuration file
-    char eventValue[33];     // the same of configuration file
-    uint32_t last_datetime;  // last execution (unix timestamp)
-    uint32_t next_datetime;  // programmed next datetime (unix timestamp)
+    char           name[11];       // configuration key without "script_"
+    char           filename[14];
+    uint32_t       next_datetime;  // programmed next datetime (unix timestamp)
+    ScriptSchedule schedule;
   };
 
 
@@ -51,10 +216,57 @@ namespace fdv
   struct ScriptScheduler
   {
 
-    static uint8_t const MAXTASKS = 10;   // 590 bytes of RAM!
+    typedef RunTime<OutputT, LibraryT> RunTimeT;
+
+    static uint8_t const  MAXTASKS    = FDV_SCRIPT_MAXTASKS;
+    static uint8_t const  MAXJOBS     = 2;    // scripts running at the same time
+    static uint16_t const SLICEPERIOD = 20;   // ms between two slices of running scripts
+    static uint16_t const SLICESTEPS  = 500;  // max instructions executed by a script in one slice (user functions included)
+    static uint16_t const SLICEMILLIS = 10;   // max ms taken by a script in one slice
+    static uint16_t const ARENASIZE   = FDV_SCRIPT_ARENA;
+
+
+    // A running (compiled) script. It is executed a slice at a time (see ScriptVM::resume()),
+    // so other tasks (ie networking) are not blocked until it ends.
+    // Script allocations are done inside "arena", released in one step with the job.
+    struct Job
+    {
+      Job(SDCard* sdcard, uint8_t taskIndex_)
+        : arena(ARENASIZE),
+          taskIndex(taskIndex_),
+          fileSystem(sdcard),
+          file(fileSystem, tasks[taskIndex_].filename, File::MD_READ),
+          input(&file),
+          library(&fileSystem),
+          runTime(NULL, &library, NULL), // TODO: setting Socket=NULL will cause crash when scripts generates output
+          vm(NULL)
+      {
+      }
+
+      ~Job()
+      {
+        delete vm;
+        arenaHighWater = max(arenaHighWater, arena.highWater());
+      }
+
+      Arena                   arena;  // first: destroyed after objects allocated from it
+      uint8_t                 taskIndex;
+      FileSystem              fileSystem;
+      File                    file;
+      BufferedFileInput       input;
+      LibraryT                library;
+      RunTimeT                runTime;
+      ScriptCode              code;
+      ScriptVM<RunTimeT>*     vm;
+    };
+
+
     static ScriptTask    tasks[MAXTASKS];
     static uint8_t       taskCount;
+    static uint8_t       heap[MAXTASKS];  // indexes of tasks, min-heap ordered by next_datetime
     static SDCard*       sdcard;
+    static Job*          jobs[MAXJOBS];
+    static uint16_t      arenaHighWater;  // max arena bytes used by a script (see FDV_SCRIPT_ARENA)
 
 
     static void init(SDCard* sdcard_)
@@ -62,6 +274,7 @@ namespace fdv
       taskCount = 0;
       sdcard = sdcard_;
       TaskManager::add(1000, exec, NULL, false);
+      TaskManager::add(SLICEPERIOD, execSlice, NULL, false);
     }
 
 
@@ -77,28 +290,44 @@ namespace fdv
     * Every date/time match:
     *   KEY   = script_(name)
     *   VALUE = (scriptfilename);DD/MM/YYYY HH:MM:SS
-    *   Notes: every field can be ".." or "...." for "don't care". ".." must be placed from left to right.
-    *   Valid Example:   KEY="script_pippo"  VALUE="pippo;../../.... 14:00:00"   -> Execute file "pippo" whenever time is "14:00:00"
-    *   Invalid example: KEY="script_pippo"  VALUE="pippo;../../.... 14:..:.."   -> WRONG!!
+    *   Notes: every field can be ".." or "...." for "don't care".
+    *   Example:   KEY="script_pippo"  VALUE="pippo;../../.... 14:00:00"   -> Execute file "pippo" whenever time is "14:00:00"
+    *
+    *
+    * Cron style:
+    *   KEY   = script_(name)
+    *   VALUE = (scriptfilename);(seconds) (minutes) (hours) (day) (month) (dayofweek)
+    *   Notes: every field can be "*" (any), "n", "a-b" (range), optionally followed by "/step". dayofweek: 0=sunday...6=saturday
+    *   Example:   KEY="script_pippo"  VALUE="pippo;0 0/15 8-18 * * 1-5"   -> Execute file "pippo" every 15 minutes from 8:00 to 18:45, monday to friday
     *
     * Notes:
     *   (name) = max 10 characters
     *   (scriptfilename) = max 13 characters
     *   (seconds) = max 32 bit unsigned
+    *   Events with invalid schedule or names are ignored.
     *   No need to synchronize taskCount because tasks are executed out of interrupts
     */
     static void refresh(Ini& ini)
     {
       taskCount = 0;
+      uint32_t const now = DateTime::now().getUnixDateTime();
       uint32_t pos = 0;
       while (ini.findKey(&pos, "script_", false) && taskCount<MAXTASKS)
       {
         ScriptTask& task = tasks[taskCount];
-        strcpy(task.eventKey, ini.readKey(pos).c_str());
-        strcpy(task.eventValue, ini.readString(&pos).c_str());
-        *strchr(task.eventValue, ';') = 0;  // replaces ";" with \0
-        task.last_datetime = DateTime::now().getUnixDateTime();  // TODO: whenever events are refreshed this is resetted, even the event has not fired now!
-        task.next_datetime = decodeTimeToExecute(taskCount, DateTime::now());
+        string const key   = ini.readKey(pos);
+        string const value = ini.readString(&pos);
+        char const* sep = strchr(value.c_str(), ';');
+        uint8_t nameLen = key.size() - 7;  // bypass "script_"
+        uint8_t filenameLen = sep - value.c_str();
+        if (sep == NULL || nameLen >= sizeof(task.name) || filenameLen >= sizeof(task.filename) || !task.schedule.parse(sep + 1))
+          continue;
+        memcpy(task.name, key.c_str() + 7, nameLen + 1);
+        memcpy(task.filename, value.c_str(), filenameLen);
+        task.filename[filenameLen] = 0;
+        task.next_datetime = task.schedule.next(now);
+        heap[taskCount] = taskCount;
+        siftUp(taskCount);
         ++taskCount;
       }
     }
@@ -112,73 +341,140 @@ namespace fdv
 
   private:
 
-    // the scripts executor
+    // the scripts executor: starts scripts which are due (the first one is on top of the heap)
     static void exec(uint8_t)
     {
-      bool doloop = true;
-      while (doloop)
+      uint32_t const now = DateTime::now().getUnixDateTime();
+      while (taskCount > 0 && now >= tasks[heap[0]].next_datetime)
       {
-        doloop = false;
-        for (uint8_t i=0; i<taskCount; ++i)
+        uint8_t i = heap[0];
+        bool running = isRunning(i);  // still running from last time: skip this execution
+        uint8_t j = freeJob();
+        if (!running && j == MAXJOBS)
+          break; // no free job: try again on next tick
+        //debug << "i=" << uint16_t(i) << " now=" << DateTime::now() << "  timetoexec=" << DateTime(tasks[i].next_datetime) << ENDL;
+        tasks[i].next_datetime = tasks[i].schedule.next(now); // set before because tasks[i] could be invalid if script calls reloadevents()
+        siftDown(0);
+        if (!running)
+          startScript(i, j);
+      }
+    }
+
+
+    // executes a slice of each running script (round robin)
+    static void execSlice(uint8_t)
+    {
+      for (uint8_t j=0; j<MAXJOBS; ++j)
+      {
+        Job* job = jobs[j];
+        if (job == NULL)
+          continue;
+        typename ScriptVM<RunTimeT>::Status status;
         {
-          //debug << "i=" << uint16_t(i) << ENDL;
-          DateTime const now_dt = DateTime::now();
-          uint32_t const now = now_dt.getUnixDateTime();
-          if (now >= tasks[i].next_datetime)
-          {
-            // execute script
-            //debug << "i=" << uint16_t(i) << " now=" << DateTime::now() << "  timetoexec=" << DateTime(tasks[i].next_datetime) << ENDL;
-            tasks[i].last_datetime = now; // set before because tasks[i] could be invalid if script calls reloadevents()
-            tasks[i].next_datetime = decodeTimeToExecute(i, now_dt);
-            execScript(i);
-            doloop = true;  // restart loop
-          }
+          Arena::Scope arenaScope(&job->arena);
+#ifdef FDV_SCRIPT_PROFILER
+          ScriptProfiler::Source profilerSource(tasks[job->taskIndex].filename);
+#endif
+          status = job->vm->resume(SLICESTEPS, SLICEMILLIS);
+        }
+        if (status != ScriptVM<RunTimeT>::RUN_SUSPENDED)
+        {
+          if (status == ScriptVM<RunTimeT>::RUN_ERROR)
+            Log::add(string("Script error: ") + job->runTime.getVariableValue("ScriptFileName")->toString());
+          jobs[j] = NULL;
+          delete job;
         }
       }
     }
 
 
-    // returns unix timestamp
-    static uint32_t decodeTimeToExecute(uint8_t taskIndex, DateTime const& now)
+    static bool before(uint8_t heapIndex1, uint8_t heapIndex2)
     {
-      char const* t = strchr(tasks[taskIndex].eventValue, 0) +1;
-      // DD/MM/YYYY HH:MM:SS
-      // 0123456789012345678
-      if (strlen(t)==19 && t[2]=='/' && t[5]=='/' && t[10]==' ' && t[13]==':' && t[16]==':')
+      return tasks[heap[heapIndex1]].next_datetime < tasks[heap[heapIndex2]].next_datetime;
+    }
+
+
+    static void siftUp(uint8_t i)
+    {
+      while (i > 0 && before(i, (i - 1) / 2))
       {
-        // datetime specified
-        uint8_t  dd = (t[0]  != '.') ? strtoul(&t[0],  NULL, 10) : now.day;
-        uint8_t  mm = (t[3]  != '.') ? strtoul(&t[3],  NULL, 10) : now.month;
-        uint16_t yy = (t[6]  != '.') ? strtoul(&t[6],  NULL, 10) : now.year;
-        uint8_t  hh = (t[11] != '.') ? strtoul(&t[11], NULL, 10) : now.hours;
-        uint8_t  mi = (t[14] != '.') ? strtoul(&t[14], NULL, 10) : now.minutes;
-        uint8_t  ss = (t[17] != '.') ? strtoul(&t[17], NULL, 10) : now.seconds;
-        return DateTime(dd, mm, yy, hh, mi, ss).getUnixDateTime();
+        swap(heap[i], heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
       }
-      else
+    }
+
+
+    static void siftDown(uint8_t i)
+    {
+      for (;;)
       {
-        // seconds specified
-        return tasks[taskIndex].last_datetime + strtoul(&t[0], NULL, 10);
+        uint8_t m = i;
+        uint8_t c = 2 * i + 1;
+        if (c < taskCount && before(c, m))
+          m = c;
+        if (c + 1 < taskCount && before(c + 1, m))
+          m = c + 1;
+        if (m == i)
+          break;
+        swap(heap[i], heap[m]);
+        i = m;
       }
     }
 
 
-    static void execScript(uint8_t taskIndex)
+    // returns MAXJOBS if all jobs are running
+    static uint8_t freeJob()
     {
-      //debug << "ScriptScheduler::execScript " << tasks[taskIndex].eventKey << ENDL;
-      FileSystem fileSystem(sdcard);
-      File file(fileSystem, tasks[taskIndex].eventValue, File::MD_READ);
-      if (file.isOpen())
+      uint8_t j = 0;
+      while (j < MAXJOBS && jobs[j] != NULL)
+        ++j;
+      return j;
+    }
+
+
+    static bool isRunning(uint8_t taskIndex)
+    {
+      for (uint8_t j=0; j<MAXJOBS; ++j)
+        if (jobs[j] && jobs[j]->taskIndex == taskIndex)
+          return true;
+      return false;
+    }
+
+
+    // Compiles the script and puts it in jobs[jobIndex] (executed by execSlice()).
+    // Scripts which cannot be compiled are directly executed now (see parseScriptFile()).
+    static void startScript(uint8_t taskIndex, uint8_t jobIndex)
+    {
+      //debug << "ScriptScheduler::startScript " << tasks[taskIndex].name << ENDL;
+      Job* job = new Job(sdcard, taskIndex);
+      if (job == NULL)
+        return;
+      if (job->file.isOpen())
       {
-        BufferedFileInput input(&file);
-        LibraryT library(&fileSystem);
-        RunTime<OutputT, LibraryT> globalRunTime(NULL, &library, NULL); // TODO: setting Socket=NULL will cause crash when scripts generates output
-        globalRunTime.addVariable( Variable("ScriptName", Variant(tasks[taskIndex].eventKey)) );
-        globalRunTime.addVariable( Variable("ScriptFileName", Variant(tasks[taskIndex].eventValue)) );
-        if (!parseScript(&globalRunTime, &input))
-          Log::add(string("Script error: ") + tasks[taskIndex].eventValue);
+        Arena::Scope arenaScope(&job->arena);
+        char const* filename = tasks[taskIndex].filename;
+        job->runTime.addVariable( Variable("ScriptName", Variant(string("script_") + tasks[taskIndex].name)) );
+        job->runTime.addVariable( Variable("ScriptFileName", Variant(filename)) );
+        if (ScriptCache::get<RunTimeT>(job->fileSystem, filename, job->file, &job->input, &job->code))
+        {
+          job->vm = new ScriptVM<RunTimeT>(&job->runTime, &job->input, &job->code);
+          if (job->vm)
+          {
+            jobs[jobIndex] = job;
+            return;
+          }
+        }
+        else
+        {
+#ifdef FDV_SCRIPT_PROFILER
+          ScriptProfiler::Source profilerSource(filename);
+#endif
+          job->input.pos(0);
+          if (!Script<RunTimeT>(&job->runTime, &job->input).parse_script())
+            Log::add(string("Script error: ") + filename);
+        }
       }
-      debug << "  end" << ENDL;
+      delete job;
     }
 
 
@@ -189,7 +485,10 @@ namespace fdv
   // ScriptScheduler class storage
   template <typename OutputT, typename LibraryT> ScriptTask ScriptScheduler<OutputT, LibraryT>::tasks[MAXTASKS];
   template <typename OutputT, typename LibraryT> uint8_t    ScriptScheduler<OutputT, LibraryT>::taskCount;
+  template <typename OutputT, typename LibraryT> uint8_t    ScriptScheduler<OutputT, LibraryT>::heap[MAXTASKS];
   template <typename OutputT, typename LibraryT> SDCard*    ScriptScheduler<OutputT, LibraryT>::sdcard;
+  template <typename OutputT, typename LibraryT> typename ScriptScheduler<OutputT, LibraryT>::Job* ScriptScheduler<OutputT, LibraryT>::jobs[MAXJOBS];
+  template <typename OutputT, typename LibraryT> uint16_t   ScriptScheduler<OutputT, LibraryT>::arenaHighWater;
 
 
 } // end of fdv namespace
@@ -34,8 +34,105 @@
 namespace fdv
 {
 
+  struct Variant;
+
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // VariantMap
+  // Items of a MAP Variant: values indexed by string keys, kept in insertion order.
+  // Keys are found through a small open addressing hash table (linear probing) which holds item
+  // indexes and is kept at most half full. erase() rebuilds the table.
+  // Members which need a complete Variant are defined after it.
+
+  class VariantMap
+  {
+
+    static uint8_t const EMPTY = 0xFF;
+
+  public:
+
+    static uint8_t const MAXITEMS = 254;
+
+
+    uint16_t size() const
+    {
+      return m_keys.size();
+    }
+
+    string const& key(uint16_t index) const
+    {
+      return m_keys[index];
+    }
+
+    Variant&       value(uint16_t index);
+    Variant const& value(uint16_t index) const;
+
+    bool contains(char const* key) const
+    {
+      return indexOf(key) != EMPTY;
+    }
+
+    // returns NULL if not found
+    Variant* find(char const* key);
+
+    // returns the value of "key" (INVALID when just added), NULL if the map is full
+    Variant* insert(char const* key);
+
+    bool erase(char const* key);
+
+    // same keys with same values (in any order)
+    bool operator==(VariantMap const& rhs) const;
+
+
+  private:
+
+    static uint16_t hash(char const* key)
+    {
+      uint16_t h = 5381;
+      for (; *key; ++key)
+        h = (h << 5) + h + *key;
+      return h;
+    }
+
+    // returns the slot of "key" or the empty slot where it should be added
+    uint16_t slot(char const* key) const
+    {
+      uint16_t mask = m_slots.size() - 1;
+      uint16_t i = hash(key) & mask;
+      while (m_slots[i] != EMPTY && strcmp(m_keys[m_slots[i]].c_str(), key) != 0)
+        i = (i + 1) & mask;
+      return i;
+    }
+
+    // returns the item index of "key" or EMPTY
+    uint8_t indexOf(char const* key) const
+    {
+      return m_slots.size() == 0? EMPTY : m_slots[slot(key)];
+    }
+
+    void rehash(uint16_t slotsCount)
+    {
+      m_slots.assign(slotsCount, uint8_t(EMPTY));
+      for (uint8_t i = 0; i != m_keys.size(); ++i)
+        m_slots[slot(m_keys[i].c_str())] = i;
+    }
+
+
+  private:
+
+    vector<string>  m_keys;
+    vector<Variant> m_values;
+    vector<uint8_t> m_slots;  // item index or EMPTY, size is a power of two
+  };
+
+
+
   ///////////////////////////////////////////////////////////////////////////////////////////////
   // Variant
+  // STRING, ARRAY and MAP values are reference counted and shared among copies (copy on write):
+  // copying a Variant never allocates, stringVal(), arrayVal() and mapVal() make the value unique
+  // before returning a modifiable reference. Use constStringVal(), constArrayVal() and
+  // constMapVal() for read only access.
 
   struct Variant
   {
@@ -48,7 +145,9 @@ namespace fdv
       FLOAT     = 0b00010000, // 16
       UINT8     = 0b00100000, // 32
       UINT16    = 0b01000000, // 64
-      UINT32    = 0b10000000  // 128
+      UINT32    = 0b10000000, // 128
+      INT32     = 0b100000000, // 256
+      MAP       = 0b1000000000 // 512
     };
 
     Variant() :
@@ -62,17 +161,17 @@ namespace fdv
       }
 
       explicit Variant(char const* value) :
-      m_type(STRING), m_stringVal(new string(value))
+      m_type(STRING), m_stringVal(new SharedString(value))
       {
       }
 
       explicit Variant(string const& value) :
-      m_type(STRING), m_stringVal(new string(value))
+      m_type(STRING), m_stringVal(new SharedString(value))
       {
       }
 
       explicit Variant(vector<Variant> const& value) :
-      m_type(ARRAY), m_arrayVal(new vector<Variant>(value))
+      m_type(ARRAY), m_arrayVal(new SharedArray(value))
       {
       }
 
@@ -101,26 +200,21 @@ namespace fdv
       {
       }
 
+      explicit Variant(int32_t value) :
+      m_type(INT32), m_int32Val(value)
+      {
+      }
+
       Variant(Variant const& c) :
-      m_type(c.m_type)
+      m_type(INVALID)
       {
-        switch (m_type)
-        {
-        case STRING:
-          m_stringVal = new string(*c.m_stringVal);
-          break;
-        case ARRAY:
-          m_arrayVal = new vector<Variant>(*c.m_arrayVal);
-          break;
-        default:
-          m_uint32Val = c.m_uint32Val; // copies largest value
-          break;
-        }
+        share(c);
       }
 
       ~Variant()
       {
-        clear();
+        if (m_type & (STRING | ARRAY | MAP))  // only shared values need to be released
+          clear();
       }
 
       uint16_t size()
@@ -130,9 +224,11 @@ namespace fdv
         case REFERENCE:
           return sizeof(Variant*);
         case ARRAY:
-          return m_arrayVal->size();
+          return m_arrayVal->value.size();
+        case MAP:
+          return m_mapVal->value.size();
         case STRING:
-          return m_stringVal->size();
+          return m_stringVal->value.size();
         case FLOAT:
           return sizeof(m_floatVal);
         case UINT8:
@@ -141,6 +237,8 @@ namespace fdv
           return sizeof(uint16_t);
         case UINT32:
           return sizeof(uint32_t);
+        case INT32:
+          return sizeof(int32_t);
         default:
           return 0;
         }
@@ -148,20 +246,10 @@ namespace fdv
 
       void operator=(Variant const& c)
       {
+        // "c" could be an item of the array being released
+        Variant t(c);
         clear();
-        m_type = c.m_type;
-        switch (m_type)
-        {
-        case STRING:
-          m_stringVal = new string(*c.m_stringVal);
-          break;
-        case ARRAY:
-          m_arrayVal = new vector<Variant>(*c.m_arrayVal);
-          break;
-        default:
-          m_uint32Val = c.m_uint32Val; // copies largest value
-          break;
-        }
+        share(t);
       }
 
       void operator=(bool v)
@@ -171,10 +259,12 @@ namespace fdv
 
       void clear()
       {
-        if (m_type==STRING)
+        if (m_type==STRING && --m_stringVal->refCount == 0)
           delete m_stringVal;
-        else if (m_type==ARRAY)
+        else if (m_type==ARRAY && --m_arrayVal->refCount == 0)
           delete m_arrayVal;
+        else if (m_type==MAP && --m_mapVal->refCount == 0)
+          delete m_mapVal;
         m_type = INVALID;
       }
 
@@ -193,10 +283,13 @@ namespace fdv
           switch (m_type)
           {
           case STRING:
-            m_stringVal = new string;
+            m_stringVal = new SharedString;
             break;
           case ARRAY:
-            m_arrayVal = new vector<Variant>;
+            m_arrayVal = new SharedArray;
+            break;
+          case MAP:
+            m_mapVal = new SharedMap;
             break;
           default:
             m_uint32Val = 0;  // init largest value
@@ -210,6 +303,88 @@ namespace fdv
 
   private:
 
+    template <typename T>
+    struct Shared
+    {
+      Shared() :
+        refCount(1)
+      {
+      }
+
+      explicit Shared(T const& value_) :
+        refCount(1), value(value_)
+      {
+      }
+
+      // from the active Arena, if any (see allocItems())
+      static void* operator new(size_t size)
+      {
+        return allocItems<uint8_t>(size);
+      }
+
+      static void operator delete(void* ptr)
+      {
+        freeItems(ptr);
+      }
+
+      uint16_t refCount;
+      T        value;
+    };
+
+    typedef Shared<string>          SharedString;
+    typedef Shared< vector<Variant> > SharedArray;
+    typedef Shared<VariantMap>      SharedMap;
+
+
+    // "this" must be INVALID
+    void share(Variant const& c)
+    {
+      m_type = c.m_type;
+      switch (m_type)
+      {
+      case STRING:
+        m_stringVal = c.m_stringVal;
+        ++m_stringVal->refCount;
+        break;
+      case ARRAY:
+        m_arrayVal = c.m_arrayVal;
+        ++m_arrayVal->refCount;
+        break;
+      case MAP:
+        m_mapVal = c.m_mapVal;
+        ++m_mapVal->refCount;
+        break;
+      case REFERENCE:
+        m_refVal = c.m_refVal;
+        break;
+      default:
+        m_uint32Val = c.m_uint32Val; // copies largest value
+        break;
+      }
+    }
+
+
+    // makes an own copy of a shared value before modifying it
+    void unshare()
+    {
+      if (m_type==STRING && m_stringVal->refCount > 1)
+      {
+        --m_stringVal->refCount;
+        m_stringVal = new SharedString(m_stringVal->value);
+      }
+      else if (m_type==ARRAY && m_arrayVal->refCount > 1)
+      {
+        --m_arrayVal->refCount;
+        m_arrayVal = new SharedArray(m_arrayVal->value);
+      }
+      else if (m_type==MAP && m_mapVal->refCount > 1)
+      {
+        --m_mapVal->refCount;
+        m_mapVal = new SharedMap(m_mapVal->value);
+      }
+    }
+
+
 #if defined(__AVR__)
 
     template <typename T>
@@ -230,32 +405,42 @@ namespace fdv
 
 #endif
 
+    // appends a string literal
+    static void appendQuoted(string& ret, char const* str)
+    {
+      ret.push_back('\"');
+      for (; *str; ++str)
+      {
+        if (*str=='\"')
+        {
+          ret.push_back('\\');
+          ret.push_back('\"');
+        }
+        else
+          ret.push_back(*str);
+      }
+      ret.push_back('\"');
+    }
+
+    // array or map item (strings are quoted)
+    static void appendItem(string& ret, Variant const& item)
+    {
+      if (item.type() == STRING)
+        appendQuoted(ret, item.constStringVal().c_str());
+      else
+        ret.append(item.toString());
+    }
+
     // note: convert to a dynamic array (array initialization)
-    static string const toString(vector<Variant>& a)
+    static string const toString(vector<Variant> const& a)
     {
       string ret;
       ret.push_back('{');
       if (a.size() > 0)
       {
-        for (vector<Variant>::iterator i=a.begin(); i!=a.end(); ++i)
+        for (vector<Variant>::const_iterator i=a.begin(); i!=a.end(); ++i)
         {
-          if (i->type() == STRING)
-          {
-            ret.push_back('\"');
-            for (char const* j=&i->stringVal()[0]; *j; ++j)
-            {
-              if (*j=='\"')
-              {
-                ret.push_back('\\');
-                ret.push_back('\"');
-              }
-              else
-                ret.push_back(*j);
-            }
-            ret.push_back('\"');
-          }
-          else
-            ret.append(i->toString());
+          appendItem(ret, *i);
           if (i!=a.end()-1)
             ret.push_back(',');
         }
@@ -264,6 +449,25 @@ namespace fdv
       return ret;
     }
 
+    // note: convert to a map initialization, {:} when empty
+    static string const toString(VariantMap const& m)
+    {
+      string ret;
+      ret.push_back('{');
+      for (uint16_t i = 0; i != m.size(); ++i)
+      {
+        if (i > 0)
+          ret.push_back(',');
+        appendQuoted(ret, m.key(i).c_str());
+        ret.push_back(':');
+        appendItem(ret, m.value(i));
+      }
+      if (m.size() == 0)
+        ret.push_back(':');
+      ret.push_back('}');
+      return ret;
+    }
+
 
   public:
 
@@ -275,9 +479,11 @@ namespace fdv
       case REFERENCE:
         return toString(uint16_t(m_refVal));  // prints pointer
       case STRING:
-        return *m_stringVal;
+        return m_stringVal->value;
       case ARRAY:
-        return toString(*m_arrayVal);
+        return toString(m_arrayVal->value);
+      case MAP:
+        return toString(m_mapVal->value);
       case FLOAT:
         return toString(m_floatVal);
       case UINT8:
@@ -286,6 +492,8 @@ namespace fdv
         return toString(m_uint16Val);
       case UINT32:
         return toString(m_uint32Val);
+      case INT32:
+        return toString(m_int32Val);
       default:
         return string();
       }
@@ -296,7 +504,7 @@ namespace fdv
       switch (m_type)
       {
       case STRING:
-        return strtod(m_stringVal->c_str(), NULL);
+        return strtod(m_stringVal->value.c_str(), NULL);
       case FLOAT:
         return m_floatVal;
       case UINT8:
@@ -305,6 +513,8 @@ namespace fdv
         return m_uint16Val;
       case UINT32:
         return m_uint32Val;
+      case INT32:
+        return m_int32Val;
       default:
         return 0.0;
       }
@@ -315,7 +525,7 @@ namespace fdv
       switch (m_type)
       {
       case STRING:
-        return strtoul(m_stringVal->c_str(), NULL, 10);
+        return strtoul(m_stringVal->value.c_str(), NULL, 10);
       case FLOAT:
         return (uint32_t)m_floatVal;
       case UINT8:
@@ -324,6 +534,29 @@ namespace fdv
         return m_uint16Val;
       case UINT32:
         return m_uint32Val;
+      case INT32:
+        return m_int32Val;
+      default:
+        return 0;
+      }
+    }
+
+    int32_t toInt32() const
+    {
+      switch (m_type)
+      {
+      case STRING:
+        return strtol(m_stringVal->value.c_str(), NULL, 10);
+      case FLOAT:
+        return (int32_t)m_floatVal;
+      case UINT8:
+        return m_uint8Val;
+      case UINT16:
+        return m_uint16Val;
+      case UINT32:
+        return m_uint32Val;
+      case INT32:
+        return m_int32Val;
       default:
         return 0;
       }
@@ -336,9 +569,11 @@ namespace fdv
       case REFERENCE:
         return m_refVal != NULL;
       case STRING:
-        return !m_stringVal->empty(); // TODO: should convert from "true/false/0/1" to int?
+        return !m_stringVal->value.empty(); // TODO: should convert from "true/false/0/1" to int?
       case ARRAY:
-        return !m_arrayVal->empty();
+        return !m_arrayVal->value.empty();
+      case MAP:
+        return m_mapVal->value.size() > 0;
       case FLOAT:
         return m_floatVal != 0.0;
       case UINT8:
@@ -347,6 +582,8 @@ namespace fdv
         return m_uint16Val != 0;
       case UINT32:
         return m_uint32Val != 0;
+      case INT32:
+        return m_int32Val != 0;
       default:
         return false;
       }
@@ -370,14 +607,44 @@ namespace fdv
 
     string& stringVal()
     {
-      type(STRING);
-      return *m_stringVal;
+      if (!type(STRING))
+        unshare();
+      return m_stringVal->value;
     }
 
     vector<Variant>& arrayVal()
     {
-      type(ARRAY);
-      return *m_arrayVal;
+      if (!type(ARRAY))
+        unshare();
+      return m_arrayVal->value;
+    }
+
+    // note: returns an empty string if this is not a STRING
+    string const& constStringVal() const
+    {
+      static string const s_empty;
+      return m_type==STRING? m_stringVal->value : s_empty;
+    }
+
+    // note: returns an empty array if this is not an ARRAY
+    vector<Variant> const& constArrayVal() const
+    {
+      static vector<Variant> const s_empty;
+      return m_type==ARRAY? m_arrayVal->value : s_empty;
+    }
+
+    VariantMap& mapVal()
+    {
+      if (!type(MAP))
+        unshare();
+      return m_mapVal->value;
+    }
+
+    // note: returns an empty map if this is not a MAP
+    VariantMap const& constMapVal() const
+    {
+      static VariantMap const s_empty;
+      return m_type==MAP? m_mapVal->value : s_empty;
     }
 
     float& floatVal()
@@ -404,6 +671,12 @@ namespace fdv
       return m_uint32Val;
     }
 
+    int32_t& int32Val()
+    {
+      type(INT32);
+      return m_int32Val;
+    }
+
     void operator--()
     {
       switch (m_type)
@@ -420,6 +693,9 @@ namespace fdv
       case UINT32:
         --m_uint32Val;
         break;
+      case INT32:
+        --m_int32Val;
+        break;
       default:
         break;
       }
@@ -441,6 +717,9 @@ namespace fdv
       case UINT32:
         ++m_uint32Val;
         break;
+      case INT32:
+        ++m_int32Val;
+        break;
       default:
         break;
       }
@@ -451,21 +730,17 @@ namespace fdv
       switch (m_type)
       {
       case STRING:  // no change
-        return Variant(*m_stringVal);
+        return *this;
       case ARRAY:   // no change
-        return Variant(*m_arrayVal);
+      case MAP:
+        return *this;
       case FLOAT:
         return Variant(-m_floatVal);
-        /*
-        case UINT8:
-        return Variant((uint8_t)-m_uint8Val);
-        case UINT16:
-        return Variant((uint16_t)-m_uint16Val);
-        case UINT32:
-        return Variant(-m_uint32Val);
-        */
+      case INT32:
+        return Variant(-m_int32Val);
       default:
-        return Variant(-toFloat()); // until signed integers will be supported
+        return Variant(-toFloat()); // unsigned values: FLOAT, as before INT32 existed
+
       }
     }
 
@@ -474,9 +749,10 @@ namespace fdv
       switch (m_type)
       {
       case STRING:  // no change
-        return Variant(*m_stringVal);
+        return *this;
       case ARRAY:   // no change
-        return Variant(*m_arrayVal);
+      case MAP:
+        return *this;
       case FLOAT:
         return Variant(m_floatVal?1.0:0.0);
       case UINT8:
@@ -485,6 +761,8 @@ namespace fdv
         return Variant((uint16_t)!m_uint16Val);
       case UINT32:
         return Variant((uint32_t)!m_uint32Val);
+      case INT32:
+        return Variant((int32_t)!m_int32Val);
       default:
         return Variant();
       }
@@ -495,123 +773,278 @@ namespace fdv
       switch (m_type)
       {
       case STRING:  // no change
-        return Variant(*m_stringVal);
+        return *this;
       case FLOAT:   // no change
         return Variant(m_floatVal);
       case ARRAY:   // no change
-        return Variant(*m_arrayVal);
+      case MAP:
+        return *this;
       case UINT8:
         return Variant((uint8_t)~m_uint8Val);
       case UINT16:
         return Variant((uint16_t)~m_uint16Val);
       case UINT32:
         return Variant((uint32_t)~m_uint32Val);
+      case INT32:
+        return Variant((int32_t)~m_int32Val);
       default:
         return Variant();
       }
     }
 
+
+  private:
+
+    // operator< when operands are not both unsigned
+    bool less(Variant const& rhs) const
+    {
+      if (m_type==STRING || rhs.m_type==STRING)
+      {
+        string t1, t2;
+        return asString(t1) < rhs.asString(t2);
+      }
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return toFloat() < rhs.toFloat();
+      case INT32:
+        return compareSigned(rhs) < 0;
+      default:
+        return toUInt32() < rhs.toUInt32();
+      }
+    }
+
+    // operator> when operands are not both unsigned
+    bool greater(Variant const& rhs) const
+    {
+      if (m_type==STRING || rhs.m_type==STRING)
+      {
+        string t1, t2;
+        return asString(t1) > rhs.asString(t2);
+      }
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return toFloat() > rhs.toFloat();
+      case INT32:
+        return compareSigned(rhs) > 0;
+      default:
+        return toUInt32() > rhs.toUInt32();
+      }
+    }
+
+    // operator== when operands are not both unsigned
+    bool equal(Variant const& rhs) const
+    {
+      if (m_type==STRING && rhs.m_type==STRING)
+        return m_stringVal == rhs.m_stringVal || m_stringVal->value == rhs.m_stringVal->value;
+      else if (m_type==STRING)
+        return m_stringVal->value == rhs.toString();  // no copy of the string operand
+      else if (rhs.m_type==STRING)
+        return toString() == rhs.m_stringVal->value;
+      else if (m_type==ARRAY && rhs.m_type==ARRAY)
+        return m_arrayVal == rhs.m_arrayVal || m_arrayVal->value == rhs.m_arrayVal->value;
+      else if (m_type==MAP && rhs.m_type==MAP)
+        return m_mapVal == rhs.m_mapVal || m_mapVal->value == rhs.m_mapVal->value;
+      else if (m_type==REFERENCE && rhs.m_type==REFERENCE)
+        return m_refVal == rhs.m_refVal;
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return toFloat() == rhs.toFloat();
+      case INT32:
+        return compareSigned(rhs) == 0;
+      default:
+        return toUInt32() == rhs.toUInt32();
+      }
+    }
+
+    // Numeric promotion of binary operators: FLOAT if any operand is FLOAT, otherwise INT32
+    // if any operand is INT32, otherwise UINT32 (results are shrunk to the smallest unsigned type,
+    // unsigned subtraction wraps around).
+    // Other types are converted (ie strtoul() of a STRING), never through toString().
+    static Type numericType(Variant const& lhs, Variant const& rhs)
+    {
+      uint16_t types = lhs.m_type | rhs.m_type;
+      if (types & FLOAT)
+        return FLOAT;
+      if (types & INT32)
+        return INT32;
+      return UINT32;
+    }
+
+    // fast path: both operands are UINT8, UINT16 or UINT32
+    static bool bothUnsigned(Variant const& lhs, Variant const& rhs)
+    {
+      return ((lhs.m_type | rhs.m_type) & ~(UINT8 | UINT16 | UINT32)) == 0;
+    }
+
+    // value of an UINT8, UINT16 or UINT32
+    uint32_t unsignedVal() const
+    {
+      return m_type==UINT8? m_uint8Val : (m_type==UINT16? m_uint16Val : m_uint32Val);
+    }
+
+    static Variant const unsignedResult(uint32_t value)
+    {
+      if (value < 256)
+        return Variant(static_cast<uint8_t>(value));
+      else if (value < 65536)
+        return Variant(static_cast<uint16_t>(value));
+      return Variant(value);
+    }
+
+    // compares operands promoted to INT32: -1 (lhs < rhs), 0 (lhs == rhs), 1 (lhs > rhs)
+    // note: a negative INT32 is lower than any unsigned value, even when it doesn't fit in INT32
+    int8_t compareSigned(Variant const& rhs) const
+    {
+      bool lneg = m_type==INT32 && m_int32Val < 0;
+      bool rneg = rhs.m_type==INT32 && rhs.m_int32Val < 0;
+      if (lneg != rneg)
+        return lneg? -1 : 1;
+      if (lneg)
+        return m_int32Val < rhs.m_int32Val? -1 : (m_int32Val > rhs.m_int32Val? 1 : 0);
+      // both not negative
+      uint32_t l = toUInt32(), r = rhs.toUInt32();
+      return l < r? -1 : (l > r? 1 : 0);
+    }
+
+    // returns the value of a STRING without copying it, otherwise converts it into "tmp"
+    string const& asString(string& tmp) const
+    {
+      if (m_type==STRING)
+        return m_stringVal->value;
+      string value(toString());
+      tmp.swap(value);  // avoids copying again
+      return tmp;
+    }
+
+
+  public:
+
     Variant const operator*(Variant const& rhs) const
     {
-      if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return Variant( toFloat() * rhs.toFloat() );
-      else
+      switch (numericType(*this, rhs))
       {
-        Variant r( toUInt32() * rhs.toUInt32() );
-        r.shrink(r.toUInt32());
-        return r;
+      case FLOAT:
+        return Variant( toFloat() * rhs.toFloat() );
+      case INT32:
+        return Variant( toInt32() * rhs.toInt32() );
+      default:
+        return unsignedResult( toUInt32() * rhs.toUInt32() );
       }
     }
 
     Variant const operator/(Variant const& rhs) const
     {
-      if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return Variant( toFloat() / rhs.toFloat() );
-      else
+      switch (numericType(*this, rhs))
       {
-        Variant r( toUInt32() / rhs.toUInt32() );
-        r.shrink(r.toUInt32());
-        return r;
+      case FLOAT:
+        return Variant( toFloat() / rhs.toFloat() );
+      case INT32:
+        return Variant( toInt32() / rhs.toInt32() );
+      default:
+        return unsignedResult( toUInt32() / rhs.toUInt32() );
       }
     }
 
     Variant const operator%(Variant const& rhs) const
     {
-      Variant r( toUInt32() % rhs.toUInt32() );
-      r.shrink(r.toUInt32());
-      return r;
+      if (numericType(*this, rhs) == INT32)
+        return Variant( toInt32() % rhs.toInt32() );
+      return unsignedResult( toUInt32() % rhs.toUInt32() );
     }
 
     Variant const operator+(Variant const& rhs) const
     {
-      if (m_type==STRING || rhs.m_type==STRING) // TODO: optimize
-        return Variant( toString() + rhs.toString() );
-      else if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return Variant( toFloat() + rhs.toFloat() );
-      else
+      if (bothUnsigned(*this, rhs))
+        return unsignedResult( unsignedVal() + rhs.unsignedVal() );
+      if (m_type==STRING || rhs.m_type==STRING)
       {
-        Variant r( toUInt32() + rhs.toUInt32() );
-        r.shrink(r.toUInt32());
+        string t1, t2;
+        Variant r(asString(t1));
+        r.m_stringVal->value.append(rhs.asString(t2));
         return r;
       }
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return Variant( toFloat() + rhs.toFloat() );
+      case INT32:
+        return Variant( toInt32() + rhs.toInt32() );
+      default:
+        return unsignedResult( toUInt32() + rhs.toUInt32() );
+      }
     }
 
     Variant const operator-(Variant const& rhs) const
     {
-      if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return Variant( toFloat() - rhs.toFloat() );
-      else
+      if (bothUnsigned(*this, rhs))
+        return unsignedResult( unsignedVal() - rhs.unsignedVal() );
+      switch (numericType(*this, rhs))
       {
-        Variant r( toUInt32() - rhs.toUInt32() );
-        r.shrink(r.toUInt32());
-        return r;
+      case FLOAT:
+        return Variant( toFloat() - rhs.toFloat() );
+      case INT32:
+        return Variant( toInt32() - rhs.toInt32() );
+      default:
+        return unsignedResult( toUInt32() - rhs.toUInt32() );
       }
     }
 
     bool operator<(Variant const& rhs) const
     {
-      if (m_type==STRING || rhs.m_type==STRING)
-        return toString() < rhs.toString();
-      else if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return toFloat() < rhs.toFloat();
-      else
-        return toUInt32() < rhs.toUInt32();
+      if (bothUnsigned(*this, rhs))
+        return unsignedVal() < rhs.unsignedVal();
+      return less(rhs);
     }
 
     bool operator<=(Variant const& rhs) const
     {
-      return *this < rhs || *this == rhs;
+      if (bothUnsigned(*this, rhs))
+        return unsignedVal() <= rhs.unsignedVal();
+      if (m_type==STRING || rhs.m_type==STRING)
+        return *this < rhs || *this == rhs;
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return toFloat() <= rhs.toFloat();
+      case INT32:
+        return compareSigned(rhs) <= 0;
+      default:
+        return toUInt32() <= rhs.toUInt32();
+      }
     }
 
     bool operator>(Variant const& rhs) const
     {
-      if (m_type==STRING || rhs.m_type==STRING)
-        return toString() > rhs.toString();
-      else if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return toFloat() > rhs.toFloat();
-      else
-        return toUInt32() > rhs.toUInt32();
+      if (bothUnsigned(*this, rhs))
+        return unsignedVal() > rhs.unsignedVal();
+      return greater(rhs);
     }
 
     bool operator>=(Variant const& rhs) const
     {
-      return *this > rhs || *this == rhs;
+      if (bothUnsigned(*this, rhs))
+        return unsignedVal() >= rhs.unsignedVal();
+      if (m_type==STRING || rhs.m_type==STRING)
+        return *this > rhs || *this == rhs;
+      switch (numericType(*this, rhs))
+      {
+      case FLOAT:
+        return toFloat() >= rhs.toFloat();
+      case INT32:
+        return compareSigned(rhs) >= 0;
+      default:
+        return toUInt32() >= rhs.toUInt32();
+      }
     }
 
     bool operator==(Variant const& rhs) const
     {
-      if (m_type==STRING && rhs.m_type==STRING)
-        return *m_stringVal == *rhs.m_stringVal;
-      else if (m_type==STRING || rhs.m_type==STRING) // TODO: optimize comparing native values
-        return toString() == rhs.toString();
-      else if (m_type==FLOAT || rhs.m_type==FLOAT)
-        return toFloat() == rhs.toFloat();
-      else if (m_type==ARRAY && rhs.m_type==ARRAY)
-        return *m_arrayVal == *rhs.m_arrayVal;
-      else if (m_type==REFERENCE && rhs.m_type==REFERENCE)
-        return m_refVal == rhs.m_refVal;
-      else
-        return toUInt32() == rhs.toUInt32();
+      if (bothUnsigned(*this, rhs))
+        return unsignedVal() == rhs.unsignedVal();
+      return equal(rhs);
     }
 
     bool operator!=(Variant const& rhs) const
@@ -623,6 +1056,8 @@ namespace fdv
     {
       if (m_type==UINT32 || rhs.m_type==UINT32)
         return Variant(toUInt32() | rhs.toUInt32());
+      else if (m_type==INT32 || rhs.m_type==INT32)
+        return Variant(toInt32() | rhs.toInt32());
       else if (m_type==UINT16 || rhs.m_type==UINT16)
         return Variant(static_cast<uint16_t>(toUInt32() | rhs.toUInt32()));
       else if (m_type==UINT8 || rhs.m_type==UINT8)
@@ -635,6 +1070,8 @@ namespace fdv
     {
       if (m_type==UINT32 || rhs.m_type==UINT32)
         return Variant(toUInt32() ^ rhs.toUInt32());
+      else if (m_type==INT32 || rhs.m_type==INT32)
+        return Variant(toInt32() ^ rhs.toInt32());
       else if (m_type==UINT16 || rhs.m_type==UINT16)
         return Variant(static_cast<uint16_t>(toUInt32() ^ rhs.toUInt32()));
       else if (m_type==UINT8 || rhs.m_type==UINT8)
@@ -647,6 +1084,8 @@ namespace fdv
     {
       if (m_type==UINT32 || rhs.m_type==UINT32)
         return Variant(toUInt32() & rhs.toUInt32());
+      else if (m_type==INT32 || rhs.m_type==INT32)
+        return Variant(toInt32() & rhs.toInt32());
       else if (m_type==UINT16 || rhs.m_type==UINT16)
         return Variant(static_cast<uint16_t>(toUInt32() & rhs.toUInt32()));
       else if (m_type==UINT8 || rhs.m_type==UINT8)
@@ -663,6 +1102,8 @@ namespace fdv
         return Variant(static_cast<uint16_t>(m_uint16Val << rhs.toUInt32()));
       else if (m_type==UINT32)
         return Variant(static_cast<uint32_t>(m_uint32Val << rhs.toUInt32()));
+      else if (m_type==INT32)
+        return Variant(static_cast<int32_t>(m_int32Val << rhs.toUInt32()));
       else
         return Variant();
     }
@@ -675,6 +1116,8 @@ namespace fdv
         return Variant(static_cast<uint16_t>(m_uint16Val >> rhs.toUInt32()));
       else if (m_type==UINT32)
         return Variant(static_cast<uint32_t>(m_uint32Val >> rhs.toUInt32()));
+      else if (m_type==INT32)
+        return Variant(static_cast<int32_t>(m_int32Val >> rhs.toUInt32()));
       else
         return Variant();
     }
@@ -686,13 +1129,15 @@ namespace fdv
 
     union
     {
-      string*          m_stringVal;
-      vector<Variant>* m_arrayVal;
+      SharedString*    m_stringVal;
+      SharedArray*     m_arrayVal;
+      SharedMap*       m_mapVal;
       Variant*         m_refVal;
       float            m_floatVal;
       uint8_t          m_uint8Val;
       uint16_t         m_uint16Val;
       uint32_t         m_uint32Val;
+      int32_t          m_int32Val;
     };
   };
 
@@ -703,6 +1148,66 @@ namespace fdv
   }
 
 
+
+  ///////////////////////////////////////////////////////////////////////////////////////////////
+  // VariantMap members which need a complete Variant
+
+  inline Variant& VariantMap::value(uint16_t index)
+  {
+    return m_values[index];
+  }
+
+  inline Variant const& VariantMap::value(uint16_t index) const
+  {
+    return m_values[index];
+  }
+
+  inline Variant* VariantMap::find(char const* key)
+  {
+    uint8_t i = indexOf(key);
+    return i == EMPTY? NULL : &m_values[i];
+  }
+
+  inline Variant* VariantMap::insert(char const* key)
+  {
+    Variant* v = find(key);
+    if (v == NULL && m_keys.size() < MAXITEMS)
+    {
+      if (m_slots.size() < 2 * (m_keys.size() + 1))
+        rehash(m_slots.size() == 0? 8 : 2 * m_slots.size());
+      m_slots[slot(key)] = m_keys.size();
+      m_keys.push_back(string(key));
+      m_values.push_back(Variant());
+      v = &m_values.back();
+    }
+    return v;
+  }
+
+  inline bool VariantMap::erase(char const* key)
+  {
+    uint8_t i = indexOf(key);
+    if (i == EMPTY)
+      return false;
+    m_keys.erase(m_keys.begin() + i);
+    m_values.erase(m_values.begin() + i);
+    rehash(m_slots.size());  // indexes of following items are changed
+    return true;
+  }
+
+  inline bool VariantMap::operator==(VariantMap const& rhs) const
+  {
+    if (size() != rhs.size())
+      return false;
+    for (uint16_t i = 0; i != size(); ++i)
+    {
+      uint8_t j = rhs.indexOf(m_keys[i].c_str());
+      if (j == EMPTY || rhs.m_values[j] != m_values[i])
+        return false;
+    }
+    return true;
+  }
+
+
 } // end of fdv namespace
 
 #endif /* FDV_VARIANT_H_ */
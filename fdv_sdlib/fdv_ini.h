@@ -43,6 +43,260 @@ namespace fdv
 {
 
 
+  /////////////////////////////////////////////////////////////////////////////////////////////
+  // IniCache
+  // Keeps in memory, for the last MAXFILES ini files, the position of each key (up to MAXKEYS),
+  // sorted by key hash, so Ini lookups read just the line of the key instead of scanning the
+  // file. Keys after the last indexed one are still searched by scanning.
+  // An index is valid while size and last write date/time of the file directory entry don't
+  // change. Ini invalidates it when it writes the file; library functions which modify files
+  // must call invalidate().
+
+  struct IniCache
+  {
+
+    static uint8_t const MAXFILES = 2;
+    static uint8_t const MAXKEYS  = 32;
+
+
+    struct Entry
+    {
+      uint16_t hash;
+      uint32_t position;   // begin of line
+    };
+
+
+    // Looks for "key" (exact match) starting from *position of the already open "file". Returns
+    // false if not found. If found *position is the begin of the line, which is stored in "line".
+    static bool find(File& file, char const* filename, char const* key, uint32_t* position, string* line)
+    {
+      uint8_t klen = strlen(key);
+      Index* index = acquire(file, filename);
+      uint32_t start = *position;
+      if (index)
+      {
+        // first indexed line with the same key hash at or after "start" (equal hashes are sorted by position)
+        vector<Entry> const& entries = index->entries;
+        uint16_t h = hash(key, klen);
+        for (size_t i = lowerBound(entries, h); i != entries.size() && entries[i].hash == h; ++i)
+        {
+          if (entries[i].position < start)
+            continue;
+          file.position(entries[i].position);
+          *line = file.readLine();
+          if (matchKey(line->c_str(), key, klen, true))
+          {
+            *position = entries[i].position;
+            return true;
+          }
+        }
+        start = max(start, index->indexedEnd);
+      }
+      file.position(start);
+      while (!file.isEOF())
+      {
+        *position = file.position();
+        *line = file.readLine();
+        if (matchKey(line->c_str(), key, klen, true))
+          return true;
+      }
+      return false;
+    }
+
+
+    // to call when "filename" is modified, renamed or removed
+    static void invalidate(char const* filename)
+    {
+      Index* index = find(filename);
+      if (index)
+        discard(index);
+    }
+
+
+    // true if "line" ("KEY = VALUE") has key "key" (or, if !exactMatch, its key begins with "key")
+    static bool matchKey(char const* line, char const* key, uint8_t klen, bool exactMatch)
+    {
+      char const* sp = strchr(line, '='); // look for '='
+      uint8_t len = sp-line-1;
+      return sp!=NULL && (exactMatch? len==klen : len>=klen) && strncmp(line, key, exactMatch? len : klen)==0;
+    }
+
+
+  private:
+
+    struct Index
+    {
+      string        filename;    // empty = unused
+      uint32_t      fileSize;
+      uint32_t      lastWrite;
+      uint32_t      indexedEnd;  // all keys before this position are in "entries"
+      vector<Entry> entries;     // sorted by hash, then position
+      uint16_t      lastUse;
+    };
+
+
+    struct Data
+    {
+      Index    indexes[MAXFILES];
+      uint16_t clock;
+    };
+
+
+    static Data& data()
+    {
+      static Data s_data;
+      return s_data;
+    }
+
+
+    // returns the index of "file", building it if necessary, or NULL if the directory entry
+    // is not available
+    static Index* acquire(File& file, char const* filename)
+    {
+      uint32_t fileSize, lastWrite;
+      if (!file.dirEntry(&fileSize, &lastWrite))
+        return NULL;
+      Data& d = data();
+      ++d.clock;
+      Index* index = find(filename);
+      if (index && (index->fileSize != fileSize || index->lastWrite != lastWrite))
+        discard(index);
+      else if (index == NULL)
+      {
+        // discard least recently used
+        index = &d.indexes[0];
+        for (uint8_t i = 1; i != MAXFILES; ++i)
+          if (uint16_t(d.clock - d.indexes[i].lastUse) > uint16_t(d.clock - index->lastUse))
+            index = &d.indexes[i];
+        discard(index);
+      }
+      if (index->filename.size() == 0)
+      {
+        Arena::Scope heap(NULL);  // the index outlives the running script arena (if any)
+        build(file, index);
+        index->filename  = filename;
+        index->fileSize  = fileSize;
+        index->lastWrite = lastWrite;
+      }
+      index->lastUse = d.clock;
+      return index;
+    }
+
+
+    // reads the whole file (in blocks), storing position and key hash of each "KEY = VALUE" line
+    static void build(File& file, Index* index)
+    {
+      uint8_t  buffer[32];
+      uint32_t pos       = 0;
+      uint32_t lineStart = 0;
+      uint8_t  keyLen    = 0;      // chars of current line before '=' (0xFF = '=' already found)
+      uint16_t h         = 5381;   // hash of current line chars
+      uint16_t hprev     = 5381;   // hash without the last char (the space before '=')
+      bool     skipNext  = false;  // CR: the next char (LF) belongs to the line end
+      file.position(0);
+      for (uint16_t len; (len = file.read(buffer, sizeof(buffer))) > 0 && len != 0xFFFF; )
+      {
+        for (uint16_t i = 0; i != len; ++i, ++pos)
+        {
+          uint8_t c = buffer[i];
+          if (skipNext || c == 0x0A || c == 0x0D)
+          {
+            if (c == 0x0D && !skipNext)
+              skipNext = true;
+            else
+            {
+              skipNext  = false;
+              lineStart = pos + 1;
+              keyLen    = 0;
+              h = hprev = 5381;
+            }
+            continue;
+          }
+          if (keyLen == 0xFF)
+            continue;
+          if (c == '=')
+          {
+            if (keyLen > 0 && !addEntry(index, hprev, lineStart))
+            {
+              index->indexedEnd = lineStart;
+              return;
+            }
+            keyLen = 0xFF;
+            continue;
+          }
+          hprev = h;
+          h = h * 33 + c;
+          if (keyLen < 0xFE)
+            ++keyLen;
+        }
+      }
+      index->indexedEnd = pos;
+    }
+
+
+    static bool addEntry(Index* index, uint16_t hash, uint32_t position)
+    {
+      vector<Entry>& entries = index->entries;
+      if (entries.size() == MAXKEYS)
+        return false;
+      // after entries with the same hash, which have lower positions
+      Entry e = {hash, position};
+      entries.insert(entries.begin() + lowerBound(entries, hash + 1u), e);
+      return true;
+    }
+
+
+    // first entry whose hash is not less than "hash"
+    static size_t lowerBound(vector<Entry> const& entries, uint32_t hash)
+    {
+      size_t lo = 0, hi = entries.size();
+      while (lo < hi)
+      {
+        size_t mid = (lo + hi) / 2;
+        if (entries[mid].hash < hash)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+
+    static uint16_t hash(char const* key, uint8_t len)
+    {
+      uint16_t h = 5381;
+      while (len--)
+        h = h * 33 + uint8_t(*key++);
+      return h;
+    }
+
+
+    // file names are not case sensitive, root directory can be omitted
+    static Index* find(char const* filename)
+    {
+      if (*filename == '/')
+        ++filename;
+      Data& d = data();
+      for (uint8_t i = 0; i != MAXFILES; ++i)
+      {
+        char const* name = d.indexes[i].filename.c_str();
+        if (d.indexes[i].filename.size() > 0 && strcasecmp(*name == '/'? name + 1 : name, filename) == 0)
+          return &d.indexes[i];
+      }
+      return NULL;
+    }
+
+
+    static void discard(Index* index)
+    {
+      index->filename.clear();
+      index->entries.clear();
+    }
+
+  };
+
+
+
   /*
   * Handle ini files
   *
@@ -76,19 +330,19 @@ namespace fdv
       FileSystem fileSystem(m_sdcard);
       checkIniFile(fileSystem);
       File iniFile(fileSystem, m_filename.c_str(), File::MD_READ);
+      if (exactMatch)
+      {
+        string line;
+        return IniCache::find(iniFile, m_filename.c_str(), key, position, &line);
+      }
       uint8_t klen = strlen(key);
       iniFile.position(*position);
       while (!iniFile.isEOF())
       {
         *position = iniFile.position(); // store begin of line, in case it is usefull
         string const line = iniFile.readLine();
-        char* sp = strchr(line.c_str(), '='); // look for '='
-        uint8_t len = sp-line.c_str()-1;
-        if ( (exactMatch && sp!=NULL && len==klen && strncmp(line.c_str(), key, len)==0)
-          || (!exactMatch && sp!=NULL && len>=klen && strncmp(line.c_str(), key, klen)==0) )
-        {
+        if (IniCache::matchKey(line.c_str(), key, klen, false))
           return true; // key found
-        }
       }
       return false; // not found (*position becomes undefined)
     }
@@ -122,18 +376,10 @@ namespace fdv
       FileSystem fileSystem(m_sdcard);
       checkIniFile(fileSystem);
       File iniFile(fileSystem, m_filename.c_str(), File::MD_READ);
-      uint8_t klen = strlen(key);
-      while (!iniFile.isEOF())
-      {
-        string const line = iniFile.readLine();
-        char* sp = strchr(line.c_str(), '='); // look for '='
-        if (sp)
-        {
-          uint8_t len = sp - &line[0] - 1;
-          if (len==klen && strncmp(&line[0], key, len)==0)
-            return string(sp+2); // key found, return value
-        }
-      }
+      uint32_t position = 0;
+      string line;
+      if (IniCache::find(iniFile, m_filename.c_str(), key, &position, &line))
+        return string(strchr(line.c_str(), '=')+2); // key found, return value
       return string(defaultValue);  // not found, return default value
     }
 
@@ -201,9 +447,7 @@ namespace fdv
       while (!inputFile.isEOF())
       {
         string const line = inputFile.readLine();
-        char* sp = strchr(line.c_str(), '='); // look for '='
-        uint8_t len = sp-line.c_str()-1;
-        if (sp!=NULL && len==klen && strncmp(line.c_str(), key, len)==0)
+        if (IniCache::matchKey(line.c_str(), key, klen, true))
         {
           // found, replace key/value
           outputFile.write(key);
@@ -229,6 +473,7 @@ namespace fdv
 
       inputFile.close();
       outputFile.close();
+      IniCache::invalidate(m_filename.c_str());
       fileSystem.removeFile(m_filename.c_str());
       fileMove(fileSystem, tempFilename.c_str(), m_filename.c_str());
     }
@@ -287,6 +532,7 @@ namespace fdv
 
       inputFile.close();
       outputFile.close();
+      IniCache::invalidate(m_filename.c_str());
       fileSystem.removeFile(m_filename.c_str());
       fileMove(fileSystem, tempFilename.c_str(), m_filename.c_str());
 
@@ -475,6 +475,18 @@ namespace fdv
     }
 
 
+    // gets size and last write date/time (FAT format, date in high word) from the directory entry
+    bool dirEntry(uint32_t* fileSize, uint32_t* lastWrite)
+    {
+      dir_t p;
+      if (!m_file.dirEntry(&p))
+        return false;
+      *fileSize  = p.fileSize;
+      *lastWrite = (uint32_t(p.lastWriteDate) << 16) | p.lastWriteTime;
+      return true;
+    }
+
+
     uint16_t read(void* buf, uint16_t nbyte)
     {
       return m_file.read(buf, nbyte);
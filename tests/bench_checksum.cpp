@@ -0,0 +1,139 @@
+// Internet checksum benchmark: DataList::calcInternetChecksum() against the previous
+// byte by byte implementation (kept below), for the buffer layouts the stack sends.
+//
+//   make bench
+//   build/bench_checksum
+
+#include "fdv_network/fdv_TCPIP.h"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace fdv;
+
+
+namespace fdv
+{
+  void TimeOut::timeOutFunc(uint8_t taskIndex)
+  {
+    TaskManager::get(taskIndex).m_everyMillisecs = 0xFFFFFFFF;
+  }
+
+  Task volatile TaskManager::s_info[TaskManager::MAXTASKS];
+}
+
+
+// the previous DataList::calcInternetChecksum() (wrong when the list contains empty buffers)
+static uint16_t oldInternetChecksum(DataList const& dataList)
+{
+  DataList::Enumerator enu(dataList);
+  uint16_t nbytes = dataList.calcLength();
+  uint32_t sum = 0;
+  while (nbytes > 1)
+  {
+    uint8_t lo = *enu.data; enu.moveNext();
+    uint8_t hi = *enu.data; enu.moveNext();
+    sum += (uint16_t)lo << 8 | hi;
+    nbytes -= 2;
+  }
+  if (nbytes == 1)
+  {
+    uint8_t lo = *enu.data; enu.moveNext();
+    sum += (uint16_t)lo << 8;
+  }
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+
+struct Layout
+{
+  char const* name;
+  uint16_t    parts[4];   // buffer lengths, 0 terminated
+};
+
+static Layout const layouts[] =
+{
+  { "20 (IP header)",        { 20 } },
+  { "8+512 (UDP)",           { 8, 512 } },
+  { "12+20+1460 (TCP)",      { 12, 20, 1460 } },
+  { "12+8+37+480 (odd)",     { 12, 8, 37, 480 } },
+};
+
+static uint8_t const REPEATS = 7;   // the best of REPEATS measurements is reported
+
+
+static double cpuSeconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint8_t s_data[1600];
+
+
+// nanoseconds per checksum
+template <typename ChecksumF>
+static double measure(DataList const& dataList, uint32_t count, ChecksumF checksum)
+{
+  double best = 1e9;
+  volatile uint16_t sink = 0;
+  for (uint8_t r = 0; r != REPEATS; ++r)
+  {
+    double start = cpuSeconds();
+    for (uint32_t i = 0; i != count; ++i)
+    {
+      sink += checksum(dataList);
+      s_data[0] ^= 1;
+    }
+    double elapsed = cpuSeconds() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+  return best / count * 1e9;
+}
+
+
+static uint16_t newInternetChecksum(DataList const& dataList)
+{
+  return dataList.calcInternetChecksum();
+}
+
+
+int main()
+{
+  for (uint16_t i = 0; i != sizeof(s_data); ++i)
+    s_data[i] = i * 7;
+
+  bool ok = true;
+  for (uint8_t l = 0; l != sizeof(layouts) / sizeof(layouts[0]); ++l)
+  {
+    DataList* lists[4];
+    uint8_t   count  = 0;
+    uint16_t  length = 0;
+    while (count != 4 && layouts[l].parts[count])
+      length += layouts[l].parts[count++];
+    DataList* next   = NULL;
+    uint16_t  offset = length;
+    for (int8_t i = count - 1; i >= 0; --i)
+    {
+      offset -= layouts[l].parts[i];
+      next = lists[i] = new DataList(next, s_data + offset, layouts[l].parts[i]);
+    }
+
+    ok = oldInternetChecksum(*next) == newInternetChecksum(*next) && ok;
+    uint32_t iterations = 2000000 / (length + 20);
+    double   oldNs      = measure(*next, iterations, oldInternetChecksum);
+    double   newNs      = measure(*next, iterations, newInternetChecksum);
+    printf("%-20s old %7.1f ns   new %7.1f ns   x%.1f\n", layouts[l].name, oldNs, newNs, oldNs / newNs);
+
+    for (uint8_t i = 0; i != count; ++i)
+      delete lists[i];
+  }
+  if (!ok)
+    printf("FAIL old and new checksums differ\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+// Script engine benchmark: runs the scripts of corpus/ with parseScript() (compile + VM)
+// over memory-backed files and reports operations per second and allocations per operation.
+//
+//   make bench
+//   build/bench_script [corpus directory]
+
+#include "host/scriptlibrary.h"
+#include "host/standins.h"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace fdv;
+
+
+typedef RunTime<CountingOutput, ScriptLibrary> BenchRunTime;
+
+
+struct Benchmark
+{
+  char const* filename;
+  uint32_t    ops;      // operations (loop iterations) executed by one run of the script
+  uint16_t    runs;
+};
+
+static Benchmark const benchmarks[] =
+{
+  { "loop.s",          10000, 20 },
+  { "interpolation.s",  5000, 20 },
+  { "array.s",           200, 20 },
+  { "ini.s",             200,  5 },
+  { "call.s",            200,  5 },   // call() -> a.s -> b.s, 3 levels
+};
+
+// files the scripts above read
+static char const* const dataFiles[] = { "cfg.ini", "a.s", "b.s" };
+
+static uint8_t const REPEATS = 5;   // the best of REPEATS measurements is reported
+
+
+static double cpuSeconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static bool loadCorpusFile(char const* dir, char const* filename)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, filename);
+  if (memfs::load(filename, path))
+    return true;
+  printf("cannot load %s\n", path);
+  return false;
+}
+
+
+static bool bench(FileSystem& fileSystem, Benchmark const& b)
+{
+  memfs::MemFile* m = memfs::find(b.filename);
+  string source(m->data, m->size);
+
+  bool     ok     = true;
+  uint32_t outLen = 0;
+  double   best   = 1e9;
+  for (uint8_t r = 0; r != REPEATS; ++r)
+  {
+    MemoryStats::reset();
+    double start = cpuSeconds();
+    for (uint16_t i = 0; i != b.runs; ++i)
+    {
+      CountingOutput output;
+      ScriptLibrary  library(&fileSystem);
+      BenchRunTime   runTime(&output, &library, NULL);
+      TextInput      input(source.c_str());
+      ok = parseScript(&runTime, &input) && ok;
+      outLen = output.count;
+    }
+    double elapsed = cpuSeconds() - start;
+    if (elapsed < best)
+      best = elapsed;
+  }
+
+  double ops = double(b.ops) * b.runs;
+  MemoryStats::Data const& stats = MemoryStats::data();
+  printf("%-16s %-4s out=%7u %10.0f ops/s   allocs/op=%6.2f  reallocs/op=%6.2f\n",
+         b.filename, ok ? "ok" : "FAIL", outLen, ops / best, stats.allocs / ops, stats.reallocs / ops);
+  return ok;
+}
+
+
+int main(int argc, char** argv)
+{
+  char const* dir = argc > 1 ? argv[1] : "corpus";
+
+  bool ok = true;
+  for (uint8_t i = 0; i != sizeof(dataFiles) / sizeof(dataFiles[0]); ++i)
+    ok = loadCorpusFile(dir, dataFiles[i]) && ok;
+  for (uint8_t i = 0; i != sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+    ok = loadCorpusFile(dir, benchmarks[i].filename) && ok;
+  if (!ok)
+    return 1;
+
+  SDCard*    card = NULL;
+  FileSystem fileSystem(card);
+  for (uint8_t i = 0; i != sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+    ok = bench(fileSystem, benchmarks[i]) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+// Variant operators benchmark: the numeric promotion of binary operators against the previous
+// implementation (kept below, it compared and added through toString() when an operand was a
+// STRING), for mixed numeric, string and INT32 operands. Reports ns and allocations per operation.
+//
+//   make bench
+//   build/bench_variant
+
+#include "fdv_script/fdv_variant.h"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace fdv;
+
+
+// the previous Variant::operator<
+static bool oldLess(Variant const& lhs, Variant const& rhs)
+{
+  if (lhs.type()==Variant::STRING || rhs.type()==Variant::STRING)
+    return lhs.toString() < rhs.toString();
+  else if (lhs.type()==Variant::FLOAT || rhs.type()==Variant::FLOAT)
+    return lhs.toFloat() < rhs.toFloat();
+  else
+    return lhs.toUInt32() < rhs.toUInt32();
+}
+
+// the previous Variant::operator== (numbers and strings only)
+static bool oldEqual(Variant const& lhs, Variant const& rhs)
+{
+  if (lhs.type()==Variant::STRING && rhs.type()==Variant::STRING)
+    return lhs.constStringVal() == rhs.constStringVal();
+  else if (lhs.type()==Variant::STRING || rhs.type()==Variant::STRING)
+    return lhs.toString() == rhs.toString();
+  else if (lhs.type()==Variant::FLOAT || rhs.type()==Variant::FLOAT)
+    return lhs.toFloat() == rhs.toFloat();
+  else
+    return lhs.toUInt32() == rhs.toUInt32();
+}
+
+// the previous Variant::operator+
+static Variant const oldPlus(Variant const& lhs, Variant const& rhs)
+{
+  if (lhs.type()==Variant::STRING || rhs.type()==Variant::STRING)
+    return Variant( lhs.toString() + rhs.toString() );
+  else if (lhs.type()==Variant::FLOAT || rhs.type()==Variant::FLOAT)
+    return Variant( lhs.toFloat() + rhs.toFloat() );
+  else
+  {
+    Variant r( lhs.toUInt32() + rhs.toUInt32() );
+    r.shrink(r.toUInt32());
+    return r;
+  }
+}
+
+
+static bool newLess(Variant const& lhs, Variant const& rhs)
+{
+  return lhs < rhs;
+}
+
+static bool newEqual(Variant const& lhs, Variant const& rhs)
+{
+  return lhs == rhs;
+}
+
+static Variant const newPlus(Variant const& lhs, Variant const& rhs)
+{
+  return lhs + rhs;
+}
+
+static Variant const newMinus(Variant const& lhs, Variant const& rhs)
+{
+  return lhs - rhs;
+}
+
+static Variant const newTimes(Variant const& lhs, Variant const& rhs)
+{
+  return lhs * rhs;
+}
+
+
+static uint8_t const VALUES  = 16;  // operands vary per iteration, among VALUES values
+static uint8_t const REPEATS = 7;   // the best of REPEATS measurements is reported
+
+
+static double cpuSeconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+struct Result
+{
+  double ns;
+  double allocs;
+};
+
+
+static uint32_t sinkOf(bool value)
+{
+  return value;
+}
+
+static uint32_t sinkOf(Variant const& value)
+{
+  return value.type();
+}
+
+
+// nanoseconds and allocations per operation
+template <typename OperatorF>
+static Result measure(Variant const* lhs, Variant const* rhs, uint32_t count, OperatorF op)
+{
+  Result result = { 1e9, 0 };
+  volatile uint32_t sink = 0;
+  for (uint8_t r = 0; r != REPEATS; ++r)
+  {
+    MemoryStats::reset();
+    double start = cpuSeconds();
+    for (uint32_t i = 0; i != count; ++i)
+      sink += sinkOf(op(lhs[i % VALUES], rhs[(i / VALUES + i) % VALUES]));
+    double elapsed = cpuSeconds() - start;
+    if (elapsed < result.ns)
+      result.ns = elapsed;
+    result.allocs = double(MemoryStats::data().allocs) / count;
+  }
+  result.ns = result.ns / count * 1e9;
+  return result;
+}
+
+
+// same results of the previous and the current operator (where the previous one was correct)
+template <typename OldF, typename NewF>
+static bool sameResults(Variant const* lhs, Variant const* rhs, OldF oldOp, NewF newOp)
+{
+  for (uint8_t i = 0; i != VALUES; ++i)
+    for (uint8_t j = 0; j != VALUES; ++j)
+      if (!(oldOp(lhs[i], rhs[j]) == newOp(lhs[i], rhs[j])))
+        return false;
+  return true;
+}
+
+
+static void print(char const* name, Result const* before, Result const& after)
+{
+  if (before)
+    printf("%-12s before %7.1f ns %5.2f allocs   after %7.1f ns %5.2f allocs   x%.1f\n",
+           name, before->ns, before->allocs, after.ns, after.allocs, before->ns / after.ns);
+  else
+    printf("%-12s before       -                after %7.1f ns %5.2f allocs\n", name, after.ns, after.allocs);
+}
+
+
+template <typename OldF, typename NewF>
+static bool compare(char const* name, Variant const* lhs, Variant const* rhs, uint32_t count, OldF oldOp, NewF newOp)
+{
+  Result before = measure(lhs, rhs, count, oldOp);
+  Result after  = measure(lhs, rhs, count, newOp);
+  print(name, &before, after);
+  return sameResults(lhs, rhs, oldOp, newOp);
+}
+
+
+int main()
+{
+  Variant u8[VALUES], u16[VALUES], i32[VALUES], s[VALUES], t[VALUES];
+  for (uint8_t i = 0; i != VALUES; ++i)
+  {
+    u8[i]  = Variant(static_cast<uint8_t>(i * 13));
+    u16[i] = Variant(static_cast<uint16_t>(i * 4099));
+    i32[i] = Variant(static_cast<int32_t>(i * 1000 - 8000));
+    s[i]   = Variant(Variant(static_cast<uint8_t>(i * 17)).toString());
+    t[i]   = Variant(i & 1 ? "some longer text to compare" : "some longer text to compare too");
+  }
+
+  uint32_t const NUMERIC = 2000000, STRINGS = 200000;
+  bool ok = true;
+  ok = compare("u8 <  u16", u8, u16, NUMERIC, oldLess, newLess) && ok;
+  ok = compare("u8 == u16", u8, u16, NUMERIC, oldEqual, newEqual) && ok;
+  ok = compare("u8 +  u16", u8, u16, NUMERIC, oldPlus, newPlus) && ok;
+  ok = compare("s  == u8", s, u8, STRINGS, oldEqual, newEqual) && ok;
+  ok = compare("s  +  u8", s, u8, STRINGS, oldPlus, newPlus) && ok;
+  ok = compare("s  <  s", t, t, STRINGS, oldLess, newLess) && ok;
+
+  // INT32 didn't exist before (negative results were FLOAT or wrapped around)
+  print("i32 <  u8",  NULL, measure(i32, u8, NUMERIC, newLess));
+  print("i32 == u16", NULL, measure(i32, u16, NUMERIC, newEqual));
+  print("i32 +  u8",  NULL, measure(i32, u8, NUMERIC, newPlus));
+  print("i32 *  i32", NULL, measure(i32, i32, NUMERIC, newTimes));
+  print("u8 -  u16",  NULL, measure(u8, u16, NUMERIC, newMinus));
+
+  if (!ok)
+    printf("FAIL previous and current operators differ\n");
+  return ok ? 0 : 1;
+}
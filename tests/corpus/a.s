@@ -0,0 +1 @@
+<? if (getvar(0) > 0) result = call("a.s", getvar(0) - 1) + call("b.s"); else result = 0; ?>
\ No newline at end of file
@@ -0,0 +1 @@
+<? for (k = 1000; k < 1200; ++k) { a = {}; for (i = 0; i < 20; ++i) arrayadd(&a, i * k); b = {1, 2, 3, k}; } ?>
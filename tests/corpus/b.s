@@ -0,0 +1 @@
+<? result = 1; ?>
\ No newline at end of file
@@ -0,0 +1 @@
+<? for (i = 1000; i < 1200; ++i) x = call("a.s", 3); ?>
@@ -0,0 +1 @@
+<? for (i = 1000; i < 1200; ++i) { v = inireadstring("cfg.ini", "key3", ""); w = inireaduint("cfg.ini", "port", 0); } ?>
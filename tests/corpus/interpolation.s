@@ -0,0 +1 @@
+<? name = "sensor"; for (i = 1000; i < 6000; ++i) { s = "row $i of $name: $(i * 2)"; : "<td>$i</td><td>$name</td>"; } ?>
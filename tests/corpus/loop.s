@@ -0,0 +1 @@
+<? x = 0; for (i = 1000; i < 11000; ++i) { x = x + i % 7; if (x > 1000) x = 0; } ?>
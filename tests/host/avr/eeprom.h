@@ -0,0 +1,13 @@
+// host stand-in for <avr/eeprom.h> (see tests/Makefile)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+inline uint8_t eeprom_read_byte(const uint8_t*){return 0;}
+inline uint16_t eeprom_read_word(const uint16_t*){return 0;}
+inline uint32_t eeprom_read_dword(const uint32_t*){return 0;}
+inline void eeprom_read_block(void*, const void*, size_t){}
+inline void eeprom_update_byte(uint8_t*, uint8_t){}
+inline void eeprom_update_word(uint16_t*, uint16_t){}
+inline void eeprom_update_dword(uint32_t*, uint32_t){}
+inline void eeprom_update_block(const void*, void*, size_t){}
+inline void eeprom_write_byte(uint8_t*, uint8_t){}
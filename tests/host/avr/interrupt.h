@@ -0,0 +1,5 @@
+// host stand-in for <avr/interrupt.h> (see tests/Makefile)
+#pragma once
+#define cli()
+#define sei()
+#define ISR(x) void x()
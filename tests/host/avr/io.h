@@ -0,0 +1,127 @@
+// host stand-in for <avr/io.h> (see tests/Makefile)
+#pragma once
+#include <stdint.h>
+extern volatile uint8_t REGS[256];
+#define R(n) (REGS[n])
+#define DDRA R(1)
+#define DDRB R(2)
+#define DDRC R(3)
+#define DDRD R(4)
+#define DDRE R(5)
+#define DDRF R(6)
+#define DDRG R(7)
+#define DDRH R(8)
+#define DDRJ R(9)
+#define DDRK R(10)
+#define DDRL R(11)
+#define PINA R(12)
+#define PINB R(13)
+#define PINC R(14)
+#define PIND R(15)
+#define PINE R(16)
+#define PINF R(17)
+#define PING R(18)
+#define PINH R(19)
+#define PINJ R(20)
+#define PINK R(21)
+#define PINL R(22)
+#define PORTA R(23)
+#define PORTB R(24)
+#define PORTC R(25)
+#define PORTD R(26)
+#define PORTE R(27)
+#define PORTF R(28)
+#define PORTG R(29)
+#define PORTH R(30)
+#define PORTJ R(31)
+#define PORTK R(32)
+#define PORTL R(33)
+#define TCCR0B R(34)
+#define TIMSK0 R(35)
+#define CS00 0
+#define CS01 1
+#define TOIE0 0
+#define TCNT0 R(36)
+#define TIFR0 R(37)
+#define TOV0 0
+#define SREG R(38)
+#define SPDR R(39)
+#define SPSR R(40)
+#define SPCR R(41)
+#define SPIF 7
+#define _BV(b) (1<<(b))
+#define bit_is_set(r,b) ((r)&_BV(b))
+#define bit_is_clear(r,b) (!((r)&_BV(b)))
+#define loop_until_bit_is_set(r,b) do{}while(bit_is_clear(r,b))
+#define ADCH R(43)
+#define ADCL R(44)
+#define ADCSRA R(45)
+#define ADCSRB R(46)
+#define ADEN 3
+#define ADMUX R(48)
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADSC 3
+#define CS02 2
+#define DORD 3
+#define EICRA R(55)
+#define EICRB R(56)
+#define EIMSK R(57)
+#define INT0 0
+#define INT1 1
+#define INT2 2
+#define INT3 3
+#define INT4 4
+#define INT5 5
+#define INT6 6
+#define INT7 7
+#define ISC00 0
+#define ISC01 1
+#define ISC10 0
+#define ISC11 1
+#define ISC20 0
+#define ISC21 1
+#define ISC30 0
+#define ISC31 1
+#define ISC40 0
+#define ISC41 1
+#define ISC50 0
+#define ISC51 1
+#define ISC60 0
+#define ISC61 1
+#define ISC70 0
+#define ISC71 1
+#define MSTR 3
+#define MUX5 5
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PCICR R(99)
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCMSK0 R(103)
+#define PCMSK1 R(104)
+#define PCMSK2 R(105)
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define SPE 3
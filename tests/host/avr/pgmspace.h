@@ -0,0 +1,19 @@
+// host stand-in for <avr/pgmspace.h> (see tests/Makefile)
+#pragma once
+#include <string.h>
+#include <stdint.h>
+#define PROGMEM
+#define PSTR(s) (s)
+typedef const char* PGM_P;
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcasecmp_P strcasecmp
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define pgm_read_ptr(p) (*(void* const*)(p))
+#define memcmp_P memcmp
@@ -0,0 +1,2 @@
+// host stand-in for <compat/twi.h> (see tests/Makefile)
+#pragma once
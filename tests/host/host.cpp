@@ -0,0 +1,26 @@
+// Definitions the libraries expect from the AVR runtime (linked into every host test).
+
+#include "fdv_generic/fdv_string.h"
+#include "fdv_generic/fdv_timesched.h"
+
+volatile uint8_t REGS[256];
+
+namespace fdv
+{
+  uint16_t const string::PREALLOCSIZE;
+
+  string const toString(uint8_t v) { char b[8]; sprintf(b, "%u", v); return string(b); }
+
+  uint16_t getFreeMem() { return 4000; }
+
+  uint32_t volatile s_seconds;
+  uint32_t          s_LastSeconds;
+  uint32_t volatile s_overflowCount;
+  uint32_t volatile s_millis;
+  uint8_t  volatile s_fract;
+  uint8_t  volatile s_specialMeasure;
+  uint32_t volatile s_specialMeasureValue;
+
+  Arena* Arena::s_first   = NULL;
+  Arena* Arena::s_current = NULL;
+}
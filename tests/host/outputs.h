@@ -0,0 +1,46 @@
+// Script Output stand-ins for host builds.
+
+#pragma once
+
+#include <string.h>
+
+#include "fdv_generic/fdv_string.h"
+
+
+// Output which counts the written characters
+struct CountingOutput
+{
+  uint32_t count;
+
+  CountingOutput()
+    : count(0)
+  {
+  }
+
+  void write(char)
+  {
+    ++count;
+  }
+
+  void write(char const* str)
+  {
+    count += strlen(str);
+  }
+};
+
+
+// Output which keeps the written text
+struct StringOutput
+{
+  fdv::string text;
+
+  void write(char c)
+  {
+    text.push_back(c);
+  }
+
+  void write(char const* str)
+  {
+    text.append(str);
+  }
+};
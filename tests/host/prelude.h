@@ -0,0 +1,28 @@
+// Forced include (-include host/prelude.h) for host builds: the avr-libc
+// functions and the fdv declarations the libraries expect from the AVR toolchain.
+
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef char prog_char;
+
+inline char* itoa(int v, char* s, int) { sprintf(s, "%d", v); return s; }
+inline char* utoa(unsigned v, char* s, int) { sprintf(s, "%u", v); return s; }
+inline char* ltoa(long v, char* s, int) { sprintf(s, "%ld", v); return s; }
+inline char* ultoa(unsigned long v, char* s, int) { sprintf(s, "%lu", v); return s; }
+inline char* dtostrf(double d, signed char w, unsigned char p, char* s) { sprintf(s, "%*.*f", w, p, d); return s; }
+
+namespace fdv
+{
+  inline void freeEx(void* p) { free(p); }
+
+  class string;
+  string const toString(uint8_t v);
+
+  // size_t is 64 bit on the host
+  inline size_t max(size_t a, uint16_t b) { return a > b ? a : b; }
+  inline size_t max(uint16_t a, size_t b) { return a > b ? a : b; }
+}
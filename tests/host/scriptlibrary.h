@@ -0,0 +1,39 @@
+// fdv_scriptLibrary.h for host builds: the AVR inline assembly (delayMicroseconds())
+// is dropped and WirelessRPC, which belongs to the application, is replaced by a
+// stand-in whose calls always fail.
+
+#pragma once
+
+#define __asm__
+#define __volatile__(...)
+
+namespace fdv
+{
+  struct WirelessRPC
+  {
+    enum
+    {
+      METHOD_GET_TEMPERATURE,
+      METHOD_GET_CARBON_MONOXIDE,
+      METHOD_BOILER_ACTIVE,
+      METHOD_BOILER_QUERY,
+      METHOD_SYSTEM_UPTIME,
+      METHOD_BUZZER_ALARM
+    };
+
+    static uint8_t localDeviceID()
+    {
+      return 0;
+    }
+
+    static bool call(uint8_t, uint8_t, int, uint8_t const*, uint8_t, uint8_t**, uint8_t*)
+    {
+      return false;
+    }
+  };
+}
+
+#include "fdv_script/fdv_scriptLibrary.h"
+
+#undef __asm__
+#undef __volatile__
@@ -0,0 +1,228 @@
+// Memory-backed stand-ins for host builds: SdFile (so FileSystem/File work without
+// an SD card) and the script Output classes of outputs.h.
+// Include once per program, after the fdv headers: it defines the SdFile members.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "outputs.h"
+
+
+namespace memfs
+{
+
+  struct MemFile
+  {
+    char     name[16];
+    char     data[8192];
+    uint32_t size;
+    uint16_t stamp;    // reported as lastWriteTime, changed by put()
+  };
+
+  static uint8_t const MAXFILES = 16;
+
+  inline MemFile* files()
+  {
+    static MemFile s_files[MAXFILES];
+    return s_files;
+  }
+
+  struct Counters
+  {
+    uint32_t opens;
+    uint32_t reads;
+    uint32_t writes;
+  };
+
+  inline Counters& counters()
+  {
+    static Counters s_counters;
+    return s_counters;
+  }
+
+  // name is matched case insensitively, like on the SD card
+  inline MemFile* find(char const* name)
+  {
+    for (uint8_t i = 0; i != MAXFILES; ++i)
+      if (files()[i].name[0] && strcasecmp(files()[i].name, name) == 0)
+        return &files()[i];
+    return NULL;
+  }
+
+  inline MemFile* create(char const* name)
+  {
+    for (uint8_t i = 0; i != MAXFILES; ++i)
+      if (!files()[i].name[0])
+      {
+        MemFile* m = &files()[i];
+        strcpy(m->name, name);
+        m->size = 0;
+        return m;
+      }
+    return NULL;
+  }
+
+  // creates or replaces a file (as if written by another program)
+  inline bool put(char const* name, char const* data, uint32_t size)
+  {
+    MemFile* m = find(name);
+    if (!m)
+      m = create(name);
+    if (!m || size > sizeof(m->data))
+      return false;
+    memcpy(m->data, data, size);
+    m->size = size;
+    ++m->stamp;
+    return true;
+  }
+
+  inline bool put(char const* name, char const* data)
+  {
+    return put(name, data, strlen(data));
+  }
+
+  // copies the host file "path" as "name"
+  inline bool load(char const* name, char const* path)
+  {
+    FILE* f = fopen(path, "rb");
+    if (!f)
+      return false;
+    static char buf[sizeof(MemFile().data) + 1];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return put(name, buf, n);
+  }
+
+  inline void clear()
+  {
+    memset(files(), 0, sizeof(MemFile) * MAXFILES);
+  }
+
+} // end of memfs namespace
+
+
+// firstCluster_ is the file index + 1
+static memfs::MemFile* memFileOf(SdFile* f)
+{
+  return f->firstCluster() ? &memfs::files()[f->firstCluster() - 1] : NULL;
+}
+
+uint8_t SdFile::open(SdFile*, char const* name, uint8_t oflag)
+{
+  ++memfs::counters().opens;
+  memfs::MemFile* m = memfs::find(name);
+  if (!m && (oflag & O_CREAT))
+    m = memfs::create(name);
+  if (!m)
+    return 0;
+  if (oflag & O_TRUNC)
+    m->size = 0;
+  firstCluster_ = m - memfs::files() + 1;
+  type_         = FAT_FILE_TYPE_NORMAL;
+  curPosition_  = 0;
+  fileSize_     = m->size;
+  return 1;
+}
+
+uint8_t SdFile::openRoot(SdVolume*)
+{
+  type_ = FAT_FILE_TYPE_ROOT16;
+  return 1;
+}
+
+uint8_t SdFile::close()
+{
+  type_         = FAT_FILE_TYPE_CLOSED;
+  firstCluster_ = 0;
+  return 1;
+}
+
+int16_t SdFile::read(void* buf, uint16_t nbyte)
+{
+  ++memfs::counters().reads;
+  memfs::MemFile* m = memFileOf(this);
+  if (!m)
+    return -1;
+  if (curPosition_ >= m->size)
+    return 0;
+  if (curPosition_ + nbyte > m->size)
+    nbyte = m->size - curPosition_;
+  memcpy(buf, m->data + curPosition_, nbyte);
+  curPosition_ += nbyte;
+  return nbyte;
+}
+
+int16_t SdFile::write(void const* buf, uint16_t nbyte)
+{
+  ++memfs::counters().writes;
+  memfs::MemFile* m = memFileOf(this);
+  if (!m || curPosition_ + nbyte > sizeof(m->data))
+    return -1;
+  memcpy(m->data + curPosition_, buf, nbyte);
+  curPosition_ += nbyte;
+  if (curPosition_ > m->size)
+    m->size = curPosition_;
+  fileSize_ = m->size;
+  return nbyte;
+}
+
+void SdFile::write(char const* str)
+{
+  write(str, strlen(str));
+}
+
+void SdFile::write_P(PGM_P str)
+{
+  write(str);
+}
+
+uint8_t SdFile::seekSet(uint32_t pos)
+{
+  curPosition_ = pos;
+  return 1;
+}
+
+uint8_t SdFile::dirEntry(dir_t* dir)
+{
+  memfs::MemFile* m = memFileOf(this);
+  memset(dir, 0, sizeof(dir_t));
+  dir->fileSize      = m->size;
+  dir->lastWriteDate = 0x4000;
+  dir->lastWriteTime = m->stamp;
+  return 1;
+}
+
+uint8_t SdFile::remove(SdFile*, char const* name)
+{
+  memfs::MemFile* m = memfs::find(name);
+  if (!m)
+    return 0;
+  m->name[0] = 0;
+  return 1;
+}
+
+uint8_t SdFile::makeDir(SdFile*, char const*)
+{
+  return 0;
+}
+
+uint8_t SdFile::rmDir()
+{
+  return 0;
+}
+
+uint8_t SdFile::sync()
+{
+  return 1;
+}
+
+uint8_t SdFile::truncate(uint32_t length)
+{
+  memfs::MemFile* m = memFileOf(this);
+  if (length < m->size)
+    m->size = fileSize_ = length;
+  return 1;
+}
@@ -0,0 +1,6 @@
+// host stand-in for <util/atomic.h> (see tests/Makefile)
+#pragma once
+#define ATOMIC_BLOCK(x) for(int _i=1;_i;_i=0)
+#define NONATOMIC_BLOCK(x) for(int _i=1;_i;_i=0)
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
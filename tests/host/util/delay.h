@@ -0,0 +1,4 @@
+// host stand-in for <util/delay.h> (see tests/Makefile)
+#pragma once
+inline void _delay_ms(double){}
+inline void _delay_us(double){}
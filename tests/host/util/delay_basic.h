@@ -0,0 +1,2 @@
+// host stand-in for <util/delay_basic.h> (see tests/Makefile)
+#pragma once
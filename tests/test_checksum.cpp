@@ -0,0 +1,306 @@
+// Internet checksum: DataList::calcInternetChecksum() over random buffer splits and
+// InternetChecksum::update() against a full recompute, then routing of datagrams by
+// Protocol_IP (TTL, incremental header checksum, bad checksums, header options).
+
+#include "fdv_network/fdv_TCPIP.h"
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+namespace fdv
+{
+  void TimeOut::timeOutFunc(uint8_t taskIndex)
+  {
+    TaskManager::get(taskIndex).m_everyMillisecs = 0xFFFFFFFF;
+  }
+
+  Task volatile TaskManager::s_info[TaskManager::MAXTASKS];
+}
+
+
+static uint32_t const ITERATIONS = 200000;
+
+static uint32_t s_random = 1;
+
+static uint32_t nextRandom(uint32_t range)
+{
+  s_random = s_random * 1103515245 + 12345;
+  return (s_random >> 8) % range;
+}
+
+
+// reference: byte by byte, RFC 1071
+static uint16_t referenceChecksum(uint8_t const* data, uint16_t length)
+{
+  uint32_t sum = 0;
+  for (uint16_t i = 0; i != length; ++i)
+    sum += (i & 1) ? data[i] : data[i] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+// random lengths (odd and even) split in 1..5 buffers at random points (empty buffers too)
+static int testSplits()
+{
+  static uint8_t data[1500];
+  uint32_t mismatches = 0;
+  for (uint32_t it = 0; it != ITERATIONS; ++it)
+  {
+    uint16_t length = nextRandom(sizeof(data));
+    for (uint16_t i = 0; i != length; ++i)
+      data[i] = nextRandom(256);
+
+    uint8_t  count = 1 + nextRandom(5);
+    uint16_t cuts[6];
+    cuts[0]     = 0;
+    cuts[count] = length;
+    for (uint8_t i = 1; i != count; ++i)
+    {
+      cuts[i] = nextRandom(length + 1);
+      for (uint8_t j = i; j > 1 && cuts[j - 1] > cuts[j]; --j)
+      {
+        uint16_t t = cuts[j]; cuts[j] = cuts[j - 1]; cuts[j - 1] = t;
+      }
+    }
+
+    DataList* lists[5];
+    DataList* next = NULL;
+    for (int8_t i = count - 1; i >= 0; --i)
+      next = lists[i] = new DataList(next, data + cuts[i], cuts[i + 1] - cuts[i]);
+
+    if (next->calcInternetChecksum() != referenceChecksum(data, length) && mismatches++ < 5)
+      printf("     mismatch: length=%u buffers=%u\n", length, count);
+
+    for (uint8_t i = 0; i != count; ++i)
+      delete lists[i];
+  }
+  return check(mismatches == 0, "calcInternetChecksum() of random buffer splits");
+}
+
+
+static void setChecksum(uint8_t* header, uint16_t checksum)
+{
+  header[10] = checksum >> 8;
+  header[11] = checksum & 0xFF;
+}
+
+
+// changes a 16 bit word and then an IP address of a valid header, updating its checksum
+static int testUpdates()
+{
+  uint32_t mismatches16 = 0, mismatches32 = 0;
+  for (uint32_t it = 0; it != ITERATIONS; ++it)
+  {
+    uint8_t header[20];
+    for (uint8_t i = 0; i != sizeof(header); ++i)
+      header[i] = it % 7 == 0 ? 0 : nextRandom(256);    // also all zeros (checksum 0xFFFF)
+    setChecksum(header, 0);
+    uint16_t checksum = referenceChecksum(header, 20);
+    setChecksum(header, checksum);
+
+    uint8_t  w        = nextRandom(9) * 2;   // any word but the checksum
+    w = w == 10 ? 18 : w;
+    uint16_t oldValue = InternetChecksum::word(header + w);
+    uint16_t newValue = it % 5 == 0 ? 0 : nextRandom(0x10000);
+    header[w]     = newValue >> 8;
+    header[w + 1] = newValue & 0xFF;
+    checksum = InternetChecksum::update(checksum, oldValue, newValue);
+    setChecksum(header, checksum);
+    uint16_t verify = referenceChecksum(header, 20);
+    if (verify != 0 && verify != 0xFFFF)
+      ++mismatches16;
+
+    uint8_t address[4];
+    for (uint8_t i = 0; i != 4; ++i)
+      address[i] = it % 3 == 0 ? 0 : nextRandom(256);
+    checksum = InternetChecksum::update(checksum, header + 12, address);
+    memcpy(header + 12, address, 4);
+    setChecksum(header, checksum);
+    verify = referenceChecksum(header, 20);
+    if (verify != 0 && verify != 0xFFFF)
+      ++mismatches32;
+  }
+  int errors = check(mismatches16 == 0, "update() of a 16 bit field");
+  errors += check(mismatches32 == 0, "update() of a 32 bit field");
+  return errors;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Routing
+
+struct ReceivedFrame : LinkLayerReceiveFrame
+{
+  uint8_t const* data;
+  uint16_t       pos;
+
+  ReceivedFrame(uint8_t const* data_, uint16_t length, bool verified)
+    : data(data_), pos(0)
+  {
+    type_length      = 0x0800;
+    dataLength       = length;
+    checksumVerified = verified;
+  }
+
+  void readReset()
+  {
+    pos = 0;
+  }
+
+  uint8_t readByte()
+  {
+    return pos < dataLength ? data[pos++] : 0;
+  }
+
+  uint16_t readWord()
+  {
+    uint16_t hi = readByte();
+    return hi << 8 | readByte();
+  }
+
+  void readBlock(void* buffer, uint16_t length)
+  {
+    for (uint16_t i = 0; i != length; ++i)
+      static_cast<uint8_t*>(buffer)[i] = readByte();
+  }
+};
+
+
+// keeps the last sent frame
+struct CaptureLink : ILinkLayer
+{
+  LinkAddress         address;
+  bool                offload;
+  uint8_t             sent[1600];
+  int16_t             sentLength;   // -1 = nothing sent
+
+  CaptureLink(uint8_t id, bool offload_)
+    : address(2, 0, 0, 0, 0, id), offload(offload_), sentLength(-1)
+  {
+  }
+
+  bool checksumOffload() const
+  {
+    return offload;
+  }
+
+  LinkAddress const& getAddress() const
+  {
+    return address;
+  }
+
+  void addListener(ILinkLayerListener*)
+  {
+  }
+
+  void recvFrame()
+  {
+  }
+
+  SendResult sendFrame(LinkLayerSendFrame const* frame)
+  {
+    sentLength = 0;
+    for (DataList const* d = frame->dataList; d; d = d->next)
+    {
+      memcpy(sent + sentLength, d->data, d->length);
+      sentLength += d->length;
+    }
+    for (LinkLayerChecksum const* c = frame->checksums; c; c = c->next)
+    {
+      uint16_t value = referenceChecksum(sent + c->start, c->length);
+      sent[c->position]     = value >> 8;
+      sent[c->position + 1] = value & 0xFF;
+    }
+    return SendOK;
+  }
+};
+
+
+// forwards UDP datagrams from 10.0.0.0/24 (interface 0) to 10.0.1.0/24 (interface 1)
+static int testRouting(bool offload)
+{
+  printf("-- routing, checksum offload %s\n", offload ? "on" : "off");
+  int errors = 0;
+  CaptureLink  link0(1, offload), link1(2, offload);
+  Protocol_ARP arp;
+  Protocol_IP  ip(true);
+  arp.addInterface(&link0, IPAddress(10, 0, 0, 1));
+  arp.addInterface(&link1, IPAddress(10, 0, 1, 1));
+  ip.setARP(&arp);
+  ip.addRoute(IPAddress(10, 0, 0, 0), IPAddress(255, 255, 255, 0), IPAddress(10, 0, 0, 1), 0);
+  ip.addRoute(IPAddress(10, 0, 1, 0), IPAddress(255, 255, 255, 0), IPAddress(10, 0, 1, 1), 1);
+  arp.addCacheTableItem(Protocol_ARP::Item(IPAddress(10, 0, 1, 5), LinkAddress(2, 0, 0, 0, 0, 9), seconds()));
+
+  uint8_t datagram[20 + 8 + 5] = { 0x45, 0, 0, 33, 0x12, 0x34, 0x40, 0, 17, 17, 0, 0, 10, 0, 0, 5, 10, 0, 1, 5,
+                                   0, 7, 0, 9, 0, 13, 0, 0, 'h', 'e', 'l', 'l', 'o' };
+
+  // TTL 17 is forwarded with TTL 16, TTL 1 expires
+  static uint8_t const ttls[2] = { 17, 1 };
+  for (uint8_t i = 0; i != 2; ++i)
+  {
+    uint8_t ttl = ttls[i];
+    datagram[8] = ttl;
+    setChecksum(datagram, 0);
+    setChecksum(datagram, referenceChecksum(datagram, 20));
+    ReceivedFrame frame(datagram, sizeof(datagram), false);
+    link1.sentLength = -1;
+    ip.processLinkLayerFrame(&frame);
+    if (ttl > 1)
+      errors += check(link1.sentLength == sizeof(datagram) && link1.sent[8] == ttl - 1 && referenceChecksum(link1.sent, 20) == 0 &&
+                      memcmp(link1.sent, datagram, 8) == 0 && memcmp(link1.sent + 20, datagram + 20, 13) == 0, "forwarded, TTL decremented");
+    else
+      errors += check(link1.sentLength == -1, "TTL expired: dropped");
+  }
+
+  // bad header checksum
+  datagram[8] = 9;
+  datagram[10] ^= 0x10;
+  {
+    ReceivedFrame frame(datagram, sizeof(datagram), false);
+    link1.sentLength = -1;
+    ip.processLinkLayerFrame(&frame);
+    errors += check(link1.sentLength == -1 && ip.checksumErrors().IP == 1, "bad header checksum: dropped and counted");
+  }
+  {
+    ReceivedFrame frame(datagram, sizeof(datagram), true);
+    ip.processLinkLayerFrame(&frame);
+    errors += check(link1.sentLength == sizeof(datagram) && ip.checksumErrors().IP == 1, "verified by the link layer: not checked again");
+  }
+
+  // header with options (IHL = 6): forwarded with a rebuilt header, the payload must not shift
+  for (uint8_t verified = 0; verified != 2; ++verified)
+  {
+    uint8_t options[24 + 8 + 5] = { 0x46, 0, 0, 37, 0x12, 0x34, 0x40, 0, 9, 17, 0, 0, 10, 0, 0, 5, 10, 0, 1, 5, 1, 1, 1, 0,
+                                    0, 7, 0, 9, 0, 13, 0, 0, 'h', 'e', 'l', 'l', 'o' };
+    setChecksum(options, referenceChecksum(options, 24));
+    ReceivedFrame frame(options, sizeof(options), verified);
+    link1.sentLength = -1;
+    ip.processLinkLayerFrame(&frame);
+    errors += check(link1.sentLength == 20 + 13 && referenceChecksum(link1.sent, 20) == 0 && memcmp(link1.sent + 20, options + 24, 13) == 0,
+                    verified ? "header with options forwarded (verified by the link layer)" : "header with options forwarded");
+  }
+  return errors;
+}
+
+
+int main()
+{
+  int errors = testSplits();
+  errors += testUpdates();
+  errors += testRouting(false);
+  errors += testRouting(true);
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}
@@ -0,0 +1,89 @@
+// ScriptLibrary builtins called with wrong parameter types must fail the script (directly
+// executed and compiled), never write through a value that is not what it expects.
+// Build with -fsanitize=address to catch memory errors too.
+
+#include "host/scriptlibrary.h"
+#include "host/standins.h"
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+typedef RunTime<StringOutput, ScriptLibrary> TestRunTime;
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+// runs "script" directly and compiled, returns both outputs if they match ("<error>" on failure)
+static string run(FileSystem& fileSystem, char const* script)
+{
+  ScriptLibrary library(&fileSystem);
+
+  StringOutput directOutput;
+  TestRunTime  directRunTime(&directOutput, &library, NULL);
+  TextInput    directInput(script);
+  if (!Script<TestRunTime>(&directRunTime, &directInput).parse_script())
+    directOutput.text = "<error>";
+
+  StringOutput compiledOutput;
+  TestRunTime  compiledRunTime(&compiledOutput, &library, NULL);
+  TextInput    compiledInput(script);
+  ScriptCode   code;
+  if (!compileScript<TestRunTime>(&compiledInput, &code) || !runScript(&compiledRunTime, &compiledInput, &code))
+    compiledOutput.text = "<error>";
+
+  return directOutput.text == compiledOutput.text ? directOutput.text : string("<mismatch>");
+}
+
+
+struct Case
+{
+  char const* script;
+  char const* output;
+};
+
+static Case const cases[] =
+{
+  // references as expected
+  { "<? m = {\"a\": 1, \"b\": 2}; mapdel(&m, \"a\"); : mapkeys(m); ?>",      "{\"b\"}" },
+  { "<? a = {1}; arrayadd(&a, 2); arrayins(&a, 0, 0); arraydel(&a, 1); : a : sizeof(a); ?>", "{0,2}2" },
+  // references missing
+  { "<? m = {\"a\": 1}; : mapdel(m, \"a\"); ?>",                              "<error>" },
+  { "<? m = {\"a\": 1}; mapdel(m, \"a\"); : m; ?>",                           "<error>" },
+  { "<? a = {1}; arrayadd(a, 2); ?>",                                          "<error>" },
+  { "<? a = {1}; arrayins(a, 0, 2); ?>",                                       "<error>" },
+  { "<? a = {1}; arraydel(a, 0); ?>",                                          "<error>" },
+  { "<? : mapdel(\"a\", \"a\"); ?>",                                           "<error>" },
+  { "<? : mapdel(5, \"a\"); ?>",                                               "<error>" },
+  // references to the wrong type
+  { "<? s = \"text\"; : mapdel(&s, \"a\"); ?>",                                "<error>" },
+  { "<? : mapkeys(\"a\"); ?>",                                                 "<error>" },
+  { "<? : maphas(7, \"a\"); ?>",                                               "<error>" },
+  // numbers and strings are still converted
+  { "<? : strleft(\"hello\", \"2\") : strleft(\"hello\", 1.5); ?>",                "heh" },
+};
+
+
+int main()
+{
+  int errors = 0;
+  SDCard*    card = NULL;
+  FileSystem fileSystem(card);
+
+  for (uint8_t i = 0; i != sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    string output = run(fileSystem, cases[i].script);
+    errors += check(output == cases[i].output, cases[i].script);
+    if (output != cases[i].output)
+      printf("     output [%s], expected [%s]\n", output.c_str(), cases[i].output);
+  }
+
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}
@@ -0,0 +1,142 @@
+// Compiled scripts (compileScript() + runScript()) must behave like the directly
+// executed ones (Script::parse_script()), with and without FDV_SCRIPT_OPTIMIZE.
+// The Makefile builds this test three times (FDV_SCRIPT_OPTIMIZE=1 and 0, FDV_SCRIPT_PROFILER)
+// and also checks that all builds print the same output.
+
+#include "fdv_script/fdv_script.h"
+#include "host/outputs.h"
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+static char const* const libFuncs[] = { "add", "str", "write" };
+
+struct TestLibrary
+{
+  uint16_t findFunc(char const* name)
+  {
+    for (uint16_t i = 0; i != sizeof(libFuncs) / sizeof(libFuncs[0]); ++i)
+      if (strcmp(name, libFuncs[i]) == 0)
+        return i;
+    return 0xFFFF;
+  }
+
+  template <typename RunTimeT>
+  bool execFunc(uint16_t id, RunTimeT& runtime, Variant* result)
+  {
+    switch (id)
+    {
+      case 0:
+        *result = runtime.vars[0].value + runtime.vars[1].value;
+        return true;
+      case 1:
+        result->stringVal() = runtime.vars[0].value.toString();
+        return true;
+      case 2:
+        runtime.output->write(runtime.vars[0].value.toString().c_str());
+        return true;
+    }
+    return false;
+  }
+};
+
+typedef RunTime<StringOutput, TestLibrary> TestRunTime;
+
+
+static char const* const scripts[] =
+{
+  // constant expressions
+  "<? x = 60*60*24; : x : \" \" : 1+2*3-4 : \" \" : -5 + 2 : \" \" : !0 : ~0 : \" \" : 7/2 : \" \" : 1.5*2; ?>.",
+  "<? : \"a\" + \"b\" : \" \" : \"n=$(60*60)px\" : \" \" : \"$(1+1)$(2+2)\" : \" \" : 1 < 2 : 2 == 2 : 3 != 3 : (1 && 0) : (0 || 5); ?>.",
+  "<? x = 5; : x + 1 + 2 : \" \" : 1 + 2 + x : \" \" : x * (2 + 3) : \" \" : 10 - 2 - 3 : 1 << 4 : 256 >> 2 : 6 & 3 : 6 ^ 3 : 6 | 1; ?>.",
+  "<? : 4000000000 + 1000000000 : \" \" : 100 * 1000 : \" \" : 0 - 1 : \" \" : 250 + 10; ?>.",
+  "<? a = {1+1, 2*3}; m = {\"k\" + \"1\": 10*10}; : a : m : 2 + a[0] + 1; ?>.",
+  "<? : 1 ? 2 + 3 : 4 : (1 ? 2 : 3) + 4 : (0 ? 1 : 2); ?>.",
+  // dead branches and constant conditions
+  "<? if (0) { : \"dead\"; } else { : \"live\"; } if (1) : \"yes\"; else : \"no\"; if (2-2) : \"x\"; ?>.",
+  "<? i = 0; while (0) { : \"never\"; } while (1) { ++i; if (i > 3) break; : i; } ?>.",
+  "<? for (i = 0; i < 3; ++i) { if (0) continue; if (1) : i; else break; } ?>.",
+  "<? do { : \"once\"; } while (0); x = 0; while (x < 2) { x = x + 1 * 1; } : x; ?>.",
+  "<? if (0) { ?>dead text<? } ?>live text.",
+  // function definitions inside dead or runtime-false branches
+  "<? if (0) { func g() { return 5; } } : g(); ?>.",
+  "<? if (0) { func g() { return 5; } } : \"x\"; ?>.",
+  "<? x = 0; if (x) { func g() { return 1; } } : g(); ?>.",
+  "<? if (1) { func g() { return 1; } } else { func g() { return 2; } } : g(); ?>.",
+  "<? for (i = 0; i < 2; ++i) { if (i) { func h() { return \"one\"; } } else { func h() { return \"zero\"; } } : h(); } ?>.",
+  "<? if (0) { func str(v) { return \"user\"; } } : str(5); ?>.",
+  // functions
+  "<? func fact(n) { if (n < 2) return 1; return n * fact(n - 1); } : fact(5); ?>.",
+  "<? func fib(n) { if (n < 2) return n; return fib(n-1) + fib(n-2); } for (k = 0; k < 7; ++k) : fib(k) : \" \"; ?>.",
+  "<? func d(n) { if (n == 0) return 0; return d(n - 1) + 1; } : d(6) : d(7); : d(8); ?>.",
+  "<? func s(x) { return \"v=$x\"; } : s(add(1, 2 * 3)); ?>.",
+  "<? func t() { if (0) return 1; ?>text<? return 5; } : t() : t(); ?>.",
+  "<? : str(5); func str(v) { return \"u\"; } : str(5); func str(v) { return \"w\"; } : str(5); ?>.",
+  NULL
+};
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+// runs "script" directly and compiled, returns the number of failures
+static int compare(char const* script)
+{
+  TestLibrary library;
+
+  StringOutput directOutput;
+  TestRunTime  directRunTime(&directOutput, &library, NULL);
+  TextInput    directInput(script);
+  bool directOK = Script<TestRunTime>(&directRunTime, &directInput).parse_script();
+
+  StringOutput compiledOutput;
+  TestRunTime  compiledRunTime(&compiledOutput, &library, NULL);
+  TextInput    compiledInput(script);
+  ScriptCode   code;
+  bool compiled   = compileScript<TestRunTime>(&compiledInput, &code);
+  bool compiledOK = compiled && runScript(&compiledRunTime, &compiledInput, &code);
+
+  bool same = compiled && directOK == compiledOK && directOutput.text == compiledOutput.text;
+  printf("%s %s -> %s[%s]\n", same ? "ok  " : "FAIL", script, directOK ? "" : "error ", directOutput.text.c_str());
+  if (!same)
+    printf("     compiled=%d -> %s[%s]\n", compiled, compiledOK ? "" : "error ", compiledOutput.text.c_str());
+  return same ? 0 : 1;
+}
+
+
+static uint16_t codeSize(char const* script)
+{
+  TextInput  input(script);
+  ScriptCode code;
+  return compileScript<TestRunTime>(&input, &code) ? code.code.size() : 0;
+}
+
+
+int main()
+{
+  int errors = 0;
+
+  for (uint8_t i = 0; scripts[i]; ++i)
+    errors += compare(scripts[i]);
+
+  // the optimizer folds constants and drops dead code, otherwise the code is kept as written
+  // (the "if" statement itself is compiled in both, so FDV_SCRIPT_PROFILER builds compare too)
+  uint16_t product = codeSize("<? x = 60 * 60 * 24; ?>"), folded = codeSize("<? x = 86400; ?>");
+  uint16_t dead    = codeSize("<? if (0) { : \"dead\"; func g() { return 1; } } : 1; ?>"), live = codeSize("<? if (0) { } : 1; ?>");
+#if FDV_SCRIPT_OPTIMIZE
+  errors += check(product == folded, "constant expressions folded as configured");
+  errors += check(dead == live, "dead branches dropped as configured");
+#else
+  errors += check(product > folded, "constant expressions folded as configured");
+  errors += check(dead > live, "dead branches dropped as configured");
+#endif
+
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}
@@ -0,0 +1,85 @@
+// ScriptProfiler: statements are counted per script and offset, so statements of different
+// scripts at the same offset (ie a script and the ones it runs with call()) are not mixed.
+// The Makefile builds this test with FDV_SCRIPT_PROFILER.
+
+#include "host/scriptlibrary.h"
+#include "host/standins.h"
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+typedef RunTime<StringOutput, ScriptLibrary> TestRunTime;
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+static bool runFile(FileSystem& fileSystem, char const* filename)
+{
+  StringOutput  output;
+  ScriptLibrary library(&fileSystem);
+  TestRunTime   runTime(&output, &library, NULL);
+  File          file(fileSystem, filename, File::MD_READ);
+  return file.isOpen() && parseScriptFile(&runTime, fileSystem, filename, file);
+}
+
+
+static bool runText(FileSystem& fileSystem, char const* script)
+{
+  StringOutput  output;
+  ScriptLibrary library(&fileSystem);
+  TestRunTime   runTime(&output, &library, NULL);
+  TextInput     input(script);
+  return parseScript(&runTime, &input);
+}
+
+
+// count of the statement "name" ("script@offset") in the report, -1 if missing
+static int statementCount(string const& report, char const* name)
+{
+  string line = string("\n") + name + " ";
+  char const* found = strstr(report.c_str(), line.c_str());
+  return found ? atoi(found + line.size()) : -1;
+}
+
+
+int main()
+{
+  int errors = 0;
+  SDCard*    card = NULL;
+  FileSystem fileSystem(card);
+
+  // "x = 1;" and "y = 2;" at offset 2
+  memfs::put("A.S", "<? x = 1; for (i = 0; i < 3; ++i) r = call(\"b.s\"); ?>");
+  memfs::put("B.S", "<? y = 2; ?>");
+
+  ScriptProfiler::reset();
+  errors += check(runFile(fileSystem, "a.s") && runFile(fileSystem, "/A.S"), "a.s runs (compiled, then from cache)");
+  errors += check(runText(fileSystem, "<? z = 3; ?>"), "unnamed script runs");
+
+  StringOutput  report;
+  ScriptLibrary library(&fileSystem);
+  ScriptProfiler::dump(report, library);
+  printf("%s", report.text.c_str());
+  errors += check(statementCount(report.text, "a.s@2") == 2, "a.s statement counted apart");
+  errors += check(statementCount(report.text, "b.s@2") == 6, "b.s statement (call) counted apart");
+  errors += check(statementCount(report.text, "@2") == 1, "unnamed script statement counted apart");
+  errors += check(statementCount(report.text, "call") == 6, "call() counted");
+
+  // reset() while a script runs ("x = 1;" at offset 19): the running script is kept
+  memfs::put("C.S", "<? profile_reset(); x = 1; ?>");
+  errors += check(runFile(fileSystem, "c.s"), "c.s runs");
+  report.text.clear();
+  ScriptProfiler::dump(report, library);
+  printf("%s", report.text.c_str());
+  errors += check(statementCount(report.text, "c.s@19") == 1 && statementCount(report.text, "a.s@2") == -1, "counters reset, running script kept");
+
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}
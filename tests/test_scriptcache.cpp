@@ -0,0 +1,97 @@
+// ScriptCache: compiled scripts are stored next to their source (NAME.EXT -> NAME.ESB) and
+// loaded back, without ever replacing a source or a user file.
+
+#include "host/scriptlibrary.h"
+#include "host/standins.h"
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+typedef RunTime<StringOutput, ScriptLibrary> TestRunTime;
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+// runs "filename" with parseScriptFile(), returns its output ("<error>" on failure)
+static string run(FileSystem& fileSystem, char const* filename)
+{
+  StringOutput  output;
+  ScriptLibrary library(&fileSystem);
+  TestRunTime   runTime(&output, &library, NULL);
+  File          file(fileSystem, filename, File::MD_READ);
+  if (!file.isOpen() || !parseScriptFile(&runTime, fileSystem, filename, file))
+    return string("<error>");
+  return output.text;
+}
+
+
+static bool hasContent(char const* name, char const* content)
+{
+  memfs::MemFile* m = memfs::find(name);
+  return m && m->size == strlen(content) && memcmp(m->data, content, m->size) == 0;
+}
+
+
+static bool isCacheFile(char const* name)
+{
+  memfs::MemFile* m = memfs::find(name);
+  return m && m->size > 3 && memcmp(m->data, "SBC", 3) == 0;
+}
+
+
+int main()
+{
+  int errors = 0;
+  SDCard*    card = NULL;
+  FileSystem fileSystem(card);
+
+  string name;
+  errors += check(ScriptCache::cacheFilename("/www/index.htm", &name) && name == "/www/index.HSB", "cache name of index.htm");
+  errors += check(ScriptCache::cacheFilename("readme", &name) && name == "readme.SB", "cache name without extension");
+  errors += check(!ScriptCache::cacheFilename("x.sbc", &name), "SBC sources are not cached");
+  errors += check(!ScriptCache::cacheFilename("x.HSB", &name), "sources named as their own cache are not cached");
+
+  // sources with the same name and different extensions have their own cache
+  memfs::put("INDEX.HTM", "<? : 1 + 1; ?>");
+  memfs::put("INDEX.TXT", "<? : \"t\"; ?>");
+  for (uint8_t i = 0; i != 2; ++i)
+  {
+    run(fileSystem, "index.htm");
+    run(fileSystem, "/INDEX.TXT");
+  }
+  errors += check(isCacheFile("INDEX.HSB") && isCacheFile("INDEX.TSB"), "one cache file per source");
+  uint32_t writes = memfs::counters().writes;
+  errors += check(run(fileSystem, "index.htm") == "2" && run(fileSystem, "INDEX.TXT") == "t", "cached scripts output");
+  errors += check(memfs::counters().writes == writes, "cached scripts loaded, not saved again");
+
+  // a script with the SBC extension is not compiled over itself
+  char const* sbcSource = "<? : \"sbc\"; ?>";
+  memfs::put("X.SBC", sbcSource);
+  errors += check(run(fileSystem, "x.sbc") == "sbc" && hasContent("X.SBC", sbcSource) && !memfs::find("X.SSB"), "x.sbc runs, not cached");
+
+  // neither is a script named as its own cache file
+  char const* hsbSource = "<? : \"hsb\"; ?>";
+  memfs::put("Y.HSB", hsbSource);
+  errors += check(run(fileSystem, "y.hsb") == "hsb" && hasContent("Y.HSB", hsbSource), "y.hsb runs, not overwritten");
+
+  // a user file with the cache name is left alone
+  char const* userData = "user data";
+  memfs::put("DATA.HTM", "<? : \"data\"; ?>");
+  memfs::put("DATA.HSB", userData);
+  errors += check(run(fileSystem, "data.htm") == "data" && run(fileSystem, "data.htm") == "data", "data.htm runs");
+  errors += check(hasContent("DATA.HSB", userData), "user file with the cache name not overwritten");
+
+  // an outdated cache file is replaced
+  memfs::put("INDEX.HTM", "<? : 3 + 3; ?>");
+  errors += check(run(fileSystem, "index.htm") == "6" && isCacheFile("INDEX.HSB"), "modified source compiled and cached again");
+
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}
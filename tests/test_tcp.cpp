@@ -0,0 +1,520 @@
+// TCP/IP stack over a loopback ILinkLayer: two stacks (10.0.0.1 and 10.0.0.2) exchange
+// frames through an in-memory queue, with simulated time (1ms per received frame),
+// frame loss and corruption.
+// Covers UDP, ping, TCP transfers with loss, refused connections, zero window,
+// full connection table and corrupted frames, without and with checksum offload.
+
+#define private public    // to inspect connection slots
+#include "fdv_network/fdv_TCPIP.h"
+#undef private
+
+#include <stdio.h>
+
+using namespace fdv;
+
+
+namespace fdv
+{
+  void TimeOut::timeOutFunc(uint8_t taskIndex)
+  {
+    TaskManager::get(taskIndex).m_everyMillisecs = 0xFFFFFFFF;
+  }
+
+  Task volatile TaskManager::s_info[TaskManager::MAXTASKS];
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Loopback link layer
+
+struct Frame
+{
+  uint8_t     to;   // destination link index
+  uint16_t    typeLength;
+  LinkAddress srcAddress;
+  LinkAddress destAddress;
+  uint16_t    length;
+  uint8_t     data[1600];
+};
+
+static uint16_t const QUEUESIZE = 256;
+
+static Frame    s_queue[QUEUESIZE];
+static uint32_t s_queueHead, s_queueTail;
+static uint32_t s_random = 12345;
+
+// 1 of "s_dropRate" sent frames is lost, 1 of "s_corruptRate" has a bit flipped (0 = none)
+static uint32_t s_dropRate, s_corruptRate;
+
+// statistics
+static uint32_t s_sent, s_dropped, s_corrupted, s_offloaded, s_badChecksums, s_zeroWindows;
+
+
+static uint16_t checksum(uint8_t const* data, uint16_t length, uint32_t sum = 0)
+{
+  for (uint16_t i = 0; i + 1 < length; i += 2)
+    sum += data[i] << 8 | data[i + 1];
+  if (length & 1)
+    sum += data[length - 1] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
+
+
+// verifies IP header and ICMP/UDP/TCP checksums of a sent datagram
+static void verifyDatagram(uint8_t const* data)
+{
+  if (checksum(data, 20) != 0)
+  {
+    ++s_badChecksums;
+    printf("bad IP checksum\n");
+    return;
+  }
+  uint16_t totalLength = data[2] << 8 | data[3];
+  uint8_t  protocol    = data[9];
+  uint32_t pseudoSum   = 0;
+  if (protocol != 1)  // not ICMP
+    pseudoSum = (data[12] << 8 | data[13]) + (data[14] << 8 | data[15]) + (data[16] << 8 | data[17]) + (data[18] << 8 | data[19]) + protocol + totalLength - 20;
+  if (checksum(data + 20, totalLength - 20, pseudoSum) != 0)
+  {
+    ++s_badChecksums;
+    printf("bad protocol %d checksum\n", protocol);
+  }
+}
+
+
+struct ReceivedFrame : LinkLayerReceiveFrame
+{
+  Frame const* frame;
+  uint16_t     pos;
+
+  void readReset()
+  {
+    pos = 0;
+  }
+
+  uint8_t readByte()
+  {
+    return pos < frame->length ? frame->data[pos++] : 0;
+  }
+
+  uint16_t readWord()
+  {
+    uint16_t hi = readByte();
+    return hi << 8 | readByte();
+  }
+
+  void readBlock(void* buffer, uint16_t length)
+  {
+    for (uint16_t i = 0; i != length; ++i)
+      static_cast<uint8_t*>(buffer)[i] = readByte();
+  }
+};
+
+
+struct LoopbackLink : ILinkLayer
+{
+  static LoopbackLink* s_links[2];
+
+  uint8_t              index;
+  LinkAddress          address;
+  bool                 offload;
+  ILinkLayerListener*  listeners[4];
+  uint8_t              listenersCount;
+
+  LoopbackLink(uint8_t index_, bool offload_)
+    : index(index_), address(2, 0, 0, 0, 0, index_), offload(offload_), listenersCount(0)
+  {
+    s_links[index] = this;
+  }
+
+  bool checksumOffload() const
+  {
+    return offload;
+  }
+
+  LinkAddress const& getAddress() const
+  {
+    return address;
+  }
+
+  void addListener(ILinkLayerListener* listener)
+  {
+    listeners[listenersCount++] = listener;
+  }
+
+  SendResult sendFrame(LinkLayerSendFrame const* sendFrame)
+  {
+    ++s_sent;
+    s_random = s_random * 1103515245 + 12345;
+    if (s_dropRate && (s_random >> 16) % s_dropRate == 0)
+    {
+      ++s_dropped;
+      return SendOK;
+    }
+    if (s_queueTail - s_queueHead == QUEUESIZE)
+    {
+      printf("queue overflow\n");
+      return SendFail;
+    }
+    Frame& frame      = s_queue[s_queueTail++ % QUEUESIZE];
+    frame.to          = 1 - index;
+    frame.typeLength  = sendFrame->type_length;
+    frame.srcAddress  = sendFrame->srcAddress;
+    frame.destAddress = sendFrame->destAddress;
+    frame.length      = 0;
+    for (DataList const* d = sendFrame->dataList; d; d = d->next)
+    {
+      memcpy(frame.data + frame.length, d->data, d->length);
+      frame.length += d->length;
+    }
+    // what the controller does when checksumOffload() is true
+    for (LinkLayerChecksum const* c = sendFrame->checksums; c; c = c->next)
+    {
+      uint16_t value = checksum(frame.data + c->start, c->length);
+      frame.data[c->position]     = value >> 8;
+      frame.data[c->position + 1] = value & 0xFF;
+      ++s_offloaded;
+    }
+    if (frame.typeLength == 0x0800)
+    {
+      verifyDatagram(frame.data);
+      uint8_t const* tcp = frame.data + (frame.data[0] & 0x0F) * 4;
+      if (frame.data[9] == 6 && tcp[14] == 0 && tcp[15] == 0 && !(tcp[13] & 0x04))   // TCP, window 0, not RST
+        ++s_zeroWindows;
+    }
+    if (s_corruptRate && (s_random >> 8) % s_corruptRate == 0)
+    {
+      frame.data[(s_random >> 4) % frame.length] ^= 1 << ((s_random >> 12) & 7);
+      ++s_corrupted;
+    }
+    return SendOK;
+  }
+
+  // advances time by 1ms and delivers one queued frame (to any link)
+  void recvFrame()
+  {
+    static bool s_busy = false;
+    ++s_millis;
+    TaskManager::schedule(s_millis, true);
+    if (s_busy || s_queueHead == s_queueTail)
+      return;
+    s_busy = true;
+    static Frame frame;
+    frame = s_queue[s_queueHead++ % QUEUESIZE];
+    LoopbackLink* dest = s_links[frame.to];
+    ReceivedFrame received;
+    received.frame       = &frame;
+    received.type_length = frame.typeLength;
+    received.dataLength  = frame.length;
+    received.srcAddress  = frame.srcAddress;
+    received.destAddress = frame.destAddress;
+    for (uint8_t i = 0; i != dest->listenersCount; ++i)
+    {
+      received.readReset();
+      if (dest->listeners[i]->processLinkLayerFrame(&received))
+        break;
+    }
+    s_busy = false;
+  }
+};
+
+LoopbackLink* LoopbackLink::s_links[2];
+
+
+
+////////////////////////////////////////////////////////////////////////////////////////
+// Tests
+
+static IPAddress const IP_A(10, 0, 0, 1);
+static IPAddress const IP_B(10, 0, 0, 2);
+
+
+static int check(bool condition, char const* what)
+{
+  printf("%s %s\n", condition ? "ok  " : "FAIL", what);
+  return condition ? 0 : 1;
+}
+
+
+static uint8_t usedSlots(Protocol_TCP& tcp)
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i != Protocol_TCP::MAXCONNECTIONS; ++i)
+    if (tcp.m_connections[i].buffer)
+      ++count;
+  return count;
+}
+
+
+static void run(StackTCPIP& A, StackTCPIP& B, uint32_t iterations)
+{
+  for (uint32_t i = 0; i != iterations; ++i)
+  {
+    A.yield();
+    B.yield();
+  }
+}
+
+
+static int testUDP(StackTCPIP& A, StackTCPIP& B)
+{
+  int errors = 0;
+  errors += check(A.ICMP().ping(IP_B) != 0xFFFFFFFF, "ping");
+
+  Socket other(&B, Socket::UDP), receiver(&B, Socket::UDP), sender(&A, Socket::UDP);
+  other.bind(IP_A, 999);     // another listener, which rejects the datagrams
+  receiver.bind(IP_A, 0);
+  uint8_t msg[1000];
+  for (uint16_t i = 0; i != sizeof(msg); ++i)
+    msg[i] = i * 13;
+  sender.send(IP_B, 5000, msg, sizeof(msg));
+  uint8_t  got[1200] = { 0 };
+  uint16_t len = receiver.recv(100000, got, sizeof(got));
+  errors += check(len == sizeof(msg) && memcmp(got, msg, sizeof(msg)) == 0, "udp datagram received");
+  return errors;
+}
+
+
+// A sends "total" bytes to B, which echoes them back, with 1 of "dropRate" frames lost
+static int testTransfer(StackTCPIP& A, StackTCPIP& B, uint16_t total, uint32_t dropRate)
+{
+  if (dropRate)
+    printf("-- transfer %u bytes, loss 1/%u\n", total, dropRate);
+  else
+    printf("-- transfer %u bytes\n", total);
+  s_dropRate = dropRate;
+  s_sent = s_dropped = 0;
+  uint32_t startMillis = s_millis;
+
+  int errors = 0;
+  Socket server(&B, Socket::TCP), conn(&B, Socket::TCP);
+  errors += check(server.listen(80), "listen");
+  uint8_t c = A.TCP().connect(IP_B, 80);
+  errors += check(c != Protocol_TCP::INVALID, "connect issued");
+  // accept() only runs B: A must run too, to retransmit a lost SYN
+  bool accepted = false;
+  for (uint32_t i = 0; i != 10000 && !accepted; ++i)
+  {
+    A.yield();
+    accepted = server.accept(&conn, 10);
+  }
+  errors += check(accepted, "accept");
+  if (errors)
+    return errors;
+  for (uint32_t i = 0; i != 200000 && A.TCP().state(c) != Protocol_TCP::ESTABLISHED; ++i)
+    A.yield();
+  errors += check(A.TCP().state(c) == Protocol_TCP::ESTABLISHED, "client established");
+
+  static uint8_t src[10000], echo[10000];
+  for (uint16_t i = 0; i != total; ++i)
+    src[i] = i * 7 + i / 251;
+  uint16_t sent = 0, echoed = 0;
+  uint8_t  pending[50];
+  uint16_t pendingPos = 0, pendingLen = 0;
+  for (uint32_t i = 0; i != 2000000 && echoed < total; ++i)
+  {
+    if (sent < total)
+      sent += A.TCP().send(c, src + sent, total - sent);
+    uint16_t len;
+    while ((len = A.TCP().recv(c, echo + echoed, 97)))
+      echoed += len;
+    // server echo, non-blocking
+    if (pendingPos == pendingLen)
+    {
+      pendingPos = 0;
+      pendingLen = B.TCP().recv(conn.m_connection, pending, sizeof(pending));
+    }
+    if (pendingPos < pendingLen)
+      pendingPos += B.TCP().send(conn.m_connection, pending + pendingPos, pendingLen - pendingPos);
+    A.yield();
+    B.yield();
+  }
+  errors += check(echoed == total && memcmp(echo, src, total) == 0, "echoed data identical");
+  printf("     frames=%u dropped=%u ms=%u\n", s_sent, s_dropped, s_millis - startMillis);
+
+  A.TCP().close(c);
+  for (uint32_t i = 0; i != 20000 && conn.canReceive(); ++i)
+    A.yield();
+  uint8_t x;
+  errors += check(conn.recv(10, &x, 1) == 0, "server sees EOF");
+  conn.close();
+  server.close();
+  run(A, B, 40000);
+  errors += check(usedSlots(A.TCP()) == 0 && usedSlots(B.TCP()) == 0, "slots released");
+  s_dropRate = 0;
+  return errors;
+}
+
+
+static int testCorruptedFrames(StackTCPIP& A, StackTCPIP& B)
+{
+  printf("-- corrupted frames\n");
+  int errors = 0;
+  s_corruptRate = 4;
+  s_corrupted   = 0;
+  errors += testTransfer(A, B, 3000, 0);
+
+  Socket receiver(&B, Socket::UDP), sender(&A, Socket::UDP);
+  receiver.bind(IP_A, 0);
+  uint8_t msg[301];
+  for (uint16_t i = 0; i != sizeof(msg); ++i)
+    msg[i] = i * 11;
+  uint8_t good = 0, bad = 0;
+  for (uint8_t k = 0; k != 40; ++k)
+  {
+    sender.send(IP_B, 5000, msg, sizeof(msg));
+    uint8_t  got[400];
+    uint16_t len = receiver.recv(1000, got, sizeof(got));
+    if (len)
+      ++(len == sizeof(msg) && memcmp(got, msg, sizeof(msg)) == 0 ? good : bad);
+  }
+  for (uint8_t k = 0; k != 10; ++k)
+    A.ICMP().ping(IP_B);
+  s_corruptRate = 0;
+
+  Protocol_IP::ChecksumErrors const& ea = A.IP().checksumErrors();
+  Protocol_IP::ChecksumErrors const& eb = B.IP().checksumErrors();
+  printf("     corrupted=%u udp good=%d bad=%d  dropped A: ip=%d icmp=%d udp=%d tcp=%d  B: ip=%d icmp=%d udp=%d tcp=%d\n",
+         s_corrupted, good, bad, ea.IP, ea.ICMP, ea.UDP, ea.TCP, eb.IP, eb.ICMP, eb.UDP, eb.TCP);
+  errors += check(bad == 0 && good > 0, "no corrupted udp datagram delivered");
+  errors += check(ea.IP + eb.IP > 0 && eb.UDP > 0 && ea.TCP + eb.TCP > 0, "corrupted datagrams counted");
+  return errors;
+}
+
+
+static int testRefused(StackTCPIP& A)
+{
+  printf("-- refused connection\n");
+  Socket s(&A, Socket::TCP);
+  uint32_t startMillis = s_millis;
+  int errors = check(!s.connect(IP_B, 81, 100000), "connect refused");
+  errors += check(s_millis - startMillis < 100000, "refused before the timeout");
+  return errors;
+}
+
+
+// blocking Socket client against a Protocol_TCP server which stops reading
+static int testZeroWindow(StackTCPIP& A, StackTCPIP& B)
+{
+  printf("-- zero window\n");
+  int errors = 0;
+  B.TCP().listen(23);
+  Socket s(&A, Socket::TCP);
+  errors += check(s.connect(IP_B, 23, 100000) && s.isConnected(), "socket connect");
+  uint8_t sc = Protocol_TCP::INVALID;
+  for (uint16_t i = 0; i != 1000 && sc == Protocol_TCP::INVALID; ++i)
+  {
+    B.yield();
+    sc = B.TCP().accept(23);
+  }
+  errors += check(sc != Protocol_TCP::INVALID, "accept");
+  if (errors)
+    return errors;
+
+  char msg[600];
+  for (uint16_t i = 0; i != sizeof(msg); ++i)
+    msg[i] = 'a' + i % 26;
+  errors += check(s.send(msg, 500), "socket send 500 bytes");
+  // the server doesn't read: its window closes
+  s_zeroWindows = 0;
+  for (uint32_t i = 0; i != 60000; ++i)
+    A.yield();
+  errors += check(s_zeroWindows > 0, "zero window advertised");
+  errors += check(s.isConnected(), "still connected with zero window");
+  char     got[600];
+  uint16_t len = 0;
+  for (uint16_t i = 0; i != 100 && len < 250; ++i)
+  {
+    len += B.TCP().recv(sc, got + len, 250 - len);
+    B.yield();
+  }
+  errors += check(s.send(msg + 500, 100), "socket send 100 bytes after the window opens");
+  for (uint32_t i = 0; i != 100000 && len < sizeof(msg); ++i)
+  {
+    len += B.TCP().recv(sc, got + len, sizeof(msg) - len);
+    B.yield();
+  }
+  errors += check(len == sizeof(msg) && memcmp(msg, got, sizeof(msg)) == 0, "server received all data");
+
+  B.TCP().send(sc, "bye", 3);
+  B.TCP().close(sc);
+  char reply[10];
+  errors += check(s.recv(100000, reply, sizeof(reply)) == 3 && memcmp(reply, "bye", 3) == 0, "socket recv");
+  errors += check(s.recv(100000, reply, sizeof(reply)) == 0, "socket recv EOF");
+  s.close();
+  B.TCP().unlisten(23);
+  run(A, B, 40000);
+  errors += check(usedSlots(A.TCP()) == 0 && usedSlots(B.TCP()) == 0, "slots released");
+  return errors;
+}
+
+
+static int testFullTable(StackTCPIP& A, StackTCPIP& B)
+{
+  printf("-- full connection table\n");
+  int errors = 0;
+  uint8_t const count = Protocol_TCP::MAXCONNECTIONS;
+  B.TCP().listen(80);
+  uint8_t c[count + 1];
+  for (uint8_t i = 0; i != count + 1; ++i)
+    c[i] = A.TCP().connect(IP_B, 80);
+  errors += check(c[count] == Protocol_TCP::INVALID, "connect fails when the table is full");
+  for (uint16_t i = 0; i != 2000; ++i)
+    A.yield();
+  uint8_t established = 0;
+  for (uint8_t i = 0; i != count; ++i)
+    if (A.TCP().state(c[i]) == Protocol_TCP::ESTABLISHED)
+      ++established;
+  errors += check(established == count, "other connections established");
+  for (uint8_t i = 0; i != count; ++i)
+    A.TCP().close(c[i]);
+  for (uint8_t i = 0; i != count; ++i)
+  {
+    uint8_t sc = B.TCP().accept(80);
+    if (sc != Protocol_TCP::INVALID)
+      B.TCP().close(sc);
+  }
+  B.TCP().unlisten(80);
+  run(A, B, 40000);
+  errors += check(usedSlots(A.TCP()) == 0 && usedSlots(B.TCP()) == 0, "slots released");
+  return errors;
+}
+
+
+static int testAll(bool offload)
+{
+  printf("== checksum offload %s\n", offload ? "on" : "off");
+  s_queueHead = s_queueTail = 0;
+  s_offloaded = s_badChecksums = 0;
+
+  LoopbackLink linkA(0, offload), linkB(1, offload);
+  StackTCPIP   A(IP_A, IPAddress(255, 255, 255, 0), IPAddress(10, 0, 0, 254), &linkA, false);
+  StackTCPIP   B(IP_B, IPAddress(255, 255, 255, 0), IPAddress(10, 0, 0, 254), &linkB, false);
+  A.ARP().addCacheTableItem(Protocol_ARP::Item(IP_B, linkB.address, seconds()));
+  B.ARP().addCacheTableItem(Protocol_ARP::Item(IP_A, linkA.address, seconds()));
+
+  int errors = testUDP(A, B);
+  errors += testTransfer(A, B, 5000, 0);
+  errors += testTransfer(A, B, 3000, 3);
+  errors += testTransfer(A, B, 3000, 7);
+  errors += testTransfer(A, B, 8000, 20);
+  errors += testCorruptedFrames(A, B);
+  errors += testRefused(A);
+  errors += testZeroWindow(A, B);
+  errors += testFullTable(A, B);
+  errors += check(s_badChecksums == 0, "sent checksums correct");
+  errors += check(offload == (s_offloaded > 0), "checksums offloaded only when supported");
+  return errors;
+}
+
+
+int main()
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  int errors = testAll(false) + testAll(true);
+  printf("errors=%d\n", errors);
+  return errors != 0;
+}